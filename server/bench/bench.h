@@ -0,0 +1,19 @@
+/*
+ * bench.h - common definitions for Xen VNC Proxy benchmarks
+ *
+ * Copyright (C) 2009-2013, Colin Dean
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+extern double bench_ms(void);
+extern long   bench_status_kb(char *field);
+extern void   bench_peak_reset(void);
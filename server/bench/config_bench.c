@@ -0,0 +1,135 @@
+/*
+ * config_bench.c - benchmark of config loading for Xen VNC Proxy
+ *
+ * Copyright (C) 2009-2013, Colin Dean
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Load a config file, such as one written by genconf.sh, as xvp does
+ * at startup, and time it, noting the resident memory and page tables
+ * this adds, which every forked process shares until written.  Then
+ * look every VM up again, by name or UUID in its pool and by port, as
+ * sessions and the master do, checking each lookup finds the VM, and
+ * time that too.  Last, re-read the config a few times, as on SIGUSR1,
+ * to see that memory is given back each time.
+ *
+ *   config_bench [-i] xvp.conf
+ *
+ * With -i, the config is first compiled into an image, in a child so
+ * as not to count that, and then loaded from the image, as xvp does
+ * when the image is up to date.
+ *
+ * Run by "make bench", on a config of 100,000 VMs, both ways.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../xvp.h"
+#include "bench.h"
+
+#define RELOADS 5
+
+/*
+ * Compile the config into an image in a child, returning true if done
+ */
+static bool compile_image(void)
+{
+    pid_t pid;
+    int status;
+
+    if ((pid = fork()) < 0)
+	return false;
+
+    if (pid == 0) {
+	xvp_image_compiling = true;
+	xvp_config_init();
+	exit(xvp_image_write() ? 0 : 1);
+    }
+
+    return (waitpid(pid, &status, 0) == pid &&
+	    WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int main(int argc, char **argv)
+{
+    xvp_pool *pool;
+    xvp_vm *vm;
+    int vms = 0, lookups = 0, found = 0, i;
+    bool image = false;
+    long rss;
+    double start;
+
+    if (argc == 3 && !strcmp(argv[1], "-i")) {
+	image = true;
+	argv++;
+	argc--;
+    }
+
+    if (argc != 2) {
+	fprintf(stderr, "usage: %s [-i] config-file\n", argv[0]);
+	return 1;
+    }
+
+    xvp_log_filename = "-";
+    xvp_log_init();
+    xvp_config_filename = argv[1];
+
+    if (image && !compile_image()) {
+	fprintf(stderr, "%s: could not compile %s\n", argv[0], argv[1]);
+	return 1;
+    }
+    xvp_image_compiling = !image; /* else the text is read, not an image */
+
+    rss = bench_status_kb("VmRSS");
+    start = bench_ms();
+    xvp_config_init();
+    printf("%s load: %.1f ms", image ? "image" : "text", bench_ms() - start);
+
+    for (pool = xvp_pools; pool; pool = pool->next)
+	for (vm = pool->vms; vm; vm = vm->next)
+	    vms++;
+    printf(", %d VMs, RSS +%ld kB, page tables %ld kB\n", vms,
+	   bench_status_kb("VmRSS") - rss, bench_status_kb("VmPTE"));
+
+    start = bench_ms();
+    for (pool = xvp_pools; pool; pool = pool->next) {
+	for (vm = pool->vms; vm; vm = vm->next) {
+	    lookups++;
+	    if (*vm->uuid)
+		found += (xvp_config_vm_by_uuid(pool, vm->uuid) == vm);
+	    else
+		found += (xvp_config_vm_by_name(pool, vm->vmname) == vm);
+	    if (vm->port > 0) {
+		lookups++;
+		found += (xvp_config_vm_by_port(vm->port) == vm);
+	    }
+	}
+    }
+    printf("lookups: %.1f ms, %d of %d found\n",
+	   bench_ms() - start, found, lookups);
+
+    start = bench_ms();
+    for (i = 0; i < RELOADS; i++)
+	xvp_config_init();
+    printf("reloads: %.1f ms each, RSS +%ld kB after %d\n",
+	   (bench_ms() - start) / RELOADS, bench_status_kb("VmRSS") - rss,
+	   RELOADS);
+
+    return (found == lookups) ? 0 : 1;
+}
@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Copyright (C) 2009-2013, Colin Dean
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation; either version 2 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+
+#
+# Write a generated xvp.conf to standard output, for the benchmarks:
+#
+#   genconf.sh VMS [POOLS [FIRSTPORT [PORTS]]]
+#
+# The VMS are shared between POOLS pools (default 10).  The first PORTS
+# of them (default as many as fit below 65536) get their own ports from
+# FIRSTPORT (default 6000) up, the rest are reached only by multiplexing
+# on port 5900.  Every fourth VM is named by UUID.
+#
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 vms [pools [firstport [ports]]]" >&2
+    exit 1
+fi
+
+awk -v vms="$1" -v pools="${2:-10}" -v first="${3:-6000}" \
+    -v ports="${4:-0}" 'BEGIN {
+    if (ports <= 0 || ports > 65536 - first)
+	ports = 65536 - first
+    print "OTP ALLOW IPCHECK OFF 60"
+    print "MULTIPLEX 5900"
+    for (k = p = 0; p < pools; p++) {
+	print "POOL pool" p
+	print "DOMAIN example.com"
+	print "MANAGER root 0123456789abcdef0123456789abcdef"
+	print "HOST 10.0." p ".1 host" p
+	print "GROUP group" p
+	for (n = int(vms / pools) + (p < vms % pools); n > 0; n--) {
+	    port = (k < ports) ? first + k : "-"
+	    if (k % 4)
+		name = sprintf("vm%06d", k)
+	    else
+		name = sprintf("%08x-0000-4000-8000-%012x", k, k)
+	    print "VM " port " " name " 0123456789abcdef"
+	    k++
+	}
+    }
+}'
@@ -0,0 +1,319 @@
+/*
+ * json_bench.c - benchmark of Xen API response parsing for Xen VNC Proxy
+ *
+ * Copyright (C) 2009-2013, Colin Dean
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Generate the response to the first event.from call for a pool of
+ * VMS VMs (default 5,000), an "add" event with a snapshot for every VM
+ * and console, both as XML-RPC and as JSON-RPC.  Then time parsing each
+ * several times, and note the peak memory each parse adds to that of
+ * the response itself:
+ *
+ * - XML-RPC into a libxml2 document, as libxenserver does before it
+ *   turns the document into records, which is not counted here;
+ *
+ * - JSON-RPC with json.c, in pieces as curl passes them, keeping only
+ *   each event's reference, as xenapi.c does.
+ *
+ *   json_bench [VMS]
+ *
+ * Run by "make bench".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <libxml/parser.h>
+
+/* libxml2 has brought in stdbool.h, as the SDK does for xenapi.c */
+#define XEN_API_XEN_ALL_H
+
+#include "../xvp.h"
+#include "bench.h"
+
+#define ROUNDS     5
+#define PIECE_SIZE 16384 /* CURL_MAX_WRITE_SIZE */
+#define MAX_DEPTH  16
+
+static FILE *out;
+static bool  xml;
+static int   depth;
+static char  kinds[MAX_DEPTH];  /* '{' or '[' */
+static bool  firsts[MAX_DEPTH]; /* no JSON comma needed yet */
+
+/*
+ * Response writing, the same calls making either format
+ */
+static void put_value_start(char *key)
+{
+    if (depth > 0 && !firsts[depth] && !xml)
+	fputc(',', out);
+    firsts[depth] = false;
+
+    if (xml) {
+	if (key)
+	    fprintf(out, "<member><name>%s</name>", key);
+	fputs("<value>", out);
+    } else if (key) {
+	fprintf(out, "\"%s\":", key);
+    }
+}
+
+static void put_value_end(void)
+{
+    if (xml)
+	fputs(kinds[depth] == '{' ? "</value></member>" : "</value>", out);
+}
+
+static void put_string(char *key, char *value)
+{
+    put_value_start(key);
+    fprintf(out, xml ? "%s" : "\"%s\"", value);
+    put_value_end();
+}
+
+static void put_start(char *key, char kind)
+{
+    put_value_start(key);
+    if (xml)
+	fputs(kind == '{' ? "<struct>" : "<array><data>", out);
+    else
+	fputc(kind, out);
+    kinds[++depth] = kind;
+    firsts[depth] = true;
+}
+
+static void put_end(void)
+{
+    if (xml)
+	fputs(kinds[depth] == '{' ? "</struct>" : "</data></array>", out);
+    else
+	fputc(kinds[depth] == '{' ? '}' : ']', out);
+    depth--;
+    put_value_end();
+}
+
+static void put_event(int i, char *class)
+{
+    char buf[64];
+    int j;
+
+    put_start(NULL, '{');
+    sprintf(buf, "%d", i);
+    put_string("id", buf);
+    put_string("timestamp", "20130101T00:00:00Z");
+    put_string("class", class);
+    put_string("operation", "add");
+    sprintf(buf, "OpaqueRef:%08x-%04x-4000-8000-%012x",
+	    i, *class == 'v' ? 0 : 1, i);
+    put_string("ref", buf);
+
+    put_start("snapshot", '{');
+    sprintf(buf, "%08x-0000-4000-8000-%012x", i, i);
+    put_string("uuid", buf);
+    sprintf(buf, "vm%d", i);
+    put_string("name_label", buf);
+    put_string("name_description",
+	       "a virtual machine in a pool with several thousand others");
+    put_string("power_state", "Running");
+    put_string("resident_on", "OpaqueRef:host");
+    put_start("other_config", '{');
+    for (j = 0; j < 8; j++) {
+	sprintf(buf, "key%d", j);
+	put_string(buf, "a value of twenty ch");
+    }
+    put_end();
+    put_string("VCPUs_max", "4");
+    put_string("memory_static_max", "4294967296");
+    put_start("blocked_operations", '{');
+    put_end();
+    put_start("allowed_operations", '[');
+    put_string(NULL, "start");
+    put_string(NULL, "clean_shutdown");
+    put_string(NULL, "hard_reboot");
+    put_string(NULL, "pause");
+    put_string(NULL, "suspend");
+    put_end();
+    put_start("consoles", '[');
+    sprintf(buf, "OpaqueRef:%08x-0001-4000-8000-%012x", i, i);
+    put_string(NULL, buf);
+    put_end();
+    put_start("VBDs", '[');
+    for (j = 0; j < 3; j++) {
+	sprintf(buf, "OpaqueRef:%08x-%04x-4000-8000-%012x", i, 0x10 + j, i);
+	put_string(NULL, buf);
+    }
+    put_end();
+    put_start("VIFs", '[');
+    for (j = 0; j < 2; j++) {
+	sprintf(buf, "OpaqueRef:%08x-%04x-4000-8000-%012x", i, 0x20 + j, i);
+	put_string(NULL, buf);
+    }
+    put_end();
+    put_end();
+
+    put_end();
+}
+
+static char *make_response(bool as_xml, int vms, size_t *lenp)
+{
+    char *response;
+    int i;
+
+    xml = as_xml;
+    depth = 0;
+    kinds[0] = '['; /* the response is a value alone, as in an array */
+    out = open_memstream(&response, lenp);
+
+    if (xml)
+	fputs("<?xml version=\"1.0\"?>"
+	      "<methodResponse><params><param>", out);
+    put_start(NULL, '{');
+    if (xml) {
+	put_string("Status", "Success");
+	put_start("Value", '{');
+    } else {
+	put_string("jsonrpc", "2.0");
+	put_start("result", '{');
+    }
+
+    put_start("events", '[');
+    for (i = 0; i < vms; i++) {
+	put_event(i, "VM");
+	put_event(i, "console");
+    }
+    put_end();
+    put_start("valid_ref_counts", '{');
+    put_end();
+    put_string("token", "12345,");
+
+    put_end();
+    if (!xml)
+	fputs(",\"id\":1", out);
+    put_end();
+    if (xml)
+	fputs("</param></params></methodResponse>", out);
+
+    fclose(out);
+    return response;
+}
+
+/*
+ * As xvp_xenapi_events_value(), counting events rather than passing
+ * them on
+ */
+static int  json_events;
+static char json_ref[64];
+
+static void json_value(xvp_json *js, xvp_json_type type, char *value)
+{
+    if (js->depth < 3 || strcmp(js->keys[1], "result") ||
+	strcmp(js->keys[2], "events"))
+	return;
+
+    if (js->depth == 3) {
+	if (type == XVP_JSON_OBJECT)
+	    *json_ref = '\0';
+	else if (type == XVP_JSON_END && *json_ref)
+	    json_events++;
+    } else if (js->depth == 4 && type == XVP_JSON_STRING &&
+	       !strcmp(js->keys[4], "ref")) {
+	strncpy(json_ref, value, sizeof(json_ref) - 1);
+    }
+}
+
+static bool parse_xml(char *response, size_t len)
+{
+    xmlDocPtr doc;
+
+    if (!(doc = xmlReadMemory(response, len, NULL, NULL,
+			      XML_PARSE_NONET | XML_PARSE_HUGE)))
+	return false;
+
+    xmlFreeDoc(doc);
+    return true;
+}
+
+static bool parse_json(char *response, size_t len, int events)
+{
+    xvp_json js;
+    size_t pos, n;
+
+    json_events = 0;
+    xvp_json_init(&js, json_value, NULL);
+
+    for (pos = 0; pos < len; pos += n) {
+	n = (len - pos < PIECE_SIZE) ? len - pos : PIECE_SIZE;
+	if (!xvp_json_feed(&js, response + pos, n))
+	    return false;
+    }
+
+    return (xvp_json_done(&js) && json_events == events);
+}
+
+static bool run(bool as_xml, int vms)
+{
+    char *response;
+    size_t len;
+    long rss;
+    double start, ms, min = 0, total = 0;
+    int i;
+    bool ok = true;
+
+    response = make_response(as_xml, vms, &len);
+    bench_peak_reset();
+    rss = bench_status_kb("VmRSS");
+
+    for (i = 0; ok && i < ROUNDS; i++) {
+	start = bench_ms();
+	ok = as_xml ? parse_xml(response, len) :
+		      parse_json(response, len, 2 * vms);
+	ms = bench_ms() - start;
+	total += ms;
+	if (i == 0 || ms < min)
+	    min = ms;
+    }
+
+    if (ok)
+	printf("%s, %.1f MB: %.1f ms best, %.1f ms mean, peak RSS +%ld kB\n",
+	       as_xml ? "XML-RPC, libxml2 document" : "JSON-RPC, json.c",
+	       len / 1e6, min, total / ROUNDS,
+	       bench_status_kb("VmHWM") - rss);
+    else
+	printf("%s: parse failed\n", as_xml ? "XML-RPC" : "JSON-RPC");
+
+    free(response);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int vms = (argc > 1) ? atoi(argv[1]) : 5000;
+    bool ok;
+
+    if (vms <= 0) {
+	fprintf(stderr, "usage: %s [vms]\n", argv[0]);
+	return 1;
+    }
+
+    xmlInitParser();
+    printf("event.from response for %d VMs, parsed %d times\n", vms, ROUNDS);
+    ok = run(true, vms);
+    ok = run(false, vms) && ok;
+
+    return ok ? 0 : 1;
+}
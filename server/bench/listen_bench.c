@@ -0,0 +1,166 @@
+/*
+ * listen_bench.c - benchmark of connection accepting for Xen VNC Proxy
+ *
+ * Copyright (C) 2009-2013, Colin Dean
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Connect to a running xvp on each of PORTS ports in turn, from
+ * FIRSTPORT up, CONNECTIONS times in all (default once per port),
+ * keeping PARALLEL (default 64) connections under way at once.  Each
+ * connection counts as answered once the first bytes xvp sends, its RFB
+ * ProtocolVersion, arrive, and is then closed.  Report how many were
+ * answered per second, and the longest any took.
+ *
+ *   listen_bench host firstport ports [connections [parallel]]
+ *
+ * So for the master's accept loop with 10,000 listeners:
+ *
+ *   bench/genconf.sh 10000 1 6000 > bench/xvp.conf
+ *   ./xvp -n -l /dev/null -c bench/xvp.conf &
+ *   bench/listen_bench 127.0.0.1 6000 10000 50000
+ *
+ * xvp needs no XenServer for this, but it must be able to have 10,000
+ * listening sockets open.  "make bench" builds this but can't run it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../xvp.h"
+#include "bench.h"
+
+#define STALL_MS 10000 /* giving up on what is still under way */
+
+typedef struct {
+    int    sock;
+    double started;
+} connection;
+
+static struct sockaddr_in addr;
+static int firstport, ports;
+
+/*
+ * Start connecting to the next port, returning false if refused at once
+ */
+static bool start(int epoll_fd, connection *c, int n)
+{
+    struct epoll_event ev;
+
+    addr.sin_port = htons(firstport + n % ports);
+    c->started = bench_ms();
+
+    if ((c->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+	return false;
+
+    if (connect(c->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+	errno != EINPROGRESS) {
+	close(c->sock);
+	return false;
+    }
+
+    ev.events = EPOLLIN; /* data or error, whichever comes */
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->sock, &ev) < 0) {
+	close(c->sock);
+	return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    connection *conns, *c, **idle;
+    struct epoll_event *events;
+    char buf[64];
+    int connections, parallel, epoll_fd, started = 0, busy = 0, n, i;
+    int answered = 0, failed = 0;
+    double begun, ms, slowest = 0;
+
+    if (argc < 4 || argc > 6 ||
+	!inet_aton(argv[1], &addr.sin_addr) ||
+	(firstport = atoi(argv[2])) <= 0 || (ports = atoi(argv[3])) <= 0 ||
+	firstport + ports > 65536 ||
+	(connections = (argc > 4) ? atoi(argv[4]) : ports) <= 0 ||
+	(parallel = (argc > 5) ? atoi(argv[5]) : 64) <= 0) {
+	fprintf(stderr, "usage: %s host firstport ports "
+		"[connections [parallel]]\n", argv[0]);
+	return 1;
+    }
+    addr.sin_family = AF_INET;
+
+    conns = calloc(parallel, sizeof(connection));
+    idle = calloc(parallel, sizeof(connection *));
+    events = calloc(parallel, sizeof(struct epoll_event));
+    for (i = 0; i < parallel; i++)
+	idle[i] = conns + i;
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	perror("epoll_create1");
+	return 1;
+    }
+
+    begun = bench_ms();
+    while (started < connections || busy > 0) {
+
+	while (busy < parallel && started < connections) {
+	    c = idle[parallel - busy - 1];
+	    if (start(epoll_fd, c, started++))
+		busy++;
+	    else
+		failed++;
+	}
+
+	if ((n = epoll_wait(epoll_fd, events, parallel, STALL_MS)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("epoll_wait");
+	    return 1;
+	} else if (n == 0) {
+	    fprintf(stderr, "%d connections unanswered after %d ms\n",
+		    busy, STALL_MS);
+	    failed += busy;
+	    break;
+	}
+
+	for (i = 0; i < n; i++) {
+	    c = (connection *)events[i].data.ptr;
+	    if (read(c->sock, buf, sizeof(buf)) > 0) {
+		answered++;
+		if ((ms = bench_ms() - c->started) > slowest)
+		    slowest = ms;
+	    } else {
+		failed++;
+	    }
+	    close(c->sock); /* which takes it out of the epoll set */
+	    idle[parallel - busy--] = c;
+	}
+    }
+    ms = bench_ms() - begun;
+
+    printf("%d connections to %d ports: %d answered, %d failed, "
+	   "in %.0f ms\n", started, ports, answered, failed, ms);
+    printf("%.0f answered per second, slowest %.1f ms\n",
+	   answered * 1e3 / ms, slowest);
+
+    return failed ? 1 : 0;
+}
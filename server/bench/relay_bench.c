@@ -0,0 +1,271 @@
+/*
+ * relay_bench.c - benchmark of console output relaying for Xen VNC Proxy
+ *
+ * Copyright (C) 2009-2013, Colin Dean
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Compare the two ways xvp_proxy_relay() in proxy.c moves console output
+ * to the client, over loopback TCP connections:
+ *
+ * - copying: reading into a buffer that starts at 4 kB and doubles,
+ *   to at most 256 kB, each time a read fills it, then writing it all;
+ *
+ * - splicing: splice(2) from the console socket into a pipe, at most
+ *   64 kB at a time, and from the pipe to the client.
+ *
+ * Where the kernel runs TLS for the console connection, it decrypts
+ * either way, and SSL_read() is a read of the plaintext, so what is
+ * compared here is just the copying through user space that splicing
+ * avoids.  Without kernel TLS, xvp always copies.
+ *
+ * Each of SESSIONS sessions (default 4) has a process writing UPDATES
+ * (default 20,000) 16 kB updates to its "console" connection as fast as
+ * it can, a process relaying them, and one reading them as the client.
+ *
+ *   relay_bench [SESSIONS [UPDATES]]
+ *
+ * Run by "make bench".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../xvp.h"
+#include "bench.h"
+
+/* as in proxy.c */
+#define BUF_SIZE    4096
+#define BUF_MAX     (256 * 1024)
+#define SPLICE_SIZE 65536
+
+#define UPDATE_SIZE 16384
+
+static bool write_all(int fd, char *buf, int len)
+{
+    int n;
+
+    while (len > 0) {
+	if ((n = write(fd, buf, len)) < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return false;
+	buf += n;
+	len -= n;
+    }
+
+    return true;
+}
+
+/*
+ * Make a loopback TCP connection, returning its two ends
+ */
+static bool connect_pair(int *a, int *b)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listener;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ((listener = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	return false;
+
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	listen(listener, 1) < 0 ||
+	getsockname(listener, (struct sockaddr *)&addr, &len) < 0 ||
+	(*a = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+	close(listener);
+	return false;
+    }
+
+    if (connect(*a, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	(*b = accept(listener, NULL, NULL)) < 0) {
+	close(*a);
+	close(listener);
+	return false;
+    }
+
+    close(listener);
+    return true;
+}
+
+static bool relay_copy(int from, int to)
+{
+    char *buf = malloc(BUF_MAX);
+    int size = BUF_SIZE, len;
+
+    while ((len = read(from, buf, size)) != 0) {
+	if (len < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	if (!write_all(to, buf, len))
+	    return false;
+	if (len == size && size < BUF_MAX)
+	    size *= 2;
+    }
+
+    free(buf);
+    return true;
+}
+
+static bool relay_splice(int from, int to)
+{
+    int pipefd[2], len, res;
+
+    if (pipe2(pipefd, O_CLOEXEC) != 0)
+	return false;
+
+    while ((len = splice(from, NULL, pipefd[1], NULL, SPLICE_SIZE,
+			 SPLICE_F_MOVE)) != 0) {
+	if (len < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	while (len > 0) {
+	    res = splice(pipefd[0], NULL, to, NULL, len, SPLICE_F_MOVE);
+	    if (res > 0)
+		len -= res;
+	    else if (res == 0 || errno != EINTR)
+		return false;
+	}
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return true;
+}
+
+/*
+ * Run one session, once the byte from go arrives, exiting 0 if every
+ * byte reached the client
+ */
+static void session(bool spliced, int updates, int go)
+{
+    char buf[UPDATE_SIZE], c;
+    int console[2], client[2], i, len;
+    long got = 0;
+    pid_t writer, reader;
+    bool ok;
+
+    if (!connect_pair(&console[0], &console[1]) ||
+	!connect_pair(&client[0], &client[1]))
+	exit(1);
+
+    if (read(go, &c, 1) != 1)
+	exit(1);
+
+    if ((writer = fork()) == 0) {
+	memset(buf, 0xa5, sizeof(buf));
+	for (i = 0; i < updates; i++)
+	    if (!write_all(console[0], buf, sizeof(buf)))
+		exit(1);
+	exit(0);
+    }
+    close(console[0]);
+
+    if ((reader = fork()) == 0) {
+	close(client[0]);
+	while ((len = read(client[1], buf, sizeof(buf))) > 0)
+	    got += len;
+	exit(got == (long)updates * UPDATE_SIZE ? 0 : 1);
+    }
+    close(client[1]);
+
+    ok = spliced ? relay_splice(console[1], client[0]) :
+		   relay_copy(console[1], client[0]);
+    close(client[0]);
+
+    if (waitpid(writer, &i, 0) != writer || !WIFEXITED(i) ||
+	WEXITSTATUS(i) != 0)
+	ok = false;
+    if (waitpid(reader, &i, 0) != reader || !WIFEXITED(i) ||
+	WEXITSTATUS(i) != 0)
+	ok = false;
+
+    exit(ok ? 0 : 1);
+}
+
+static bool run(bool spliced, int sessions, int updates)
+{
+    int go[2], i, status;
+    double start, ms;
+    bool ok = true;
+
+    if (pipe(go) != 0)
+	return false;
+    fflush(stdout); /* not to be written by each session too */
+
+    for (i = 0; i < sessions; i++) {
+	if (fork() == 0) {
+	    close(go[1]);
+	    session(spliced, updates, go[0]);
+	}
+    }
+    close(go[0]);
+
+    usleep(200000); /* for the connections to be made */
+    start = bench_ms();
+    for (i = 0; i < sessions; i++)
+	if (write(go[1], "", 1) != 1)
+	    ok = false;
+    close(go[1]);
+
+    while (wait(&status) > 0)
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	    ok = false;
+    ms = bench_ms() - start;
+
+    if (ok)
+	printf("%s: %.0f MB/s, %d x %.1f MB in %.0f ms\n",
+	       spliced ? "splicing" : "copying ",
+	       (double)sessions * updates * UPDATE_SIZE / 1e3 / ms, sessions,
+	       (double)updates * UPDATE_SIZE / 1e6, ms);
+    else
+	printf("%s: failed\n", spliced ? "splicing" : "copying");
+
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int sessions = (argc > 1) ? atoi(argv[1]) : 4;
+    int updates = (argc > 2) ? atoi(argv[2]) : 20000;
+    bool ok;
+
+    if (sessions <= 0 || updates <= 0) {
+	fprintf(stderr, "usage: %s [sessions [updates]]\n", argv[0]);
+	return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    ok = run(false, sessions, updates);
+    ok = run(true, sessions, updates) && ok;
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+/*
+ * stubs.c - what benchmarks need from the rest of Xen VNC Proxy
+ *
+ * Copyright (C) 2009-2013, Colin Dean
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Benchmarks link the modules they measure, such as config.c, with the
+ * SDK-free ones they call, logging.c and password.c.  The few variables
+ * and functions those expect from main.c, process.c, engine.c and
+ * xenapi.c, which need the SDK, are copied or stubbed here, along with
+ * timing and memory measurement for the benchmarks themselves.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "../xvp.h"
+#include "bench.h"
+
+pid_t      xvp_pid;
+xvp_engine xvp_engine_mode = XVP_ENGINE_FORK;
+int        xvp_prefork_min, xvp_prefork_max, xvp_prefork_idle;
+int        xvp_engine_threads, xvp_engine_shards;
+char       xvp_ssl_ciphers[XVP_MAX_CIPHERS + 1] = XVP_SSL_CIPHERS;
+char       xvp_ssl_ciphersuites[XVP_MAX_CIPHERS + 1] = XVP_SSL_CIPHERSUITES;
+
+void xvp_process_cleanup(void)
+{
+}
+
+void *xvp_alloc(int size)
+{
+    void *p;
+
+    if (!(p = calloc(1, size)))
+	xvp_log(XVP_LOG_FATAL, "Out of memory");
+
+    return p;
+}
+
+void xvp_free(void *p)
+{
+    free(p);
+}
+
+char *xvp_strdup(char *s)
+{
+    char *p = xvp_alloc(strlen(s) + 1);
+
+    strcpy(p, s);
+    return p;
+}
+
+bool xvp_is_ipv4(char *address)
+{
+    unsigned int i, ip[4];
+    char dummy;
+
+    if (sscanf(address, "%u.%u.%u.%u%c",
+	       ip, ip + 1, ip + 2, ip + 3, &dummy) != 4)
+	return false;
+
+    for (i = 0; i < 4; i++)
+	if (ip[i] > 255)
+	    return false;
+
+    return (strlen(address) <= XVP_MAX_ADDRESS);
+}
+
+bool xvp_xenapi_is_uuid(char *text)
+{
+    int dashes[] = XVP_UUID_DASHES;
+    int i, j;
+    bool mustdash;
+
+    if (strlen(text) != XVP_UUID_LEN)
+	return false;
+
+    for (i = 0; i < XVP_UUID_LEN; i++) {
+	mustdash = false;
+	for (j = 0; j < XVP_UUID_NDASHES; j++) {
+	    if (i == dashes[j]) {
+		mustdash = true;
+		break;
+	    }
+	}
+	if (mustdash) {
+	    if (text[i] != '-')
+		return false;
+	} else if (isupper(text[i]) || !isxdigit(text[i])) {
+	    return false;
+	}
+    }
+
+    return true;
+}
+
+/*
+ * Milliseconds on the monotonic clock, from an arbitrary start
+ */
+double bench_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+/*
+ * Value in kB of a field of /proc/self/status, such as "VmRSS", or -1
+ */
+long bench_status_kb(char *field)
+{
+    char line[256];
+    int len = strlen(field);
+    long kb = -1;
+    FILE *stream;
+
+    if (!(stream = fopen("/proc/self/status", "r")))
+	return -1;
+
+    while (fgets(line, sizeof(line), stream)) {
+	if (!strncmp(line, field, len) && line[len] == ':') {
+	    kb = atol(line + len + 1);
+	    break;
+	}
+    }
+
+    fclose(stream);
+    return kb;
+}
+
+/*
+ * Start VmHWM, the peak RSS, again from the current RSS
+ */
+void bench_peak_reset(void)
+{
+    FILE *stream;
+
+    if ((stream = fopen("/proc/self/clear_refs", "w"))) {
+	fputs("5", stream);
+	fclose(stream);
+    }
+}
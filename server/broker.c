@@ -0,0 +1,739 @@
+/*
+ * broker.c - shared Xen API sessions for Xen VNC Proxy
+ *
+ * Copyright (C) 2009-2013, Colin Dean
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Rather than every session logging in to its pool master, master
+ * starts a broker process, which keeps one Xen API session per pool,
+ * logged in on first use and again whenever it expires.  Sessions ask
+ * the broker, over a local socket, where their VM's console is, and it
+ * answers with the console's location and its own session ID, which
+ * the session then uses to connect to the console and to act on the VM.
+ *
+ * The broker also keeps a second session per pool, the only one to
+ * receive VM and console events, and a session that wants to hear when
+ * its console is deleted, or its VM moves to another host, keeps its
+ * connection to the broker open, and is sent a byte when that happens,
+ * so that only the sessions affected hear of each event.
+ *
+ * Where each configured VM's console is rarely changes, so the broker
+ * caches what it finds, starting with every VM as soon as it has
+ * registered for events, and forgets a VM when an event arrives for it
+ * or its console.  Most lookups then need no Xen API calls at all.  The
+ * cache is only used while registered, as events may be missed between
+ * one events session and the next.
+ *
+ * Master has a channel to the broker, as with the event engine, and
+ * closes it when the configuration is re-read, after which the broker
+ * takes no more lookups, and exits once its watching sessions have
+ * gone, by which time master will have started another.  If there is
+ * no broker, sessions simply log in for themselves, as they always did.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "xvp.h"
+
+#define XVP_BROKER_NAME "xvp-broker-%d" /* abstract, by broker pid */
+
+#define XVP_BROKER_EARLY_BURST  4 /* early lookups per client address ... */
+#define XVP_BROKER_EARLY_REGAIN 15 /* ... each regained after seconds */
+
+typedef struct xvp_broker_watch xvp_broker_watch;
+struct xvp_broker_watch { /* a session waiting on its console */
+    xvp_broker_watch *next;
+    int               sock;
+    char              vm_ref[XVP_BROKER_REFLEN];
+    char              console_ref[XVP_BROKER_REFLEN];
+    char              host_ref[XVP_BROKER_REFLEN];
+};
+
+typedef struct xvp_broker_cached xvp_broker_cached;
+struct xvp_broker_cached { /* where a VM's console was last found */
+    xvp_broker_cached *next;
+    xvp_vm            *vm;
+    xvp_broker_reply   reply; /* less session ID and master */
+};
+
+typedef struct xvp_broker_pool xvp_broker_pool;
+struct xvp_broker_pool { /* broker state for one pool */
+    xvp_broker_pool  *next;
+    xvp_pool         *pool;
+    pthread_mutex_t   lock;
+    pthread_mutex_t   xa_lock;
+    xvp_xenapi       *xa;        /* for lookups, under xa_lock */
+    xvp_xenapi       *events_xa; /* for the events thread only */
+    xvp_broker_watch *watches;   /* under lock */
+    xvp_broker_cached *cache;    /* under lock */
+    bool              cacheable; /* registered for events, under lock */
+    unsigned long     generation; /* events had, under lock */
+    unsigned long     lookups;
+    unsigned long     hits;
+    unsigned long     failures;
+    unsigned long     deleted;
+    unsigned long     moved;
+};
+
+typedef struct xvp_broker_source xvp_broker_source;
+struct xvp_broker_source { /* early lookups left to a client address */
+    xvp_broker_source *next;
+    unsigned int       addr;
+    int                left;
+    time_t             when; /* since which none has been regained */
+};
+
+pid_t xvp_broker_pid = 0;
+
+static xvp_broker_pool *xvp_broker_pools = NULL;
+static pthread_mutex_t  xvp_broker_lock = PTHREAD_MUTEX_INITIALIZER;
+static int              xvp_broker_clients = 0; /* under broker lock */
+static unsigned long    xvp_broker_accepts = 0;
+static bool             xvp_broker_draining = false;
+static xvp_broker_source *xvp_broker_sources = NULL; /* under broker lock */
+static unsigned long    xvp_broker_early = 0;   /* likewise */
+static unsigned long    xvp_broker_refused = 0; /* likewise */
+
+static void xvp_broker_address(pid_t pid, struct sockaddr_un *addr,
+			       socklen_t *lenp)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+	     XVP_BROKER_NAME, (int)pid);
+    *lenp = offsetof(struct sockaddr_un, sun_path) + 1 +
+	strlen(addr->sun_path + 1);
+}
+
+/*
+ * Pools are only added, never removed, as a broker lives no longer
+ * than the configuration it was started with
+ */
+static xvp_broker_pool *xvp_broker_pool_for(xvp_pool *pool)
+{
+    xvp_broker_pool *bp;
+
+    pthread_mutex_lock(&xvp_broker_lock);
+
+    for (bp = xvp_broker_pools; bp; bp = bp->next)
+	if (bp->pool == pool)
+	    break;
+
+    if (!bp) {
+	bp = xvp_alloc(sizeof(xvp_broker_pool));
+	memset(bp, 0, sizeof(xvp_broker_pool));
+	bp->pool = pool;
+	pthread_mutex_init(&bp->lock, NULL);
+	pthread_mutex_init(&bp->xa_lock, NULL);
+	bp->xa = xvp_xenapi_create(false);
+	bp->events_xa = xvp_xenapi_create(false);
+	bp->next = xvp_broker_pools;
+	xvp_broker_pools = bp;
+    }
+
+    pthread_mutex_unlock(&xvp_broker_lock);
+    return bp;
+}
+
+static void xvp_broker_cache_flush(xvp_broker_pool *bp)
+{
+    xvp_broker_cached *cached;
+
+    while ((cached = bp->cache)) {
+	bp->cache = cached->next;
+	xvp_free(cached);
+    }
+}
+
+/*
+ * Forget any VM whose record or console has changed
+ */
+static void xvp_broker_cache_forget(xvp_broker_pool *bp, char *ref)
+{
+    xvp_broker_cached *cached, **cp;
+
+    for (cp = &bp->cache; (cached = *cp);) {
+	if (strcmp(cached->reply.vm_ref, ref) &&
+	    strcmp(cached->reply.console_ref, ref)) {
+	    cp = &cached->next;
+	    continue;
+	}
+	xvp_log(XVP_LOG_DEBUG, "Broker: forgetting console of %s",
+		cached->vm->vmname);
+	*cp = cached->next;
+	xvp_free(cached);
+    }
+}
+
+/*
+ * Find a VM's console, from the cache if we can.  Xen API calls are made
+ * without the pool lock, so as not to hold up cache hits or events, and
+ * if an event arrives meanwhile, what we found may be out of date
+ * already, so is given to the caller, but not cached.
+ */
+static bool xvp_broker_find_console(xvp_broker_pool *bp, xvp_vm *vm,
+				    xvp_broker_reply *reply)
+{
+    xvp_broker_cached *cached;
+    unsigned long generation;
+    bool hit, ok;
+
+    pthread_mutex_lock(&bp->lock);
+    bp->lookups++;
+    for (cached = bp->cache; cached; cached = cached->next)
+	if (cached->vm == vm)
+	    break;
+    if ((hit = (cached != NULL)))
+	*reply = cached->reply;
+    generation = bp->generation;
+    pthread_mutex_unlock(&bp->lock);
+
+    pthread_mutex_lock(&bp->xa_lock);
+    ok = hit ? xvp_xenapi_session_reply(bp->xa, bp->pool, reply) :
+	xvp_xenapi_lookup(bp->xa, vm, reply);
+    pthread_mutex_unlock(&bp->xa_lock);
+
+    pthread_mutex_lock(&bp->lock);
+
+    if (!ok) {
+	bp->failures++;
+    } else if (hit) {
+	bp->hits++;
+    } else if (bp->cacheable && bp->generation == generation) {
+	for (cached = bp->cache; cached; cached = cached->next)
+	    if (cached->vm == vm)
+		break;
+	if (!cached) {
+	    cached = xvp_alloc(sizeof(xvp_broker_cached));
+	    cached->vm = vm;
+	    cached->next = bp->cache;
+	    bp->cache = cached;
+	}
+	cached->reply = *reply;
+	memset(cached->reply.session_id, 0, sizeof(reply->session_id));
+    }
+
+    pthread_mutex_unlock(&bp->lock);
+    return ok;
+}
+
+/*
+ * Look up every VM in the pool, so that the first client to connect to
+ * each needn't wait for it
+ */
+static void xvp_broker_cache_warm(xvp_broker_pool *bp)
+{
+    xvp_broker_reply reply;
+    xvp_vm *vm;
+    int found = 0, total = 0;
+    bool cacheable;
+
+    for (vm = bp->pool->vms; vm; vm = vm->next, total++) {
+	pthread_mutex_lock(&bp->lock);
+	cacheable = bp->cacheable;
+	pthread_mutex_unlock(&bp->lock);
+	if (!cacheable)
+	    break;
+	memset(&reply, 0, sizeof(reply));
+	if (xvp_broker_find_console(bp, vm, &reply))
+	    found++;
+    }
+
+    xvp_log(XVP_LOG_DEBUG, "Broker: found %d of %d consoles in pool %s",
+	    found, total, bp->pool->poolname);
+}
+
+/*
+ * Called from an events thread for each VM or console changed in its
+ * pool, or with no reference once it has registered for events
+ */
+static void xvp_broker_changed(xvp_pool *pool, char *ref, bool deleted)
+{
+    xvp_broker_pool *bp = xvp_broker_pool_for(pool);
+    xvp_broker_watch *watch;
+    char c, host_ref[XVP_BROKER_REFLEN];
+    bool watched = false;
+
+    pthread_mutex_lock(&bp->lock);
+    bp->generation++;
+
+    if (!ref) {
+	xvp_broker_cache_flush(bp);
+	bp->cacheable = true;
+	pthread_mutex_unlock(&bp->lock);
+	xvp_broker_cache_warm(bp);
+	return;
+    }
+
+    xvp_broker_cache_forget(bp, ref);
+
+    for (watch = bp->watches; watch; watch = watch->next) {
+	if (!deleted && !strcmp(watch->vm_ref, ref))
+	    watched = true;
+	if (!deleted || strcmp(watch->console_ref, ref))
+	    continue;
+	c = XVP_BROKER_DELETED;
+	(void)send(watch->sock, &c, 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+	bp->deleted++;
+    }
+
+    pthread_mutex_unlock(&bp->lock);
+
+    /*
+     * Only for a VM with sessions watching, find out if it has moved,
+     * which if it has shut down instead, its console's deletion will tell
+     */
+    if (!watched ||
+	!xvp_xenapi_resident_on(bp->events_xa, ref, host_ref,
+				sizeof(host_ref)) ||
+	!*host_ref || !strcmp(host_ref, "OpaqueRef:NULL"))
+	return;
+
+    pthread_mutex_lock(&bp->lock);
+    for (watch = bp->watches; watch; watch = watch->next) {
+	if (strcmp(watch->vm_ref, ref) || !strcmp(watch->host_ref, host_ref))
+	    continue;
+	strcpy(watch->host_ref, host_ref);
+	c = XVP_BROKER_MOVED;
+	(void)send(watch->sock, &c, 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+	bp->moved++;
+    }
+    pthread_mutex_unlock(&bp->lock);
+}
+
+static void *xvp_broker_events(void *arg)
+{
+    xvp_broker_pool *bp = (xvp_broker_pool *)arg;
+
+    while (true) {
+	xvp_xenapi_watch(bp->events_xa, bp->pool, xvp_broker_changed);
+	pthread_mutex_lock(&bp->lock);
+	bp->cacheable = false;
+	bp->generation++;
+	xvp_broker_cache_flush(bp);
+	pthread_mutex_unlock(&bp->lock);
+	sleep(XVP_BROKER_RETRY);
+    }
+
+    return NULL;
+}
+
+/*
+ * Start threads with all signals blocked, leaving them to the main loop
+ */
+static bool xvp_broker_thread(void *(*func)(void *), void *arg)
+{
+    sigset_t all, old;
+    pthread_t pt;
+    bool ok;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ok = (pthread_create(&pt, NULL, func, arg) == 0);
+    if (ok)
+	pthread_detach(pt);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return ok;
+}
+
+static xvp_vm *xvp_broker_find_vm(xvp_broker_request *request)
+{
+    xvp_pool *pool;
+
+    request->poolname[XVP_MAX_POOL] = '\0';
+    request->vmname[XVP_MAX_HOSTNAME] = '\0';
+
+    if (!(pool = xvp_config_pool_by_name(request->poolname)))
+	return NULL;
+
+    if (xvp_xenapi_is_uuid(request->vmname))
+	return xvp_config_vm_by_uuid(pool, request->vmname);
+    else
+	return xvp_config_vm_by_name(pool, request->vmname);
+}
+
+/*
+ * A session may look up its console before its client has
+ * authenticated, so as to connect while the client does so, but each
+ * client address may only have that done XVP_BROKER_EARLY_BURST times
+ * at once, regaining one every XVP_BROKER_EARLY_REGAIN seconds, so that
+ * unauthenticated clients can't use us to load XenServer.  Addresses
+ * with their full allowance are forgotten.
+ */
+static bool xvp_broker_early_ok(unsigned int addr)
+{
+    xvp_broker_source *src, **sp;
+    time_t now = time(NULL);
+    int regained;
+    bool ok;
+
+    pthread_mutex_lock(&xvp_broker_lock);
+
+    for (sp = &xvp_broker_sources; (src = *sp); ) {
+	if ((regained = (now - src->when) / XVP_BROKER_EARLY_REGAIN) > 0) {
+	    src->left += regained;
+	    src->when += regained * XVP_BROKER_EARLY_REGAIN;
+	}
+	if (src->left >= XVP_BROKER_EARLY_BURST) {
+	    *sp = src->next;
+	    xvp_free(src);
+	    continue;
+	}
+	if (src->addr == addr)
+	    break;
+	sp = &src->next;
+    }
+
+    if (!src) {
+	src = xvp_alloc(sizeof(xvp_broker_source));
+	src->addr = addr;
+	src->left = XVP_BROKER_EARLY_BURST;
+	src->when = now;
+	src->next = xvp_broker_sources;
+	xvp_broker_sources = src;
+    }
+
+    if ((ok = (src->left > 0))) {
+	src->left--;
+	xvp_broker_early++;
+    } else {
+	xvp_broker_refused++;
+    }
+
+    pthread_mutex_unlock(&xvp_broker_lock);
+    return ok;
+}
+
+/*
+ * Serve one session's lookup, and then, if it asked, keep watching its
+ * console until it goes away
+ */
+static void *xvp_broker_serve(void *arg)
+{
+    int sock = (int)(long)arg;
+    xvp_broker_request request;
+    xvp_broker_reply reply;
+    xvp_broker_pool *bp;
+    xvp_broker_watch *watch, **wp;
+    xvp_vm *vm;
+    char c;
+    int len;
+
+    memset(&reply, 0, sizeof(reply));
+
+    if (recv(sock, &request, sizeof(request), 0) != sizeof(request))
+	goto done;
+
+    if (!(vm = xvp_broker_find_vm(&request))) {
+	xvp_log(XVP_LOG_ERROR, "Broker: %s:%s not configured",
+		request.poolname, request.vmname);
+	(void)send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+	goto done;
+    }
+
+    if (request.early && !xvp_broker_early_ok(request.client_ip)) {
+	reply.refused = true;
+	(void)send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+	goto done;
+    }
+
+    bp = xvp_broker_pool_for(vm->pool);
+
+    reply.ok = xvp_broker_find_console(bp, vm, &reply);
+
+    if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply) ||
+	!reply.ok || !request.watch)
+	goto done;
+
+    watch = xvp_alloc(sizeof(xvp_broker_watch));
+    watch->sock = sock;
+    strcpy(watch->vm_ref, reply.vm_ref);
+    strcpy(watch->console_ref, reply.console_ref);
+    strcpy(watch->host_ref, reply.host_ref);
+
+    pthread_mutex_lock(&bp->lock);
+    watch->next = bp->watches;
+    bp->watches = watch;
+    pthread_mutex_unlock(&bp->lock);
+
+    /* the session sends nothing more, so this returns when it's gone */
+    while ((len = recv(sock, &c, 1, 0)) > 0 || (len < 0 && errno == EINTR))
+	;
+
+    pthread_mutex_lock(&bp->lock);
+    for (wp = &bp->watches; *wp; wp = &(*wp)->next) {
+	if (*wp == watch) {
+	    *wp = watch->next;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&bp->lock);
+    xvp_free(watch);
+
+ done:
+
+    close(sock);
+    pthread_mutex_lock(&xvp_broker_lock);
+    xvp_broker_clients--;
+    pthread_mutex_unlock(&xvp_broker_lock);
+    return NULL;
+}
+
+/*
+ * Only processes of ours may ask, as the reply includes a session ID
+ */
+static void xvp_broker_accept(int listener)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int sock;
+
+    if ((sock = accept(listener, NULL, NULL)) < 0) {
+	if (errno != EINTR && errno != EAGAIN)
+	    xvp_log_errno(XVP_LOG_ERROR, "Broker accept");
+	return;
+    }
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 ||
+	cred.uid != getuid()) {
+	xvp_log(XVP_LOG_ERROR, "Broker: refused connection from uid %d",
+		(int)cred.uid);
+	close(sock);
+	return;
+    }
+
+    pthread_mutex_lock(&xvp_broker_lock);
+    xvp_broker_clients++;
+    xvp_broker_accepts++;
+    pthread_mutex_unlock(&xvp_broker_lock);
+
+    if (!xvp_broker_thread(xvp_broker_serve, (void *)(long)sock)) {
+	xvp_log_errno(XVP_LOG_ERROR, "pthread_create");
+	close(sock);
+	pthread_mutex_lock(&xvp_broker_lock);
+	xvp_broker_clients--;
+	pthread_mutex_unlock(&xvp_broker_lock);
+    }
+}
+
+static void xvp_broker_logout(void)
+{
+    xvp_broker_pool *bp;
+
+    pthread_mutex_lock(&xvp_broker_lock);
+    for (bp = xvp_broker_pools; bp; bp = bp->next) {
+	pthread_mutex_lock(&bp->xa_lock);
+	xvp_xenapi_destroy(bp->xa);
+	bp->xa = NULL;
+	pthread_mutex_unlock(&bp->xa_lock);
+    }
+    pthread_mutex_unlock(&xvp_broker_lock);
+}
+
+void xvp_broker_main(int chan)
+{
+    struct pollfd pfds[3];
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    int listener, clients;
+    char ready = 'R';
+    xvp_pool *pool;
+
+    xvp_process_set_name("xvp: broker");
+    xvp_xenapi_init();
+
+    xvp_broker_address(xvp_pid, &addr, &addrlen);
+    if ((listener = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0 ||
+	bind(listener, (struct sockaddr *)&addr, addrlen) != 0 ||
+	listen(listener, XVP_VNC_LISTEN_BACKLOG) != 0)
+	xvp_log_errno(XVP_LOG_FATAL, "Unable to create broker socket");
+
+    if (write(chan, &ready, 1) != 1)
+	exit(1);
+
+    for (pool = xvp_pools; pool; pool = pool->next)
+	if (!xvp_broker_thread(xvp_broker_events, xvp_broker_pool_for(pool)))
+	    xvp_log_errno(XVP_LOG_ERROR, "pthread_create");
+
+    pfds[0].fd = chan;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = xvp_child_sigpipe[0];
+    pfds[1].events = POLLIN;
+    pfds[2].fd = listener;
+    pfds[2].events = POLLIN;
+
+    while (true) {
+
+	if (poll(pfds, xvp_broker_draining ? 2 : 3,
+		 xvp_broker_draining ? 1000 : -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    xvp_log_errno(XVP_LOG_FATAL, "poll");
+	}
+
+	if ((pfds[1].revents & POLLIN) && !xvp_process_signal_handler())
+	    break;
+
+	/* end of file means master has retired us */
+	if (!xvp_broker_draining &&
+	    (pfds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+	    close(listener);
+	    pfds[0].fd = -1;
+	    xvp_broker_draining = true;
+	    xvp_process_set_name("xvp: broker (draining)");
+	}
+
+	if (!xvp_broker_draining && (pfds[2].revents & POLLIN))
+	    xvp_broker_accept(listener);
+
+	if (xvp_broker_draining) {
+	    pthread_mutex_lock(&xvp_broker_lock);
+	    clients = xvp_broker_clients;
+	    pthread_mutex_unlock(&xvp_broker_lock);
+	    if (clients == 0) {
+		xvp_log(XVP_LOG_DEBUG, "Broker drained");
+		break;
+	    }
+	}
+    }
+
+    /* the events sessions are left to expire with us */
+    xvp_broker_logout();
+}
+
+/*
+ * Ask the broker for the console of a VM, returning 1 if it found it, 0
+ * if not, or -1 if there's no broker to ask.  If asked to watch, the
+ * connection to the broker is left open for xvp_broker_wait().
+ */
+int xvp_broker_lookup(xvp_vm *vm, bool watch, unsigned int early_ip,
+		      xvp_broker_reply *reply, int *sockp)
+{
+    xvp_broker_request request;
+    struct sockaddr_un addr;
+    struct timeval timeout;
+    socklen_t addrlen;
+    int sock;
+
+    if (!xvp_broker_pid)
+	return -1;
+
+    memset(&request, 0, sizeof(request));
+    strcpy(request.poolname, vm->pool->poolname);
+    strcpy(request.vmname, *vm->uuid ? vm->uuid : vm->vmname);
+    request.watch = watch;
+    request.early = (early_ip != 0);
+    request.client_ip = early_ip;
+
+    xvp_broker_address(xvp_broker_pid, &addr, &addrlen);
+    if ((sock = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+	return -1;
+    if (connect(sock, (struct sockaddr *)&addr, addrlen) != 0) {
+	xvp_log_errno(XVP_LOG_DEBUG, "Broker unavailable");
+	close(sock);
+	return -1;
+    }
+
+    timeout.tv_sec = XVP_BROKER_TIMEOUT;
+    timeout.tv_usec = 0;
+    (void)setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (send(sock, &request, sizeof(request), MSG_NOSIGNAL) !=
+	sizeof(request) ||
+	recv(sock, reply, sizeof(*reply), 0) != sizeof(*reply)) {
+	xvp_log_errno(XVP_LOG_ERROR, "Broker lookup");
+	close(sock);
+	return -1;
+    }
+
+    if (!reply->ok) {
+	if (reply->refused)
+	    xvp_log(XVP_LOG_DEBUG, "Broker refused early lookup");
+	close(sock);
+	return 0;
+    }
+
+    reply->vmname[XVP_MAX_HOSTNAME] = '\0';
+    reply->host_url[sizeof(reply->host_url) - 1] = '\0';
+    reply->console_url[sizeof(reply->console_url) - 1] = '\0';
+    reply->session_id[sizeof(reply->session_id) - 1] = '\0';
+    reply->vm_ref[sizeof(reply->vm_ref) - 1] = '\0';
+    reply->console_ref[sizeof(reply->console_ref) - 1] = '\0';
+    reply->host_ref[sizeof(reply->host_ref) - 1] = '\0';
+
+    if (watch) {
+	timeout.tv_sec = 0;
+	(void)setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO,
+			 &timeout, sizeof(timeout));
+	*sockp = sock;
+    } else {
+	close(sock);
+    }
+
+    return 1;
+}
+
+/*
+ * Wait on a watching connection, returning XVP_BROKER_DELETED if the
+ * console has been deleted, XVP_BROKER_MOVED if the VM has moved to
+ * another host, or 0 if the broker has gone
+ */
+int xvp_broker_wait(int sock)
+{
+    char c;
+    int len;
+
+    while ((len = recv(sock, &c, 1, 0)) < 0 && errno == EINTR)
+	;
+
+    return len == 1 ? c : 0;
+}
+
+void xvp_broker_dump(void)
+{
+    xvp_broker_pool *bp;
+
+    pthread_mutex_lock(&xvp_broker_lock);
+
+    xvp_log(XVP_LOG_INFO, "Broker%s: %lu connections accepted, %d open, "
+	    "%lu early lookups allowed, %lu refused",
+	    xvp_broker_draining ? " (draining)" : "",
+	    xvp_broker_accepts, xvp_broker_clients,
+	    xvp_broker_early, xvp_broker_refused);
+
+    for (bp = xvp_broker_pools; bp; bp = bp->next) {
+	xvp_log(XVP_LOG_INFO, "Broker pool %s: %lu lookups (%lu cached, "
+		"%lu failed), %d logins, %lu consoles deleted, "
+		"%lu VMs moved%s",
+		bp->pool->poolname, bp->lookups, bp->hits, bp->failures,
+		bp->xa ? xvp_xenapi_logins(bp->xa) : 0, bp->deleted, bp->moved,
+		bp->cacheable ? "" : ", not caching");
+	if (bp->xa)
+	    xvp_xenapi_dump(bp->xa, "Broker lookups");
+    }
+    pthread_mutex_unlock(&xvp_broker_lock);
+}
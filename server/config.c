@@ -18,20 +18,29 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "xvp.h"
 
 #define XVP_CONFIG_MAX_DEPTH 5
 #define XVP_CONFIG_MAX_WORDS 10
 #define XVP_CONFIG_LINEBUF_SIZE 4096
+#define XVP_CONFIG_INDEX_MIN 64 /* buckets, doubling as entries exceed */
+#define XVP_CONFIG_CHUNK_SIZE (1024 * 1024) /* of arena, mapped as needed */
 
 typedef enum {
     XVP_CONFIG_STATE_DATABASE,
     XVP_CONFIG_STATE_OTP,
+    XVP_CONFIG_STATE_ENGINE,
+    XVP_CONFIG_STATE_CIPHERS,
     XVP_CONFIG_STATE_MULTIPLEX,
     XVP_CONFIG_STATE_POOL,
     XVP_CONFIG_STATE_DOMAIN,
     XVP_CONFIG_STATE_MANAGER,
+    XVP_CONFIG_STATE_FRAMERATE,
+    XVP_CONFIG_STATE_PASTERATE,
+    XVP_CONFIG_STATE_TRANSPORT,
     XVP_CONFIG_STATE_HOST,
     XVP_CONFIG_STATE_GROUP,
     XVP_CONFIG_STATE_VM
@@ -41,11 +50,361 @@ char     *xvp_config_filename = XVP_CONFIG_FILENAME;
 xvp_pool *xvp_pools = NULL;
 xvp_vm   *xvp_multiplex_vm = NULL;
 
+/*
+ * Pools and VMs are kept in lists, in the order configured, but also
+ * indexed, so that neither loading a config of many thousands of VMs,
+ * with its duplicate checks, nor finding one for a client, means
+ * walking them all.  The pool's VM name and UUID indexes are shared by
+ * all pools, so their hashes include the pool.
+ */
+typedef struct xvp_config_link {
+    struct xvp_config_link *next;
+    unsigned int            hash;
+    void                   *item;
+} xvp_config_link;
+
+typedef struct {
+    xvp_config_link **buckets;
+    unsigned int      size;  /* power of 2, or 0 until first used */
+    unsigned int      count;
+} xvp_config_index;
+
+static xvp_config_index xvp_config_pools_by_name;
+static xvp_config_index xvp_config_vms_by_name;
+static xvp_config_index xvp_config_vms_by_uuid;
+static xvp_config_index xvp_config_vms_by_port;
+static xvp_config_index xvp_config_vms_by_sock;
+static xvp_pool        *xvp_config_pools_tail = NULL;
+
+/*
+ * Each generation of the configuration, as read on starting and on each
+ * SIGUSR1, is allocated from an arena of large chunks mapped for it, so
+ * there is no per-object overhead in the master's memory, or in the page
+ * tables copied on each fork, and all of it is given back in one go on
+ * reading the next.  VMs have an arena of
+ * their own, making them an array in the order configured, and other
+ * strings are shared while loading, so that a domain or group name, say,
+ * is kept once however many times it appears.
+ */
+typedef struct xvp_config_chunk {
+    struct xvp_config_chunk *next;
+    size_t                   used;
+    size_t                   size;
+} xvp_config_chunk;
+
+typedef struct {
+    xvp_config_chunk *chunks; /* latest first */
+    size_t            total;
+} xvp_config_arena;
+
+static xvp_config_arena xvp_config_objects;
+static xvp_config_arena xvp_config_vms;
+static char           **xvp_config_strings = NULL; /* open addressed */
+static unsigned int     xvp_config_strings_size = 0;
+static unsigned int     xvp_config_strings_count = 0;
+
+/*
+ * Kept only for compiling an image (see image.c): the files read, and
+ * what xvpweb wants from DATABASE lines, which we ignore
+ */
+xvp_config_source        *xvp_config_sources = NULL;
+static xvp_config_source *xvp_config_sources_tail = NULL;
+char                     *xvp_config_database[3]; /* dsn, username, password */
+
 static int   xvp_config_depth = 0;
 static char *xvp_config_filenames[XVP_CONFIG_MAX_DEPTH];
 static FILE *xvp_config_streams[XVP_CONFIG_MAX_DEPTH];
 static int   xvp_config_linenums[XVP_CONFIG_MAX_DEPTH];
 
+static void *xvp_config_arena_alloc(xvp_config_arena *arena, size_t size,
+				    size_t align)
+{
+    xvp_config_chunk *chunk = arena->chunks;
+    size_t offset = 0, chunk_size;
+
+    if (chunk)
+	offset = (chunk->used + align - 1) & ~(align - 1);
+
+    if (!chunk || offset + size > chunk->size) {
+	chunk_size = XVP_CONFIG_CHUNK_SIZE;
+	if (size + sizeof(xvp_config_chunk) > chunk_size)
+	    chunk_size = (size + sizeof(xvp_config_chunk) + 4095) & ~4095;
+	chunk = mmap(NULL, chunk_size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (chunk == MAP_FAILED)
+	    xvp_log(XVP_LOG_FATAL, "Out of memory");
+	chunk->size = chunk_size;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->total += chunk_size;
+	offset = (sizeof(xvp_config_chunk) + align - 1) & ~(align - 1);
+    }
+
+    chunk->used = offset + size;
+    return (char *)chunk + offset; /* zeroed, as freshly mapped */
+}
+
+static void xvp_config_arena_release(xvp_config_arena *arena)
+{
+    xvp_config_chunk *chunk;
+
+    while ((chunk = arena->chunks)) {
+	arena->chunks = chunk->next;
+	munmap(chunk, chunk->size);
+    }
+
+    arena->total = 0;
+}
+
+void *xvp_config_alloc(int size)
+{
+    return xvp_config_arena_alloc(&xvp_config_objects, size,
+				  sizeof(void *));
+}
+
+xvp_vm *xvp_config_alloc_vm(void)
+{
+    return xvp_config_arena_alloc(&xvp_config_vms, sizeof(xvp_vm),
+				  sizeof(void *));
+}
+
+/* FNV-1a, seeded so that the same name hashes apart in each pool */
+static unsigned int xvp_config_hash(void *seed, char *text)
+{
+    unsigned int hash = 2166136261u ^ (unsigned int)(unsigned long)seed;
+
+    while (*text) {
+	hash ^= (unsigned char)*text++;
+	hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static unsigned int xvp_config_hash_int(int n)
+{
+    unsigned int hash = n;
+
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3bu;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static char *xvp_config_strcopy(char *text, int size)
+{
+    char *copy = xvp_config_arena_alloc(&xvp_config_objects, size, 1);
+
+    strcpy(copy, text);
+    return copy;
+}
+
+/*
+ * A copy of the string in the arena, or the one already made of it
+ * since the table of them was last forgotten
+ */
+char *xvp_config_strdup(char *text)
+{
+    unsigned int hash = xvp_config_hash(NULL, text), i, size;
+    char **old, *copy;
+
+    if (!*text)
+	return "";
+
+    if (xvp_config_strings_count * 2 >= xvp_config_strings_size) {
+	size = xvp_config_strings_size ? xvp_config_strings_size * 2 :
+	    XVP_CONFIG_INDEX_MIN;
+	old = xvp_config_strings;
+	xvp_config_strings = xvp_alloc(size * sizeof(char *));
+	for (i = 0; i < xvp_config_strings_size; i++) {
+	    if (!(copy = old[i]))
+		continue;
+	    hash = xvp_config_hash(NULL, copy) & (size - 1);
+	    while (xvp_config_strings[hash])
+		hash = (hash + 1) & (size - 1);
+	    xvp_config_strings[hash] = copy;
+	}
+	if (old)
+	    xvp_free(old);
+	xvp_config_strings_size = size;
+	hash = xvp_config_hash(NULL, text);
+    }
+
+    for (i = hash & (xvp_config_strings_size - 1);
+	 (copy = xvp_config_strings[i]);
+	 i = (i + 1) & (xvp_config_strings_size - 1))
+	if (!strcmp(copy, text))
+	    return copy;
+
+    copy = xvp_config_strcopy(text, strlen(text) + 1);
+    xvp_config_strings[i] = copy;
+    xvp_config_strings_count++;
+
+    return copy;
+}
+
+/*
+ * Once loaded, nothing more is added, so the table can go
+ */
+static void xvp_config_strings_forget(void)
+{
+    if (xvp_config_strings)
+	xvp_free(xvp_config_strings);
+    xvp_config_strings = NULL;
+    xvp_config_strings_size = xvp_config_strings_count = 0;
+}
+
+static void xvp_config_index_add(xvp_config_index *index,
+				 unsigned int hash, void *item)
+{
+    xvp_config_link *link, **old, **bucket;
+    unsigned int i, size;
+
+    if (index->count >= index->size) {
+	size = index->size ? index->size * 2 : XVP_CONFIG_INDEX_MIN;
+	old = index->buckets;
+	index->buckets = xvp_alloc(size * sizeof(xvp_config_link *));
+	for (i = 0; i < index->size; i++) {
+	    while ((link = old[i])) {
+		old[i] = link->next;
+		bucket = &index->buckets[link->hash & (size - 1)];
+		link->next = *bucket;
+		*bucket = link;
+	    }
+	}
+	if (old)
+	    xvp_free(old);
+	index->size = size;
+    }
+
+    link = xvp_config_alloc(sizeof(xvp_config_link));
+    link->hash = hash;
+    link->item = item;
+    bucket = &index->buckets[hash & (index->size - 1)];
+    link->next = *bucket;
+    *bucket = link;
+    index->count++;
+}
+
+static void xvp_config_index_remove(xvp_config_index *index,
+				    unsigned int hash, void *item)
+{
+    xvp_config_link *link, **prev;
+
+    if (!index->size)
+	return;
+
+    for (prev = &index->buckets[hash & (index->size - 1)];
+	 (link = *prev); prev = &link->next) {
+	if (link->item == item) {
+	    *prev = link->next; /* left in the arena until the next load */
+	    index->count--;
+	    return;
+	}
+    }
+}
+
+/*
+ * Returns the first item with the hash, or the next after "after",
+ * leaving the caller to check that it really is the one wanted
+ */
+static void *xvp_config_index_find(xvp_config_index *index,
+				   unsigned int hash, void *after)
+{
+    xvp_config_link *link;
+
+    if (!index->size)
+	return NULL;
+
+    link = index->buckets[hash & (index->size - 1)];
+
+    if (after) {
+	for (; link && link->item != after; link = link->next)
+	    /* empty */;
+	if (link)
+	    link = link->next;
+    }
+
+    for (; link; link = link->next)
+	if (link->hash == hash)
+	    return link->item;
+
+    return NULL;
+}
+
+/*
+ * The links are in the arena, so only the buckets need emptying
+ */
+static void xvp_config_index_clear(xvp_config_index *index)
+{
+    if (index->size)
+	memset(index->buckets, 0, index->size * sizeof(xvp_config_link *));
+
+    index->count = 0;
+}
+
+static void xvp_config_add_source(char *filename, FILE *stream)
+{
+    xvp_config_source *source = xvp_config_alloc(sizeof(xvp_config_source));
+    struct stat st;
+
+    if (fstat(fileno(stream), &st) < 0)
+	xvp_log_errno(XVP_LOG_FATAL, "%s", filename);
+
+    source->filename = xvp_config_strdup(filename);
+    source->size = st.st_size;
+    if (xvp_image_compiling &&
+	!xvp_image_file_hash(fileno(stream), &source->hash))
+	xvp_log_errno(XVP_LOG_FATAL, "%s", filename);
+
+    if (xvp_config_sources_tail)
+	xvp_config_sources_tail->next = source;
+    else
+	xvp_config_sources = source;
+    xvp_config_sources_tail = source;
+}
+
+/*
+ * Back to defaults, releasing whatever was read before, or whatever was
+ * read of an image that proved to be corrupt
+ */
+static void xvp_config_reset(void)
+{
+    int i;
+
+    xvp_otp_mode    = XVP_OTP_MODE;
+    xvp_otp_ipcheck = XVP_OTP_IPCHECK;
+    xvp_otp_window  = XVP_OTP_WINDOW;
+
+    xvp_engine_mode  = XVP_ENGINE_MODE;
+    xvp_prefork_min  = XVP_PREFORK_MIN;
+    xvp_prefork_max  = XVP_PREFORK_MAX;
+    xvp_prefork_idle = XVP_PREFORK_IDLE;
+    xvp_engine_threads = XVP_ENGINE_THREADS;
+    xvp_engine_shards  = XVP_ENGINE_SHARDS;
+
+    strcpy(xvp_ssl_ciphers, XVP_SSL_CIPHERS);
+    strcpy(xvp_ssl_ciphersuites, XVP_SSL_CIPHERSUITES);
+
+    xvp_multiplex_vm = NULL;
+    xvp_pools = NULL;
+    xvp_config_pools_tail = NULL;
+    xvp_config_sources = NULL;
+    xvp_config_sources_tail = NULL;
+    for (i = 0; i < 3; i++)
+	xvp_config_database[i] = NULL;
+
+    xvp_config_index_clear(&xvp_config_pools_by_name);
+    xvp_config_index_clear(&xvp_config_vms_by_name);
+    xvp_config_index_clear(&xvp_config_vms_by_uuid);
+    xvp_config_index_clear(&xvp_config_vms_by_port);
+    xvp_config_index_clear(&xvp_config_vms_by_sock);
+
+    xvp_config_strings_forget();
+    xvp_config_arena_release(&xvp_config_objects);
+    xvp_config_arena_release(&xvp_config_vms);
+}
+
 static void xvp_config_bad(void)
 {
     xvp_log(XVP_LOG_FATAL, "%s: Syntax error at line %d",
@@ -130,6 +489,8 @@ static int xvp_config_parse_line(char *line, char **wordv, int *linenum)
     if (!(stream = fopen(wordv[1], "r")))
 	xvp_log_errno(XVP_LOG_FATAL, "%s", wordv[1]);
 
+    xvp_config_add_source(wordv[1], stream);
+
     xvp_config_depth++;
     xvp_config_filenames[xvp_config_depth] = xvp_strdup(wordv[1]);
     xvp_config_streams[xvp_config_depth]   = stream;
@@ -152,43 +513,26 @@ void xvp_config_init(void)
     char *xvp_ipcheck_text = NULL;
 
     xvp_vm *vm, *new_vm;
+    char *groupname = NULL;
+    char password[XVP_MAX_XEN_PW + 1];
 
-    xvp_otp_mode    = XVP_OTP_MODE;
-    xvp_otp_ipcheck = XVP_OTP_IPCHECK;
-    xvp_otp_window  = XVP_OTP_WINDOW;
-
-    if (scanned) {
+    if (scanned)
 	xvp_log(XVP_LOG_INFO, "Re-reading config file on signal");
 
-	if (xvp_multiplex_vm) {
-	    xvp_free(xvp_multiplex_vm);
-	    xvp_multiplex_vm = NULL;
-	}
+    xvp_config_reset();
 
-	while (xvp_pools) {
-	    pool = xvp_pools;
-	    xvp_pools = pool->next;
-	    while (pool->hosts) {
-		host = pool->hosts;
-		pool->hosts = host->next;
-		xvp_free(host);
-	    }
-	    while (pool->vms) {
-		vm = pool->vms;
-		pool->vms = vm->next;
-		xvp_free(vm);
-	    }
-	    xvp_free(pool);
-	}
+    if (!xvp_image_compiling && xvp_image_load())
+	goto xvp_config_loaded;
 
-    } else {
-	xvp_log(XVP_LOG_DEBUG, "Reading config file %s", xvp_config_filename);
-    }
+    xvp_config_reset(); /* of anything read from a corrupt image */
 
+    xvp_log(XVP_LOG_DEBUG, "Reading config file %s", xvp_config_filename);
 
     if (!(stream = fopen(xvp_config_filename, "r")))
 	xvp_log_errno(XVP_LOG_FATAL, "%s", xvp_config_filename);
 
+    xvp_config_add_source(xvp_config_filename, stream);
+
     xvp_config_depth        = 0;
     xvp_config_filenames[0] = xvp_strdup(xvp_config_filename);
     xvp_config_streams[0]   = stream;
@@ -209,14 +553,21 @@ void xvp_config_init(void)
 		goto xvp_config_state_otp;
 	    if (wordc < 2 || wordc > 4)
 		xvp_config_bad();
-	    /* used by xvpweb, not relevant to us here, so pass over */
+	    if (wordc == 4 &&
+		(strlen(wordv[3]) != XVP_MAX_XEN_PW * 2 ||
+		 !xvp_password_text_to_hex(wordv[3], password,
+					   XVP_PASSWORD_XEN)))
+		xvp_config_bad();
+	    /* used by xvpweb, so only kept for compiling an image */
+	    for (i = 1; i < wordc; i++)
+		xvp_config_database[i - 1] = xvp_config_strdup(wordv[i]);
 	    state = XVP_CONFIG_STATE_OTP;
 	    break;
 		
 	case XVP_CONFIG_STATE_OTP: /* OTP REQUIRE|ALLOW|DENY [IPCHECK ON|OFF|HTTP] [ window ] */
 	xvp_config_state_otp:
 	    if (strcmp(wordv[0], "OTP"))
-		goto xvp_config_state_multiplex;
+		goto xvp_config_state_engine;
 	    if (wordc < 2 || wordc > 5)
 		xvp_config_bad();
 	    if (!strcmp(wordv[1], "DENY"))
@@ -245,6 +596,69 @@ void xvp_config_init(void)
 		if (xvp_otp_window < 1 || xvp_otp_window > XVP_OTP_MAX_WINDOW)
 		    xvp_config_bad();
 	    }
+	    state = XVP_CONFIG_STATE_ENGINE;
+	    break;
+
+	case XVP_CONFIG_STATE_ENGINE: /* ENGINE FORK|PREFORK|EVENT [ ... ] */
+	xvp_config_state_engine:
+	    if (strcmp(wordv[0], "ENGINE"))
+		goto xvp_config_state_ciphers;
+	    if (wordc < 2)
+		xvp_config_bad();
+	    if (!strcmp(wordv[1], "FORK")) {
+		if (wordc != 2)
+		    xvp_config_bad();
+		xvp_engine_mode = XVP_ENGINE_FORK;
+	    } else if (!strcmp(wordv[1], "PREFORK")) {
+		if (wordc != 2 && wordc != 4 && wordc != 5)
+		    xvp_config_bad();
+		xvp_engine_mode = XVP_ENGINE_PREFORK;
+		if (wordc >= 4) {
+		    xvp_prefork_min = atoi(wordv[2]);
+		    xvp_prefork_max = atoi(wordv[3]);
+		    if (xvp_prefork_min < 0 || xvp_prefork_max < 1 ||
+			xvp_prefork_min > xvp_prefork_max ||
+			xvp_prefork_max > XVP_PREFORK_MAX_LIMIT)
+			xvp_config_bad();
+		}
+		if (wordc == 5) {
+		    xvp_prefork_idle = atoi(wordv[4]);
+		    if (xvp_prefork_idle < 1)
+			xvp_config_bad();
+		}
+	    } else if (!strcmp(wordv[1], "EVENT")) {
+		if (wordc < 2 || wordc > 4)
+		    xvp_config_bad();
+		xvp_engine_mode = XVP_ENGINE_EVENT;
+		if (wordc >= 3) {
+		    xvp_engine_threads = atoi(wordv[2]);
+		    if (xvp_engine_threads < 1 ||
+			xvp_engine_threads > XVP_ENGINE_MAX_THREADS)
+			xvp_config_bad();
+		}
+		if (wordc == 4) {
+		    xvp_engine_shards = atoi(wordv[3]);
+		    if (xvp_engine_shards < 1 ||
+			xvp_engine_shards > XVP_ENGINE_MAX_SHARDS)
+			xvp_config_bad();
+		}
+	    } else {
+		xvp_config_bad();
+	    }
+	    state = XVP_CONFIG_STATE_CIPHERS;
+	    break;
+
+	case XVP_CONFIG_STATE_CIPHERS: /* CIPHERS list [ suites ] */
+	xvp_config_state_ciphers:
+	    if (strcmp(wordv[0], "CIPHERS"))
+		goto xvp_config_state_multiplex;
+	    if (wordc < 2 || wordc > 3 ||
+		strlen(wordv[1]) > XVP_MAX_CIPHERS ||
+		(wordc == 3 && strlen(wordv[2]) > XVP_MAX_CIPHERS))
+		xvp_config_bad();
+	    strcpy(xvp_ssl_ciphers, wordv[1]);
+	    if (wordc == 3)
+		strcpy(xvp_ssl_ciphersuites, wordv[2]);
 	    state = XVP_CONFIG_STATE_MULTIPLEX;
 	    break;
 
@@ -263,10 +677,7 @@ void xvp_config_init(void)
 		if (port < 1024 || port > 65535)
 		    xvp_config_bad();
 	    }
-	    xvp_multiplex_vm = xvp_alloc(sizeof(xvp_vm));
-	    xvp_multiplex_vm->sock = -1;
-	    xvp_multiplex_vm->port = port;
-	    strcpy(xvp_multiplex_vm->vmname, "[multiplexer]");
+	    xvp_config_set_multiplex(port);
 	    state = XVP_CONFIG_STATE_POOL;
 	    break;
 
@@ -289,12 +700,11 @@ void xvp_config_init(void)
 		xvp_log(XVP_LOG_FATAL,
 			"%s: Duplicate pool name at line %d",
 			xvp_config_filenames[xvp_config_depth], linenum);
-	    new_pool = xvp_alloc(sizeof(xvp_pool));
-	    strcpy(new_pool->poolname, line + 1);
-	    if (pool = xvp_config_last_pool())
-		pool->next = new_pool;
-	    else
-		xvp_pools = new_pool;
+	    new_pool = xvp_config_alloc(sizeof(xvp_pool));
+	    new_pool->poolname = xvp_config_strdup(line + 1);
+	    new_pool->domainname = "";
+	    xvp_config_add_pool(new_pool);
+	    groupname = NULL;
 	    state = XVP_CONFIG_STATE_DOMAIN;
 	    break;
 
@@ -304,8 +714,9 @@ void xvp_config_init(void)
 		xvp_config_bad();
 	    if (*wordv[1]) {
 		/* store with leading dot for ease of manipulation */
-		*new_pool->domainname = '.';
-		strcpy(new_pool->domainname + 1, wordv[1]);
+		*line = '.';
+		strcpy(line + 1, wordv[1]);
+		new_pool->domainname = xvp_config_strdup(line);
 	    }
 	    state = XVP_CONFIG_STATE_MANAGER;
 	    break;
@@ -317,11 +728,50 @@ void xvp_config_init(void)
 		!xvp_password_text_to_hex(wordv[2], new_pool->password,
 					  XVP_PASSWORD_XEN))
 		xvp_config_bad();
-	    strcpy(new_pool->manager, wordv[1]);
+	    new_pool->manager = xvp_config_strdup(wordv[1]);
+	    state = XVP_CONFIG_STATE_FRAMERATE;
+	    break;
+
+	case XVP_CONFIG_STATE_FRAMERATE: /* FRAMERATE fps */
+	    if (strcmp(wordv[0], "FRAMERATE"))
+		goto xvp_config_state_pasterate;
+	    if (wordc != 2)
+		xvp_config_bad();
+	    new_pool->framerate = atoi(wordv[1]);
+	    if (new_pool->framerate < 0 ||
+		new_pool->framerate > XVP_MAX_FRAMERATE)
+		xvp_config_bad();
+	    state = XVP_CONFIG_STATE_PASTERATE;
+	    break;
+
+	case XVP_CONFIG_STATE_PASTERATE: /* PASTERATE cps */
+	xvp_config_state_pasterate:
+	    if (strcmp(wordv[0], "PASTERATE"))
+		goto xvp_config_state_transport;
+	    if (wordc != 2)
+		xvp_config_bad();
+	    new_pool->pasterate = atoi(wordv[1]);
+	    if (new_pool->pasterate < 0 ||
+		new_pool->pasterate > XVP_MAX_PASTERATE)
+		xvp_config_bad();
+	    state = XVP_CONFIG_STATE_TRANSPORT;
+	    break;
+
+	case XVP_CONFIG_STATE_TRANSPORT: /* TRANSPORT XMLRPC|JSONRPC */
+	xvp_config_state_transport:
+	    if (strcmp(wordv[0], "TRANSPORT"))
+		goto xvp_config_state_host;
+	    if (wordc != 2)
+		xvp_config_bad();
+	    if (!strcmp(wordv[1], "JSONRPC"))
+		new_pool->jsonrpc = true;
+	    else if (strcmp(wordv[1], "XMLRPC"))
+		xvp_config_bad();
 	    state = XVP_CONFIG_STATE_HOST;
 	    break;
 
 	case XVP_CONFIG_STATE_HOST: /* HOST hostname */
+	xvp_config_state_host:
 	    if (strcmp(wordv[0], "HOST")) {
 		if (new_pool->hosts)
 		    goto xvp_config_state_group;
@@ -349,16 +799,11 @@ void xvp_config_init(void)
 			"%s: Duplicate host name at line %d",
 			xvp_config_filenames[xvp_config_depth], linenum);
 		
-	    new_host = xvp_alloc(sizeof(xvp_host));
-	    new_host->pool = new_pool;
-	    strcpy(new_host->address, address);
-	    strcpy(new_host->hostname, hostname);
+	    new_host = xvp_config_alloc(sizeof(xvp_host));
+	    new_host->address = xvp_config_strdup(address);
+	    new_host->hostname = xvp_config_strdup(hostname);
 	    new_host->hostname_is_ipv4 = xvp_is_ipv4(new_host->hostname);
-
-	    if (host = xvp_config_last_host(new_pool))
-		host->next = new_host;
-	    else
-		new_pool->hosts = new_host;
+	    xvp_config_add_host(new_pool, new_host);
 	    break;
 
 	case XVP_CONFIG_STATE_GROUP: /* GROUP groupname */
@@ -367,11 +812,16 @@ void xvp_config_init(void)
 		goto xvp_config_state_vm;
 	    if (wordc < 2)
 		xvp_config_bad();
-	    /* used by xvpweb, not relevant to us here, so pass over */
+	    /* used by xvpweb, so only kept for compiling an image */
+	    for (i = 1, *line = '\0'; i < wordc; i++) {
+		strcat(line, " ");
+		memmove(line + strlen(line), wordv[i], strlen(wordv[i]) + 1);
+	    }
+	    groupname = xvp_config_strdup(line + 1);
 	    state = XVP_CONFIG_STATE_VM;
 	    break;
 
-	case XVP_CONFIG_STATE_VM: /* VM port vmname vnc-password */
+	case XVP_CONFIG_STATE_VM: /* VM port vmname vnc-password [fps] [HOT] */
 	xvp_config_state_vm:
 	    if (!strcmp(wordv[0], "GROUP"))
 		goto xvp_config_state_group;
@@ -380,8 +830,12 @@ void xvp_config_init(void)
 		    goto xvp_config_state_pool;
 		xvp_config_bad();
 	    }
-	    new_vm = xvp_alloc(sizeof(xvp_vm));
-	    if (wordc != 4 ||
+	    new_vm = xvp_config_alloc_vm();
+	    if (wordc > 4 && !strcmp(wordv[wordc - 1], "HOT")) {
+		new_vm->hot = true;
+		wordc--;
+	    }
+	    if ((wordc != 4 && wordc != 5) ||
 		strlen(wordv[2]) > XVP_MAX_HOSTNAME ||
 		strlen(wordv[3]) != XVP_MAX_VNC_PW * 2 ||
 		!xvp_password_text_to_hex(wordv[3], new_vm->password,
@@ -420,20 +874,21 @@ void xvp_config_init(void)
 			"%s: Duplicate port number at line %d",
 			xvp_config_filenames[xvp_config_depth], linenum);
 
-	    new_vm->pool = new_pool;
-	    new_vm->port = port;
-	    new_vm->sock = -1;
-	    if (xvp_xenapi_is_uuid(wordv[2])) {
-		strcpy(new_vm->uuid, wordv[2]);
-		strcpy(new_vm->vmname, "uuid=");
-		strcat(new_vm->vmname, wordv[2]);
+	    /* maximum frame rate, if not as for the pool */
+	    if (wordc == 5) {
+		new_vm->framerate = atoi(wordv[4]);
+		if (new_vm->framerate < 0 ||
+		    new_vm->framerate > XVP_MAX_FRAMERATE)
+		    xvp_config_bad();
 	    } else {
-		strcpy(new_vm->vmname, wordv[2]);
+		new_vm->framerate = new_pool->framerate;
 	    }
-	    if (vm = xvp_config_last_vm(new_pool))
-		vm->next = new_vm;
-	    else
-		new_pool->vms = new_vm;
+
+	    new_vm->port = port;
+	    new_vm->sock = -1;
+	    new_vm->groupname = groupname;
+	    xvp_config_set_vmname(new_vm, wordv[2]);
+	    xvp_config_add_vm(new_pool, new_vm);
 	    break;
 	}
     }
@@ -442,6 +897,13 @@ void xvp_config_init(void)
 	xvp_log(XVP_LOG_FATAL, "%s: Unexpected end of file at line %d",
 		xvp_config_filename, xvp_config_linenums[0]);
 
+ xvp_config_loaded:
+
+    xvp_config_strings_forget();
+    xvp_log(XVP_LOG_DEBUG, "Config uses %lu kB",
+	    (unsigned long)(xvp_config_objects.total +
+			    xvp_config_vms.total) / 1024);
+
     switch (xvp_otp_mode) {
     case XVP_OTP_DENY:
 	xvp_otp_text = "DENY";
@@ -466,6 +928,21 @@ void xvp_config_init(void)
     }
     xvp_log(XVP_LOG_DEBUG, "> OTP %s IPCHECK %s %d",
 	    xvp_otp_text, xvp_ipcheck_text, xvp_otp_window);
+    switch (xvp_engine_mode) {
+    case XVP_ENGINE_FORK:
+	xvp_log(XVP_LOG_DEBUG, "> ENGINE FORK");
+	break;
+    case XVP_ENGINE_PREFORK:
+	xvp_log(XVP_LOG_DEBUG, "> ENGINE PREFORK %d %d %d",
+		xvp_prefork_min, xvp_prefork_max, xvp_prefork_idle);
+	break;
+    case XVP_ENGINE_EVENT:
+	xvp_log(XVP_LOG_DEBUG, "> ENGINE EVENT %d %d",
+		xvp_engine_threads, xvp_engine_shards);
+	break;
+    }
+    xvp_log(XVP_LOG_DEBUG, "> CIPHERS %s %s",
+	    xvp_ssl_ciphers, xvp_ssl_ciphersuites);
     if (xvp_multiplex_vm)
 	xvp_log(XVP_LOG_DEBUG, "> MULTIPLEX %d", xvp_multiplex_vm->port);
     for (pool = xvp_pools; pool; pool = pool->next) {
@@ -473,6 +950,12 @@ void xvp_config_init(void)
 	xvp_log(XVP_LOG_DEBUG, ">   DOMAIN \"%s\"", *pool->domainname ?
 		pool->domainname + 1 : "");
 	xvp_log(XVP_LOG_DEBUG, ">   MANAGER \"%s\"", pool->manager);
+	if (pool->framerate)
+	    xvp_log(XVP_LOG_DEBUG, ">   FRAMERATE %d", pool->framerate);
+	if (pool->pasterate)
+	    xvp_log(XVP_LOG_DEBUG, ">   PASTERATE %d", pool->pasterate);
+	if (pool->jsonrpc)
+	    xvp_log(XVP_LOG_DEBUG, ">   TRANSPORT JSONRPC");
 	for (host = pool->hosts; host; host = host->next) {
 	    if (host->address[0])
 		xvp_log(XVP_LOG_DEBUG, ">   HOST %s \"%s\"",
@@ -482,29 +965,105 @@ void xvp_config_init(void)
 	}
 	for (vm = pool->vms; vm; vm = vm->next)
 	    if (vm->port)
-		xvp_log(XVP_LOG_DEBUG, ">   VM %d %s", vm->port, vm->vmname);
+		xvp_log(XVP_LOG_DEBUG, ">   VM %d %s %d%s",
+			vm->port, vm->vmname, vm->framerate,
+			vm->hot ? " HOT" : "");
 	    else
-		xvp_log(XVP_LOG_DEBUG, ">   VM - %s", vm->vmname);
+		xvp_log(XVP_LOG_DEBUG, ">   VM - %s %d%s",
+			vm->vmname, vm->framerate, vm->hot ? " HOT" : "");
     }
 
     scanned = true;
 }
 
-xvp_pool *xvp_config_last_pool(void)
+/*
+ * Add to the lists and indexes, for the config file or an image, which
+ * has already checked for duplicates
+ */
+void xvp_config_add_pool(xvp_pool *pool)
 {
-    xvp_pool *pool;
+    if (xvp_config_pools_tail)
+	xvp_config_pools_tail->next = pool;
+    else
+	xvp_pools = pool;
+    xvp_config_pools_tail = pool;
+
+    xvp_config_index_add(&xvp_config_pools_by_name,
+			 xvp_config_hash(NULL, pool->poolname), pool);
+}
 
-    for (pool = xvp_pools; pool && pool->next; pool = pool->next)
-	/* empty */;
+void xvp_config_add_host(xvp_pool *pool, xvp_host *host)
+{
+    host->pool = pool;
 
-    return pool;
+    if (pool->hosts_tail)
+	pool->hosts_tail->next = host;
+    else
+	pool->hosts = host;
+    pool->hosts_tail = host;
+}
+
+void xvp_config_add_vm(xvp_pool *pool, xvp_vm *vm)
+{
+    vm->pool = pool;
+
+    if (pool->vms_tail)
+	pool->vms_tail->next = vm;
+    else
+	pool->vms = vm;
+    pool->vms_tail = vm;
+
+    xvp_config_index_add(&xvp_config_vms_by_name,
+			 xvp_config_hash(pool, vm->vmname), vm);
+    if (*vm->uuid)
+	xvp_config_index_add(&xvp_config_vms_by_uuid,
+			     xvp_config_hash(pool, vm->uuid), vm);
+    if (vm->port)
+	xvp_config_index_add(&xvp_config_vms_by_port,
+			     xvp_config_hash_int(vm->port), vm);
+}
+
+void xvp_config_set_multiplex(int port)
+{
+    xvp_multiplex_vm = xvp_config_alloc_vm();
+    xvp_multiplex_vm->sock = -1;
+    xvp_multiplex_vm->port = port;
+    xvp_multiplex_vm->vmname = "[multiplexer]";
+    xvp_multiplex_vm->uuid = "";
+}
+
+/*
+ * VM names and UUIDs are distinct within a pool, and so not worth
+ * sharing.  A VM configured by UUID is known as "uuid=..." until its
+ * name label is found (see xenapi.c), and written over with that, so
+ * has room for it.
+ */
+void xvp_config_set_vmname(xvp_vm *vm, char *vmname)
+{
+    char name[XVP_MAX_HOSTNAME + 1];
+
+    if (xvp_xenapi_is_uuid(vmname)) {
+	vm->uuid = xvp_config_strcopy(vmname, strlen(vmname) + 1);
+	sprintf(name, "uuid=%s", vmname);
+	vm->vmname = xvp_config_strcopy(name, sizeof(name));
+    } else {
+	vm->uuid = "";
+	vm->vmname = xvp_config_strcopy(vmname, strlen(vmname) + 1);
+    }
+}
+
+xvp_pool *xvp_config_last_pool(void)
+{
+    return xvp_config_pools_tail;
 }
 
 xvp_pool *xvp_config_pool_by_name(char *poolname)
 {
-    xvp_pool *pool;
+    unsigned int hash = xvp_config_hash(NULL, poolname);
+    xvp_pool *pool = NULL;
 
-    for (pool = xvp_pools; pool; pool = pool->next)
+    while ((pool = xvp_config_index_find(&xvp_config_pools_by_name,
+					 hash, pool)))
 	if (!strcmp(pool->poolname, poolname))
 	    return pool;
 
@@ -513,12 +1072,7 @@ xvp_pool *xvp_config_pool_by_name(char *poolname)
 
 xvp_host *xvp_config_last_host(xvp_pool *pool)
 {
-    xvp_host *host;
-
-    for (host = pool->hosts; host && host->next; host = host->next)
-	/* empty */;
-
-    return host;
+    return pool->hosts_tail;
 }
 
 xvp_host *xvp_config_host_by_name(xvp_pool *pool, char *hostname)
@@ -541,17 +1095,13 @@ xvp_host *xvp_config_host_by_name(xvp_pool *pool, char *hostname)
 
 xvp_vm *xvp_config_last_vm(xvp_pool *pool)
 {
-    xvp_vm *vm;
-
-    for (vm = pool->vms; vm && vm->next; vm = vm->next)
-	/* empty */;
-
-    return vm;
+    return pool->vms_tail;
 }
 
 xvp_vm *xvp_config_vm_by_name(xvp_pool *pool, char *vmname)
 {
-    xvp_vm *vm;
+    unsigned int hash;
+    xvp_vm *vm = NULL;
 
     if (!pool) {
 	for (pool = xvp_pools; pool; pool = pool->next)
@@ -560,8 +1110,9 @@ xvp_vm *xvp_config_vm_by_name(xvp_pool *pool, char *vmname)
 	return NULL;
     }
 
-    for (vm = pool->vms; vm; vm = vm->next)
-	if (!strcmp(vm->vmname, vmname))
+    hash = xvp_config_hash(pool, vmname);
+    while ((vm = xvp_config_index_find(&xvp_config_vms_by_name, hash, vm)))
+	if (vm->pool == pool && !strcmp(vm->vmname, vmname))
 	    return vm;
 
     return NULL;
@@ -569,7 +1120,8 @@ xvp_vm *xvp_config_vm_by_name(xvp_pool *pool, char *vmname)
 
 xvp_vm *xvp_config_vm_by_uuid(xvp_pool *pool, char *uuid)
 {
-    xvp_vm *vm;
+    unsigned int hash;
+    xvp_vm *vm = NULL;
 
     if (!pool) {
 	for (pool = xvp_pools; pool; pool = pool->next)
@@ -578,8 +1130,9 @@ xvp_vm *xvp_config_vm_by_uuid(xvp_pool *pool, char *uuid)
 	return NULL;
     }
 
-    for (vm = pool->vms; vm; vm = vm->next)
-	if (!strncmp(vm->vmname, "uuid=", 5) && !strcmp(vm->vmname + 5, uuid))
+    hash = xvp_config_hash(pool, uuid);
+    while ((vm = xvp_config_index_find(&xvp_config_vms_by_uuid, hash, vm)))
+	if (vm->pool == pool && !strcmp(vm->uuid, uuid))
 	    return vm;
 
     return NULL;
@@ -587,8 +1140,8 @@ xvp_vm *xvp_config_vm_by_uuid(xvp_pool *pool, char *uuid)
 
 xvp_vm *xvp_config_vm_by_port(int port)
 {
-    xvp_pool *pool;
-    xvp_vm *vm;
+    unsigned int hash = xvp_config_hash_int(port);
+    xvp_vm *vm = NULL;
 
     if (!port)
 	return NULL;
@@ -596,26 +1149,40 @@ xvp_vm *xvp_config_vm_by_port(int port)
     if (xvp_multiplex_vm && xvp_multiplex_vm->port == port)
 	return xvp_multiplex_vm;
 
-    for (pool = xvp_pools; pool; pool = pool->next)
-	for (vm = pool->vms; vm; vm = vm->next)
-	    if (vm->port == port)
-		return vm;
+    while ((vm = xvp_config_index_find(&xvp_config_vms_by_port, hash, vm)))
+	if (vm->port == port)
+	    return vm;
 
     return NULL;
 }
 
 xvp_vm *xvp_config_vm_by_sock(int sock)
 {
-    xvp_pool *pool;
-    xvp_vm *vm;
+    unsigned int hash = xvp_config_hash_int(sock);
+    xvp_vm *vm = NULL;
 
     if (xvp_multiplex_vm && xvp_multiplex_vm->sock == sock)
 	return xvp_multiplex_vm;
 
-    for (pool = xvp_pools; pool; pool = pool->next)
-	for (vm = pool->vms; vm; vm = vm->next)
-	    if (vm->sock == sock)
-		return vm;
+    while ((vm = xvp_config_index_find(&xvp_config_vms_by_sock, hash, vm)))
+	if (vm->sock == sock)
+	    return vm;
 
     return NULL;
 }
+
+/*
+ * Record the socket a VM is listening on, keeping the index in step
+ */
+void xvp_config_set_sock(xvp_vm *vm, int sock)
+{
+    if (vm != xvp_multiplex_vm && vm->sock >= 0)
+	xvp_config_index_remove(&xvp_config_vms_by_sock,
+				xvp_config_hash_int(vm->sock), vm);
+
+    vm->sock = sock;
+
+    if (vm != xvp_multiplex_vm && sock >= 0)
+	xvp_config_index_add(&xvp_config_vms_by_sock,
+			     xvp_config_hash_int(sock), vm);
+}
@@ -0,0 +1,501 @@
+/*
+ * engine.c - event engine for Xen VNC Proxy
+ *
+ * Copyright (C) 2009-2012, Colin Dean
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * With "ENGINE EVENT", master passes each client connection to a single
+ * engine process, rather than to a process of its own.  The engine runs
+ * all its sessions from one epoll loop, using non-blocking sockets, and
+ * a small pool of job threads for anything that may block, chiefly
+ * talking to XenServer.  When the configuration is re-read, master
+ * closes its channel to the engine, which then stops taking on new
+ * sessions, and exits once its existing ones have ended, by which time
+ * master will have started another engine with the new configuration.
+ *
+ * With "ENGINE EVENT threads shards", master starts one engine per shard
+ * and listens on nothing itself.  Each shard has listening sockets of
+ * its own on every port, bound with SO_REUSEPORT, so the kernel spreads
+ * incoming connections between the shards, and they can run on as many
+ * cores, without master in between.  Each shard publishes its load for
+ * master to report on SIGUSR2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "xvp.h"
+
+#define XVP_ENGINE_MAX_EVENTS 64
+
+int xvp_engine_threads = XVP_ENGINE_THREADS;
+int xvp_engine_shards  = XVP_ENGINE_SHARDS;
+
+static int        xvp_engine_epoll_fd = -1;
+static int        xvp_engine_done_pipe[2];
+static bool       xvp_engine_draining = false;
+static xvp_watch  xvp_engine_chan_watch;
+static xvp_watch  xvp_engine_sig_watch;
+static xvp_watch  xvp_engine_done_watch;
+static xvp_timer *xvp_engine_timers = NULL;
+static int        xvp_engine_shard = -1; /* or not sharded */
+static xvp_watch *xvp_engine_listeners = NULL;
+static int        xvp_engine_listen_count = 0;
+
+static pthread_mutex_t xvp_engine_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  xvp_engine_cond = PTHREAD_COND_INITIALIZER;
+static xvp_job        *xvp_engine_queue = NULL;
+static xvp_job        *xvp_engine_queue_tail = NULL;
+static xvp_job        *xvp_engine_done = NULL;
+
+static int           xvp_engine_jobs = 0; /* submitted, not yet done */
+static int           xvp_engine_jobs_max = 0;
+static unsigned long xvp_engine_jobs_run = 0;
+static unsigned long xvp_engine_sessions = 0;
+static unsigned long xvp_engine_accepts = 0;
+
+/*
+ * Milliseconds, monotonic, as for timers, but also used by session
+ * processes to pace update requests
+ */
+long long xvp_engine_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Register interest in events on a file descriptor, or with no events,
+ * cancel it, which must be done before the descriptor is closed
+ */
+void xvp_engine_watch(xvp_watch *watch, unsigned int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (events == watch->events)
+	return;
+
+    if (!watch->events)
+	op = EPOLL_CTL_ADD;
+    else if (!events)
+	op = EPOLL_CTL_DEL;
+    else
+	op = EPOLL_CTL_MOD;
+
+    ev.events = events;
+    ev.data.ptr = watch;
+    if (epoll_ctl(xvp_engine_epoll_fd, op, watch->fd, &ev) != 0)
+	xvp_log_errno(XVP_LOG_ERROR, "epoll_ctl");
+
+    watch->events = events;
+}
+
+void xvp_engine_cancel(xvp_timer *timer)
+{
+    xvp_timer **tp;
+
+    for (tp = &xvp_engine_timers; *tp; tp = &(*tp)->next) {
+	if (*tp == timer) {
+	    *tp = timer->next;
+	    break;
+	}
+    }
+}
+
+void xvp_engine_schedule(xvp_timer *timer, int msec)
+{
+    xvp_timer **tp;
+
+    xvp_engine_cancel(timer);
+    timer->when = xvp_engine_now() + msec;
+
+    for (tp = &xvp_engine_timers; *tp; tp = &(*tp)->next)
+	if ((*tp)->when > timer->when)
+	    break;
+
+    timer->next = *tp;
+    *tp = timer;
+}
+
+static int xvp_engine_timeout(void)
+{
+    long long msec;
+
+    if (!xvp_engine_timers)
+	return -1;
+
+    msec = xvp_engine_timers->when - xvp_engine_now();
+    return msec > 0 ? msec : 0;
+}
+
+static void xvp_engine_run_timers(void)
+{
+    long long now = xvp_engine_now();
+    xvp_timer *timer;
+
+    while ((timer = xvp_engine_timers) && timer->when <= now) {
+	xvp_engine_timers = timer->next;
+	timer->func(timer->arg);
+	xvp_log_id = 0;
+    }
+}
+
+/*
+ * Queue a job for the next free thread, its done function being called
+ * back in the event loop once it has run
+ */
+void xvp_engine_submit(xvp_job *job)
+{
+    job->next = NULL;
+
+    pthread_mutex_lock(&xvp_engine_lock);
+    if (xvp_engine_queue_tail)
+	xvp_engine_queue_tail->next = job;
+    else
+	xvp_engine_queue = job;
+    xvp_engine_queue_tail = job;
+    pthread_cond_signal(&xvp_engine_cond);
+    pthread_mutex_unlock(&xvp_engine_lock);
+
+    if (++xvp_engine_jobs > xvp_engine_jobs_max)
+	xvp_engine_jobs_max = xvp_engine_jobs;
+}
+
+static void *xvp_engine_thread(void *arg)
+{
+    xvp_job *job;
+    bool wake;
+    char c = 0;
+
+    while (true) {
+
+	pthread_mutex_lock(&xvp_engine_lock);
+	while (!(job = xvp_engine_queue))
+	    pthread_cond_wait(&xvp_engine_cond, &xvp_engine_lock);
+	if (!(xvp_engine_queue = job->next))
+	    xvp_engine_queue_tail = NULL;
+	pthread_mutex_unlock(&xvp_engine_lock);
+
+	job->run(job->arg);
+	xvp_log_id = 0;
+
+	/* the event loop only needs waking for the first of a batch */
+	pthread_mutex_lock(&xvp_engine_lock);
+	wake = (xvp_engine_done == NULL);
+	job->next = xvp_engine_done;
+	xvp_engine_done = job;
+	pthread_mutex_unlock(&xvp_engine_lock);
+
+	if (wake && write(xvp_engine_done_pipe[1], &c, 1) != 1)
+	    xvp_log_errno(XVP_LOG_ERROR, "Error writing job pipe");
+    }
+
+    return NULL;
+}
+
+static void xvp_engine_complete(void)
+{
+    xvp_job *jobs = NULL, *job, *next;
+    char buf[64];
+
+    while (read(xvp_engine_done_pipe[0], buf, sizeof(buf)) > 0)
+	/* empty */;
+
+    pthread_mutex_lock(&xvp_engine_lock);
+    job = xvp_engine_done;
+    xvp_engine_done = NULL;
+    pthread_mutex_unlock(&xvp_engine_lock);
+
+    /* done list is newest first, so reverse it */
+    for (; job; job = next) {
+	next = job->next;
+	job->next = jobs;
+	jobs = job;
+    }
+
+    /* a done function may reuse its job, so move on first */
+    while ((job = jobs)) {
+	jobs = job->next;
+	xvp_engine_jobs--;
+	xvp_engine_jobs_run++;
+	job->done(job->arg);
+	xvp_log_id = 0;
+    }
+}
+
+static void xvp_engine_start_threads(void)
+{
+    sigset_t all, old;
+    pthread_t pt;
+    int i;
+
+    /* leave signals to the event loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    for (i = 0; i < xvp_engine_threads; i++)
+	if (pthread_create(&pt, NULL, xvp_engine_thread, NULL) != 0)
+	    xvp_log_errno(XVP_LOG_FATAL, "pthread_create");
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Each session needs a couple of file descriptors, so allow as many
+ * as we're permitted
+ */
+static void xvp_engine_fd_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == rl.rlim_max)
+	return;
+
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+	xvp_log_errno(XVP_LOG_ERROR, "setrlimit");
+}
+
+/*
+ * Accept connections queued on one of a shard's own listeners, though
+ * no more than a batch at a time, so as not to starve existing sessions
+ */
+static void xvp_engine_listen_accept(xvp_watch *watch, unsigned int events)
+{
+    xvp_vm *vm = (xvp_vm *)watch->arg;
+    struct sockaddr_in client_addr;
+    socklen_t len;
+    int i, client_sock;
+
+    for (i = 0; i < XVP_ENGINE_MAX_EVENTS; i++) {
+	len = sizeof(client_addr);
+	client_sock = accept4(watch->fd, (struct sockaddr *)&client_addr, &len,
+			      SOCK_CLOEXEC);
+	if (client_sock == -1) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    if (errno != EAGAIN && errno != EWOULDBLOCK)
+		xvp_log_errno(XVP_LOG_ERROR, "accept on port %d", vm->port);
+	    return;
+	}
+
+	xvp_engine_accepts++;
+	xvp_engine_sessions++;
+	xvp_proxy_start(vm, client_sock, client_addr.sin_addr.s_addr);
+    }
+}
+
+static void xvp_engine_listen_for_vm(xvp_vm *vm)
+{
+    xvp_watch *watch;
+    int sock;
+
+    /* unlike master, carry on without it, as other shards may manage */
+    if ((sock = xvp_listen_socket(vm->port, true)) < 0) {
+	xvp_log_errno(XVP_LOG_ERROR, "Unable to listen on port %d for %s",
+		      vm->port, vm->vmname);
+	return;
+    }
+
+    watch = &xvp_engine_listeners[xvp_engine_listen_count++];
+    watch->fd = sock;
+    watch->func = xvp_engine_listen_accept;
+    watch->arg = vm;
+    xvp_engine_watch(watch, EPOLLIN);
+    xvp_config_set_sock(vm, sock);
+}
+
+static void xvp_engine_listen_init(void)
+{
+    int nsocks;
+    xvp_pool *pool;
+    xvp_vm *vm;
+
+    nsocks = xvp_multiplex_vm ? 1 : 0;
+    for (pool = xvp_pools; pool; pool = pool->next)
+	for (vm = pool->vms; vm; vm = vm->next)
+	    if (vm->port)
+		nsocks++;
+
+    xvp_engine_listeners = xvp_alloc((nsocks ? nsocks : 1) * sizeof(xvp_watch));
+
+    if (xvp_multiplex_vm)
+	xvp_engine_listen_for_vm(xvp_multiplex_vm);
+
+    for (pool = xvp_pools; pool; pool = pool->next)
+	for (vm = pool->vms; vm; vm = vm->next)
+	    if (vm->port)
+		xvp_engine_listen_for_vm(vm);
+
+    xvp_log(XVP_LOG_DEBUG, "Engine shard %d listening on %d ports",
+	    xvp_engine_shard, xvp_engine_listen_count);
+}
+
+/*
+ * Take whatever connections the kernel has already queued for us, as
+ * they would be reset when we close, then stop listening
+ */
+static void xvp_engine_listen_close(void)
+{
+    xvp_watch *watch;
+    int i;
+
+    for (i = 0; i < xvp_engine_listen_count; i++) {
+	watch = &xvp_engine_listeners[i];
+	xvp_engine_listen_accept(watch, EPOLLIN);
+	xvp_engine_watch(watch, 0);
+	close(watch->fd);
+    }
+
+    xvp_engine_listen_count = 0;
+}
+
+static void xvp_engine_accept(xvp_watch *watch, unsigned int events)
+{
+    unsigned int client_ip;
+    int client_sock;
+    xvp_vm *vm;
+
+    /* end of file means master has re-read its config, or exited */
+    if ((client_sock = xvp_process_receive(watch->fd, &vm, &client_ip)) < 0) {
+	xvp_engine_listen_close();
+	xvp_proxy_warm_stop();
+	xvp_log(XVP_LOG_DEBUG, "Draining %d sessions", xvp_proxy_active());
+	xvp_engine_watch(watch, 0);
+	close(watch->fd);
+	xvp_engine_draining = true;
+	xvp_process_set_name("xvp: engine (draining)");
+	return;
+    }
+
+    if (!vm) {
+	close(client_sock);
+	return;
+    }
+
+    xvp_engine_sessions++;
+    xvp_proxy_start(vm, client_sock, client_ip);
+}
+
+void xvp_engine_main(int chan, int shard)
+{
+    struct epoll_event events[XVP_ENGINE_MAX_EVENTS];
+    int i, nready;
+    bool completed, signalled;
+    xvp_watch *watch;
+
+    xvp_engine_shard = shard;
+    xvp_process_set_name(shard < 0 ? "xvp: engine" : "xvp: engine shard");
+    xvp_engine_fd_limit();
+    xvp_xenapi_init();
+
+    if ((xvp_engine_epoll_fd = epoll_create(XVP_ENGINE_MAX_EVENTS)) < 0)
+	xvp_log_errno(XVP_LOG_FATAL, "epoll_create");
+
+    if (pipe(xvp_engine_done_pipe) != 0 ||
+	fcntl(xvp_engine_done_pipe[0], F_SETFL, O_NONBLOCK) != 0)
+	xvp_log_errno(XVP_LOG_FATAL, "Unable to create job pipe");
+
+    xvp_engine_chan_watch.fd = chan;
+    xvp_engine_chan_watch.func = xvp_engine_accept;
+    xvp_engine_watch(&xvp_engine_chan_watch, EPOLLIN);
+    xvp_engine_sig_watch.fd = xvp_child_sigpipe[0];
+    xvp_engine_watch(&xvp_engine_sig_watch, EPOLLIN);
+    xvp_engine_done_watch.fd = xvp_engine_done_pipe[0];
+    xvp_engine_watch(&xvp_engine_done_watch, EPOLLIN);
+
+    if (shard >= 0)
+	xvp_engine_listen_init();
+
+    xvp_engine_start_threads();
+    xvp_log(XVP_LOG_DEBUG, "Event engine running with %d threads",
+	    xvp_engine_threads);
+    xvp_proxy_warm_start();
+
+    while (true) {
+
+	nready = epoll_wait(xvp_engine_epoll_fd, events,
+			    XVP_ENGINE_MAX_EVENTS, xvp_engine_timeout());
+
+	if (nready < 0) {
+	    if (errno == EINTR)
+		continue;
+	    xvp_log_errno(XVP_LOG_FATAL, "epoll_wait");
+	}
+
+	/*
+	 * Sessions are only freed by completed jobs, so deal with those
+	 * after all other events, which may refer to them.
+	 */
+	for (i = 0, completed = signalled = false; i < nready; i++) {
+	    watch = (xvp_watch *)events[i].data.ptr;
+	    if (watch == &xvp_engine_done_watch)
+		completed = true;
+	    else if (watch == &xvp_engine_sig_watch)
+		signalled = true;
+	    else
+		watch->func(watch, events[i].events);
+	    xvp_log_id = 0;
+	}
+
+	if (completed)
+	    xvp_engine_complete();
+
+	xvp_engine_run_timers();
+
+	if (signalled && !xvp_process_signal_handler())
+	    return;
+
+	if (xvp_engine_shard >= 0 && !xvp_engine_draining)
+	    xvp_process_shard_load(xvp_engine_shard, xvp_engine_accepts,
+				   xvp_proxy_active());
+
+	if (xvp_engine_draining &&
+	    xvp_proxy_active() == 0 && xvp_engine_jobs == 0) {
+	    xvp_log(XVP_LOG_DEBUG, "Event engine drained");
+	    return;
+	}
+    }
+}
+
+void xvp_engine_dump(void)
+{
+    if (xvp_engine_shard >= 0)
+	xvp_log(XVP_LOG_INFO, "Engine shard %d: listening on %d ports, "
+		"%lu connections accepted", xvp_engine_shard,
+		xvp_engine_listen_count, xvp_engine_accepts);
+
+    xvp_log(XVP_LOG_INFO,
+	    "Event engine%s: %d active of %lu sessions, "
+	    "%lu jobs run, %d pending (max %d), %d threads",
+	    xvp_engine_draining ? " (draining)" : "",
+	    xvp_proxy_active(), xvp_engine_sessions, xvp_engine_jobs_run,
+	    xvp_engine_jobs, xvp_engine_jobs_max, xvp_engine_threads);
+    xvp_proxy_dump();
+}
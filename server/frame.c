@@ -0,0 +1,502 @@
+/*
+ * frame.c - following console messages for Xen VNC Proxy
+ *
+ * Copyright (C) 2009-2013, Colin Dean
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * XVP messages for the client (see proxy.c) must go between the
+ * console's messages, not in the middle of one, so the console's output
+ * is followed as it is relayed, to know where each message ends.  We
+ * look no further into a rectangle than it takes to find its length,
+ * and the rest is passed over unseen, so that it can still be spliced.
+ *
+ * That only works for encodings we know how to size, so proxy.c leaves
+ * any others out of the SetEncodings messages of clients wanting XVP
+ * messages, unless xvp_frame_encoding() knows them to be mere hints, of
+ * which the console sends nothing back.  Should we lose track all the
+ * same, off is set, and stays set.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "xvp.h"
+
+#ifndef MIN
+#define MIN(a,b) (((a) < (b)) ? (a) : (b))
+#endif
+
+/*
+ * Standard RFB server->client message types
+ */
+#define XVP_RFB_MESSAGE_TYPE_FB_UPDATE       0
+#define XVP_RFB_MESSAGE_TYPE_SET_COLOUR_MAP  1
+#define XVP_RFB_MESSAGE_TYPE_BELL            2
+#define XVP_RFB_MESSAGE_TYPE_SERVER_CUT_TEXT 3
+
+/*
+ * RFB encodings, and pseudo-encodings, whose rectangles we can find the
+ * end of without decoding them, as sent by XenServer's console (QEMU)
+ */
+#define XVP_RFB_ENCODING_RAW           0
+#define XVP_RFB_ENCODING_COPY_RECT     1
+#define XVP_RFB_ENCODING_RRE           2
+#define XVP_RFB_ENCODING_CORRE         4
+#define XVP_RFB_ENCODING_HEXTILE       5
+#define XVP_RFB_ENCODING_ZLIB          6
+#define XVP_RFB_ENCODING_TIGHT         7
+#define XVP_RFB_ENCODING_ZRLE          16
+#define XVP_RFB_ENCODING_ZYWRLE        17
+#define XVP_RFB_ENCODING_DESKTOP_SIZE  -223
+#define XVP_RFB_ENCODING_LAST_RECT     -224
+#define XVP_RFB_ENCODING_POINTER_POS   -232
+#define XVP_RFB_ENCODING_CURSOR        -239
+#define XVP_RFB_ENCODING_X_CURSOR      -240
+#define XVP_RFB_ENCODING_QEMU_POINTER  -257
+#define XVP_RFB_ENCODING_QEMU_KEY      -258
+#define XVP_RFB_ENCODING_TIGHT_PNG     -260
+#define XVP_RFB_ENCODING_QEMU_LED      -261
+#define XVP_RFB_ENCODING_DESKTOP_NAME  -307
+#define XVP_RFB_ENCODING_EXTENDED_SIZE -308
+
+typedef enum { /* what comes next from the console */
+    XVP_FRAME_TYPE,           /* message type */
+    XVP_FRAME_END,            /* ... having had all of one */
+    XVP_FRAME_UPDATE,         /* FramebufferUpdate header */
+    XVP_FRAME_RECT,           /* ... rectangle header */
+    XVP_FRAME_RECT_END,
+    XVP_FRAME_COLOUR_MAP,     /* SetColourMapEntries header */
+    XVP_FRAME_CUT_TEXT,       /* ServerCutText header */
+    XVP_FRAME_LENGTH,         /* U32 length of data to follow */
+    XVP_FRAME_RRE,            /* number of subrectangles */
+    XVP_FRAME_HEXTILE,        /* subencoding of a tile */
+    XVP_FRAME_HEXTILE_COUNT,  /* ... its number of subrectangles */
+    XVP_FRAME_HEXTILE_END,
+    XVP_FRAME_TIGHT,          /* compression control */
+    XVP_FRAME_TIGHT_FILTER,
+    XVP_FRAME_TIGHT_PALETTE,  /* number of colours, less one */
+    XVP_FRAME_TIGHT_DATA,
+    XVP_FRAME_TIGHT_LENGTH,   /* a byte of compact length */
+    XVP_FRAME_SCREENS         /* ExtendedDesktopSize header */
+} xvp_frame_state_enum;
+
+/*
+ * Whether the console may be asked to use an encoding while we follow
+ * its messages
+ */
+bool xvp_frame_encoding(int encoding)
+{
+    switch (encoding) {
+    case XVP_RFB_ENCODING_RAW:
+    case XVP_RFB_ENCODING_COPY_RECT:
+    case XVP_RFB_ENCODING_RRE:
+    case XVP_RFB_ENCODING_CORRE:
+    case XVP_RFB_ENCODING_HEXTILE:
+    case XVP_RFB_ENCODING_ZLIB:
+    case XVP_RFB_ENCODING_TIGHT:
+    case XVP_RFB_ENCODING_ZRLE:
+    case XVP_RFB_ENCODING_ZYWRLE:
+    case XVP_RFB_ENCODING_DESKTOP_SIZE:
+    case XVP_RFB_ENCODING_LAST_RECT:
+    case XVP_RFB_ENCODING_POINTER_POS:
+    case XVP_RFB_ENCODING_CURSOR:
+    case XVP_RFB_ENCODING_X_CURSOR:
+    case XVP_RFB_ENCODING_QEMU_POINTER:
+    case XVP_RFB_ENCODING_QEMU_KEY:
+    case XVP_RFB_ENCODING_TIGHT_PNG:
+    case XVP_RFB_ENCODING_QEMU_LED:
+    case XVP_RFB_ENCODING_DESKTOP_NAME:
+    case XVP_RFB_ENCODING_EXTENDED_SIZE:
+	return true;
+    default:
+	/*
+	 * Quality, compression, fine quality and subsampling levels are
+	 * hints, never sent back
+	 */
+	return (encoding >= -32 && encoding <= -23) ||
+	    (encoding >= -256 && encoding <= -247) ||
+	    (encoding >= -512 && encoding <= -412) ||
+	    (encoding >= -768 && encoding <= -763);
+    }
+}
+
+static void xvp_frame_next(xvp_frame *f);
+
+static void xvp_frame_enter(xvp_frame *f, int state)
+{
+    f->state = state;
+    f->have = 0;
+
+    switch (state) {
+    case XVP_FRAME_UPDATE:
+	f->need = 3;
+	break;
+    case XVP_FRAME_RECT:
+	f->need = 12;
+	break;
+    case XVP_FRAME_COLOUR_MAP:
+	f->need = 5;
+	break;
+    case XVP_FRAME_CUT_TEXT:
+	f->need = 7;
+	break;
+    case XVP_FRAME_LENGTH:
+    case XVP_FRAME_RRE:
+    case XVP_FRAME_SCREENS:
+	f->need = 4;
+	break;
+    case XVP_FRAME_END:
+    case XVP_FRAME_RECT_END:
+    case XVP_FRAME_HEXTILE_END:
+    case XVP_FRAME_TIGHT_DATA:
+	f->need = 0;
+	xvp_frame_next(f);
+	break;
+    default:
+	f->need = 1;
+	break;
+    }
+}
+
+static void xvp_frame_skip(xvp_frame *f, unsigned long len, int after)
+{
+    if (len == 0) {
+	xvp_frame_enter(f, after);
+	return;
+    }
+
+    f->skip = len;
+    f->after = after;
+}
+
+static void xvp_frame_lost(xvp_frame *f, char *what, int value)
+{
+    xvp_log(XVP_LOG_ERROR, "Lost track of console messages (%s %d)",
+	    what, value);
+    f->off = true;
+    f->since = 0;
+}
+
+/*
+ * Take the pixel format the console uses now, as each update starts
+ */
+static void xvp_frame_pixels(xvp_frame *f)
+{
+    unsigned char *pf = f->pixel_format;
+
+    f->bpp = pf[0] / 8;
+    f->tpixel = (pf[0] == 32 && pf[1] == 24 && pf[3] &&
+		 pf[4] == 0 && pf[5] == 255 && pf[6] == 0 && pf[7] == 255 &&
+		 pf[8] == 0 && pf[9] == 255) ? 3 : f->bpp;
+}
+
+static void xvp_frame_rect(xvp_frame *f)
+{
+    unsigned char *h = f->header;
+    unsigned long w, len;
+    int encoding;
+
+    f->width = w = (h[4] << 8) | h[5];
+    f->height = (h[6] << 8) | h[7];
+    encoding = (int)(((unsigned int)h[8] << 24) | (h[9] << 16) |
+		     (h[10] << 8) | h[11]);
+
+    switch (encoding) {
+    case XVP_RFB_ENCODING_RAW:
+	len = w * f->height * f->bpp;
+	xvp_frame_skip(f, len, XVP_FRAME_RECT_END);
+	break;
+    case XVP_RFB_ENCODING_COPY_RECT:
+	xvp_frame_skip(f, 4, XVP_FRAME_RECT_END);
+	break;
+    case XVP_RFB_ENCODING_RRE:
+    case XVP_RFB_ENCODING_CORRE:
+	f->subrect = (encoding == XVP_RFB_ENCODING_RRE) ? 8 : 4;
+	xvp_frame_enter(f, XVP_FRAME_RRE);
+	break;
+    case XVP_RFB_ENCODING_HEXTILE:
+	f->tile_x = f->tile_y = 0;
+	xvp_frame_enter(f, (w && f->height) ? XVP_FRAME_HEXTILE :
+			XVP_FRAME_RECT_END);
+	break;
+    case XVP_RFB_ENCODING_ZLIB:
+    case XVP_RFB_ENCODING_ZRLE:
+    case XVP_RFB_ENCODING_ZYWRLE:
+    case XVP_RFB_ENCODING_DESKTOP_NAME:
+	xvp_frame_enter(f, XVP_FRAME_LENGTH);
+	break;
+    case XVP_RFB_ENCODING_TIGHT:
+    case XVP_RFB_ENCODING_TIGHT_PNG:
+	xvp_frame_enter(f, XVP_FRAME_TIGHT);
+	break;
+    case XVP_RFB_ENCODING_CURSOR:
+	len = w * f->height * f->bpp + (w + 7) / 8 * f->height;
+	xvp_frame_skip(f, len, XVP_FRAME_RECT_END);
+	break;
+    case XVP_RFB_ENCODING_X_CURSOR:
+	len = (w && f->height) ? 6 + 2 * ((w + 7) / 8) * f->height : 0;
+	xvp_frame_skip(f, len, XVP_FRAME_RECT_END);
+	break;
+    case XVP_RFB_ENCODING_QEMU_LED:
+	xvp_frame_skip(f, 1, XVP_FRAME_RECT_END);
+	break;
+    case XVP_RFB_ENCODING_EXTENDED_SIZE:
+	xvp_frame_enter(f, XVP_FRAME_SCREENS);
+	break;
+    case XVP_RFB_ENCODING_DESKTOP_SIZE:
+    case XVP_RFB_ENCODING_POINTER_POS:
+    case XVP_RFB_ENCODING_QEMU_POINTER:
+    case XVP_RFB_ENCODING_QEMU_KEY:
+	xvp_frame_enter(f, XVP_FRAME_RECT_END);
+	break;
+    case XVP_RFB_ENCODING_LAST_RECT:
+	xvp_frame_enter(f, XVP_FRAME_END);
+	break;
+    default:
+	xvp_frame_lost(f, "encoding", encoding);
+	break;
+    }
+}
+
+static void xvp_frame_hextile(xvp_frame *f)
+{
+    int sub = f->header[0], len = 0;
+
+    if (sub & 1) { /* raw */
+	len = MIN(16, f->width - f->tile_x) * MIN(16, f->height - f->tile_y);
+	xvp_frame_skip(f, len * f->bpp, XVP_FRAME_HEXTILE_END);
+	return;
+    }
+
+    if (sub & 2) /* background */
+	len += f->bpp;
+    if (sub & 4) /* foreground */
+	len += f->bpp;
+    f->coloured = (sub & 16) != 0;
+    xvp_frame_skip(f, len, (sub & 8) ? XVP_FRAME_HEXTILE_COUNT :
+		   XVP_FRAME_HEXTILE_END);
+}
+
+/*
+ * Tight's basic compression: data under 12 bytes is sent as it is,
+ * anything longer zlib compressed, after its compact length
+ */
+static void xvp_frame_tight_data(xvp_frame *f)
+{
+    unsigned long len;
+
+    if (f->colours == 2)
+	len = (f->width + 7) / 8 * f->height;
+    else if (f->colours > 0)
+	len = f->width * f->height;
+    else
+	len = f->width * f->height * f->tpixel;
+
+    if (len < 12) {
+	xvp_frame_skip(f, len, XVP_FRAME_RECT_END);
+    } else {
+	f->length = f->shift = 0;
+	xvp_frame_enter(f, XVP_FRAME_TIGHT_LENGTH);
+    }
+}
+
+static void xvp_frame_tight(xvp_frame *f)
+{
+    int control = f->header[0] >> 4;
+
+    f->colours = 0;
+
+    if (control == 8) { /* fill */
+	xvp_frame_skip(f, f->tpixel, XVP_FRAME_RECT_END);
+    } else if (control == 9 || control == 10) { /* JPEG or PNG */
+	f->length = f->shift = 0;
+	xvp_frame_enter(f, XVP_FRAME_TIGHT_LENGTH);
+    } else if (control > 10) {
+	xvp_frame_lost(f, "Tight compression control", control);
+    } else if (control & 4) { /* filter given */
+	xvp_frame_enter(f, XVP_FRAME_TIGHT_FILTER);
+    } else {
+	xvp_frame_tight_data(f);
+    }
+}
+
+/*
+ * Act on a complete header, or move on from one state to the next
+ */
+static void xvp_frame_next(xvp_frame *f)
+{
+    unsigned char *h = f->header;
+    unsigned long len;
+
+    switch (f->state) {
+    case XVP_FRAME_TYPE:
+	switch (h[0]) {
+	case XVP_RFB_MESSAGE_TYPE_FB_UPDATE:
+	    f->update = true;
+	    xvp_frame_enter(f, XVP_FRAME_UPDATE);
+	    break;
+	case XVP_RFB_MESSAGE_TYPE_SET_COLOUR_MAP:
+	    xvp_frame_enter(f, XVP_FRAME_COLOUR_MAP);
+	    break;
+	case XVP_RFB_MESSAGE_TYPE_BELL:
+	    xvp_frame_enter(f, XVP_FRAME_END);
+	    break;
+	case XVP_RFB_MESSAGE_TYPE_SERVER_CUT_TEXT:
+	    xvp_frame_enter(f, XVP_FRAME_CUT_TEXT);
+	    break;
+	default:
+	    xvp_frame_lost(f, "message type", h[0]);
+	    break;
+	}
+	break;
+    case XVP_FRAME_END:
+	if (f->update) {
+	    f->update = false;
+	    f->updates++;
+	}
+	xvp_frame_enter(f, XVP_FRAME_TYPE);
+	break;
+    case XVP_FRAME_UPDATE:
+	xvp_frame_pixels(f);
+	f->rects = (h[1] << 8) | h[2];
+	xvp_frame_enter(f, f->rects ? XVP_FRAME_RECT : XVP_FRAME_END);
+	break;
+    case XVP_FRAME_RECT:
+	xvp_frame_rect(f);
+	break;
+    case XVP_FRAME_RECT_END:
+	xvp_frame_enter(f, --f->rects > 0 ? XVP_FRAME_RECT : XVP_FRAME_END);
+	break;
+    case XVP_FRAME_COLOUR_MAP:
+	xvp_frame_skip(f, ((h[3] << 8) | h[4]) * 6, XVP_FRAME_END);
+	break;
+    case XVP_FRAME_CUT_TEXT:
+	len = ((unsigned long)h[3] << 24) | (h[4] << 16) | (h[5] << 8) | h[6];
+	xvp_frame_skip(f, len, XVP_FRAME_END);
+	break;
+    case XVP_FRAME_LENGTH:
+	len = ((unsigned long)h[0] << 24) | (h[1] << 16) | (h[2] << 8) | h[3];
+	xvp_frame_skip(f, len, XVP_FRAME_RECT_END);
+	break;
+    case XVP_FRAME_RRE:
+	len = ((unsigned long)h[0] << 24) | (h[1] << 16) | (h[2] << 8) | h[3];
+	xvp_frame_skip(f, f->bpp + len * (f->bpp + f->subrect),
+		       XVP_FRAME_RECT_END);
+	break;
+    case XVP_FRAME_HEXTILE:
+	xvp_frame_hextile(f);
+	break;
+    case XVP_FRAME_HEXTILE_COUNT:
+	xvp_frame_skip(f, h[0] * (2 + (f->coloured ? f->bpp : 0)),
+		       XVP_FRAME_HEXTILE_END);
+	break;
+    case XVP_FRAME_HEXTILE_END:
+	if ((f->tile_x += 16) >= f->width) {
+	    f->tile_x = 0;
+	    f->tile_y += 16;
+	}
+	xvp_frame_enter(f, f->tile_y < f->height ? XVP_FRAME_HEXTILE :
+			XVP_FRAME_RECT_END);
+	break;
+    case XVP_FRAME_TIGHT:
+	xvp_frame_tight(f);
+	break;
+    case XVP_FRAME_TIGHT_FILTER:
+	if (h[0] == 1) /* palette */
+	    xvp_frame_enter(f, XVP_FRAME_TIGHT_PALETTE);
+	else if (h[0] == 0 || h[0] == 2) /* copy or gradient */
+	    xvp_frame_tight_data(f);
+	else
+	    xvp_frame_lost(f, "Tight filter", h[0]);
+	break;
+    case XVP_FRAME_TIGHT_PALETTE:
+	f->colours = h[0] + 1;
+	xvp_frame_skip(f, f->colours * f->tpixel, XVP_FRAME_TIGHT_DATA);
+	break;
+    case XVP_FRAME_TIGHT_DATA:
+	xvp_frame_tight_data(f);
+	break;
+    case XVP_FRAME_TIGHT_LENGTH:
+	if (f->shift == 14) { /* third byte, all eight bits */
+	    f->length |= (unsigned long)h[0] << 14;
+	} else {
+	    f->length |= (unsigned long)(h[0] & 0x7f) << f->shift;
+	    f->shift += 7;
+	    if (h[0] & 0x80) {
+		xvp_frame_enter(f, XVP_FRAME_TIGHT_LENGTH);
+		break;
+	    }
+	}
+	xvp_frame_skip(f, f->length, XVP_FRAME_RECT_END);
+	break;
+    case XVP_FRAME_SCREENS:
+	xvp_frame_skip(f, h[0] * 16, XVP_FRAME_RECT_END);
+	break;
+    }
+}
+
+/*
+ * Start following a new console connection's messages, sent in the
+ * given pixel format, or not at all if off
+ */
+void xvp_frame_init(xvp_frame *f, unsigned char *pixel_format, bool off)
+{
+    memset(f, 0, sizeof(xvp_frame));
+    memcpy(f->pixel_format, pixel_format, sizeof(f->pixel_format));
+    f->off = off;
+    xvp_frame_enter(f, XVP_FRAME_TYPE);
+}
+
+/*
+ * Size rectangles in updates yet to start by another pixel format
+ */
+void xvp_frame_pixel_format(xvp_frame *f, unsigned char *pixel_format)
+{
+    memcpy(f->pixel_format, pixel_format, sizeof(f->pixel_format));
+}
+
+/*
+ * Follow len bytes of console output, which may be NULL if they are
+ * being passed over unseen, as only skip bytes can be
+ */
+void xvp_frame_feed(xvp_frame *f, const char *data, unsigned long len)
+{
+    unsigned long n;
+
+    while (len > 0 && !f->off) {
+	if (f->skip > 0) {
+	    n = MIN(len, f->skip);
+	    f->skip -= n;
+	    if (f->skip == 0)
+		xvp_frame_enter(f, f->after);
+	} else if (!data) {
+	    xvp_frame_lost(f, "bytes unseen", (int)len);
+	    return;
+	} else {
+	    n = MIN(len, (unsigned long)(f->need - f->have));
+	    memcpy(f->header + f->have, data, n);
+	    if ((f->have += n) == f->need)
+		xvp_frame_next(f);
+	}
+	/* a message ending here leaves since zero, plus what follows */
+	f->since += n;
+	if (f->state == XVP_FRAME_TYPE && f->have == 0 && f->skip == 0)
+	    f->since = 0;
+	if (data)
+	    data += n;
+	len -= n;
+    }
+}
@@ -0,0 +1,679 @@
+/*
+ * image.c - compiled configuration images for Xen VNC Proxy
+ *
+ * Copyright (C) 2009-2013, Colin Dean
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * A configuration of many thousands of VMs, spread over INCLUDE files,
+ * takes a while to parse and check, and xvpweb would otherwise do so
+ * on every page.  So "xvp --compile-config" writes what it has read to
+ * an image beside it (xvp.conf.img, say), which both xvp and xvpweb
+ * read in preference, for as long as none of the files it was compiled
+ * from has since changed.
+ *
+ * The image, all of whose numbers are 32-bit little-endian, is:
+ *
+ *   header     as xvp_image_header below
+ *   sources    the files compiled from, with their times and sizes
+ *   pools      each with the index and count of its hosts and VMs
+ *   hosts
+ *   vms
+ *   tables     open-addressed hash tables, each slot holding a VM's
+ *              index plus 1, or 0 if empty, by "poolname:vmname" and
+ *              by port, so that xvpweb can find one VM without loading
+ *              the rest
+ *   strings    each once only, NUL-terminated, referred to by offset
+ *              from the start of strings, 0 meaning none
+ *
+ * Passwords are kept as configured, encrypted.  xvp, needing to change
+ * its VMs as it runs, still builds its own lists from the image, but
+ * with nothing left to parse or check.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <stdint.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "xvp.h"
+
+#define XVP_IMAGE_MAGIC   "XVPCONF"
+#define XVP_IMAGE_VERSION 2
+#define XVP_IMAGE_SUFFIX  ".img"
+
+#define XVP_IMAGE_FNV_BASIS 2166136261U
+#define XVP_IMAGE_FNV_PRIME 16777619U
+#define XVP_IMAGE_FNV64_BASIS 14695981039346656037ULL
+#define XVP_IMAGE_FNV64_PRIME 1099511628211ULL
+#define XVP_IMAGE_PORT_MULT 2654435761U
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t size;
+    uint32_t nsources, sources;
+    uint32_t otp_mode, otp_ipcheck, otp_window;
+    uint32_t engine_mode, prefork_min, prefork_max, prefork_idle;
+    uint32_t engine_threads, engine_shards;
+    uint32_t ciphers, ciphersuites;
+    uint32_t multiplex_port;
+    uint32_t db_dsn, db_username, db_password;
+    uint32_t npools, pools;
+    uint32_t nhosts, hosts;
+    uint32_t nvms, vms;
+    uint32_t vms_by_name_size, vms_by_name;
+    uint32_t vms_by_port_size, vms_by_port;
+    uint32_t strings_size, strings;
+} xvp_image_header;
+
+typedef struct {
+    uint32_t filename;
+    uint32_t size;
+    uint32_t hash_low, hash_high;
+} xvp_image_source;
+
+typedef struct {
+    uint32_t poolname, domainname, manager;
+    uint32_t framerate, pasterate, jsonrpc;
+    uint32_t first_host, nhosts;
+    uint32_t first_vm, nvms;
+    char     password[XVP_MAX_XEN_PW];
+} xvp_image_pool;
+
+typedef struct {
+    uint32_t pool;
+    uint32_t hostname, address;
+} xvp_image_host;
+
+typedef struct {
+    uint32_t pool;
+    uint32_t vmname; /* as configured, so a UUID without "uuid=" */
+    uint32_t port, framerate, hot;
+    uint32_t groupname;
+    char     password[XVP_MAX_VNC_PW];
+} xvp_image_vm;
+
+bool xvp_image_compiling = false;
+
+/*
+ * While compiling, the image is built up in memory, with strings kept
+ * separately, and interned, until their place is known
+ */
+typedef struct {
+    char         *data;
+    unsigned int  len, size;
+} xvp_image_buf;
+
+typedef struct {
+    xvp_image_buf strings;
+    uint32_t     *slots; /* string offsets, hashed */
+    unsigned int  nslots, count;
+} xvp_image_intern;
+
+char *xvp_image_filename(void)
+{
+    static char filename[MAXPATHLEN + 1];
+
+    snprintf(filename, sizeof(filename), "%s%s",
+	     xvp_config_filename, XVP_IMAGE_SUFFIX);
+    return filename;
+}
+
+static uint32_t xvp_image_hash(char *text, char *suffix)
+{
+    uint32_t hash = XVP_IMAGE_FNV_BASIS;
+
+    for (; *text; text++)
+	hash = (hash ^ (unsigned char)*text) * XVP_IMAGE_FNV_PRIME;
+
+    if (suffix) {
+	hash = (hash ^ ':') * XVP_IMAGE_FNV_PRIME;
+	for (; *suffix; suffix++)
+	    hash = (hash ^ (unsigned char)*suffix) * XVP_IMAGE_FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/*
+ * FNV-1a again, but 64 bits, of the contents of a file the config was
+ * read from, so that an image can be seen to be stale however little
+ * time passed, or if the file was replaced.  xvpweb gets the same from
+ * PHP's hash("fnv1a64").  This reads from the start, leaving the file
+ * offset where it was.
+ */
+bool xvp_image_file_hash(int fd, unsigned long long *hash)
+{
+    unsigned char buf[65536];
+    off_t off = 0;
+    ssize_t len, i;
+
+    *hash = XVP_IMAGE_FNV64_BASIS;
+    while ((len = pread(fd, buf, sizeof(buf), off)) > 0) {
+	for (i = 0; i < len; i++)
+	    *hash = (*hash ^ buf[i]) * XVP_IMAGE_FNV64_PRIME;
+	off += len;
+    }
+
+    return len == 0;
+}
+
+static uint32_t xvp_image_hash_port(int port)
+{
+    return (uint32_t)port * XVP_IMAGE_PORT_MULT;
+}
+
+/* slots for a table of count entries, no more than half full */
+static unsigned int xvp_image_table_size(unsigned int count)
+{
+    unsigned int size = 1;
+
+    while (size < count * 2)
+	size <<= 1;
+
+    return size;
+}
+
+static void xvp_image_table_put(uint32_t *table, unsigned int size,
+				uint32_t hash, unsigned int index)
+{
+    unsigned int slot = hash & (size - 1);
+
+    while (table[slot])
+	slot = (slot + 1) & (size - 1);
+
+    table[slot] = htole32(index + 1);
+}
+
+static void *xvp_image_append(xvp_image_buf *buf, void *data, int len)
+{
+    void *p;
+
+    if (buf->len + len > buf->size) {
+	while (buf->len + len > buf->size)
+	    buf->size = buf->size ? buf->size * 2 : 65536;
+	if (!(buf->data = realloc(buf->data, buf->size)))
+	    xvp_log(XVP_LOG_FATAL, "Out of memory");
+    }
+
+    p = buf->data + buf->len;
+    if (data)
+	memcpy(p, data, len);
+    else
+	memset(p, 0, len);
+    buf->len += len;
+
+    return p;
+}
+
+static uint32_t xvp_image_string(xvp_image_intern *in, char *text)
+{
+    unsigned int slot, i;
+    uint32_t *slots, off;
+
+    if (!text)
+	return 0;
+
+    if (in->count * 2 >= in->nslots) {
+	slots = in->slots;
+	in->nslots = in->nslots ? in->nslots * 2 : 1024;
+	in->slots = xvp_alloc(in->nslots * sizeof(uint32_t));
+	for (i = 0; i < in->nslots / 2; i++) {
+	    if (!slots || !(off = slots[i]))
+		continue;
+	    slot = xvp_image_hash(in->strings.data + off, NULL);
+	    while (in->slots[slot &= in->nslots - 1])
+		slot++;
+	    in->slots[slot] = off;
+	}
+	xvp_free(slots);
+    }
+
+    slot = xvp_image_hash(text, NULL);
+    while ((off = in->slots[slot &= in->nslots - 1])) {
+	if (!strcmp(in->strings.data + off, text))
+	    return htole32(off);
+	slot++;
+    }
+
+    if (!in->strings.len)
+	xvp_image_append(&in->strings, NULL, 1); /* so offset 0 is none */
+
+    off = in->strings.len;
+    xvp_image_append(&in->strings, text, strlen(text) + 1);
+    in->slots[slot] = off;
+    in->count++;
+
+    return htole32(off);
+}
+
+/*
+ * Write an image of the configuration just read, replacing any older
+ * image only once the new one is complete
+ */
+bool xvp_image_write(void)
+{
+    xvp_image_buf image = { NULL, 0, 0 };
+    xvp_image_intern in;
+    xvp_image_header header;
+    xvp_image_source *source;
+    xvp_image_pool *ipool;
+    xvp_image_host *ihost;
+    xvp_image_vm *ivm;
+    xvp_config_source *src;
+    xvp_pool *pool;
+    xvp_host *host;
+    xvp_vm *vm;
+    uint32_t *table;
+    unsigned int nhosts = 0, nvms = 0, i;
+    char *filename = xvp_image_filename(), tmpname[MAXPATHLEN + 1];
+    struct stat st;
+    int fd, len;
+
+    memset(&in, 0, sizeof(in));
+    memset(&header, 0, sizeof(header));
+
+    strcpy(header.magic, XVP_IMAGE_MAGIC);
+    header.version = htole32(XVP_IMAGE_VERSION);
+
+    header.otp_mode       = htole32(xvp_otp_mode);
+    header.otp_ipcheck    = htole32(xvp_otp_ipcheck);
+    header.otp_window     = htole32(xvp_otp_window);
+    header.engine_mode    = htole32(xvp_engine_mode);
+    header.prefork_min    = htole32(xvp_prefork_min);
+    header.prefork_max    = htole32(xvp_prefork_max);
+    header.prefork_idle   = htole32(xvp_prefork_idle);
+    header.engine_threads = htole32(xvp_engine_threads);
+    header.engine_shards  = htole32(xvp_engine_shards);
+    header.ciphers        = xvp_image_string(&in, xvp_ssl_ciphers);
+    header.ciphersuites   = xvp_image_string(&in, xvp_ssl_ciphersuites);
+    header.multiplex_port = htole32(xvp_multiplex_vm ?
+				    xvp_multiplex_vm->port : 0);
+    header.db_dsn      = xvp_image_string(&in, xvp_config_database[0]);
+    header.db_username = xvp_image_string(&in, xvp_config_database[1]);
+    header.db_password = xvp_image_string(&in, xvp_config_database[2]);
+
+    xvp_image_append(&image, NULL, sizeof(header));
+
+    header.sources = htole32(image.len);
+    for (src = xvp_config_sources, i = 0; src; src = src->next, i++) {
+	source = xvp_image_append(&image, NULL, sizeof(xvp_image_source));
+	source->filename = xvp_image_string(&in, src->filename);
+	source->size      = htole32(src->size);
+	source->hash_low  = htole32((uint32_t)src->hash);
+	source->hash_high = htole32((uint32_t)(src->hash >> 32));
+    }
+    header.nsources = htole32(i);
+
+    header.pools = htole32(image.len);
+    for (pool = xvp_pools, i = 0; pool; pool = pool->next, i++) {
+	ipool = xvp_image_append(&image, NULL, sizeof(xvp_image_pool));
+	ipool->poolname   = xvp_image_string(&in, pool->poolname);
+	ipool->domainname = xvp_image_string(&in, pool->domainname);
+	ipool->manager    = xvp_image_string(&in, pool->manager);
+	ipool->framerate  = htole32(pool->framerate);
+	ipool->pasterate  = htole32(pool->pasterate);
+	ipool->jsonrpc    = htole32(pool->jsonrpc);
+	ipool->first_host = htole32(nhosts);
+	ipool->first_vm   = htole32(nvms);
+	memcpy(ipool->password, pool->password, XVP_MAX_XEN_PW);
+	for (host = pool->hosts; host; host = host->next)
+	    nhosts++;
+	for (vm = pool->vms; vm; vm = vm->next)
+	    nvms++;
+	ipool->nhosts = htole32(nhosts - le32toh(ipool->first_host));
+	ipool->nvms   = htole32(nvms - le32toh(ipool->first_vm));
+    }
+    header.npools = htole32(i);
+
+    header.hosts  = htole32(image.len);
+    header.nhosts = htole32(nhosts);
+    for (pool = xvp_pools, i = 0; pool; pool = pool->next, i++) {
+	for (host = pool->hosts; host; host = host->next) {
+	    ihost = xvp_image_append(&image, NULL, sizeof(xvp_image_host));
+	    ihost->pool     = htole32(i);
+	    ihost->hostname = xvp_image_string(&in, host->hostname);
+	    ihost->address  = xvp_image_string(&in, host->address);
+	}
+    }
+
+    header.vms  = htole32(image.len);
+    header.nvms = htole32(nvms);
+    for (pool = xvp_pools, i = 0; pool; pool = pool->next, i++) {
+	for (vm = pool->vms; vm; vm = vm->next) {
+	    ivm = xvp_image_append(&image, NULL, sizeof(xvp_image_vm));
+	    ivm->pool      = htole32(i);
+	    ivm->vmname    = xvp_image_string(&in, *vm->uuid ?
+						 vm->uuid : vm->vmname);
+	    ivm->port      = htole32(vm->port);
+	    ivm->framerate = htole32(vm->framerate);
+	    ivm->hot       = htole32(vm->hot);
+	    ivm->groupname = xvp_image_string(&in, vm->groupname ?
+						 vm->groupname : "");
+	    memcpy(ivm->password, vm->password, XVP_MAX_VNC_PW);
+	}
+    }
+
+    len = xvp_image_table_size(nvms);
+    header.vms_by_name_size = htole32(len);
+    header.vms_by_name = htole32(image.len);
+    table = xvp_image_append(&image, NULL, len * sizeof(uint32_t));
+    for (pool = xvp_pools, i = 0; pool; pool = pool->next)
+	for (vm = pool->vms; vm; vm = vm->next, i++)
+	    xvp_image_table_put(table, len,
+				xvp_image_hash(pool->poolname, *vm->uuid ?
+					       vm->uuid : vm->vmname), i);
+
+    header.vms_by_port_size = htole32(len);
+    header.vms_by_port = htole32(image.len);
+    table = xvp_image_append(&image, NULL, len * sizeof(uint32_t));
+    for (pool = xvp_pools, i = 0; pool; pool = pool->next)
+	for (vm = pool->vms; vm; vm = vm->next, i++)
+	    if (vm->port)
+		xvp_image_table_put(table, len,
+				    xvp_image_hash_port(vm->port), i);
+
+    header.strings = htole32(image.len);
+    header.strings_size = htole32(in.strings.len);
+    xvp_image_append(&image, in.strings.data, in.strings.len);
+    header.size = htole32(image.len);
+    memcpy(image.data, &header, sizeof(header));
+
+    free(in.strings.data);
+    xvp_free(in.slots);
+
+    /*
+     * xvpweb must be able to read the image if it can read the config
+     * file, so the image is given the config file's group and mode
+     */
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+    if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+	xvp_log_errno(XVP_LOG_ERROR, "%s", tmpname);
+	free(image.data);
+	return false;
+    }
+
+    if (stat(xvp_config_filename, &st) == 0) {
+	(void)fchown(fd, -1, st.st_gid);
+	(void)fchmod(fd, st.st_mode & 0777);
+    }
+
+    for (i = 0; i < image.len; i += len) {
+	if ((len = write(fd, image.data + i, image.len - i)) <= 0) {
+	    xvp_log_errno(XVP_LOG_ERROR, "%s", tmpname);
+	    close(fd);
+	    unlink(tmpname);
+	    free(image.data);
+	    return false;
+	}
+    }
+
+    free(image.data);
+
+    if (fsync(fd) < 0 || close(fd) < 0 || rename(tmpname, filename) < 0) {
+	xvp_log_errno(XVP_LOG_ERROR, "%s", filename);
+	unlink(tmpname);
+	return false;
+    }
+
+    xvp_log(XVP_LOG_INFO, "Compiled %u pools, %u hosts and %u VMs into %s",
+	    le32toh(header.npools), nhosts, nvms, filename);
+    return true;
+}
+
+/*
+ * A string from a mapped image, or NULL if its offset is out of range,
+ * the image having been checked to end with a NUL
+ */
+static char *xvp_image_text(char *base, xvp_image_header *header,
+			    uint32_t off)
+{
+    off = le32toh(off);
+    if (!off || off >= le32toh(header->strings_size))
+	return NULL;
+
+    return base + le32toh(header->strings) + off;
+}
+
+/*
+ * A string from the image, copied into the config's arena, or NULL if
+ * it is out of range or too long
+ */
+static char *xvp_image_strdup(char *base, xvp_image_header *header,
+			      uint32_t off, int max)
+{
+    char *text = xvp_image_text(base, header, off);
+
+    if (!text || strlen(text) > max)
+	return NULL;
+
+    return xvp_config_strdup(text);
+}
+
+static bool xvp_image_copy(char *dst, char *src, int max)
+{
+    if (!src || strlen(src) > max)
+	return false;
+
+    strcpy(dst, src);
+    return true;
+}
+
+static bool xvp_image_fits(xvp_image_header *header, uint32_t off,
+			   uint32_t count, int size)
+{
+    return off <= le32toh(header->size) &&
+	count <= (le32toh(header->size) - off) / size;
+}
+
+/*
+ * Whether a file the image was compiled from still has the same size and
+ * contents, setting text to its name, if the image has one for it
+ */
+static bool xvp_image_source_same(char *base, xvp_image_header *header,
+				  xvp_image_source *source, char **text)
+{
+    unsigned long long hash;
+    struct stat st;
+    bool same;
+    int fd;
+
+    if (!(*text = xvp_image_text(base, header, source->filename)) ||
+	(fd = open(*text, O_RDONLY)) < 0)
+	return false;
+
+    same = fstat(fd, &st) == 0 &&
+	(uint32_t)st.st_size == le32toh(source->size) &&
+	xvp_image_file_hash(fd, &hash) &&
+	(uint32_t)hash == le32toh(source->hash_low) &&
+	(uint32_t)(hash >> 32) == le32toh(source->hash_high);
+
+    close(fd);
+    return same;
+}
+
+/*
+ * Build the configuration from the image, if there is one and it is up
+ * to date, returning false if the config file must be read instead
+ */
+bool xvp_image_load(void)
+{
+    char *filename = xvp_image_filename(), *base, *text;
+    xvp_image_header *header;
+    xvp_image_source *sources;
+    xvp_image_pool *ipools, *ipool;
+    xvp_image_host *ihosts, *ihost;
+    xvp_image_vm *ivms, *ivm;
+    xvp_pool *pool;
+    xvp_host *host;
+    xvp_vm *vm;
+    uint32_t i, j;
+    struct stat st;
+    size_t size;
+    bool ok = false;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+	if (errno != ENOENT)
+	    xvp_log_errno(XVP_LOG_ERROR, "%s", filename);
+	return false;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(xvp_image_header)) {
+	xvp_log(XVP_LOG_ERROR, "%s: Not a config image", filename);
+	close(fd);
+	return false;
+    }
+
+    size = st.st_size;
+    base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+	xvp_log_errno(XVP_LOG_ERROR, "%s", filename);
+	return false;
+    }
+
+    header = (xvp_image_header *)base;
+    if (memcmp(header->magic, XVP_IMAGE_MAGIC, sizeof(header->magic)) ||
+	le32toh(header->version) != XVP_IMAGE_VERSION ||
+	le32toh(header->size) != size || base[size - 1] != '\0' ||
+	!xvp_image_fits(header, le32toh(header->sources),
+			le32toh(header->nsources), sizeof(xvp_image_source)) ||
+	!xvp_image_fits(header, le32toh(header->pools),
+			le32toh(header->npools), sizeof(xvp_image_pool)) ||
+	!xvp_image_fits(header, le32toh(header->hosts),
+			le32toh(header->nhosts), sizeof(xvp_image_host)) ||
+	!xvp_image_fits(header, le32toh(header->vms),
+			le32toh(header->nvms), sizeof(xvp_image_vm)) ||
+	!xvp_image_fits(header, le32toh(header->strings),
+			le32toh(header->strings_size), 1) ||
+	le32toh(header->strings) + le32toh(header->strings_size) != size ||
+	!le32toh(header->npools)) {
+	xvp_log(XVP_LOG_ERROR, "%s: Not a config image of version %d",
+		filename, XVP_IMAGE_VERSION);
+	goto done;
+    }
+
+    sources = (xvp_image_source *)(base + le32toh(header->sources));
+    for (i = 0; i < le32toh(header->nsources); i++) {
+	if (!xvp_image_source_same(base, header, sources + i, &text)) {
+	    xvp_log(XVP_LOG_INFO, "%s: Stale, as %s has changed",
+		    filename, text ? text : "config");
+	    goto done;
+	}
+    }
+
+    xvp_log(XVP_LOG_DEBUG, "Reading config image %s", filename);
+
+    xvp_otp_mode       = le32toh(header->otp_mode);
+    xvp_otp_ipcheck    = le32toh(header->otp_ipcheck);
+    xvp_otp_window     = le32toh(header->otp_window);
+    xvp_engine_mode    = le32toh(header->engine_mode);
+    xvp_prefork_min    = le32toh(header->prefork_min);
+    xvp_prefork_max    = le32toh(header->prefork_max);
+    xvp_prefork_idle   = le32toh(header->prefork_idle);
+    xvp_engine_threads = le32toh(header->engine_threads);
+    xvp_engine_shards  = le32toh(header->engine_shards);
+    if (!xvp_image_copy(xvp_ssl_ciphers,
+			xvp_image_text(base, header, header->ciphers),
+			XVP_MAX_CIPHERS) ||
+	!xvp_image_copy(xvp_ssl_ciphersuites,
+			xvp_image_text(base, header, header->ciphersuites),
+			XVP_MAX_CIPHERS))
+	goto bad;
+
+    if (le32toh(header->multiplex_port))
+	xvp_config_set_multiplex(le32toh(header->multiplex_port));
+
+    ipools = (xvp_image_pool *)(base + le32toh(header->pools));
+    ihosts = (xvp_image_host *)(base + le32toh(header->hosts));
+    ivms   = (xvp_image_vm *)(base + le32toh(header->vms));
+
+    for (i = 0; i < le32toh(header->npools); i++) {
+	ipool = ipools + i;
+	if (le32toh(ipool->first_host) > le32toh(header->nhosts) ||
+	    le32toh(ipool->nhosts) >
+	    le32toh(header->nhosts) - le32toh(ipool->first_host) ||
+	    le32toh(ipool->first_vm) > le32toh(header->nvms) ||
+	    le32toh(ipool->nvms) >
+	    le32toh(header->nvms) - le32toh(ipool->first_vm))
+	    goto bad;
+
+	pool = xvp_config_alloc(sizeof(xvp_pool));
+	if (!(pool->poolname = xvp_image_strdup(base, header, ipool->poolname,
+						XVP_MAX_POOL)) ||
+	    !(pool->domainname = xvp_image_strdup(base, header,
+						  ipool->domainname,
+						  XVP_MAX_HOSTNAME)) ||
+	    !(pool->manager = xvp_image_strdup(base, header, ipool->manager,
+					       XVP_MAX_MANAGER)))
+	    goto bad;
+	memcpy(pool->password, ipool->password, XVP_MAX_XEN_PW);
+	pool->framerate = le32toh(ipool->framerate);
+	pool->pasterate = le32toh(ipool->pasterate);
+	pool->jsonrpc   = le32toh(ipool->jsonrpc);
+	xvp_config_add_pool(pool);
+
+	for (j = 0; j < le32toh(ipool->nhosts); j++) {
+	    ihost = ihosts + le32toh(ipool->first_host) + j;
+	    host = xvp_config_alloc(sizeof(xvp_host));
+	    if (!(host->hostname = xvp_image_strdup(base, header,
+						    ihost->hostname,
+						    XVP_MAX_HOSTNAME)) ||
+		!(host->address = xvp_image_strdup(base, header,
+						   ihost->address,
+						   XVP_MAX_ADDRESS)))
+		goto bad;
+	    host->hostname_is_ipv4 = xvp_is_ipv4(host->hostname);
+	    xvp_config_add_host(pool, host);
+	}
+
+	for (j = 0; j < le32toh(ipool->nvms); j++) {
+	    ivm = ivms + le32toh(ipool->first_vm) + j;
+	    if (!(text = xvp_image_text(base, header, ivm->vmname)) ||
+		strlen(text) > XVP_MAX_HOSTNAME)
+		goto bad;
+	    vm = xvp_config_alloc_vm();
+	    vm->sock = -1;
+	    vm->port = le32toh(ivm->port);
+	    vm->framerate = le32toh(ivm->framerate);
+	    vm->hot = le32toh(ivm->hot);
+	    memcpy(vm->password, ivm->password, XVP_MAX_VNC_PW);
+	    xvp_config_set_vmname(vm, text);
+	    if (!(text = xvp_image_text(base, header, ivm->groupname)))
+		goto bad;
+	    vm->groupname = *text ? xvp_config_strdup(text) : NULL;
+	    xvp_config_add_vm(pool, vm);
+	}
+    }
+
+    ok = true;
+    goto done;
+
+ bad:
+
+    xvp_log(XVP_LOG_ERROR, "%s: Corrupt config image", filename);
+
+ done:
+
+    munmap(base, size);
+    return ok;
+}
@@ -0,0 +1,333 @@
+/*
+ * json.c - streaming JSON parser for Xen VNC Proxy
+ *
+ * Copyright (C) 2009-2013, Colin Dean
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * For Xen API calls made with JSON-RPC (see xenapi.c), the response is
+ * parsed as it arrives from curl, a piece at a time, without building a
+ * document: each scalar value, and the start and end of each object and
+ * array, is passed to a callback, along with its depth and the keys
+ * leading to it, and the callback keeps only what it wants.  So a
+ * response listing thousands of VMs needs no more memory than one.
+ *
+ * Strings and numbers longer than XVP_JSON_MAX_TOKEN are truncated, as
+ * are keys longer than XVP_JSON_MAX_KEY: the values we want, such as
+ * object references, are far shorter.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "xvp.h"
+
+typedef enum {
+    XVP_JSON_STATE_VALUE,        /* a value is due */
+    XVP_JSON_STATE_VALUE_OR_END, /* just after [ */
+    XVP_JSON_STATE_KEY,          /* after , in an object */
+    XVP_JSON_STATE_KEY_OR_END,   /* just after { */
+    XVP_JSON_STATE_COLON,        /* after a key */
+    XVP_JSON_STATE_AFTER,        /* after a value */
+    XVP_JSON_STATE_STRING,
+    XVP_JSON_STATE_ESCAPE,       /* after \ in a string */
+    XVP_JSON_STATE_UNICODE,      /* after \u in a string */
+    XVP_JSON_STATE_BARE,         /* number, true, false or null */
+    XVP_JSON_STATE_DONE,
+    XVP_JSON_STATE_ERROR
+} xvp_json_state_enum;
+
+void xvp_json_init(xvp_json *js,
+		   void (*func)(xvp_json *js, xvp_json_type type, char *value),
+		   void *arg)
+{
+    memset(js, 0, sizeof(xvp_json));
+    js->func = func;
+    js->arg = arg;
+    js->state = XVP_JSON_STATE_VALUE;
+}
+
+static void xvp_json_put(xvp_json *js, char c)
+{
+    if (js->len < XVP_JSON_MAX_TOKEN)
+	js->token[js->len++] = c;
+}
+
+/* \uXXXX as UTF-8, with surrogates, which we've no need of, as '?' */
+static void xvp_json_put_unicode(xvp_json *js, unsigned int u)
+{
+    if (u < 0x80) {
+	xvp_json_put(js, u);
+    } else if (u < 0x800) {
+	xvp_json_put(js, 0xc0 | (u >> 6));
+	xvp_json_put(js, 0x80 | (u & 0x3f));
+    } else if (u >= 0xd800 && u < 0xe000) {
+	xvp_json_put(js, '?');
+    } else {
+	xvp_json_put(js, 0xe0 | (u >> 12));
+	xvp_json_put(js, 0x80 | ((u >> 6) & 0x3f));
+	xvp_json_put(js, 0x80 | (u & 0x3f));
+    }
+}
+
+static void xvp_json_emit(xvp_json *js, xvp_json_type type, char *value)
+{
+    js->func(js, type, value);
+}
+
+static bool xvp_json_open(xvp_json *js, char container)
+{
+    if (js->depth >= XVP_JSON_MAX_DEPTH - 1)
+	return false;
+
+    xvp_json_emit(js, container == '{' ? XVP_JSON_OBJECT : XVP_JSON_ARRAY,
+		  NULL);
+    js->stack[js->depth++] = container;
+    js->keys[js->depth][0] = '\0';
+    js->state = (container == '{') ? XVP_JSON_STATE_KEY_OR_END :
+	XVP_JSON_STATE_VALUE_OR_END;
+    return true;
+}
+
+static bool xvp_json_close(xvp_json *js, char c)
+{
+    if (js->depth == 0 ||
+	js->stack[js->depth - 1] != (c == '}' ? '{' : '['))
+	return false;
+
+    js->depth--;
+    xvp_json_emit(js, XVP_JSON_END, NULL);
+    js->state = js->depth ? XVP_JSON_STATE_AFTER : XVP_JSON_STATE_DONE;
+    return true;
+}
+
+/*
+ * A scalar value, or a key, is complete
+ */
+static void xvp_json_token(xvp_json *js, xvp_json_type type)
+{
+    js->token[js->len] = '\0';
+
+    if (js->is_key) {
+	strncpy(js->keys[js->depth], js->token, XVP_JSON_MAX_KEY);
+	js->keys[js->depth][XVP_JSON_MAX_KEY] = '\0';
+	js->state = XVP_JSON_STATE_COLON;
+	return;
+    }
+
+    xvp_json_emit(js, type, js->token);
+    js->state = js->depth ? XVP_JSON_STATE_AFTER : XVP_JSON_STATE_DONE;
+}
+
+static bool xvp_json_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool xvp_json_is_bare(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+	c == '-' || c == '+' || c == '.' || c == 'E';
+}
+
+static int xvp_json_hex(char c)
+{
+    if (c >= '0' && c <= '9')
+	return c - '0';
+    if (c >= 'a' && c <= 'f')
+	return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+	return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Take the next piece of the document, returning false once it has
+ * been found not to be JSON, or to go too deep
+ */
+bool xvp_json_feed(xvp_json *js, const char *data, size_t len)
+{
+    const char *end = data + len;
+    char c;
+    int hex;
+
+    while (data < end) {
+
+	c = *data;
+
+	switch (js->state) {
+
+	case XVP_JSON_STATE_VALUE_OR_END:
+	    if (c == ']') {
+		if (!xvp_json_close(js, c))
+		    goto fail;
+		break;
+	    }
+	    /* drop thru */
+	case XVP_JSON_STATE_VALUE:
+	    if (xvp_json_is_space(c))
+		break;
+	    js->is_key = false;
+	    js->len = 0;
+	    if (c == '{' || c == '[') {
+		if (!xvp_json_open(js, c))
+		    goto fail;
+	    } else if (c == '"') {
+		js->state = XVP_JSON_STATE_STRING;
+	    } else if (xvp_json_is_bare(c)) {
+		js->state = XVP_JSON_STATE_BARE;
+		continue; /* keep c as first character */
+	    } else {
+		goto fail;
+	    }
+	    break;
+
+	case XVP_JSON_STATE_KEY_OR_END:
+	    if (c == '}') {
+		if (!xvp_json_close(js, c))
+		    goto fail;
+		break;
+	    }
+	    /* drop thru */
+	case XVP_JSON_STATE_KEY:
+	    if (xvp_json_is_space(c))
+		break;
+	    if (c != '"')
+		goto fail;
+	    js->is_key = true;
+	    js->len = 0;
+	    js->state = XVP_JSON_STATE_STRING;
+	    break;
+
+	case XVP_JSON_STATE_COLON:
+	    if (xvp_json_is_space(c))
+		break;
+	    if (c != ':')
+		goto fail;
+	    js->state = XVP_JSON_STATE_VALUE;
+	    break;
+
+	case XVP_JSON_STATE_AFTER:
+	    if (xvp_json_is_space(c))
+		break;
+	    if (c == ',') {
+		js->state = (js->stack[js->depth - 1] == '{') ?
+		    XVP_JSON_STATE_KEY : XVP_JSON_STATE_VALUE;
+	    } else if (c == '}' || c == ']') {
+		if (!xvp_json_close(js, c))
+		    goto fail;
+	    } else {
+		goto fail;
+	    }
+	    break;
+
+	case XVP_JSON_STATE_STRING:
+	    if (c == '"')
+		xvp_json_token(js, XVP_JSON_STRING);
+	    else if (c == '\\')
+		js->state = XVP_JSON_STATE_ESCAPE;
+	    else
+		xvp_json_put(js, c);
+	    break;
+
+	case XVP_JSON_STATE_ESCAPE:
+	    js->state = XVP_JSON_STATE_STRING;
+	    switch (c) {
+	    case 'b': xvp_json_put(js, '\b'); break;
+	    case 'f': xvp_json_put(js, '\f'); break;
+	    case 'n': xvp_json_put(js, '\n'); break;
+	    case 'r': xvp_json_put(js, '\r'); break;
+	    case 't': xvp_json_put(js, '\t'); break;
+	    case 'u':
+		js->unicode = 0;
+		js->digits = 0;
+		js->state = XVP_JSON_STATE_UNICODE;
+		break;
+	    default:  xvp_json_put(js, c); break;
+	    }
+	    break;
+
+	case XVP_JSON_STATE_UNICODE:
+	    if ((hex = xvp_json_hex(c)) < 0)
+		goto fail;
+	    js->unicode = (js->unicode << 4) | hex;
+	    if (++js->digits == 4) {
+		xvp_json_put_unicode(js, js->unicode);
+		js->state = XVP_JSON_STATE_STRING;
+	    }
+	    break;
+
+	case XVP_JSON_STATE_BARE:
+	    if (xvp_json_is_bare(c)) {
+		xvp_json_put(js, c);
+		break;
+	    }
+	    js->token[js->len] = '\0';
+	    xvp_json_token(js, (*js->token == '-' ||
+				(*js->token >= '0' && *js->token <= '9')) ?
+			   XVP_JSON_NUMBER : XVP_JSON_LITERAL);
+	    continue; /* c ends the value, so look at it again */
+
+	case XVP_JSON_STATE_DONE:
+	    if (!xvp_json_is_space(c))
+		goto fail;
+	    break;
+
+	default:
+	    return false;
+	}
+
+	data++;
+    }
+
+    return true;
+
+ fail:
+
+    js->state = XVP_JSON_STATE_ERROR;
+    return false;
+}
+
+/*
+ * True if a whole document has been parsed, and nothing more
+ */
+bool xvp_json_done(xvp_json *js)
+{
+    return js->state == XVP_JSON_STATE_DONE;
+}
+
+/*
+ * Quote text as a JSON string, for a request, truncating it if need be
+ */
+char *xvp_json_quote(char *text, char *buf, int buflen)
+{
+    char *bp = buf, *end = buf + buflen - 8;
+
+    *bp++ = '"';
+    for (; *text && bp < end; text++) {
+	if (*text == '"' || *text == '\\') {
+	    *bp++ = '\\';
+	    *bp++ = *text;
+	} else if ((unsigned char)*text < 0x20) {
+	    bp += sprintf(bp, "\\u%04x", (unsigned char)*text);
+	} else {
+	    *bp++ = *text;
+	}
+    }
+    *bp++ = '"';
+    *bp = '\0';
+
+    return buf;
+}
@@ -30,6 +30,9 @@ bool  xvp_verbose = false;
 bool  xvp_tracing = false;
 int   xvp_log_fd = -1;
 
+/* event engine session or job being logged for, so lines can be told apart */
+__thread unsigned int xvp_log_id = 0;
+
 static FILE *stream = NULL;
 
 void xvp_log_init(void)
@@ -86,7 +89,10 @@ void xvp_log(xvp_log_type type, char *format, ...)
     }
 
     strftime(tbuf, sizeof(tbuf), "%b %e %T", localtime(&now));
-    sprintf(buf, "%s xvp[%d]: %s ", tbuf, xvp_pid, typename);
+    if (xvp_log_id)
+	sprintf(buf, "%s xvp[%d/%u]: %s ", tbuf, xvp_pid, xvp_log_id, typename);
+    else
+	sprintf(buf, "%s xvp[%d]: %s ", tbuf, xvp_pid, typename);
 
     va_start(ap, format);
     (void)vsprintf(buf + strlen(buf), format, ap);
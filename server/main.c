@@ -45,7 +45,10 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <termios.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
@@ -53,8 +56,23 @@
 
 #include "xvp.h"
 
-static fd_set xvp_read_fds;
-static int    xvp_read_max = -1;
+#define XVP_LISTEN_MAX_EVENTS 64
+#define XVP_LISTEN_FD_HEADROOM 256
+
+/*
+ * Listening sockets are remembered with their ports, so that when the
+ * config file is re-read, those for ports still configured can be kept
+ */
+typedef struct {
+    int sock;
+    int port;
+} xvp_listener;
+
+static int           xvp_epoll_fd = -1;
+static char          xvp_listen_upgrade; /* marks the upgrade pipe's events */
+static xvp_listener *xvp_listeners = NULL;
+static int           xvp_listen_count = 0;
+static unsigned long xvp_listen_accepts = 0;
 
 
 static void xvp_mainloop(void);
@@ -76,7 +94,8 @@ static void usage(void)
 "        -r | --reconnect  seconds    ( reconnect delay, default %d )\n"
 "        -n | --nodaemon              ( run in foreground )\n"
 "        -v | --verbose               ( increase logging detail )\n"
-"        -t | --trace                 ( enable some packet trace logging )\n",
+"        -t | --trace                 ( enable some packet trace logging )\n"
+"        -C | --compile-config        ( check config, write image, exit )\n",
 	    XVP_CONFIG_FILENAME, XVP_LOG_FILENAME, XVP_PID_FILENAME,
 	    XVP_RECONNECT_DELAY);
     fprintf(stderr,
@@ -94,9 +113,13 @@ static void usage(void)
 "        # or VNC display (:0 to :99, :0 = port 5900, :1 = 5901, etc).\n"
 "        # \"DATABASE\" and \"GROUP\" lines are used by xvpweb only.\n"
 "        # \"OTP\" (one time passwords) line optional, default %s, %s, %d.\n"
+"        # \"ENGINE\" line optional, default FORK, EVENT threads default 8,\n"
+"        # shards default 1, or one engine per shard, each listening.\n"
 "        # \"MULTIPLEX\" required if VM ports \"-\", otherwise optional.\n"
 "        DATABASE dsn [ username [ password ] ]\n"
 "        OTP REQUIRE|ALLOW|DENY [ IPCHECK ON|OFF|HTTP ] [ time-window-seconds ]\n"
+"        ENGINE FORK|PREFORK [ min max [ idle-seconds ] ]\n"
+"        ENGINE EVENT [ threads [ shards ] ]\n"
 "        MULTIPLEX port\n"
 "        POOL poolname\n"
 "            DOMAIN domainname\n"
@@ -210,7 +233,7 @@ char *xvp_xmlescape(char *text, char *buf, int buflen)
 int main(int argc, char **argv, char **envp)
 {
     int optc = argc, type, maxpw;
-    bool encrypting = false;
+    bool encrypting = false, logging = false;
     char **optv = argv;
 
     if (argc == 2) {
@@ -280,6 +303,7 @@ int main(int argc, char **argv, char **envp)
 	    if (optc < 3)
 		usage();
 	    xvp_log_filename = xvp_strdup(optv[2]);
+	    logging = true;
 	    optv += 2;
 	    optc -= 2;
 	    continue;
@@ -324,15 +348,33 @@ int main(int argc, char **argv, char **envp)
 	    continue;
 	}
 
+	if (!strcmp(optv[1], "-C") || !strcmp(optv[1], "--compile-config")) {
+	    xvp_image_compiling = true;
+	    optv++;
+	    optc--;
+	    continue;
+	}
+
 	usage();
     }
 
+    if (xvp_image_compiling) {
+	/* config errors are fatal, so only a valid config is compiled */
+	if (!logging)
+	    xvp_log_filename = "-";
+	xvp_log_init();
+	xvp_config_init();
+	return xvp_image_write() ? 0 : 1;
+    }
+
     umask(077);
     xvp_log_init();
     xvp_process_init(argc, argv, envp);
     xvp_log(XVP_LOG_INFO, "Starting as master");
     xvp_config_init();
     xvp_listen_init();
+    xvp_process_prefork();
+    xvp_process_upgraded(); /* if replacing an old master, it can go */
 
     xvp_mainloop();
 
@@ -341,32 +383,75 @@ int main(int argc, char **argv, char **envp)
     return 0;
 }
 
-static void xvp_listen_for_vm(xvp_vm *vm)
+/*
+ * Set up a non-blocking listening socket, with SO_REUSEPORT if it is to
+ * share its port with others, as engine shards do, letting the kernel
+ * spread incoming connections between them.
+ */
+int xvp_listen_socket(int port, bool reuseport)
 {
     int sock, val = 1, len = sizeof(val), flags;
     struct sockaddr_in listen_addr;
 
     listen_addr.sin_family = AF_INET;
     listen_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    listen_addr.sin_port = htons(vm->port);
+    listen_addr.sin_port = htons(port);
 
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+	return -1;
 
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
-	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&val, len) != 0 ||
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&val, len) != 0 ||
+	(reuseport &&
+	 setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char *)&val, len) != 0) ||
 	(flags = fcntl(sock, F_GETFL, 0)) == -1 ||
 	fcntl(sock, F_SETFL, flags | O_NONBLOCK) != 0 ||
 	bind(sock, (struct sockaddr *)&listen_addr,
 	     sizeof(listen_addr)) != 0 ||
-	listen(sock, XVP_VNC_LISTEN_BACKLOG) != 0)
-	xvp_log(XVP_LOG_FATAL, "Unable to set up listening socket");
+	listen(sock, XVP_VNC_LISTEN_BACKLOG) != 0) {
+	close(sock);
+	return -1;
+    }
 
-    FD_SET(sock, &xvp_read_fds);
-    if (sock > xvp_read_max)
-	xvp_read_max = sock;
+    return sock;
+}
+
+/*
+ * Listen for a VM, on a new socket, or on one kept from the previous
+ * config, whose registration must now carry the new VM
+ */
+static void xvp_listen_for_vm(xvp_vm *vm, int sock)
+{
+    struct epoll_event ev;
+    bool kept = (sock >= 0);
 
-    vm->sock = sock;
+    /* old engine shards may not yet have closed their own listeners */
+    if (!kept && (sock = xvp_listen_socket(vm->port,
+					   xvp_process_sharded())) < 0)
+	xvp_log(XVP_LOG_FATAL, "Unable to set up listening socket");
 
-    if (vm->port < XVP_VNC_PORT_MIN || vm->port > XVP_VNC_PORT_MAX)
+    /*
+     * Each registration carries its VM, so a ready listener needs no
+     * lookup, and being level-triggered, we hear of it again while
+     * connections are still queued, if we couldn't take them all.
+     */
+    ev.events = EPOLLIN;
+    ev.data.ptr = vm;
+    if (epoll_ctl(xvp_epoll_fd, kept ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		  sock, &ev) != 0 &&
+	/* inherited from an old master, so not registered yet */
+	(errno != ENOENT ||
+	 epoll_ctl(xvp_epoll_fd, EPOLL_CTL_ADD, sock, &ev) != 0))
+	xvp_log_errno(XVP_LOG_FATAL, "epoll_ctl");
+
+    xvp_listeners[xvp_listen_count].sock = sock;
+    xvp_listeners[xvp_listen_count].port = vm->port;
+    xvp_listen_count++;
+    xvp_config_set_sock(vm, sock);
+
+    if (kept)
+	xvp_log(XVP_LOG_DEBUG, "Still listening on port %d for %s",
+		vm->port, vm->vmname);
+    else if (vm->port < XVP_VNC_PORT_MIN || vm->port > XVP_VNC_PORT_MAX)
 	xvp_log(XVP_LOG_INFO, "Listening on port %d for %s",
 		vm->port, vm->vmname);
     else
@@ -374,68 +459,315 @@ static void xvp_listen_for_vm(xvp_vm *vm)
 		vm->port, vm->port - XVP_VNC_PORT_MIN, vm->vmname);
 }
 
+/*
+ * With thousands of VM ports, the default soft limit on open files
+ * may be too low, so raise it as far as the hard limit allows.
+ */
+static void xvp_listen_fd_limit(int nsocks)
+{
+    struct rlimit rl;
+    rlim_t wanted = nsocks + XVP_LISTEN_FD_HEADROOM;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur >= wanted)
+	return;
+
+    rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max > wanted) ?
+	wanted : rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+	xvp_log_errno(XVP_LOG_ERROR, "setrlimit");
+    else
+	xvp_log(XVP_LOG_DEBUG, "Open file limit raised to %lu",
+		(unsigned long)rl.rlim_cur);
+}
+
+/*
+ * Take over the listening sockets of the old master we are replacing,
+ * as described by xvp_listen_fds(), for the first xvp_listen_init() to
+ * keep, as it would on re-reading the config file.  Their ports are
+ * found from the sockets themselves.
+ */
+static void xvp_listen_inherit(void)
+{
+    char *map = getenv(XVP_UPGRADE_FDS_ENV), *next;
+    int first, last, fd, val, maxfd = getdtablesize();
+    struct sockaddr_in addr;
+    socklen_t len;
+
+    if (!map)
+	return;
+
+    xvp_listeners = xvp_alloc(maxfd * sizeof(xvp_listener));
+
+    for (; *map; map = next) {
+	first = last = strtol(map, &next, 10);
+	if (next == map)
+	    break;
+	if (*next == '-')
+	    last = strtol(next + 1, &next, 10);
+	if (*next == ',')
+	    next++;
+	for (fd = (first > 2 ? first : 3); fd <= last && fd < maxfd; fd++) {
+	    len = sizeof(addr);
+	    if (getsockname(fd, (struct sockaddr *)&addr, &len) != 0 ||
+		addr.sin_family != AF_INET ||
+		(len = sizeof(val),
+		 getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &len) != 0) ||
+		!val) {
+		xvp_log(XVP_LOG_ERROR, "Inherited descriptor %d is not a "
+			"listening socket", fd);
+		continue;
+	    }
+	    xvp_listeners[xvp_listen_count].sock = fd;
+	    xvp_listeners[xvp_listen_count].port = ntohs(addr.sin_port);
+	    xvp_listen_count++;
+	}
+    }
+
+    unsetenv(XVP_UPGRADE_FDS_ENV);
+    xvp_log(XVP_LOG_INFO, "Inherited %d listening sockets",
+	    xvp_listen_count);
+}
+
+/*
+ * Describe our listening sockets for a new master to inherit (see
+ * process.c), as runs of descriptors such as "5-1004,1010", or return
+ * NULL if they are too scattered to fit in its environment
+ */
+static int xvp_listen_compare(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+char *xvp_listen_fds(void)
+{
+    int *fds, i, j, len = 0;
+    char *map = xvp_alloc(XVP_UPGRADE_MAX_ENV + 1);
+
+    fds = xvp_alloc((xvp_listen_count ? xvp_listen_count : 1) * sizeof(int));
+    for (i = 0; i < xvp_listen_count; i++)
+	fds[i] = xvp_listeners[i].sock;
+    qsort(fds, xvp_listen_count, sizeof(int), xvp_listen_compare);
+
+    for (i = 0; i < xvp_listen_count; i = j) {
+	for (j = i + 1; j < xvp_listen_count && fds[j] == fds[j - 1] + 1; j++)
+	    /* empty */;
+	if (len > XVP_UPGRADE_MAX_ENV - 24) {
+	    xvp_free(map);
+	    map = NULL;
+	    break;
+	}
+	if (j - i > 1)
+	    len += sprintf(map + len, "%s%d-%d", len ? "," : "",
+			   fds[i], fds[j - 1]);
+	else
+	    len += sprintf(map + len, "%s%d", len ? "," : "", fds[i]);
+    }
+
+    xvp_free(fds);
+    return map;
+}
+
+/*
+ * In the child about to exec a new master, which has marked all other
+ * descriptors close-on-exec, keep the listening sockets open for it
+ */
+void xvp_listen_keep_on_exec(void)
+{
+    int i;
+
+    for (i = 0; i < xvp_listen_count; i++)
+	(void)fcntl(xvp_listeners[i].sock, F_SETFD, 0);
+}
+
+/*
+ * Watch, or stop watching, the pipe from a new master we're upgrading
+ * to, alongside the listeners, so that we keep serving meanwhile
+ */
+void xvp_listen_watch_upgrade(int fd, bool watch)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &xvp_listen_upgrade;
+    if (epoll_ctl(xvp_epoll_fd, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+		  fd, &ev) != 0)
+	xvp_log_errno(XVP_LOG_ERROR, "epoll_ctl");
+}
+
+/*
+ * Listen on every configured port.  When the config file is re-read,
+ * the sockets for ports still configured are kept, so that connections
+ * to them are never refused, and only those for ports added or removed
+ * are opened or closed.  Likewise for those inherited from an old
+ * master, when replacing it with an upgraded binary.
+ */
 void xvp_listen_init(void)
 {
-    int fd, sigpipe;
+    static bool started = false;
+    int i, nsocks, old_count = xvp_listen_count, kept = 0, closed = 0;
+    int *old_by_port;
+    xvp_listener *old = xvp_listeners;
+    struct epoll_event ev;
     xvp_pool *pool;
     xvp_vm *vm;
 
     if (!xvp_child_pid)
 	return;
 
-    sigpipe = xvp_master_sigpipe[0];
-
-    for (fd = 0; fd <= xvp_read_max; fd++) {
-	if (FD_ISSET(fd, &xvp_read_fds) && fd != sigpipe) {
-	    FD_CLR(fd, &xvp_read_fds);
-	    close(fd);
-	}
+    if (xvp_epoll_fd < 0) {
+	if ((xvp_epoll_fd = epoll_create(XVP_LISTEN_MAX_EVENTS)) < 0)
+	    xvp_log_errno(XVP_LOG_FATAL, "epoll_create");
+	(void)fcntl(xvp_epoll_fd, F_SETFD, FD_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(xvp_epoll_fd, EPOLL_CTL_ADD,
+		      xvp_master_sigpipe[0], &ev) != 0)
+	    xvp_log_errno(XVP_LOG_FATAL, "epoll_ctl");
+	xvp_listen_inherit();
+	old = xvp_listeners;
+	old_count = xvp_listen_count;
+	started = (old_count > 0);
     }
 
-    FD_ZERO(&xvp_read_fds);
-    FD_SET(sigpipe, &xvp_read_fds);
-    xvp_read_max = sigpipe;
+    /* index + 1 of the old listener on each port, if any */
+    old_by_port = xvp_alloc(65536 * sizeof(int));
+    for (i = 0; i < old_count; i++)
+	old_by_port[old[i].port] = i + 1;
+
+    xvp_listeners = NULL;
+    xvp_listen_count = 0;
 
-    if (xvp_multiplex_vm)
-	xvp_listen_for_vm(xvp_multiplex_vm);
+    /* engine shards listen for themselves, so we needn't */
+    if (xvp_engine_mode == XVP_ENGINE_EVENT && xvp_engine_shards > 1) {
+	xvp_log(XVP_LOG_INFO, "Listening left to %d engine shards",
+		xvp_engine_shards);
+	goto close_old;
+    }
 
+    nsocks = xvp_multiplex_vm ? 1 : 0;
     for (pool = xvp_pools; pool; pool = pool->next)
 	for (vm = pool->vms; vm; vm = vm->next)
 	    if (vm->port)
-		xvp_listen_for_vm(vm);
+		nsocks++;
+
+    xvp_listen_fd_limit(nsocks + old_count);
+    xvp_listeners = xvp_alloc((nsocks ? nsocks : 1) * sizeof(xvp_listener));
+
+    if (xvp_multiplex_vm) {
+	i = old_by_port[xvp_multiplex_vm->port];
+	old_by_port[xvp_multiplex_vm->port] = 0;
+	xvp_listen_for_vm(xvp_multiplex_vm, i ? old[i - 1].sock : -1);
+	kept += (i != 0);
+    }
+
+    for (pool = xvp_pools; pool; pool = pool->next) {
+	for (vm = pool->vms; vm; vm = vm->next) {
+	    if (!vm->port)
+		continue;
+	    i = old_by_port[vm->port];
+	    old_by_port[vm->port] = 0;
+	    xvp_listen_for_vm(vm, i ? old[i - 1].sock : -1);
+	    kept += (i != 0);
+	}
+    }
+
+ close_old:
+
+    /*
+     * Deregister explicitly rather than rely on close(), as a freshly
+     * forked child may briefly still hold a copy of the socket.
+     */
+    for (i = 0; i < old_count; i++) {
+	if (!old_by_port[old[i].port])
+	    continue;
+	(void)epoll_ctl(xvp_epoll_fd, EPOLL_CTL_DEL, old[i].sock, &ev);
+	close(old[i].sock);
+	closed++;
+    }
+
+    xvp_free(old_by_port);
+    if (old)
+	xvp_free(old);
+
+    if (started)
+	xvp_log(XVP_LOG_INFO,
+		"Listening on %d ports: %d kept, %d opened, %d closed",
+		xvp_listen_count, kept, xvp_listen_count - kept, closed);
+    started = true;
+}
+
+void xvp_listen_dump(void)
+{
+    xvp_log(XVP_LOG_INFO, "Listening on %d ports, %lu connections accepted",
+	    xvp_listen_count, xvp_listen_accepts);
+}
+
+/*
+ * Accept connections queued on the listener, though no more than a batch
+ * at a time, so that other ports and signals get a look in, leaving the
+ * rest, or any we were short of resources to take, for next time round
+ */
+static void xvp_listen_accept(xvp_vm *vm)
+{
+    int i, client_sock;
+    struct sockaddr_in client_addr;
+    socklen_t len;
+
+    for (i = 0; i < XVP_LISTEN_MAX_EVENTS; i++) {
+	len = sizeof(client_addr);
+	client_sock = accept4(vm->sock, (struct sockaddr *)&client_addr, &len,
+			      SOCK_CLOEXEC);
+	if (client_sock == -1) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    if (errno != EAGAIN && errno != EWOULDBLOCK)
+		xvp_log_errno(XVP_LOG_ERROR, "accept on port %d", vm->port);
+	    return;
+	}
+
+	xvp_listen_accepts++;
+	xvp_process_spawn(vm, client_sock, client_addr.sin_addr.s_addr);
+    }
 }
 
 static void xvp_mainloop(void)
 {
-    int sigpipe = xvp_master_sigpipe[0];
-    fd_set read_fds;
-    xvp_vm *vm;
+    struct epoll_event events[XVP_LISTEN_MAX_EVENTS];
+    int i, nready;
+    bool signalled, upgrade;
 
     while (true) {
 
-	read_fds = xvp_read_fds;
-	int nfds = xvp_read_max + 1;
-	int fd;
-	int nready = select(nfds, &read_fds, NULL, NULL, NULL);
+	nready = epoll_wait(xvp_epoll_fd, events, XVP_LISTEN_MAX_EVENTS,
+			    xvp_process_timeout());
 
 	if (nready < 0) {
 	    if (errno == EINTR)
 		continue;
-	    xvp_log_errno(XVP_LOG_FATAL, "select");
+	    xvp_log_errno(XVP_LOG_FATAL, "epoll_wait");
 	}
 
-	for (fd = 0; fd < nfds; fd++) {
-	    if (FD_ISSET(fd, &read_fds)) {
-		if (fd == sigpipe) {
-		    if (!xvp_process_signal_handler())
-			return;
-		} else if (vm = xvp_config_vm_by_sock(fd)) {
-		    xvp_process_spawn(vm);
-		} else {
-		    xvp_log(XVP_LOG_FATAL, "Unexpected fd %d in mainloop", fd);
-		}
-	    }
+	/*
+	 * Leave the signal pipe until last, as re-reading the config
+	 * file frees the VMs the other events point at.
+	 */
+	for (i = 0, signalled = upgrade = false; i < nready; i++) {
+	    if (events[i].data.ptr == &xvp_listen_upgrade)
+		upgrade = true;
+	    else if (events[i].data.ptr)
+		xvp_listen_accept((xvp_vm *)events[i].data.ptr);
+	    else
+		signalled = true;
 	}
+
+	/* a new master taking over leaves us to exit */
+	if (!xvp_process_upgrading(upgrade))
+	    return;
+
+	if (signalled && !xvp_process_signal_handler())
+	    return;
+
+	xvp_process_prefork();
     }
 }
 
@@ -452,50 +784,59 @@ char *xvp_message_code_to_text(int code)
 	return "reboot";
     case XVP_MESSAGE_CODE_RESET:
 	return "reset";
+    case XVP_MESSAGE_CODE_PROGRESS:
+	return "progress";
     }
 
     return "unknown";
 }
 
 /*
- * Standard connect(2) has too long a timeout for our purposes,
- * especially if we try to establish a session to a host that's down, so
- * slide in a modified implementation that allows us to set our own
- * timeout.
+ * Start connecting a socket, without waiting, as connect(2) would for a
+ * non-blocking socket, but bypassing our own connect() below, for those
+ * that want to wait for several connections at once
  */
-int connect(int sock, const struct sockaddr *addr, socklen_t addrlen)
+int xvp_connect_start(int sock, const struct sockaddr *addr, int addrlen)
 {
 #define SYS_CONNECT 3 /* avoid needing kernel header <linux/net.h> */
 
-    int flags, optval, optlen;
-    fd_set mask;
-    struct timeval timeout = {XVP_CONNECT_TIMEOUT, 0};
-
 #ifdef SYS_socketcall
     void *args[3];
 
     args[0] = (void *)(long)sock;
     args[1] = (void *)addr;
     args[2] = (void *)(long)addrlen;
+
+    return syscall(SYS_socketcall, SYS_CONNECT, args);
+#else
+    return syscall(SYS_connect, sock, addr, addrlen);
 #endif
+}
+
+/*
+ * Standard connect(2) has too long a timeout for our purposes,
+ * especially if we try to establish a session to a host that's down, so
+ * slide in a modified implementation that allows us to set our own
+ * timeout.
+ */
+int connect(int sock, const struct sockaddr *addr, socklen_t addrlen)
+{
+    int flags, optval, optlen;
+    struct pollfd pfd;
 
     if ((flags = fcntl(sock, F_GETFL, 0)) == -1 ||
 	fcntl(sock, F_SETFL, flags | O_NONBLOCK) != 0)
 	return -1;
 
-#ifdef SYS_socketcall
-    if (syscall(SYS_socketcall, SYS_CONNECT, args) == 0)
-#else
-    if (syscall(SYS_connect, sock, addr, addrlen) == 0)
-#endif
+    if (xvp_connect_start(sock, addr, (int)addrlen) == 0)
 	return fcntl(sock, F_SETFL, flags);
     else if (errno != EINPROGRESS)
 	return -1;
 
-    FD_ZERO(&mask);
-    FD_SET(sock, &mask);
+    pfd.fd = sock;
+    pfd.events = POLLOUT;
 
-    switch (select(sock + 1, NULL, &mask, NULL, &timeout)) {
+    switch (poll(&pfd, 1, XVP_CONNECT_TIMEOUT * 1000)) {
     case 0:
 	errno = ETIMEDOUT;
 	/* drop thru */
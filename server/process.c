@@ -20,22 +20,104 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "xvp.h"
 
-char  *xvp_pid_filename = XVP_PID_FILENAME;
-bool   xvp_daemon = true;
-pid_t  xvp_pid, xvp_child_pid = -1;
-int    xvp_master_sigpipe[2];
-int    xvp_child_sigpipe[2];
+/*
+ * How a session process came to be, indexing the spawn statistics
+ */
+typedef enum {
+    XVP_SPAWN_FORK,
+    XVP_SPAWN_PREFORK,
+    XVP_SPAWN_ENGINE,
+    XVP_SPAWN_BROKER, /* not a session process, so no statistics */
+    XVP_SPAWN_TYPES
+} xvp_spawn_type;
+
+/*
+ * Spawn statistics live in memory shared with all children, so that
+ * each session process can record how long it took to become ready.
+ */
+typedef struct {
+    unsigned long count[XVP_SPAWN_TYPES];
+    unsigned long usec_total[XVP_SPAWN_TYPES];
+    unsigned long usec_max[XVP_SPAWN_TYPES];
+    struct { /* load on each engine shard, as updated by the shard */
+	unsigned long accepted;
+	int           active;
+	int           peak;
+    } shards[XVP_ENGINE_MAX_SHARDS];
+} xvp_spawn_stats;
+
+typedef struct { /* passed from master to a worker or the engine */
+    unsigned short  port;
+    unsigned int    client_ip;
+    struct timespec accepted;
+} xvp_worker_job;
+
+typedef struct { /* an idle pre-forked worker, as seen by master */
+    pid_t  pid;
+    int    chan;
+    time_t since;
+} xvp_worker;
+
+typedef struct { /* an event engine, or one shard of it */
+    pid_t  pid;
+    int    chan;
+} xvp_engine_proc;
+
+char      *xvp_pid_filename = XVP_PID_FILENAME;
+bool       xvp_daemon = true;
+pid_t      xvp_pid, xvp_child_pid = -1;
+int        xvp_master_sigpipe[2];
+int        xvp_child_sigpipe[2];
+xvp_engine xvp_engine_mode;
+int        xvp_prefork_min;
+int        xvp_prefork_max;
+int        xvp_prefork_idle;
 
 static char *xvp_process_name;
 static int xvp_process_maxlen = 0;
+static char *xvp_process_exe;   /* to run afresh, on SIGTTIN */
+static char **xvp_process_argv; /* likewise, as before being overwritten */
+static pid_t xvp_process_group; /* ours, and that of sessions we inherit */
+static bool  xvp_process_in_charge = true; /* of sessions and pid file */
+static int   xvp_process_ready_fd = -1;     /* to old master, till ready */
+
+static int   xvp_upgrade_chan = -1; /* from new master, while upgrading */
+static pid_t xvp_upgrade_pid;
+static pid_t *xvp_upgrade_children = NULL; /* it has spawned so far */
+static int   xvp_upgrade_nchildren = 0;
+static int   xvp_upgrade_maxchildren = 0;
+static struct timespec xvp_upgrade_started;
+
+static xvp_spawn_stats *xvp_spawn_stats_shared = NULL;
+static xvp_worker      *xvp_workers = NULL;
+static int              xvp_workers_size = 0;
+static int              xvp_workers_idle = 0;
+static int              xvp_workers_target = 0;
+static struct timespec  xvp_workers_dispatched;
+static xvp_engine_proc  xvp_engines[XVP_ENGINE_MAX_SHARDS];
+static int              xvp_engines_count = 0;
+static xvp_spawn_type   xvp_process_type = XVP_SPAWN_FORK;
+static int              xvp_broker_chan = -1;
+static time_t           xvp_broker_started = 0;
+
+static char *xvp_spawn_names[XVP_SPAWN_TYPES] = {
+    "fork", "prefork", "engine", "broker"
+};
 
 static void xvp_process_background(void)
 {
@@ -96,7 +178,7 @@ static bool xvp_process_signal_children(int sig)
 {
     if (xvp_child_pid) {
 	signal(sig, SIG_IGN);
-	killpg(xvp_pid, sig);
+	killpg(xvp_process_group, sig);
 	signal(sig, xvp_process_signal_pipe);
     }
 }
@@ -112,7 +194,23 @@ void xvp_process_init(int argc, char **argv, char **envp)
      */
 
     int i;
-    char *last;
+    char *last, exe[MAXPATHLEN];
+    ssize_t len;
+    bool upgrading = (getenv(XVP_UPGRADE_READY_ENV) != NULL);
+
+    /*
+     * Remember how we were run, to run again on SIGTTIN, taking the
+     * path of the binary now, as it will look deleted once replaced.
+     */
+    xvp_process_argv = xvp_alloc((argc + 1) * sizeof(char *));
+    for (i = 0; i < argc; i++)
+	xvp_process_argv[i] = xvp_strdup(argv[i]);
+    if ((len = readlink("/proc/self/exe", exe, sizeof(exe) - 1)) > 0) {
+	exe[len] = '\0';
+	xvp_process_exe = xvp_strdup(exe);
+    } else {
+	xvp_process_exe = xvp_process_argv[0];
+    }
 
     for (i = 0; envp[i]; i++) {
 	last = envp[i];
@@ -127,14 +225,28 @@ void xvp_process_init(int argc, char **argv, char **envp)
     }
 
     xvp_pid = getpid();
-    (void)setsid();
 
-    if (xvp_daemon)
-	xvp_process_background();
+    /*
+     * A new master replacing an old one (see xvp_process_upgrade) is
+     * already in the background, and stays in its process group, with
+     * its sessions, to signal them as its own.
+     */
+    if (!upgrading) {
+	(void)setsid();
+	if (xvp_daemon)
+	    xvp_process_background();
+    }
+    xvp_process_group = getpgrp();
 
     if (pipe(xvp_master_sigpipe) != 0)
 	xvp_log_errno(XVP_LOG_FATAL, "Unable to create master pipe");
 
+    xvp_spawn_stats_shared = mmap(NULL, sizeof(xvp_spawn_stats),
+				  PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (xvp_spawn_stats_shared == MAP_FAILED)
+	xvp_log_errno(XVP_LOG_FATAL, "Unable to map spawn statistics");
+
     signal(SIGPIPE, SIG_IGN);
     signal(SIGHUP,  xvp_process_signal_pipe);
     signal(SIGINT,  xvp_process_signal_pipe);
@@ -143,8 +255,23 @@ void xvp_process_init(int argc, char **argv, char **envp)
     signal(SIGUSR2, xvp_process_signal_pipe);
     signal(SIGCHLD, xvp_process_signal_pipe);
     signal(SIGTERM, xvp_process_signal_pipe);
+    signal(SIGTTIN, xvp_process_signal_pipe);
 
-    xvp_process_write_pidfile();
+    /*
+     * If replacing an old master, all is its until we're ready.  The
+     * pipe to it must not outlive us in our children, or it would wait
+     * in vain for end of file should we die: they close it as they
+     * start, along with our other descriptors, and it is close-on-exec.
+     */
+    if (upgrading) {
+	xvp_log(XVP_LOG_INFO, "Replacing master process %d", getppid());
+	xvp_process_in_charge = false;
+	xvp_process_ready_fd = atoi(getenv(XVP_UPGRADE_READY_ENV));
+	(void)fcntl(xvp_process_ready_fd, F_SETFD, FD_CLOEXEC);
+	unsetenv(XVP_UPGRADE_READY_ENV);
+    } else {
+	xvp_process_write_pidfile();
+    }
 }
 
 void xvp_process_set_name(char *process_name)
@@ -158,21 +285,572 @@ char *xvp_process_get_name(void)
     return xvp_process_name;
 }
 
-bool xvp_process_spawn(xvp_vm *vm)
+static unsigned long xvp_process_usec_since(struct timespec *then)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1000000 +
+	(now.tv_nsec - then->tv_nsec) / 1000;
+}
+
+/*
+ * Called in a session process once it is ready to talk to its client,
+ * to record the time taken since the connection was accepted.
+ */
+static void xvp_process_spawned(xvp_spawn_type type, struct timespec *accepted)
+{
+    xvp_spawn_stats *stats = xvp_spawn_stats_shared;
+    unsigned long usec = xvp_process_usec_since(accepted), max;
+
+    (void)__sync_fetch_and_add(&stats->count[type], 1);
+    (void)__sync_fetch_and_add(&stats->usec_total[type], usec);
+    while ((max = stats->usec_max[type]) < usec &&
+	   !__sync_bool_compare_and_swap(&stats->usec_max[type], max, usec))
+	/* empty */;
+
+    xvp_log(XVP_LOG_DEBUG, "Session ready %lu us after accept (%s)",
+	    usec, xvp_spawn_names[type]);
+}
+
+/*
+ * Receive a client connection passed by master, returning its socket,
+ * or -1 if master has closed the channel.  The VM is set to NULL if
+ * the port is no longer configured.
+ */
+int xvp_process_receive(int chan, xvp_vm **vmp, unsigned int *client_ip)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    xvp_worker_job job;
+    int client_sock;
+    ssize_t len;
+
+    do {
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &job;
+	iov.iov_len = sizeof(job);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+    } while ((len = recvmsg(chan, &msg, 0)) < 0 && errno == EINTR);
+
+    if (len != sizeof(job) || !(cmsg = CMSG_FIRSTHDR(&msg)) ||
+	cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+	return -1;
+
+    memcpy(&client_sock, CMSG_DATA(cmsg), sizeof(int));
+    *client_ip = job.client_ip;
+
+    if (!(*vmp = xvp_config_vm_by_port(job.port))) {
+	xvp_log(XVP_LOG_ERROR, "Given connection for unknown port %d",
+		job.port);
+	return client_sock;
+    }
+
+    xvp_process_spawned(xvp_process_type, &job.accepted);
+    return client_sock;
+}
+
+/*
+ * Pre-forked workers already have their file descriptors tidied and
+ * libraries initialised, and then sit here until the master passes
+ * them a client socket, after which they behave as a forked session.
+ */
+static void xvp_process_worker(int chan)
+{
+    struct pollfd pfds[2];
+    unsigned int client_ip;
+    int client_sock, sig;
+    xvp_vm *vm;
+
+    xvp_process_set_name("xvp: worker");
+    xvp_xenapi_init();
+
+    pfds[0].fd = chan;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = xvp_child_sigpipe[0];
+    pfds[1].events = POLLIN;
+
+    while (true) {
+
+	if (poll(pfds, 2, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    xvp_log_errno(XVP_LOG_FATAL, "poll");
+	}
+
+	if (pfds[1].revents & POLLIN) {
+	    if (read(pfds[1].fd, &sig, sizeof(sig)) != sizeof(sig))
+		xvp_log_errno(XVP_LOG_FATAL, "Error reading signal pipe");
+	    switch (sig) {
+	    case SIGHUP:
+		xvp_log_init();
+		break;
+	    case SIGTERM:
+		exit(0);
+		break;
+	    }
+	    continue;
+	}
+
+	if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR))
+	    break;
+    }
+
+    /* end of file means master has retired us */
+    if ((client_sock = xvp_process_receive(chan, &vm, &client_ip)) < 0)
+	exit(0);
+    close(chan);
+
+    if (!vm)
+	exit(1);
+
+    exit(xvp_proxy_main(vm, client_sock, client_ip));
+}
+
+/*
+ * Fork a worker or the engine, with a channel over which master can
+ * pass it client connections, returning its process ID to master
+ */
+static pid_t xvp_process_spawn_helper(xvp_spawn_type type, int shard,
+				      int *chanp)
+{
+    int chan[2], fd;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, chan) != 0) {
+	xvp_log_errno(XVP_LOG_ERROR, "Unable to create %s channel",
+		      xvp_spawn_names[type]);
+	return -1;
+    }
+
+    if (pipe(xvp_child_sigpipe) != 0) {
+	xvp_log_errno(XVP_LOG_ERROR, "Unable to create child pipe");
+	close(chan[0]);
+	close(chan[1]);
+	return -1;
+    }
+
+    switch (pid = xvp_child_pid = fork()) {
+    case 0: /* child */
+	xvp_pid = getpid();
+	xvp_process_type = type;
+	for (fd = getdtablesize() - 1; fd > 2; fd--)
+	    if (fd != chan[1] && fd != xvp_log_fd && 
+		fd != xvp_child_sigpipe[0] && fd != xvp_child_sigpipe[1])
+		close(fd);
+	signal(SIGQUIT, SIG_IGN); /* used as internal signal */
+	signal(SIGCHLD, SIG_IGN); /* used as internal signal */
+	if (type == XVP_SPAWN_ENGINE) {
+	    xvp_engine_main(chan[1], shard);
+	    exit(0);
+	}
+	if (type == XVP_SPAWN_BROKER) {
+	    xvp_broker_main(chan[1]);
+	    exit(0);
+	}
+	xvp_process_worker(chan[1]);
+	break;
+    case -1:
+	xvp_log_errno(XVP_LOG_ERROR, "Unable to spawn %s process",
+		      xvp_spawn_names[type]);
+	close(chan[0]);
+	close(chan[1]);
+	close(xvp_child_sigpipe[0]);
+	close(xvp_child_sigpipe[1]);
+	return -1;
+	break;
+    default:
+	close(chan[1]);
+	close(xvp_child_sigpipe[0]);
+	close(xvp_child_sigpipe[1]);
+	(void)fcntl(chan[0], F_SETFD, FD_CLOEXEC);
+	xvp_log(XVP_LOG_DEBUG, "Spawned %s process %d",
+		type == XVP_SPAWN_PREFORK ? "worker" : xvp_spawn_names[type],
+		pid);
+	/* an old master we're replacing kills these too if we fail */
+	if (xvp_process_ready_fd >= 0 &&
+	    write(xvp_process_ready_fd, &pid, sizeof(pid)) != sizeof(pid))
+	    xvp_log_errno(XVP_LOG_ERROR, "Unable to tell old master of %d",
+			  pid);
+	break;
+    }
+
+    *chanp = chan[0];
+    return pid;
+}
+
+static bool xvp_process_spawn_worker(void)
+{
+    int chan;
+    pid_t pid;
+
+    if ((pid = xvp_process_spawn_helper(XVP_SPAWN_PREFORK, -1, &chan)) < 0)
+	return false;
+
+    xvp_workers[xvp_workers_idle].pid = pid;
+    xvp_workers[xvp_workers_idle].chan = chan;
+    xvp_workers[xvp_workers_idle].since = time(NULL);
+    xvp_workers_idle++;
+
+    return true;
+}
+
+/*
+ * Closing its channel tells an engine to finish its current sessions
+ * and exit, though we forget it now, and start another as needed
+ */
+static void xvp_process_retire_engine(int i)
+{
+    if (xvp_engines[i].chan < 0)
+	return;
+
+    close(xvp_engines[i].chan);
+    xvp_engines[i].chan = -1;
+    xvp_engines[i].pid = 0;
+}
+
+static void xvp_process_retire_engines(void)
+{
+    int i;
+
+    for (i = 0; i < xvp_engines_count; i++)
+	xvp_process_retire_engine(i);
+    xvp_engines_count = 0;
+}
+
+/*
+ * Keep the event engine running, or with "ENGINE EVENT threads shards",
+ * one engine per shard, each listening on every port for itself, with
+ * the kernel spreading connections between them
+ */
+static void xvp_process_engines(void)
+{
+    int i, shards = (xvp_engine_mode == XVP_ENGINE_EVENT) ?
+	xvp_engine_shards : 0;
+
+    if (shards != xvp_engines_count) {
+	xvp_process_retire_engines();
+	for (i = 0; i < shards; i++)
+	    xvp_engines[i].chan = -1;
+	xvp_engines_count = shards;
+    }
+
+    for (i = 0; i < xvp_engines_count; i++) {
+	if (xvp_engines[i].chan >= 0)
+	    continue;
+	if (shards > 1)
+	    memset(&xvp_spawn_stats_shared->shards[i], 0,
+		   sizeof(xvp_spawn_stats_shared->shards[i]));
+	xvp_engines[i].pid =
+	    xvp_process_spawn_helper(XVP_SPAWN_ENGINE, shards > 1 ? i : -1,
+				     &xvp_engines[i].chan);
+	if (xvp_engines[i].pid < 0) {
+	    xvp_engines[i].pid = 0;
+	    break;
+	}
+    }
+}
+
+/*
+ * Closing its channel tells the broker to take no more lookups, and to
+ * exit once the sessions it is watching consoles for have gone.  Those
+ * already spawned keep its process ID, but fall back to logging in for
+ * themselves if they find it gone.
+ */
+static void xvp_process_retire_broker(void)
+{
+    if (xvp_broker_chan < 0)
+	return;
+
+    close(xvp_broker_chan);
+    xvp_broker_chan = -1;
+    xvp_broker_pid = 0;
+}
+
+/*
+ * Start the broker before anything that will inherit its process ID,
+ * waiting briefly until it is ready for lookups, but not restarting it
+ * too often if it keeps failing
+ */
+static void xvp_process_broker(void)
+{
+    struct pollfd pfd;
+    time_t now = time(NULL);
+    pid_t pid;
+    char ready;
+
+    if (xvp_broker_chan >= 0 || now - xvp_broker_started < XVP_BROKER_RETRY)
+	return;
+
+    xvp_broker_started = now;
+    if ((pid = xvp_process_spawn_helper(XVP_SPAWN_BROKER, -1,
+					&xvp_broker_chan)) < 0) {
+	xvp_broker_chan = -1;
+	return;
+    }
+
+    pfd.fd = xvp_broker_chan;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 1000) == 1 && read(xvp_broker_chan, &ready, 1) == 1) {
+	xvp_broker_pid = pid;
+	return;
+    }
+
+    xvp_log(XVP_LOG_ERROR, "Broker process %d not ready", pid);
+    close(xvp_broker_chan);
+    xvp_broker_chan = -1;
+    kill(pid, SIGTERM);
+}
+
+/*
+ * True if engine shards are listening, so that any listening sockets of
+ * master's own must be able to share ports with them until they retire
+ */
+bool xvp_process_sharded(void)
+{
+    return xvp_engines_count > 1;
+}
+
+/*
+ * Called by an engine shard to publish its load, for master to report
+ */
+void xvp_process_shard_load(int shard, unsigned long accepted, int active)
+{
+    xvp_spawn_stats *stats = xvp_spawn_stats_shared;
+
+    stats->shards[shard].accepted = accepted;
+    stats->shards[shard].active = active;
+    if (active > stats->shards[shard].peak)
+	stats->shards[shard].peak = active;
+}
+
+/*
+ * Idle workers are kept oldest first, and taken from the front, as the
+ * newest may not yet have finished initialising.
+ */
+static void xvp_process_remove_worker(int i)
+{
+    xvp_workers_idle--;
+    memmove(xvp_workers + i, xvp_workers + i + 1,
+	    (xvp_workers_idle - i) * sizeof(xvp_worker));
+}
+
+/*
+ * Closing its channel tells an idle worker to exit
+ */
+static void xvp_process_retire_worker(int i)
 {
-    int client_sock, client_ip, fd;
-    struct sockaddr_in client_addr;
-    socklen_t len;
+    close(xvp_workers[i].chan);
+    xvp_process_remove_worker(i);
+}
 
-    len = sizeof(client_addr);
-    client_sock = accept(vm->sock, (struct sockaddr *)&client_addr, &len);
-    if (client_sock == -1)
+static void xvp_process_retire_all(void)
+{
+    while (xvp_workers_idle > 0)
+	xvp_process_retire_worker(xvp_workers_idle - 1);
+}
+
+/*
+ * Keep the pool of idle workers topped up.  It starts at the minimum
+ * size, doubles (up to the maximum) whenever a connection arrives to
+ * find it empty, and shrinks back as surplus workers exceed their idle
+ * lifetime.  Unless the pool is empty, replacements are held back for
+ * a moment after a dispatch, so as not to compete with the worker that
+ * has just been given a client.
+ */
+void xvp_process_prefork(void)
+{
+    time_t now = time(NULL);
+    int i;
+
+    xvp_process_broker();
+    xvp_process_engines();
+
+    if (xvp_engine_mode != XVP_ENGINE_PREFORK) {
+	xvp_process_retire_all();
 	return;
+    }
+
+    if (xvp_workers_size != xvp_prefork_max) {
+	xvp_process_retire_all();
+	if (xvp_workers)
+	    xvp_free(xvp_workers);
+	xvp_workers = xvp_alloc(xvp_prefork_max * sizeof(xvp_worker));
+	xvp_workers_size = xvp_prefork_max;
+    }
+
+    if (xvp_workers_target < xvp_prefork_min)
+	xvp_workers_target = xvp_prefork_min;
+    else if (xvp_workers_target > xvp_prefork_max)
+	xvp_workers_target = xvp_prefork_max;
+
+    for (i = 0; i < xvp_workers_idle && xvp_workers_idle > xvp_prefork_min;) {
+	if (now - xvp_workers[i].since < xvp_prefork_idle) {
+	    i++;
+	    continue;
+	}
+	xvp_log(XVP_LOG_DEBUG, "Retiring idle worker process %d",
+		xvp_workers[i].pid);
+	xvp_process_retire_worker(i);
+	if (xvp_workers_target > xvp_workers_idle)
+	    xvp_workers_target = MAX(xvp_workers_idle, xvp_prefork_min);
+    }
+
+    if (xvp_workers_idle > 0 &&
+	xvp_process_usec_since(&xvp_workers_dispatched) <
+	XVP_PREFORK_DELAY * 1000)
+	return;
+
+    while (xvp_workers_idle < xvp_workers_target)
+	if (!xvp_process_spawn_worker())
+	    break;
+}
+
+static int xvp_process_workers_timeout(void)
+{
+    time_t oldest, now = time(NULL);
+    long usec;
+
+    if (xvp_engine_mode != XVP_ENGINE_PREFORK)
+	return -1;
+
+    if (xvp_workers_idle < xvp_workers_target) {
+	usec = XVP_PREFORK_DELAY * 1000 -
+	    xvp_process_usec_since(&xvp_workers_dispatched);
+	return usec > 0 ? (usec + 999) / 1000 : 0;
+    }
+
+    if (xvp_workers_idle <= xvp_prefork_min)
+	return -1;
+
+    oldest = xvp_workers[0].since;
+
+    return (oldest + xvp_prefork_idle > now) ?
+	(oldest + xvp_prefork_idle - now) * 1000 : 0;
+}
+
+/*
+ * How long master may sleep before it next needs to spawn or retire
+ * a worker, or restart the broker
+ */
+int xvp_process_timeout(void)
+{
+    int msec = xvp_process_workers_timeout(), broker, upgrade;
+
+    if (xvp_upgrade_chan >= 0) {
+	upgrade = MAX(XVP_UPGRADE_TIMEOUT * 1000 -
+		      (long)(xvp_process_usec_since(&xvp_upgrade_started) /
+			     1000), 0);
+	if (msec < 0 || upgrade < msec)
+	    msec = upgrade;
+    }
+
+    if (xvp_broker_chan >= 0)
+	return msec;
+
+    broker = MAX(xvp_broker_started + XVP_BROKER_RETRY - time(NULL), 0) * 1000;
+    return (msec < 0 || broker < msec) ? broker : msec;
+}
+
+/*
+ * Pass a client connection over a worker or engine channel, without
+ * waiting if the other end isn't keeping up
+ */
+static bool xvp_process_send(int chan, xvp_vm *vm, int client_sock,
+			     unsigned int client_ip, struct timespec *accepted)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    xvp_worker_job job;
+
+    memset(&job, 0, sizeof(job));
+    job.port = vm->port;
+    job.client_ip = client_ip;
+    job.accepted = *accepted;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &job;
+    iov.iov_len = sizeof(job);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &client_sock, sizeof(int));
+
+    return sendmsg(chan, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) == sizeof(job);
+}
+
+static bool xvp_process_dispatch(xvp_vm *vm, int client_sock,
+				 unsigned int client_ip,
+				 struct timespec *accepted)
+{
+    xvp_worker *worker;
+
+    while (xvp_workers_idle > 0) {
+
+	worker = &xvp_workers[0];
+
+	if (xvp_process_send(worker->chan, vm, client_sock,
+			     client_ip, accepted)) {
+	    xvp_log(XVP_LOG_DEBUG, "Passed connection to worker process %d",
+		    worker->pid);
+	    close(worker->chan);
+	    xvp_process_remove_worker(0);
+	    close(client_sock);
+	    clock_gettime(CLOCK_MONOTONIC, &xvp_workers_dispatched);
+	    return true;
+	}
+
+	xvp_log_errno(XVP_LOG_ERROR, "Unable to pass connection to worker %d",
+		      worker->pid);
+	xvp_process_retire_worker(0);
+    }
+
+    xvp_workers_target = MIN(xvp_prefork_max, MAX(xvp_workers_target * 2, 1));
+    return false;
+}
+
+bool xvp_process_spawn(xvp_vm *vm, int client_sock, unsigned int client_ip)
+{
+    int fd;
+    struct timespec accepted;
 
-    client_ip = client_addr.sin_addr.s_addr;
+    clock_gettime(CLOCK_MONOTONIC, &accepted);
+
+    /* if the engine can't take it, fall back to forking */
+    if (xvp_engine_mode == XVP_ENGINE_EVENT && xvp_engines_count == 1 &&
+	xvp_engines[0].chan >= 0) {
+	if (xvp_process_send(xvp_engines[0].chan, vm, client_sock,
+			     client_ip, &accepted)) {
+	    close(client_sock);
+	    return true;
+	}
+	xvp_log_errno(XVP_LOG_ERROR, "Unable to pass connection to engine %d",
+		      xvp_engines[0].pid);
+    }
+
+    if (xvp_engine_mode == XVP_ENGINE_PREFORK) {
+	bool dispatched = xvp_process_dispatch(vm, client_sock, client_ip,
+					       &accepted);
+	xvp_process_prefork();
+	if (dispatched)
+	    return true;
+    }
 
     if (pipe(xvp_child_sigpipe) != 0) {
 	xvp_log_errno(XVP_LOG_ERROR, "Unable to create child pipe");
+	close(client_sock);
 	return false;
     }
 
@@ -190,6 +868,8 @@ bool xvp_process_spawn(xvp_vm *vm)
 		close(fd);
 	signal(SIGQUIT, SIG_IGN); /* used as internal signal */
 	signal(SIGCHLD, SIG_IGN); /* used as internal signal */
+	xvp_xenapi_init();
+	xvp_process_spawned(XVP_SPAWN_FORK, &accepted);
 	exit(xvp_proxy_main(vm, client_sock, client_ip));
 	break;
     case -1:
@@ -211,8 +891,193 @@ bool xvp_process_spawn(xvp_vm *vm)
     return true;
 }
 
+void xvp_process_dump(void)
+{
+    xvp_spawn_stats *stats = xvp_spawn_stats_shared;
+    int type, i;
+
+    for (type = 0; type < XVP_SPAWN_TYPES; type++) {
+	if (stats->count[type] == 0)
+	    continue;
+	xvp_log(XVP_LOG_INFO,
+		"Sessions %s: %lu, ready after mean %lu us, max %lu us",
+		type == XVP_SPAWN_PREFORK ? "from workers" :
+		type == XVP_SPAWN_ENGINE ? "in event engine" : "forked",
+		stats->count[type], stats->usec_total[type] / stats->count[type],
+		stats->usec_max[type]);
+    }
+
+    if (xvp_engine_mode == XVP_ENGINE_PREFORK)
+	xvp_log(XVP_LOG_INFO, "Idle worker processes: %d (target %d)",
+		xvp_workers_idle, xvp_workers_target);
+    else if (xvp_engine_mode == XVP_ENGINE_EVENT && xvp_engines_count == 1)
+	xvp_log(XVP_LOG_INFO, "Event engine process: %d", xvp_engines[0].pid);
+
+    if (xvp_broker_pid)
+	xvp_log(XVP_LOG_INFO, "Broker process: %d", xvp_broker_pid);
+
+    for (i = 0; xvp_engines_count > 1 && i < xvp_engines_count; i++)
+	xvp_log(XVP_LOG_INFO,
+		"Engine shard %d, process %d: %lu accepted, %d active (peak %d)",
+		i, xvp_engines[i].pid, stats->shards[i].accepted,
+		stats->shards[i].active, stats->shards[i].peak);
+}
+
+/*
+ * On SIGTTIN, run the xvp binary afresh, as upgraded, say, as a new
+ * master, passing it our listening sockets, for xvp_process_upgrading()
+ * to see it through, while we carry on serving meanwhile
+ */
+static void xvp_process_upgrade(void)
+{
+    int chan[2], fd;
+    char *map, env[16];
+    pid_t pid;
+
+    if (xvp_upgrade_chan >= 0) {
+	xvp_log(XVP_LOG_ERROR, "Unable to upgrade: already upgrading");
+	return;
+    }
+
+    if (!(map = xvp_listen_fds())) {
+	xvp_log(XVP_LOG_ERROR, "Unable to upgrade: too many listeners");
+	return;
+    }
+
+    if (pipe(chan) != 0) {
+	xvp_log_errno(XVP_LOG_ERROR, "Unable to create upgrade pipe");
+	xvp_free(map);
+	return;
+    }
+
+    xvp_log(XVP_LOG_INFO, "Upgrading to %s", xvp_process_exe);
+
+    switch (pid = fork()) {
+    case 0: /* child, to become the new master */
+	xvp_pid = getpid();
+	for (fd = getdtablesize() - 1; fd > 2; fd--)
+	    if (fd != chan[1])
+		(void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+	xvp_listen_keep_on_exec();
+	sprintf(env, "%d", chan[1]);
+	setenv(XVP_UPGRADE_FDS_ENV, map, 1);
+	setenv(XVP_UPGRADE_READY_ENV, env, 1);
+	execvp(xvp_process_exe, xvp_process_argv);
+	xvp_log_errno(XVP_LOG_ERROR, "%s", xvp_process_exe);
+	_exit(1);
+	break;
+    case -1:
+	xvp_log_errno(XVP_LOG_ERROR, "Unable to spawn new master process");
+	close(chan[0]);
+	close(chan[1]);
+	xvp_free(map);
+	return;
+	break;
+    default:
+	close(chan[1]);
+	xvp_free(map);
+	break;
+    }
+
+    xvp_upgrade_chan = chan[0];
+    xvp_upgrade_pid = pid;
+    xvp_upgrade_nchildren = 0;
+    clock_gettime(CLOCK_MONOTONIC, &xvp_upgrade_started);
+    xvp_listen_watch_upgrade(xvp_upgrade_chan, true);
+}
+
+static void xvp_process_upgrade_done(void)
+{
+    xvp_listen_watch_upgrade(xvp_upgrade_chan, false);
+    close(xvp_upgrade_chan);
+    xvp_upgrade_chan = -1;
+}
+
+/*
+ * Called from master's main loop, with whether the upgrade pipe is
+ * readable.  The new master tells us of each process it spawns, then
+ * sends a zero process ID once it is accepting connections, or we see
+ * end of file if it exits.  Once it is ready, leave it our sessions,
+ * which stay in the process group it signals, returning false, for us
+ * to exit, with them still connected.  If it fails, or takes too long,
+ * we carry on as we were.
+ */
+bool xvp_process_upgrading(bool readable)
+{
+    pid_t child, *grown;
+    int i;
+
+    if (xvp_upgrade_chan < 0)
+	return true;
+
+    if (readable) {
+	if (read(xvp_upgrade_chan, &child, sizeof(child)) != sizeof(child))
+	    goto failed;
+	if (!child) {
+	    xvp_process_upgrade_done();
+	    xvp_log(XVP_LOG_INFO, "New master process %d is ready, "
+		    "leaving sessions to it", xvp_upgrade_pid);
+	    /* idle workers exit, and engines and broker once work is done */
+	    xvp_process_retire_all();
+	    xvp_process_retire_engines();
+	    xvp_process_retire_broker();
+	    xvp_process_in_charge = false;
+	    return false;
+	}
+	if (xvp_upgrade_nchildren == xvp_upgrade_maxchildren) {
+	    xvp_upgrade_maxchildren = xvp_upgrade_maxchildren ?
+		xvp_upgrade_maxchildren * 2 : 64;
+	    grown = xvp_alloc(xvp_upgrade_maxchildren * sizeof(pid_t));
+	    if (xvp_upgrade_children)
+		memcpy(grown, xvp_upgrade_children,
+		       xvp_upgrade_nchildren * sizeof(pid_t));
+	    xvp_free(xvp_upgrade_children);
+	    xvp_upgrade_children = grown;
+	}
+	xvp_upgrade_children[xvp_upgrade_nchildren++] = child;
+    }
+
+    if (xvp_process_usec_since(&xvp_upgrade_started) <
+	XVP_UPGRADE_TIMEOUT * 1000000UL)
+	return true;
+
+ failed:
+
+    /* if still trying, lest we have two, along with all it spawned */
+    xvp_process_upgrade_done();
+    xvp_log(XVP_LOG_ERROR, "New master process %d failed to start",
+	    xvp_upgrade_pid);
+    kill(xvp_upgrade_pid, SIGKILL);
+    for (i = 0; i < xvp_upgrade_nchildren; i++)
+	kill(xvp_upgrade_children[i], SIGKILL);
+    return true;
+}
+
+/*
+ * Called by a new master once it is accepting connections, to tell the
+ * old one it is replacing that it can go
+ */
+void xvp_process_upgraded(void)
+{
+    pid_t ready = 0;
+
+    if (xvp_process_ready_fd < 0)
+	return;
+
+    xvp_process_write_pidfile();
+    xvp_process_in_charge = true;
+
+    if (write(xvp_process_ready_fd, &ready, sizeof(ready)) != sizeof(ready))
+	xvp_log_errno(XVP_LOG_ERROR, "Unable to tell old master we're ready");
+    close(xvp_process_ready_fd);
+    xvp_process_ready_fd = -1;
+}
+
 void xvp_process_cleanup(void)
 {
+    if (!xvp_process_in_charge) /* an old or new master has them */
+	return;
+
     if (xvp_child_pid) {
 	signal(SIGCHLD, SIG_IGN);
 	xvp_process_signal_children(SIGTERM);
@@ -222,8 +1087,9 @@ void xvp_process_cleanup(void)
 
 bool xvp_process_signal_handler(void)
 {
-    int fd, sig, status;
+    int fd, sig, status, i;
     pid_t pid;
+    struct timespec started;
 
     fd = (xvp_child_pid ? xvp_master_sigpipe[0]: xvp_child_sigpipe[0]);
     if (read(fd, &sig, sizeof(sig)) != sizeof(sig))
@@ -254,15 +1120,35 @@ bool xvp_process_signal_handler(void)
 
     case SIGUSR1:
 	if (xvp_child_pid) { /* master only - re-read config file */
+	    clock_gettime(CLOCK_MONOTONIC, &started);
 	    xvp_config_init();
-	    xvp_listen_init();
+	    xvp_listen_init(); /* keeping listeners for unchanged ports */
+	    xvp_log(XVP_LOG_INFO, "Config re-read in %lu ms",
+		    xvp_process_usec_since(&started) / 1000);
+	    /* idle workers and engines have the old config, so replace them */
+	    xvp_process_retire_all();
+	    xvp_process_retire_engines();
+	    xvp_process_retire_broker();
+	    xvp_broker_started = 0;
+	    xvp_process_prefork();
 	}
 	break;
 
+    case SIGTTIN: /* run afresh, as upgraded */
+	if (xvp_child_pid)
+	    xvp_process_upgrade();
+	break;
+
     case SIGUSR2: /* dump current connections to log */
 	if (xvp_child_pid) {
 	    xvp_log(XVP_LOG_INFO, "Dumping active session list");
+	    xvp_listen_dump();
+	    xvp_process_dump();
 	    xvp_process_signal_children(sig);
+	} else if (xvp_process_type == XVP_SPAWN_ENGINE) {
+	    xvp_engine_dump();
+	} else if (xvp_process_type == XVP_SPAWN_BROKER) {
+	    xvp_broker_dump();
 	} else {
 	    xvp_proxy_dump();
 	}
@@ -278,20 +1164,36 @@ bool xvp_process_signal_handler(void)
 	break;
 
     case SIGCHLD:
-	if (xvp_child_pid) { /* master - reap child */
-	    if ((pid = wait(&status)) < 0)
+	if (xvp_child_pid) { /* master - reap children, may be several */
+	    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		if (WIFEXITED(status))
+		    xvp_log(XVP_LOG_DEBUG,
+			    "Child %d exited %d", pid, WEXITSTATUS(status));
+		else if (WIFSIGNALED(status))
+		    xvp_log(XVP_LOG_ERROR,
+			    "Child %d terminated by %s",
+			    pid, sys_siglist[WTERMSIG(status)]);
+		else
+		    xvp_log(XVP_LOG_ERROR,
+			    "Child %d terminated with unexpected status 0x%x",
+			    pid, status);
+		for (i = 0; i < xvp_workers_idle; i++) {
+		    if (xvp_workers[i].pid == pid) {
+			xvp_process_retire_worker(i);
+			break;
+		    }
+		}
+		for (i = 0; i < xvp_engines_count; i++) {
+		    if (xvp_engines[i].pid == pid) { /* replaced by prefork */
+			xvp_process_retire_engine(i);
+			break;
+		    }
+		}
+		if (pid == xvp_broker_pid) /* likewise */
+		    xvp_process_retire_broker();
+	    }
+	    if (pid < 0 && errno != ECHILD)
 		xvp_log_errno(XVP_LOG_ERROR, "Wait failed");
-	    else if (WIFEXITED(status))
-		xvp_log(XVP_LOG_DEBUG,
-			"Child %d exited %d", pid, WEXITSTATUS(status));
-	    else if (WIFSIGNALED(status))
-		xvp_log(XVP_LOG_ERROR,
-			"Child %d terminated by %s",
-			pid, sys_siglist[WTERMSIG(status)]);
-	    else
-		xvp_log(XVP_LOG_ERROR,
-			"Child %d terminated with unexpected status 0x%x",
-			pid, status);
 	} else { /* child - stop idling, sub-thread has completed task */
 	    xvp_proxy_resume();
 	}
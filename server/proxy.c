@@ -33,19 +33,36 @@
  * user-level byte in 1 packet.  This means we can't necessarily retrieve
  * the whole of a single RFB message from the client in a single read(2)
  * system call, although we do so where we can for efficiency reasons.
+ *
+ * Each session is normally run by its own process, using blocking I/O
+ * from several threads.  With "ENGINE EVENT", many sessions are instead
+ * run by the event engine process, driving the same RFB state machine
+ * from its epoll loop with non-blocking sockets and SSL, and buffering
+ * data in each direction.
+ *
+ * Where the kernel supports TLS (kTLS), and takes over decrypting the
+ * console connection once the handshake is done, console output is
+ * relayed to the client with splice(2), through a pipe, without being
+ * copied to and from user space.  Anything else, such as TLS control
+ * records, still goes through SSL_read().
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <time.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <openssl/ssl.h>
 
@@ -54,6 +71,17 @@
 /* Use modest buffer size - could be many instances running */
 #define XVP_PROXY_BUF_SIZE 4096
 
+/* ... though relaying to a busy client may grow it, for a while */
+#define XVP_PROXY_BUF_MAX (256 * 1024)
+#define XVP_PROXY_BUF_IDLE 10 /* seconds */
+
+/* How long a hot VM's ready console connection is kept before renewal */
+#define XVP_PROXY_WARM_REFRESH 300 /* seconds */
+#define XVP_PROXY_WARM_RETRY    30 /* seconds, if it couldn't be made */
+
+/* At most what a pipe holds by default, so splicing into it won't block */
+#define XVP_PROXY_SPLICE_SIZE 65536
+
 /* RFB data types - transferred big-endian */
 typedef unsigned char  U8;
 typedef unsigned short U16;
@@ -80,77 +108,168 @@ typedef enum {
     XVP_STATE_BROKEN
 } xvp_proxy_state_enum;
 
-typedef struct { /* to pass to server-connecting thread */
-    xvp_vm *vm;
-    bool shared;
-    bool reinit;
-    SSL **sslp; /* for return */
-} xvp_server_info;
-
-typedef struct { /* to pass to RFB proxying threads */
-    int client_sock;
-    SSL *server_handle;
-} xvp_proxy_handles;
-
-typedef struct { /* to pass to extension message code thread */
-    int client_sock;
-    int message_code;
-} xvp_proxy_code;
-
-static char client_hostname[XVP_MAX_HOSTNAME + 1];
-static char proxy_name[XVP_MAX_HOSTNAME * 2 + 16];
-static xvp_proxy_state_enum xvp_proxy_state;
-static unsigned int xvp_proxy_minor_version;
-static unsigned int xvp_proxy_security_type;
-static bool xvp_proxy_writing;
-static bool xvp_proxy_extensions;
-static pthread_t xvp_proxy_writer_thread;
-static pthread_t xvp_proxy_reader_thread;
-
-static struct {
+typedef struct {
     U16 fb_width;
     U16 fb_height;
     U8  pixel_format[16];
     U32 name_length;
     /* U8 name[name_length]; */
-} xvp_proxy_server_details;
+} xvp_rfb_server_init;
 
-static struct {
+typedef struct {
     U8  message_type; /* XVP_RFB_MESSAGE_TYPE_SET_PIXEL_FORMAT */
     U8  padding1[3];
     U8  pixel_format[16];
-} xvp_proxy_pixel_format;
+} xvp_rfb_set_pixel_format;
 
-static struct {
+typedef struct {
     U8  message_type; /* XVP_RFB_MESSAGE_TYPE_SET_ENCODINGS */
     U8  padding;
     U16 number; /* of encodings */
 #define XVP_PROXY_MAX_ENCODINGS 32
     S32 encodings[XVP_PROXY_MAX_ENCODINGS];
-} xvp_proxy_encodings;
+} xvp_rfb_set_encodings;
 
-static struct {
+typedef struct {
     U8  message_type; /* XVP_RFB_MESSAGE_TYPE_CLIENT_CUT_TEXT */
     U8  padding1[3];
     U32 text_length;
     /* U8 text[text_length]; */
-} xvp_proxy_cut_text;
+} xvp_rfb_client_cut_text;
 
-static struct {
+typedef struct {
     U8 message_type; /* 4 */
     U8 down_flag; /* non-zero => down, zero => up */
     U8 padding1[2];
     U32 key;
-} xvp_proxy_key_event;
+} xvp_rfb_key_event;
 
-static struct {
+typedef struct {
     U8  message_type; /* 3 */
     U8  incremental;
     U16 x_position;
     U16 y_position;
     U16 width;
     U16 height;
-} xvp_proxy_fb_request;
+} xvp_rfb_fb_update_request;
+
+typedef struct { /* data queued in one direction */
+    int   off;  /* start of data not yet consumed */
+    int   len;  /* end of data */
+    int   size;
+    char *data;
+} xvp_proxy_buf;
+
+struct xvp_session {
+    xvp_session             *next;
+    xvp_session             *prev;
+    unsigned int             id;
+    xvp_vm                  *vm;
+    xvp_xenapi              *xenapi;
+    int                      client_sock;
+    unsigned int             client_ip;
+    char                     client_hostname[XVP_MAX_HOSTNAME + 1];
+    char                     name[XVP_MAX_HOSTNAME * 2 + 16];
+    xvp_proxy_state_enum     state;
+    unsigned int             minor_version;
+    unsigned int             security_type;
+    bool                     writing;
+    bool                     extensions;
+    bool                     shared;
+    bool                     reinit;
+    bool                     early;      /* console connect before ClientInit */
+    bool                     early_done; /* ... and finished, if not used */
+    SSL                     *ssl;
+    xvp_rfb_server_init      server_details;
+    xvp_rfb_set_pixel_format pixel_format;
+    xvp_rfb_set_encodings    encodings;
+    bool                     ktls;     /* console output is splicable */
+    int                      pipe[2];  /* to splice it through */
+    unsigned long            relayed;  /* bytes of console output */
+    unsigned long            spliced;  /* of those, moved by splice(2) */
+    unsigned long            reads;    /* from console, to relay */
+    unsigned long            writes;   /* to client */
+    unsigned int             pending_updates; /* XVP codes, as bits */
+    xvp_frame                frame;    /* to send them between messages */
+    int                      wake[2];  /* to reader, when there are some */
+    bool                     tasks;    /* client takes task progress */
+    int                      progress; /* percent, to send as PROGRESS */
+    U32                      cut_remaining; /* yet to come from client */
+    xvp_proxy_buf            paste;      /* cut text, yet to be typed */
+    long long                paste_when; /* msec, when next may be */
+    unsigned long            pasted;     /* characters typed */
+    xvp_proxy_buf            in;  /* from client */
+    xvp_proxy_buf            up;  /* to server */
+    int                      up_held;    /* of that, in a blocked write */
+    bool                     up_pointer; /* up ends with a PointerEvent */
+    unsigned long            pointers;   /* PointerEvents from client */
+    unsigned long            merged;     /* of those, coalesced */
+    xvp_rfb_fb_update_request asked;     /* last incremental request sent */
+    bool                     asking;     /* ... and not yet answered */
+    unsigned long            asked_reads; /* console reads when sent */
+    unsigned long            asked_updates; /* ... FramebufferUpdates */
+    unsigned long            forwarded;  /* requests, this connection */
+    bool                     pared;      /* encodings left out, logged */
+    long long                asked_when;  /* msec, when sent */
+    xvp_rfb_fb_update_request held;      /* incremental request, paced */
+    bool                     holding;
+    unsigned long            requests;   /* incremental, from client */
+    unsigned long            dropped;    /* of those, not sent */
+
+    /* the rest is only used by the event engine */
+    bool                     authok;
+    bool                     wrongvm;
+    bool                     closing; /* once pending output is sent */
+    bool                     closed;
+    bool                     busy;    /* job in progress */
+    int                      message_code;
+    bool                     tasking; /* ... its VM operation under way */
+    bool                     job_ok;
+    int                      job_percent;
+    SSL                     *job_ssl;
+    unsigned int             challenge[4];
+    unsigned int             ssl_read_wants;
+    unsigned int             ssl_write_wants;
+    xvp_watch                client;
+    xvp_watch                server;
+    xvp_job                  job;
+    xvp_timer                timer;
+    xvp_timer                idle;   /* to shrink out, once quiet */
+    xvp_timer                pace;   /* to send a held update request */
+    time_t                   filled; /* when out was last filled */
+    int                      piped; /* bytes spliced, not yet sent */
+    xvp_proxy_buf            out; /* to client */
+};
+
+typedef struct xvp_proxy_warm { /* console connection ready for a hot VM */
+    struct xvp_proxy_warm *next;
+    xvp_session           *session; /* with no client, to make it */
+    SSL                   *ssl;     /* ServerInit read, nothing sent since */
+    bool                   busy;    /* job in progress */
+    bool                   stopped;
+    xvp_job                job;
+    xvp_timer              timer;   /* to renew it, or try again */
+    xvp_watch              stream;  /* to notice the console hang up */
+    xvp_watch              events;  /* to hear of changes from the broker */
+    unsigned long          made;
+    unsigned long          used;    /* handed to clients */
+} xvp_proxy_warm;
+
+typedef struct { /* to pass to extension message code thread */
+    xvp_session *session;
+    int message_code;
+    bool tasks;
+} xvp_proxy_code;
+
+static xvp_session *xvp_proxy_sessions = NULL;
+static xvp_proxy_warm *xvp_proxy_warms = NULL;
+static unsigned int xvp_proxy_next_id = 0;
+static int xvp_proxy_count = 0;
+static bool xvp_proxy_engine = false;
+static pthread_t xvp_proxy_writer_thread;
+static pthread_t xvp_proxy_reader_thread;
+static pthread_mutex_t xvp_proxy_frame_lock = /* updates, and frame */
+    PTHREAD_MUTEX_INITIALIZER;
 
 bool xvp_reconnect_delay = XVP_RECONNECT_DELAY;
 
@@ -180,30 +299,134 @@ bool xvp_reconnect_delay = XVP_RECONNECT_DELAY;
 #define XVP_RFB_MESSAGE_TYPE_XVP 250
 #define XVP_RFB_MESSAGE_VERSION  1
 
+/*
+ * Our own extension of that: a client sending its requests as version 2
+ * is told how each is progressing, with PROGRESS messages carrying a
+ * percentage, and then of its success, by the request's code coming
+ * back, or of its failure, as before.  Other clients only hear of
+ * failure, as they would reject messages they don't know.  INIT says
+ * version 2 is accepted in its padding, which older clients ignore,
+ * rather than in its version, which some echo in their requests.
+ */
+#define XVP_RFB_MESSAGE_VERSION_TASKS 2
+
 typedef struct {
     U8 message_type; /* XVP_RFB_MESSAGE_TYPE_XVP */
     U8 padding;
     U8 version;
     U8 code;
+    U8 percent;      /* XVP_MESSAGE_CODE_PROGRESS only */
 } xvp_proxy_code_message;
 
+#define XVP_PROXY_STATS_LEN 512
+
+/* Room for one of each XVP message, as queued for the client */
+#define XVP_PROXY_UPDATES_LEN (32 * sizeof(xvp_proxy_code_message))
+
+static char *xvp_proxy_relay_stats(xvp_session *s, char *buf)
+{
+    sprintf(buf, "%lu bytes relayed, %lu spliced, "
+	    "%lu reads, %lu writes of %lu bytes average, "
+	    "%lu of %lu pointer events merged, "
+	    "%lu of %lu update requests dropped, "
+	    "%lu characters pasted",
+	    s->relayed, s->spliced, s->reads, s->writes,
+	    s->writes ? s->relayed / s->writes : 0,
+	    s->merged, s->pointers, s->dropped, s->requests, s->pasted);
+    return buf;
+}
+
 void xvp_proxy_dump(void)
 {
-    xvp_log(XVP_LOG_INFO, "Active %s", proxy_name + 5);
+    xvp_session *s;
+    xvp_proxy_warm *w;
+    char buf[XVP_PROXY_STATS_LEN];
+
+    for (w = xvp_proxy_warms; w; w = w->next)
+	xvp_log(XVP_LOG_INFO, "Hot VM %s: console connection %s, "
+		"%lu made, %lu used", w->session->vm->vmname,
+		w->ssl ? "ready" : "not ready", w->made, w->used);
+
+    for (s = xvp_proxy_sessions; s; s = s->next) {
+	xvp_log_id = s->id;
+	xvp_log(XVP_LOG_INFO, "Active %s, %s",
+		s->name + 5, xvp_proxy_relay_stats(s, buf));
+    }
+    xvp_log_id = 0;
 }
 
-static void xvp_proxy_set_name(xvp_vm *vm)
+static void xvp_proxy_set_name(xvp_session *s, xvp_vm *vm)
 {
-    sprintf(proxy_name, "xvp: proxy: %s to %s", client_hostname, vm->vmname);
-    xvp_process_set_name(proxy_name);
+    s->vm = vm;
+    sprintf(s->name, "xvp: proxy: %s to %s", s->client_hostname, vm->vmname);
+    if (!xvp_proxy_engine)
+	xvp_process_set_name(s->name);
 }
 
-static char *xvp_proxy_get_name(void)
+static char *xvp_proxy_get_name(xvp_session *s)
 {
-    char *name = xvp_process_get_name();
+    char *name = xvp_proxy_engine ? s->name : xvp_process_get_name();
     return strncmp(name, "xvp: ", 5) ? name : name + 5;
 }
 
+static xvp_session *xvp_proxy_session_new(xvp_vm *vm, int client_sock,
+					  unsigned int client_ip)
+{
+    xvp_session *s = xvp_alloc(sizeof(xvp_session));
+
+    memset(s, 0, sizeof(xvp_session));
+    s->id = ++xvp_proxy_next_id;
+    s->vm = vm;
+    s->xenapi = xvp_xenapi_create(!xvp_proxy_engine);
+    s->client_sock = client_sock;
+    s->client_ip = client_ip;
+    s->pixel_format.message_type = 0xff;
+    s->encodings.message_type = 0xff;
+    s->extensions = false;
+    s->pipe[0] = s->pipe[1] = -1;
+    s->wake[0] = s->wake[1] = -1;
+
+    if ((s->next = xvp_proxy_sessions))
+	s->next->prev = s;
+    xvp_proxy_sessions = s;
+    xvp_proxy_count++;
+
+    return s;
+}
+
+static void xvp_proxy_session_unlink(xvp_session *s)
+{
+    if (s->next)
+	s->next->prev = s->prev;
+    if (s->prev)
+	s->prev->next = s->next;
+    else
+	xvp_proxy_sessions = s->next;
+    xvp_proxy_count--;
+}
+
+/*
+ * Called from a job thread in the event engine, so avoid anything
+ * not thread-safe, such as gethostbyaddr()
+ */
+static void xvp_proxy_client_hostname(xvp_session *s)
+{
+    struct sockaddr_in sin;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = s->client_ip;
+
+    if (s->client_ip == htonl(INADDR_LOOPBACK)) {
+	strcpy(s->client_hostname, "localhost");
+    } else if (getnameinfo((struct sockaddr *)&sin, sizeof(sin),
+			   s->client_hostname, sizeof(s->client_hostname),
+			   NULL, 0, NI_NAMEREQD) != 0) {
+	(void)inet_ntop(AF_INET, &sin.sin_addr, s->client_hostname,
+			sizeof(s->client_hostname));
+    }
+}
+
 static bool xvp_read_all(int fd, void *buf, int len) {
     int total, got;
     char *cbuf = buf;
@@ -240,7 +463,6 @@ static bool xvp_write_all(int fd, void *buf, int len)
     }
     return true;
 }
-
 static void xvp_proxy_trace_client(void *buf, int len, bool proxy)
 {
     unsigned char *u8 = (unsigned char *)buf;
@@ -333,70 +555,332 @@ static void xvp_proxy_trace_server(char *u8, int len)
     xvp_log(XVP_LOG_DEBUG, "Server %s %d", type, len);
 }
 
-static bool xvp_proxy_client_update(int sock, xvp_message_code code)
+/*
+ * Console messages
+ * ----------------
+ *
+ * XVP messages for the client must go between the console's, not in
+ * the middle of one, so we follow where each ends (see frame.c), passing
+ * over their contents unseen, which lets them still be spliced.
+ * SetEncodings from a client wanting XVP messages is pared down to
+ * encodings we can follow.  Should we lose track all the same, or be
+ * unsure of the pixel format, XVP messages are held until the next
+ * console connection, when we start again.
+ */
+
+/*
+ * Leave out of a SetEncodings message those encodings the console might
+ * send us data for that we can't follow, if the client wants XVP
+ * messages, returning its length.  The first time, say which.
+ */
+static int xvp_proxy_frame_encodings(xvp_session *s, char *buf)
+{
+    xvp_rfb_set_encodings *se = (xvp_rfb_set_encodings *)buf;
+    int i, n = ntohs(se->number), kept = 0, len = 0;
+    S32 e, xvp = htonl(XVP_RFB_ENCODING_XVP);
+    bool wanted = false;
+    char left[256];
+
+    for (i = 0; i < n && !wanted; i++) {
+	memcpy(&e, buf + 4 + i * sizeof(S32), sizeof(S32));
+	wanted = (e == xvp);
+    }
+
+    if (!wanted)
+	return 4 + n * sizeof(S32);
+
+    for (i = 0; i < n; i++) {
+	memcpy(&e, buf + 4 + i * sizeof(S32), sizeof(S32));
+	if (e == xvp || xvp_frame_encoding(ntohl(e)))
+	    memcpy(buf + 4 + kept++ * sizeof(S32), &e, sizeof(S32));
+	else if (len < sizeof(left) - 13)
+	    len += sprintf(left + len, " %d", ntohl(e));
+    }
+    se->number = htons(kept);
+
+    if (len > 0 && !s->pared) {
+	xvp_log(XVP_LOG_INFO, "Not passing on client encodings:%s", left);
+	s->pared = true;
+    }
+
+    return 4 + kept * sizeof(S32);
+}
+
+/*
+ * Start following a new console connection's messages, unless the
+ * client has said it doesn't want XVP messages
+ */
+static void xvp_proxy_frame_init(xvp_session *s)
+{
+    U8 *pf = (s->pixel_format.message_type != 0xff) ?
+	s->pixel_format.pixel_format : s->server_details.pixel_format;
+
+    xvp_frame_init(&s->frame, pf,
+		   s->encodings.message_type != 0xff && !s->extensions);
+    s->forwarded = s->reinit ? 1 : 0; /* re-init asks for a full update */
+}
+
+/*
+ * The client has changed its pixel format, which the console uses for
+ * any update it begins once it has read the change.  We can only be sure
+ * none is under way if every update request passed on has been answered,
+ * and we're between messages, else we give up following them, holding
+ * any XVP messages, until the next console connection.
+ */
+static void xvp_proxy_frame_pixel_format(xvp_session *s)
+{
+    bool lost = false;
+
+    pthread_mutex_lock(&xvp_proxy_frame_lock);
+    if (s->frame.off)
+	/* nothing to do */;
+    else if (s->frame.since == 0 && s->frame.updates >= s->forwarded)
+	xvp_frame_pixel_format(&s->frame, s->pixel_format.pixel_format);
+    else
+	lost = s->frame.off = true;
+    pthread_mutex_unlock(&xvp_proxy_frame_lock);
+
+    if (lost)
+	xvp_log(XVP_LOG_INFO, "Pixel format changed during an update, "
+		"holding XVP messages until console reconnects");
+}
+
+/*
+ * How much of the console's output we may pass on unseen, up to max
+ */
+static int xvp_proxy_frame_unseen(xvp_session *s, int max)
+{
+    int len;
+
+    pthread_mutex_lock(&xvp_proxy_frame_lock);
+    len = s->frame.off ? max : MIN(s->frame.skip, max);
+    pthread_mutex_unlock(&xvp_proxy_frame_lock);
+
+    return len;
+}
+
+/*
+ * Follow what the console has sent.  In a session process, the writer
+ * also looks at how far we've got, so this is done under the lock.
+ */
+static void xvp_proxy_frame_feed(xvp_session *s, const char *data, int len)
+{
+    pthread_mutex_lock(&xvp_proxy_frame_lock);
+    xvp_frame_feed(&s->frame, data, len);
+    pthread_mutex_unlock(&xvp_proxy_frame_lock);
+}
+
+/*
+ * Returns the length of the message, only PROGRESS carrying a percentage
+ */
+static int xvp_proxy_make_update(xvp_proxy_code_message *message,
+				 xvp_message_code code, int percent)
+{
+    message->message_type = XVP_RFB_MESSAGE_TYPE_XVP;
+    message->padding      = (code == XVP_MESSAGE_CODE_INIT) ?
+	XVP_RFB_MESSAGE_VERSION_TASKS : 0;
+    message->version      = (code >= XVP_MESSAGE_CODE_SHUTDOWN) ?
+	XVP_RFB_MESSAGE_VERSION_TASKS : XVP_RFB_MESSAGE_VERSION;
+    message->code         = code;
+    message->percent      = percent;
+
+    return (code == XVP_MESSAGE_CODE_PROGRESS) ?
+	sizeof(*message) : sizeof(*message) - 1;
+}
+
+/*
+ * Queue an XVP message for the client, for whatever writes to it to
+ * send between console messages.  In a session process, this may be the
+ * thread following a VM operation, and the reader may need waking.  A
+ * result makes any PROGRESS still queued out of date.
+ */
+static void xvp_proxy_queue_update(xvp_session *s, xvp_message_code code,
+				   int percent)
+{
+    char wake = 0;
+
+    pthread_mutex_lock(&xvp_proxy_frame_lock);
+    if (code == XVP_MESSAGE_CODE_PROGRESS)
+	s->progress = percent;
+    else
+	s->pending_updates &= ~(1 << XVP_MESSAGE_CODE_PROGRESS);
+    s->pending_updates |= 1 << code;
+    pthread_mutex_unlock(&xvp_proxy_frame_lock);
+
+    if (s->wake[1] >= 0)
+	(void)write(s->wake[1], &wake, 1);
+}
+
+/*
+ * Take the queued XVP messages, into buf, returning their length, if
+ * they can go where the last complete console message ends, no further
+ * back than the last got bytes from the console, setting since to the
+ * number after it.  They're held while we aren't following the messages.
+ */
+static int xvp_proxy_take_updates(xvp_session *s, char *buf, int got,
+				  int *since)
 {
     xvp_proxy_code_message message;
+    int code, len = 0, n;
+
+    pthread_mutex_lock(&xvp_proxy_frame_lock);
+    if (s->frame.off || s->frame.since > got) {
+	pthread_mutex_unlock(&xvp_proxy_frame_lock);
+	return 0;
+    }
+    *since = s->frame.since;
+    for (code = 0; s->pending_updates; code++) {
+	if (!(s->pending_updates & (1 << code)))
+	    continue;
+	s->pending_updates &= ~(1 << code);
+	n = xvp_proxy_make_update(&message, code, s->progress);
+	memcpy(buf + len, &message, n);
+	len += n;
+    }
+    pthread_mutex_unlock(&xvp_proxy_frame_lock);
+
+    return len;
+}
+
+/*
+ * Save encodings for use in re-init, returning true if they are the
+ * first the client has sent
+ */
+static bool xvp_proxy_save_encodings(xvp_session *s, char *buf)
+{
+    bool seen = (s->encodings.message_type != 0xff);
+    int n = ntohs(((xvp_rfb_set_encodings *)buf)->number);
 
-    message.message_type = XVP_RFB_MESSAGE_TYPE_XVP;
-    message.padding      = 0;
-    message.version      = XVP_RFB_MESSAGE_VERSION;
-    message.code         = code;
+    if (n > XVP_PROXY_MAX_ENCODINGS)
+	n = XVP_PROXY_MAX_ENCODINGS;
+    memcpy(&s->encodings, buf, 4 + n * sizeof(S32));
+    s->encodings.number = htons(n);
 
-    return xvp_write_all(sock, &message, sizeof(message));
+    return !seen;
 }
 
-static bool xvp_proxy_extensions_init(int sock)
+/*
+ * Check the client's first encodings, returning true if it needs to be
+ * told that we support XVP extensions
+ */
+static bool xvp_proxy_extensions_init(xvp_session *s)
 {
-    int i, n = ntohs(xvp_proxy_encodings.number);
+    int i, n = ntohs(s->encodings.number);
     int e = htonl(XVP_RFB_ENCODING_XVP);
 
     for (i = 0; i < n; i++) {
-	if (xvp_proxy_encodings.encodings[i] == e) {
-	    xvp_proxy_extensions = true;
+	if (s->encodings.encodings[i] == e) {
+	    s->extensions = true;
 	    xvp_log(XVP_LOG_DEBUG, "Client supports XVP extensions to RFB");
 	    break;
 	}
     }
 
-    if (!xvp_proxy_extensions || xvp_vm_is_host)
-	return true;
+    return s->extensions && !xvp_xenapi_vm_is_host(s->xenapi);
+}
+
+static bool xvp_proxy_extensions_version(int version)
+{
+    if (version != XVP_RFB_MESSAGE_VERSION &&
+	version != XVP_RFB_MESSAGE_VERSION_TASKS) {
+	xvp_log(XVP_LOG_ERROR, "Unrecognised client XVP extension version %d",
+		version);
+	return false;
+    }
 
-    return xvp_proxy_client_update(sock, XVP_MESSAGE_CODE_INIT);
+    return true;
 }
 
+/*
+ * In a session process, start the client's VM operation, and follow it
+ * to the end, telling the client how it goes if it wants to know
+ */
 static void *xvp_proxy_message_code_handler(void *arg)
 {
     xvp_proxy_code *pc = (xvp_proxy_code *)arg;
+    xvp_session *s = pc->session;
+    int code = pc->message_code, percent = -1, last = -1;
+    bool tasks = pc->tasks;
+
+    xvp_free(pc);
+
+    if (xvp_xenapi_task_start(s->xenapi, code)) {
+	while ((percent = xvp_xenapi_task_wait(s->xenapi)) >= 0 &&
+	       percent < 100) {
+	    if (tasks && percent != last)
+		xvp_proxy_queue_update(s, XVP_MESSAGE_CODE_PROGRESS, percent);
+	    last = percent;
+	}
+    }
+
+    if (percent < 0)
+	xvp_proxy_queue_update(s, XVP_MESSAGE_CODE_FAIL, 0);
+    else if (tasks)
+	xvp_proxy_queue_update(s, code, 0);
 
-    if (!xvp_xenapi_handle_message_code(pc->message_code))
-	(void)xvp_proxy_client_update(pc->client_sock, XVP_MESSAGE_CODE_FAIL);
+    return NULL;
 }
 
-static bool xvp_proxy_handle_extensions(int sock, int version, int code)
+static bool xvp_proxy_handle_extensions(xvp_session *s, int version, int code)
 {
     pthread_t pt;
-    static xvp_proxy_code pc;
-    bool ha;
-
-    pc.client_sock = sock;
-    pc.message_code = code;
+    xvp_proxy_code *pc;
 
-    if (version != XVP_RFB_MESSAGE_VERSION) {
-	xvp_log(XVP_LOG_ERROR, "Unrecognised client XVP extension version %d",
-		version);
+    if (!xvp_proxy_extensions_version(version))
 	return false;
-    }
 
-    if (pthread_create(&pt, NULL, xvp_proxy_message_code_handler, &pc) != 0)
+    pc = xvp_alloc(sizeof(xvp_proxy_code));
+    pc->session = s;
+    pc->message_code = code;
+    pc->tasks = (version == XVP_RFB_MESSAGE_VERSION_TASKS);
+
+    if (pthread_create(&pt, NULL, xvp_proxy_message_code_handler, pc) != 0)
 	xvp_log_errno(XVP_LOG_FATAL, "pthread_create");
+    pthread_detach(pt);
 
     return true;
 }
 
-static bool xvp_proxy_handle_cut_text(SSL *server_handle, char *text, int len)
+/*
+ * Size of a client message of the given type if fixed, or of its fixed
+ * part if not, or zero if the type is not recognised
+ */
+static int xvp_proxy_client_length(U8 type)
+{
+    switch (type) {
+    case XVP_RFB_MESSAGE_TYPE_SET_PIXEL_FORMAT:
+	return 20;
+    case XVP_RFB_MESSAGE_TYPE_SET_ENCODINGS:
+	return 4; /* +4 for each encoding */
+    case XVP_RFB_MESSAGE_TYPE_FB_UPDATE_REQUEST:
+	return 10;
+    case XVP_RFB_MESSAGE_TYPE_KEY_EVENT:
+	return 8;
+    case XVP_RFB_MESSAGE_TYPE_POINTER_EVENT:
+	return 6;
+    case XVP_RFB_MESSAGE_TYPE_CLIENT_CUT_TEXT:
+	return 8; /* + length */
+    case XVP_RFB_MESSAGE_TYPE_XVP:
+	return 4;
+    default:
+	return 0;
+    }
+}
+
+static void xvp_proxy_key_event(xvp_rfb_key_event *event, U32 key, U8 down)
 {
-    int i, c, flag;
+    event->message_type = XVP_RFB_MESSAGE_TYPE_KEY_EVENT;
+    event->down_flag = down;
+    event->padding1[0] = event->padding1[1] = 0;
+    event->key = htonl(key);
+}
 
+/*
+ * Convert one byte of cut text to KeyEvent messages in buf, which must
+ * have room for four of them, returning the number of bytes used
+ */
+static int xvp_proxy_cut_text_keys(int c, char *buf)
+{
     /*
      * As XenServer consoles ignore RFB ClientCutText messages,
      * convert to a sequence of down/up KeyEvent messages.
@@ -425,193 +909,585 @@ static bool xvp_proxy_handle_cut_text(SSL *server_handle, char *text, int len)
      */
 
     static char *shiftsyms = "~!@#$%^&*()_+|{}:\"<>?";
-    bool shifted;
-
-    xvp_proxy_key_event.message_type = XVP_RFB_MESSAGE_TYPE_KEY_EVENT;
-    for (i = 0; i < len; i++) {
-	c = *((unsigned char *)text + i);
-	shifted = false;
-	if (c == '\n')
-	    c = 0xff0d;
-	else if (c < 0x20)
-	    continue;
-	else if ((c >= 'A' && c <= 'Z') || strchr(shiftsyms, c) != NULL)
-	    shifted = true;
-
-	if (xvp_verbose && xvp_tracing) {
-	    xvp_log(XVP_LOG_DEBUG, "ClientCutText %s%c 0x%02x",
-		    shifted ? "Shift " : "", c, c);
-	}
-
-	if (shifted) {
-	    xvp_proxy_key_event.key = htonl(0xffe1);
-	    xvp_proxy_key_event.down_flag = 1;
-	    if (SSL_write(server_handle, &xvp_proxy_key_event, 8) != 8)
-		return false;
-	}
-	xvp_proxy_key_event.key = htonl(c);
-	for (flag = 1; flag >= 0; flag--) {
-	    xvp_proxy_key_event.down_flag = flag;
-	    if (SSL_write(server_handle, &xvp_proxy_key_event, 8) != 8)
-		return false;
-	}
-	if (shifted) {
-	    xvp_proxy_key_event.key = htonl(0xffe1);
-	    xvp_proxy_key_event.down_flag = 0;
-	    if (SSL_write(server_handle, &xvp_proxy_key_event, 8) != 8)
-		return false;
-	}
+    xvp_rfb_key_event *event = (xvp_rfb_key_event *)buf;
+    bool shifted = false;
+
+    if (c == '\n')
+	c = 0xff0d;
+    else if (c < 0x20)
+	return 0;
+    else if ((c >= 'A' && c <= 'Z') || strchr(shiftsyms, c) != NULL)
+	shifted = true;
+
+    if (xvp_verbose && xvp_tracing) {
+	xvp_log(XVP_LOG_DEBUG, "ClientCutText %s%c 0x%02x",
+		shifted ? "Shift " : "", c, c);
     }
 
-    return true;
+    if (shifted)
+	xvp_proxy_key_event(event++, 0xffe1, 1);
+    xvp_proxy_key_event(event++, c, 1);
+    xvp_proxy_key_event(event++, c, 0);
+    if (shifted)
+	xvp_proxy_key_event(event++, 0xffe1, 0);
+
+    return (char *)event - buf;
 }
 
-static void *xvp_proxy_writer(void *arg)
+/*
+ * Buffers start at XVP_PROXY_BUF_SIZE, and the one relaying console
+ * output to the client doubles, up to XVP_PROXY_BUF_MAX, whenever the
+ * client keeps up with it, so more is moved with each system call.
+ * It shrinks back once the session has been quiet a while.
+ */
+static void xvp_proxy_buf_init(xvp_proxy_buf *b)
 {
-    xvp_proxy_handles *ph = (xvp_proxy_handles *)arg;
-    char buf[XVP_PROXY_BUF_SIZE];
-    int len, expected, sig = SIGQUIT;
-    U8 type;
-
-    while (true) {
-	/*
-	 * don't read sizeof(buf) as could get multiple messages in 1 call:
-	 * just read 1st byte (message type) and then take it from there
-	 */
-	if ((len = read(ph->client_sock, buf, 1)) <= 0)
-	    break;
-
-	type = buf[0];
-
-	/*
-	 * Set expected byte length to size of message (if fixed) or
-	 * size of fixed part, and ensure have this so can parse
-	 */
-	switch (type) {
-	case XVP_RFB_MESSAGE_TYPE_SET_PIXEL_FORMAT:
-	    expected = 20;
-	    break;
-	case XVP_RFB_MESSAGE_TYPE_SET_ENCODINGS:
-	    expected = 4; /* +4 for each encoding */
-	    break;
-	case XVP_RFB_MESSAGE_TYPE_FB_UPDATE_REQUEST:
-	    expected = 10;
-	    break;
-	case XVP_RFB_MESSAGE_TYPE_KEY_EVENT:
-	    expected = 8;
-	    break;
-	case XVP_RFB_MESSAGE_TYPE_POINTER_EVENT:
-	    expected = 6;
-	    break;
-	case XVP_RFB_MESSAGE_TYPE_CLIENT_CUT_TEXT:
-	    expected = 8; /* + length */
-	    break;
-	case XVP_RFB_MESSAGE_TYPE_XVP:
-	    expected = 4;
-	    break;
-	default:
-	    expected = 0;
-	    break;
-	}
-
-	if (expected > len) {
-	    if (!xvp_read_all(ph->client_sock, buf + len, expected - len))
-		break;
-	    len = expected;
-	}
-
-	if (expected == 0) {
-	    xvp_log(XVP_LOG_ERROR, "Unrecognised client message type %d",
-		    buf[0]);
-	    break;
-	}
-
-	if (type == XVP_RFB_MESSAGE_TYPE_SET_PIXEL_FORMAT) {
-
-	    /* save pixel format for use in re-init */
-	    memcpy(&xvp_proxy_pixel_format, buf, sizeof(xvp_proxy_pixel_format));
-
-	} else if (type == XVP_RFB_MESSAGE_TYPE_SET_ENCODINGS) {
-
-	    bool seen = (xvp_proxy_encodings.message_type != 0xff);
-	    memcpy(&xvp_proxy_encodings, buf, len);
-	    expected += ntohs(xvp_proxy_encodings.number) * sizeof(S32);
-	    if (expected > len) {
-		if (!xvp_read_all(ph->client_sock, buf + len, expected - len))
-		    break;
-		len = expected;
-		memcpy(&xvp_proxy_encodings, buf, len);
-	    }
-	    if (!seen && !xvp_proxy_extensions_init(ph->client_sock))
-		break;
-
-	} else if (type == XVP_RFB_MESSAGE_TYPE_CLIENT_CUT_TEXT) {
-
-	    memcpy(&xvp_proxy_cut_text, buf, len);
-	    expected += ntohl(xvp_proxy_cut_text.text_length);
-	    if (expected > len) {
-		if (!xvp_read_all(ph->client_sock, buf + len, expected - len))
-		    break;
-		len = expected;
-	    }
-	    if (!xvp_proxy_handle_cut_text(ph->server_handle, buf + 8, len - 8))
-		break;
-	    continue;
+    b->off = b->len = 0;
+    b->size = XVP_PROXY_BUF_SIZE;
+    b->data = xvp_alloc(b->size);
+}
 
-	} else if (type == XVP_RFB_MESSAGE_TYPE_XVP) {
+static void xvp_proxy_buf_free(xvp_proxy_buf *b)
+{
+    xvp_free(b->data);
+    b->data = NULL;
+}
 
-	    xvp_proxy_code_message *cm = (xvp_proxy_code_message *)buf;
-	    if (!xvp_proxy_handle_extensions(ph->client_sock, cm->version, cm->code))
-		break;
-	    continue;
-	}
+static int xvp_proxy_buf_used(xvp_proxy_buf *b)
+{
+    return b->len - b->off;
+}
 
-	if (xvp_verbose && xvp_tracing)
-	    xvp_proxy_trace_client(buf, len, false);
+static bool xvp_proxy_buf_full(xvp_proxy_buf *b)
+{
+    return xvp_proxy_buf_used(b) >= b->size;
+}
 
-	if (SSL_write(ph->server_handle, buf, len) != len)
-	    return NULL;
+/*
+ * Return room at the end of the buffer, having moved unconsumed data
+ * to the start
+ */
+static int xvp_proxy_buf_room(xvp_proxy_buf *b)
+{
+    if (b->off > 0) {
+	memmove(b->data, b->data + b->off, b->len - b->off);
+	b->len -= b->off;
+	b->off = 0;
     }
 
-    if (write(xvp_child_sigpipe[1], &sig, sizeof(sig)) != sizeof(sig))
-	exit(1);
-
-    return NULL;
+    return b->size - b->len;
 }
 
-static void *xvp_proxy_reader(void *arg)
+static char *xvp_proxy_buf_space(xvp_proxy_buf *b, int len)
 {
-    xvp_proxy_handles *ph = (xvp_proxy_handles *)arg;
-    char buf[XVP_PROXY_BUF_SIZE];
-    int len, sig = SIGQUIT;
-    static int incarnation = 0;
+    if (b->len + len > b->size &&
+	xvp_proxy_buf_room(b) < len)
+	return NULL;
 
-    while (true) {
-	if ((len = SSL_read(ph->server_handle, buf, sizeof(buf))) <= 0)
-	    return NULL;
+    return b->data + b->len;
+}
 
-	if (xvp_verbose && xvp_tracing)
-	    xvp_proxy_trace_server(buf, len);
+static bool xvp_proxy_buf_put(xvp_proxy_buf *b, void *data, int len)
+{
+    char *space;
 
-	if (!xvp_write_all(ph->client_sock, buf, len))
-	    break;
-    }
+    if (!(space = xvp_proxy_buf_space(b, len)))
+	return false;
 
-    if (write(xvp_child_sigpipe[1], &sig, sizeof(sig)) != sizeof(sig))
-	exit(1);
+    memcpy(space, data, len);
+    b->len += len;
+    return true;
+}
 
-    return NULL;
+static void xvp_proxy_buf_consume(xvp_proxy_buf *b, int len)
+{
+    if ((b->off += len) == b->len)
+	b->off = b->len = 0;
 }
 
-static bool xvp_proxy_ssl_read(SSL *ssl, void *buf, int len)
+static void xvp_proxy_buf_resize(xvp_proxy_buf *b, int size)
 {
-    int res = SSL_read(ssl, buf, len);
+    char *data = xvp_alloc(size);
+
+    memcpy(data, b->data + b->off, xvp_proxy_buf_used(b));
+    xvp_free(b->data);
+    b->data = data;
+    b->len -= b->off;
+    b->off = 0;
+    b->size = size;
+}
 
-    if (res != len) {
-	xvp_log(XVP_LOG_ERROR, "SSL read: Error %d",
-		SSL_get_error(ssl, res));
+static bool xvp_proxy_buf_grow(xvp_proxy_buf *b)
+{
+    if (b->size >= XVP_PROXY_BUF_MAX)
 	return false;
-    }
+
+    xvp_proxy_buf_resize(b, b->size * 2);
+    return true;
+}
+
+static bool xvp_proxy_buf_shrink(xvp_proxy_buf *b)
+{
+    if (xvp_proxy_buf_used(b) > XVP_PROXY_BUF_SIZE)
+	return false;
+
+    if (b->size > XVP_PROXY_BUF_SIZE)
+	xvp_proxy_buf_resize(b, XVP_PROXY_BUF_SIZE);
+    return true;
+}
+
+/*
+ * An incremental FramebufferUpdateRequest is taken to be answered once a
+ * FramebufferUpdate ends, which may be answering something earlier, in
+ * which case we merely pass on more than we need to.  If we've lost
+ * track of the console's messages, or aren't following them, we take
+ * anything the console sends to be the start of the answer.
+ */
+static bool xvp_proxy_update_answered(xvp_session *s)
+{
+    bool answered;
+
+    pthread_mutex_lock(&xvp_proxy_frame_lock);
+    answered = s->frame.off ? s->reads != s->asked_reads :
+	s->frame.updates != s->asked_updates;
+    pthread_mutex_unlock(&xvp_proxy_frame_lock);
+
+    return answered;
+}
+
+/*
+ * Until then, another request for no more than the same area is redundant
+ */
+static bool xvp_proxy_update_redundant(xvp_session *s,
+				       xvp_rfb_fb_update_request *req)
+{
+    xvp_rfb_fb_update_request *area = &s->asked;
+
+    return s->asking && !xvp_proxy_update_answered(s) &&
+	ntohs(req->x_position) >= ntohs(area->x_position) &&
+	ntohs(req->y_position) >= ntohs(area->y_position) &&
+	ntohs(req->x_position) + ntohs(req->width) <=
+	ntohs(area->x_position) + ntohs(area->width) &&
+	ntohs(req->y_position) + ntohs(req->height) <=
+	ntohs(area->y_position) + ntohs(area->height);
+}
+
+static void xvp_proxy_update_sent(xvp_session *s,
+				  xvp_rfb_fb_update_request *req)
+{
+    memcpy(&s->asked, req, sizeof(s->asked));
+    s->asking = true;
+    s->forwarded++;
+    pthread_mutex_lock(&xvp_proxy_frame_lock);
+    s->asked_reads = s->reads;
+    s->asked_updates = s->frame.updates;
+    pthread_mutex_unlock(&xvp_proxy_frame_lock);
+    s->asked_when = xvp_engine_now();
+}
+
+/*
+ * Extend the held request to cover another one's area as well
+ */
+static void xvp_proxy_update_merge(xvp_session *s,
+				   xvp_rfb_fb_update_request *req)
+{
+    xvp_rfb_fb_update_request *held = &s->held;
+    int x, y, right, bottom;
+
+    x = MIN(ntohs(held->x_position), ntohs(req->x_position));
+    y = MIN(ntohs(held->y_position), ntohs(req->y_position));
+    right = MAX(ntohs(held->x_position) + ntohs(held->width),
+		ntohs(req->x_position) + ntohs(req->width));
+    bottom = MAX(ntohs(held->y_position) + ntohs(held->height),
+		 ntohs(req->y_position) + ntohs(req->height));
+
+    held->x_position = htons(x);
+    held->y_position = htons(y);
+    held->width = htons(right - x);
+    held->height = htons(bottom - y);
+}
+
+/*
+ * Milliseconds until the held request may be sent, or the next pasted
+ * character typed, whichever is sooner, or -1 if neither is waiting,
+ * or if what's due is only waiting for the console to take what's
+ * already queued for it
+ */
+static int xvp_proxy_pace_wait(xvp_session *s)
+{
+    long long now = xvp_engine_now(), when = -1;
+
+    if (s->holding)
+	when = s->asked_when +
+	    (s->vm->framerate > 0 ? 1000 / s->vm->framerate : 0);
+
+    if (xvp_proxy_buf_used(&s->paste) > 0 &&
+	(when < 0 || s->paste_when < when))
+	when = s->paste_when;
+
+    if (when < 0 || (when <= now && xvp_proxy_buf_used(&s->up) > 0))
+	return -1;
+
+    return when > now ? (int)(when - now) : 0;
+}
+
+/*
+ * Whether to send a FramebufferUpdateRequest from the client on to the
+ * console: not if incremental and redundant, nor if sooner after the
+ * last than the VM's maximum frame rate allows, in which case it's held
+ * for xvp_proxy_release_update(), covering any more that come meanwhile
+ */
+static bool xvp_proxy_update_request(xvp_session *s,
+				     xvp_rfb_fb_update_request *req)
+{
+    if (!req->incremental) {
+	s->forwarded++;
+	return true;
+    }
+
+    s->requests++;
+
+    if (xvp_proxy_update_redundant(s, req)) {
+	s->dropped++;
+	return false;
+    }
+
+    if (s->holding) {
+	xvp_proxy_update_merge(s, req);
+	s->dropped++;
+	return false;
+    }
+
+    if (s->asking && s->vm->framerate > 0 &&
+	xvp_engine_now() < s->asked_when + 1000 / s->vm->framerate) {
+	memcpy(&s->held, req, sizeof(s->held));
+	s->holding = true;
+	return false;
+    }
+
+    xvp_proxy_update_sent(s, req);
+    return true;
+}
+
+/*
+ * Queue the held request for the console, once its time has come,
+ * unless an answer to another is still awaited, making it redundant
+ */
+static void xvp_proxy_release_update(xvp_session *s)
+{
+    if (!s->holding || xvp_engine_now() < s->asked_when +
+	(s->vm->framerate > 0 ? 1000 / s->vm->framerate : 0) ||
+	!xvp_proxy_buf_space(&s->up, sizeof(s->held)))
+	return;
+
+    s->holding = false;
+    if (xvp_proxy_update_redundant(s, &s->held)) {
+	s->dropped++;
+	return;
+    }
+
+    xvp_proxy_update_sent(s, &s->held);
+    xvp_proxy_trace_client(&s->held, sizeof(s->held), true);
+    (void)xvp_proxy_buf_put(&s->up, &s->held, sizeof(s->held));
+    s->up_pointer = false;
+}
+
+/*
+ * Type pasted text into the console, as far as there's room to queue
+ * the key events, and the pool's paste rate allows
+ */
+static void xvp_proxy_release_paste(xvp_session *s)
+{
+    int rate = s->vm->pool ? s->vm->pool->pasterate : 0;
+    long long now = xvp_engine_now();
+    char *keys;
+
+    if (s->paste_when < now)
+	s->paste_when = now;
+
+    while (xvp_proxy_buf_used(&s->paste) > 0 &&
+	   (rate == 0 || s->paste_when <= now)) {
+	if (!(keys = xvp_proxy_buf_space(&s->up,
+					 4 * sizeof(xvp_rfb_key_event))))
+	    break;
+	s->up.len += xvp_proxy_cut_text_keys(
+	    *(unsigned char *)(s->paste.data + s->paste.off), keys);
+	s->up_pointer = false;
+	xvp_proxy_buf_consume(&s->paste, 1);
+	s->pasted++;
+	if (rate > 0)
+	    s->paste_when += 1000 / rate;
+    }
+
+    /* give back what a long paste grew the buffer to */
+    if (xvp_proxy_buf_used(&s->paste) == 0 && s->paste.data)
+	(void)xvp_proxy_buf_shrink(&s->paste);
+}
+
+static bool xvp_proxy_parse(xvp_session *s);
+static xvp_proxy_warm *xvp_proxy_warm_find(xvp_vm *vm);
+
+/*
+ * Read whatever the client has sent, and pass on all the complete
+ * messages in it with a single SSL_write(), so in one TLS record rather
+ * than one per message, keeping any partial message for next time.
+ * Rather than block writing while the console isn't taking input, we
+ * keep reading, so pointer movements can be merged meanwhile, and we
+ * wake up to send whatever is being paced.
+ */
+static void *xvp_proxy_writer(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+    struct pollfd pfd[2];
+    int len, room, wait, sig = SIGQUIT;
+
+    pfd[0].fd = s->client_sock;
+    pfd[1].events = POLLOUT;
+
+    while (true) {
+
+	if (!xvp_proxy_parse(s))
+	    goto client_gone;
+
+	wait = xvp_proxy_pace_wait(s);
+	room = xvp_proxy_buf_room(&s->in);
+	if ((len = xvp_proxy_buf_used(&s->up)) > 0 || wait >= 0 || room == 0) {
+	    /* no room to read means waiting for the console regardless */
+	    pfd[0].events = room > 0 ? POLLIN : 0;
+	    pfd[1].fd = len > 0 ? SSL_get_fd(s->ssl) : -1;
+	    if (poll(pfd, 2, wait) < 0) {
+		if (errno == EINTR)
+		    continue;
+		goto client_gone;
+	    }
+	    if (pfd[1].revents) {
+		if (SSL_write(s->ssl, s->up.data + s->up.off, len) != len)
+		    return NULL;
+		xvp_proxy_buf_consume(&s->up, len);
+		continue;
+	    }
+	    if (!pfd[0].revents)
+		continue;
+	    if (room == 0) /* so hung up, or in error */
+		goto client_gone;
+	}
+
+	if ((len = read(s->client_sock, s->in.data + s->in.len, room)) <= 0)
+	    break;
+	s->in.len += len;
+    }
+
+ client_gone:
+
+    if (write(xvp_child_sigpipe[1], &sig, sizeof(sig)) != sizeof(sig))
+	exit(1);
+
+    return NULL;
+}
+
+/*
+ * Called once connected to the console, to see whether its output can
+ * be spliced, which it can't be if we're to trace it
+ */
+static void xvp_proxy_splice_init(xvp_session *s)
+{
+    int flags = O_CLOEXEC | (xvp_proxy_engine ? O_NONBLOCK : 0);
+
+    s->ktls = !(xvp_verbose && xvp_tracing) && xvp_xenapi_stream_ktls(s->ssl);
+    if (!s->ktls || s->pipe[0] >= 0)
+	return;
+
+    if (pipe2(s->pipe, flags) != 0) {
+	xvp_log_errno(XVP_LOG_ERROR, "pipe2");
+	s->pipe[0] = s->pipe[1] = -1;
+	s->ktls = false;
+	return;
+    }
+
+    xvp_log(XVP_LOG_DEBUG, "Console output decrypted by kernel, splicing");
+}
+
+static void xvp_proxy_splice_close(xvp_session *s)
+{
+    if (s->pipe[0] < 0)
+	return;
+
+    close(s->pipe[0]);
+    close(s->pipe[1]);
+    s->pipe[0] = s->pipe[1] = -1;
+}
+
+/*
+ * Splice console output into the pipe, returning the number of bytes,
+ * 0 at end of file, or -1 with errno set, EINVAL or EIO meaning a TLS
+ * control record is next, for SSL_read() to deal with
+ */
+static int xvp_proxy_splice_in(xvp_session *s, int len, unsigned int flags)
+{
+    int res;
+
+    while ((res = splice(SSL_get_fd(s->ssl), NULL, s->pipe[1], NULL, len,
+			 SPLICE_F_MOVE | flags)) < 0 && errno == EINTR)
+	/* empty */;
+
+    if (res > 0) {
+	s->relayed += res;
+	s->spliced += res;
+	s->reads++;
+    }
+
+    return res;
+}
+
+/*
+ * Send the client what we got from the console, from the reader, as the
+ * only thread writing to it once proxying, with its queued XVP messages
+ * where the last complete console message ends, if they can go yet
+ */
+static bool xvp_proxy_relay_write(xvp_session *s, char *data, int len)
+{
+    char buf[XVP_PROXY_UPDATES_LEN];
+    int n, since, at = len;
+
+    if ((n = xvp_proxy_take_updates(s, buf, len, &since)) > 0) {
+	at = len - since;
+	if (!xvp_write_all(s->client_sock, data, at) ||
+	    !xvp_write_all(s->client_sock, buf, n))
+	    return false;
+	data += at;
+	len -= at;
+    }
+
+    return len == 0 || xvp_write_all(s->client_sock, data, len);
+}
+
+/*
+ * Relay what the console has ready, returning 1 to carry on, 0 once the
+ * console connection is closed, or -1 if the client has gone.  Without
+ * splicing, we read all SSL already holds, and whatever else has arrived,
+ * as far as the buffer allows, to write it to the client in one go,
+ * with any XVP messages queued meanwhile where a console message ends.
+ * Splicing is limited to what we needn't see to follow the messages.
+ */
+static int xvp_proxy_relay(xvp_session *s, xvp_proxy_buf *buf)
+{
+    struct pollfd pfd[2];
+    char junk[64];
+    int len, res, wait;
+
+    if (!xvp_proxy_relay_write(s, NULL, 0))
+	return -1;
+
+    pfd[0].fd = SSL_get_fd(s->ssl);
+    pfd[0].events = POLLIN;
+    pfd[1].fd = s->wake[0];
+    pfd[1].events = POLLIN;
+
+    /*
+     * Wait for the console, or for XVP messages to send, and once quiet
+     * for a while, give back what the buffer grew to
+     */
+    if (SSL_pending(s->ssl) == 0) {
+	wait = (buf->size > XVP_PROXY_BUF_SIZE) ?
+	    XVP_PROXY_BUF_IDLE * 1000 : -1;
+	while ((res = poll(pfd, 2, wait)) <= 0) {
+	    if (res == 0) {
+		(void)xvp_proxy_buf_shrink(buf);
+		wait = -1;
+	    } else if (errno != EINTR) {
+		return 0;
+	    }
+	}
+	if (pfd[1].revents) {
+	    (void)read(s->wake[0], junk, sizeof(junk));
+	    if (!pfd[0].revents)
+		return 1;
+	}
+    }
+
+    if (s->ktls && SSL_pending(s->ssl) == 0 &&
+	(len = xvp_proxy_frame_unseen(s, XVP_PROXY_SPLICE_SIZE)) > 0) {
+	if ((len = xvp_proxy_splice_in(s, len, 0)) == 0)
+	    return 0;
+	if (len < 0 && errno != EINVAL && errno != EIO)
+	    return 0;
+	if (len > 0)
+	    xvp_proxy_frame_feed(s, NULL, len);
+	while (len > 0) {
+	    res = splice(s->pipe[0], NULL, s->client_sock, NULL, len,
+			 SPLICE_F_MOVE);
+	    if (res > 0) {
+		len -= res;
+		s->writes++;
+	    } else if (res == 0 || errno != EINTR) {
+		return -1;
+	    }
+	}
+	if (len == 0)
+	    return 1;
+    }
+
+    /* with splicing, stop where it can take over */
+    do {
+	len = SSL_read(s->ssl, buf->data + buf->len, xvp_proxy_buf_room(buf));
+	if (len <= 0)
+	    return 0;
+	if (xvp_verbose && xvp_tracing)
+	    xvp_proxy_trace_server(buf->data + buf->len, len);
+	xvp_proxy_frame_feed(s, buf->data + buf->len, len);
+	buf->len += len;
+	s->relayed += len;
+	s->reads++;
+    } while (!xvp_proxy_buf_full(buf) &&
+	     !(s->ktls && xvp_proxy_frame_unseen(s, 1) > 0) &&
+	     (SSL_pending(s->ssl) > 0 || poll(pfd, 1, 0) > 0));
+
+    s->writes++;
+    if (!xvp_proxy_relay_write(s, buf->data, buf->len))
+	return -1;
+
+    /* the client took all we had, so we could have given it more */
+    if (xvp_proxy_buf_full(buf))
+	(void)xvp_proxy_buf_grow(buf);
+    xvp_proxy_buf_consume(buf, buf->len);
+
+    return 1;
+}
+
+static void xvp_proxy_reader_cleanup(void *arg)
+{
+    xvp_proxy_buf_free((xvp_proxy_buf *)arg);
+}
+
+static void *xvp_proxy_reader(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+    xvp_proxy_buf buf;
+    int res, sig = SIGQUIT;
+
+    xvp_proxy_buf_init(&buf);
+    pthread_cleanup_push(xvp_proxy_reader_cleanup, &buf);
+
+    while ((res = xvp_proxy_relay(s, &buf)) > 0)
+	/* empty */;
+
+    pthread_cleanup_pop(1);
+
+    if (res < 0 && write(xvp_child_sigpipe[1], &sig, sizeof(sig)) != sizeof(sig))
+	exit(1);
+
+    return NULL;
+}
+
+static bool xvp_proxy_ssl_read(SSL *ssl, void *buf, int len)
+{
+    int res = SSL_read(ssl, buf, len);
+
+    if (res != len) {
+	xvp_log(XVP_LOG_ERROR, "SSL read: Error %d",
+		SSL_get_error(ssl, res));
+	return false;
+    }
 
     return true;
 }
@@ -645,92 +1521,113 @@ static bool xvp_proxy_version_known(unsigned int major, unsigned int minor)
 }
 
 /*
- * This is run in a background thread to avoid blocking signal handling
- * or dead client detection.  We signal the main thread when we're done.
+ * Connect to the VM's console and complete the RFB handshake with it,
+ * replaying the client's settings if reconnecting.  This blocks, so is
+ * run from a background thread, or as an event engine job.
  */
-static void *xvp_proxy_server_handshake(void *arg)
+static SSL *xvp_proxy_server_connect(xvp_session *s, bool reinit)
 {
-    xvp_server_info *info = (xvp_server_info *)arg;
     unsigned int major, minor, type, len;
-    int sig;
     char buf[XVP_PROXY_BUF_SIZE];
+    xvp_rfb_fb_update_request fb_request;
     SSL *ssl;
 
-    *info->sslp = NULL;
-
-    if (!(ssl = xvp_xenapi_open_stream(info->vm)))
-	goto end;
+    if (!(ssl = xvp_xenapi_open_stream(s->xenapi, s->vm)))
+	return NULL;
 
     if (!xvp_proxy_ssl_read(ssl, buf, 12))
-	goto end;
+	goto fail;
     buf[12] = '\0';
     if (sscanf(buf, "RFB %03u.%03u\n", &major, &minor) != 2 ||
 	!xvp_proxy_version_known(major, minor)) {
 	xvp_log(XVP_LOG_ERROR, "Unsupported server version: %s", buf);
-	goto end;
+	goto fail;
     }
     sprintf(buf, "RFB %03u.%03u\n", XVP_RFB_MAJOR, XVP_RFB_MINOR_SERVER);
     if (!xvp_proxy_ssl_write(ssl, buf, 12))
-	goto end;
+	goto fail;
 
     if (!xvp_proxy_ssl_read(ssl, &type, sizeof(type)))
-	goto end;
+	goto fail;
     if (ntohl(type) != XVP_RFB_SECURITY_NONE) {
 	xvp_log(XVP_LOG_ERROR, "Unexpected security type: %d", ntohl(type));
-	goto end;
+	goto fail;
     }
-    buf[0] = (info->shared ? 1 : 0);
+    buf[0] = (s->shared ? 1 : 0);
     if (!xvp_proxy_ssl_write(ssl, buf, 1))
-	goto end;
-    if (!xvp_proxy_ssl_read(ssl, &xvp_proxy_server_details,
-			      sizeof(xvp_proxy_server_details)))
-	goto end;
-    len = ntohl(xvp_proxy_server_details.name_length);
-    if (!xvp_proxy_ssl_read(ssl, buf, len))
-	goto end;
-
-    if (info->reinit) {
-
-	if (xvp_proxy_pixel_format.message_type != 0xff) {
-	    len = sizeof(xvp_proxy_pixel_format);
-	    xvp_proxy_trace_client(&xvp_proxy_pixel_format, len, true);
-	    if (!xvp_proxy_ssl_write(ssl, &xvp_proxy_pixel_format, len))
-		goto end;
+	goto fail;
+    if (!xvp_proxy_ssl_read(ssl, &s->server_details,
+			      sizeof(s->server_details)))
+	goto fail;
+    len = ntohl(s->server_details.name_length);
+    if (len >= sizeof(buf) || !xvp_proxy_ssl_read(ssl, buf, len))
+	goto fail;
+
+    if (reinit) {
+
+	if (s->pixel_format.message_type != 0xff) {
+	    len = sizeof(s->pixel_format);
+	    xvp_proxy_trace_client(&s->pixel_format, len, true);
+	    if (!xvp_proxy_ssl_write(ssl, &s->pixel_format, len))
+		goto fail;
 	}
 
-	if (xvp_proxy_encodings.message_type != 0xff) {
-	    len = XVP_PROXY_MAX_ENCODINGS - htons(xvp_proxy_encodings.number);
-	    len = sizeof(xvp_proxy_encodings) - len * sizeof(S32);
-	    xvp_proxy_trace_client(&xvp_proxy_encodings, len, true);
-	    if (!xvp_proxy_ssl_write(ssl, &xvp_proxy_encodings, len))
-	    goto end;
+	if (s->encodings.message_type != 0xff) {
+	    len = XVP_PROXY_MAX_ENCODINGS - htons(s->encodings.number);
+	    len = sizeof(s->encodings) - len * sizeof(S32);
+	    xvp_proxy_trace_client(&s->encodings, len, true);
+	    if (!xvp_proxy_ssl_write(ssl, &s->encodings, len))
+		goto fail;
 	}
 
-	xvp_proxy_fb_request.message_type = 3;
-	xvp_proxy_fb_request.incremental = 0;
-	xvp_proxy_fb_request.x_position = 0;
-	xvp_proxy_fb_request.y_position = 0;
-	xvp_proxy_fb_request.width = xvp_proxy_server_details.fb_width;
-	xvp_proxy_fb_request.height = xvp_proxy_server_details.fb_height;
-
-	len = sizeof(xvp_proxy_fb_request);
-	xvp_proxy_trace_client(&xvp_proxy_fb_request, len, true);
-	if (!xvp_proxy_ssl_write(ssl, &xvp_proxy_fb_request, len))
-	    goto end;
+	fb_request.message_type = 3;
+	fb_request.incremental = 0;
+	fb_request.x_position = 0;
+	fb_request.y_position = 0;
+	fb_request.width = s->server_details.fb_width;
+	fb_request.height = s->server_details.fb_height;
+
+	len = sizeof(fb_request);
+	xvp_proxy_trace_client(&fb_request, len, true);
+	if (!xvp_proxy_ssl_write(ssl, &fb_request, len))
+	    goto fail;
     }
 
-    *info->sslp = ssl;
-
     xvp_log(XVP_LOG_DEBUG, "Server handshake successful");
+    return ssl;
 
- end:
+ fail:
 
-    sig = SIGCHLD;
-    if (write(xvp_child_sigpipe[1], &sig, sizeof(sig)) != sizeof(sig))
-	exit(1);
+    xvp_xenapi_close_stream(ssl);
+    return NULL;
+}
 
-    if (!*info->sslp || !xvp_xenapi_event_wait(info->vm))
-	return NULL;
+/*
+ * ServerInit message for the client, with the server's details but
+ * our own choice of desktop name
+ */
+static int xvp_proxy_server_init_message(xvp_session *s, char *buf)
+{
+    int size = sizeof(s->server_details), len;
+
+    sprintf(buf + size, "VM Console - %s", s->vm->vmname);
+    len = strlen(buf + size);
+    s->server_details.name_length = htonl(len);
+    memcpy(buf, &s->server_details, size);
+
+    return size + len;
+}
+
+/*
+ * Wait for the console to go, and then have the main thread end the
+ * session, or reconnect, as set by xvp_reconnect_delay
+ */
+static void xvp_proxy_server_watch(xvp_session *s)
+{
+    int sig;
+
+    if (!xvp_xenapi_event_wait(s->xenapi, s->vm))
+	return;
 
     xvp_log(XVP_LOG_INFO, "Lost connection to console");
     pthread_cancel(xvp_proxy_writer_thread);
@@ -748,110 +1645,263 @@ static void *xvp_proxy_server_handshake(void *arg)
 
     if (write(xvp_child_sigpipe[1], &sig, sizeof(sig)) != sizeof(sig))
 	exit(1);
+}
+
+/*
+ * This is run in a background thread to avoid blocking signal handling
+ * or dead client detection.  We signal the main thread when we're done.
+ */
+static void *xvp_proxy_server_handshake(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+    int sig;
+
+    s->ssl = xvp_proxy_server_connect(s, s->reinit);
+
+    sig = SIGCHLD;
+    if (write(xvp_child_sigpipe[1], &sig, sizeof(sig)) != sizeof(sig))
+	exit(1);
+
+    if (s->ssl)
+	xvp_proxy_server_watch(s);
+
+    return NULL;
+}
+
+/*
+ * Likewise, but started while the client is still authenticating, and
+ * leaving the console unwatched until the client has it, as until then
+ * there are no reader and writer threads to stop
+ */
+static void *xvp_proxy_server_early(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+    int sig;
+
+    xvp_xenapi_set_early(s->xenapi, s->client_ip);
+    s->ssl = xvp_proxy_server_connect(s, false);
+    xvp_xenapi_set_early(s->xenapi, 0);
+
+    sig = SIGCHLD;
+    if (write(xvp_child_sigpipe[1], &sig, sizeof(sig)) != sizeof(sig))
+	exit(1);
+
+    return NULL;
+}
 
+static void *xvp_proxy_server_watcher(void *arg)
+{
+    xvp_proxy_server_watch((xvp_session *)arg);
     return NULL;
 }
 
-static void xvp_proxy_server_init(xvp_vm *vm, bool shared, bool reinit,
-				  SSL **sslp)
+static void xvp_proxy_thread(void *(*func)(void *), xvp_session *s)
 {
-    static xvp_server_info info;
     pthread_t pt;
 
-    info.shared = shared;
-    info.reinit = reinit;
-    info.vm = vm;
-    info.sslp = sslp;
-    if (pthread_create(&pt, NULL, xvp_proxy_server_handshake, &info) != 0)
+    if (pthread_create(&pt, NULL, func, s) != 0)
 	xvp_log_errno(XVP_LOG_FATAL, "pthread_create"); 
 }
 
-static void xvp_proxy_start_proxying(int client_sock, SSL *server_handle)
+static void xvp_proxy_server_init(xvp_session *s, bool reinit)
+{
+    s->reinit = reinit;
+    xvp_proxy_thread(xvp_proxy_server_handshake, s);
+}
+
+/*
+ * Whether to connect to the console while the client authenticates,
+ * which we only do once we know which VM it wants, if it isn't to have
+ * a ready connection anyway, and if there's a broker, as that limits
+ * how often each client address may have this done.  If the client
+ * fails to authenticate, the connection is simply dropped with it.
+ * XenServer ignores the client's shared flag, so we needn't wait for it.
+ */
+static bool xvp_proxy_early_wanted(xvp_session *s, bool wrongvm)
+{
+    return !s->early && xvp_broker_pid && !wrongvm &&
+	s->vm != xvp_multiplex_vm && !xvp_proxy_warm_find(s->vm);
+}
+
+static void xvp_proxy_start_proxying(xvp_session *s)
 {
-    static xvp_proxy_handles ph;
+    if (!s->in.data) {
+	xvp_proxy_buf_init(&s->in);
+	xvp_proxy_buf_init(&s->up);
+    }
+    s->up.off = s->up.len = 0; /* anything for a lost console connection */
+    s->up_held = 0;
+    s->asking = false;
 
-    ph.client_sock = client_sock;
-    ph.server_handle = server_handle;
+    if (s->wake[0] < 0 && pipe2(s->wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+	xvp_log_errno(XVP_LOG_ERROR, "pipe2");
+	s->wake[0] = s->wake[1] = -1;
+    }
 
+    xvp_proxy_frame_init(s);
+    xvp_proxy_splice_init(s);
     xvp_log(XVP_LOG_DEBUG, "Starting reader-writer threads\n");
 
     if (pthread_create(&xvp_proxy_writer_thread,
-		       NULL, xvp_proxy_writer, &ph) != 0 ||
+		       NULL, xvp_proxy_writer, s) != 0 ||
 	pthread_create(&xvp_proxy_reader_thread,
-		       NULL, xvp_proxy_reader, &ph) != 0)
+		       NULL, xvp_proxy_reader, s) != 0)
 	xvp_log_errno(XVP_LOG_FATAL, "pthread_create"); 
 }
 
-static int xvp_proxy_mainloop(xvp_vm *vm, int client_sock, unsigned int client_ip)
-{
-    int sigpipe, nfds, nready, i, len, size;
-    fd_set read_fds, write_fds;
-    unsigned int major, minor, type, res, challenge[4], response[4];
-    unsigned char *user_target;
-    bool authok, shared, wrongvm;
-    SSL *ssl;
-    char buf[XVP_PROXY_BUF_SIZE];
+/*
+ * XVP authentication extension to RFB, client sends:
+ *
+ *   U8 user-length
+ *   U8 target-length
+ *   U8 array user-string
+ *   U8 array target-string  ( [pool:]vm)
+ *
+ * and then we proceed as in VNC authentication.  Given these in buf,
+ * select the VM, returning false if the client can't have it.
+ */
+static bool xvp_proxy_select_vm(xvp_session *s, char *buf)
+{
+    unsigned char *user_target = (unsigned char *)buf;
+    char text[512], *target, *vmname, *username;
+    int len = user_target[0] + user_target[1];
     xvp_pool *pool;
-    char *target, *vmname, *username;
     xvp_vm *real_vm;
+    bool ok = true;
+
+    memcpy(text, buf + 2, len);
+    text[len] = '\0';
+    target = xvp_strdup(text + user_target[0]);
+    text[user_target[0]] = '\0';
+    username = text;
+    xvp_log(XVP_LOG_INFO, "XVP auth credentials %s@%s", username, target);
+
+    if ((vmname = strchr(target, ':'))) {
+	*vmname++ = '\0';
+	if (!(pool = xvp_config_pool_by_name(target))) {
+	    xvp_free(target);
+	    return false;
+	}
+    } else {
+	vmname = target;
+	pool = NULL;
+    }
+
+    /*
+     * If client connected to multiplex port, only now do we now
+     * which VM it actually wants to connect to.  If it didn't
+     * tell us which one, just let things drop through and fail
+     * at challenge/response.  If not connected to multiplex
+     * port, but target specified, it had better match.
+     */
+
+    if (xvp_xenapi_is_uuid(vmname))
+	real_vm = xvp_config_vm_by_uuid(pool, vmname);
+    else
+	real_vm = xvp_config_vm_by_name(pool, vmname);
+
+    if (s->vm == xvp_multiplex_vm) {
+	if (real_vm) {
+	    xvp_proxy_set_name(s, real_vm);
+	    xvp_log(XVP_LOG_INFO,
+		    "Multiplexer selecting VM %s in pool %s",
+		    real_vm->vmname, real_vm->pool->poolname);
+	} else {
+	    ok = false;
+	}
+    } else if ((pool || *vmname) && s->vm != real_vm) {
+	ok = false;
+    }
+
+    xvp_free(target);
+    return ok;
+}
+
+static void xvp_proxy_challenge(unsigned int *challenge)
+{
+    static bool seeded = false;
+    int i;
+
+    if (!seeded) {
+	srandom((unsigned int)(time(NULL) ^ 0xdf214a30));
+	seeded = true;
+    }
+
+    for (i = 0; i < 4; i++) {
+	challenge[i] = (random() ^ 0x51a488ce);
+    }
+}
+
+static int xvp_proxy_mainloop(xvp_session *s)
+{
+    int sigpipe, nready, len, size;
+    struct pollfd pfds[2];
+    bool sigready, readable, writable;
+    unsigned int major, minor, type, res, challenge[4], response[4];
+    unsigned char *user_target;
+    bool authok, wrongvm;
+    int client_sock = s->client_sock;
+    char buf[XVP_PROXY_BUF_SIZE];
 
     sigpipe = xvp_child_sigpipe[0];
-    nfds = MAX(sigpipe, client_sock) + 1;
+    pfds[0].fd = sigpipe;
+    pfds[1].fd = client_sock;
 
-    xvp_proxy_state = XVP_STATE_SERVER_VERSION;
-    xvp_proxy_writing = true;
+    s->state = XVP_STATE_SERVER_VERSION;
+    s->writing = true;
     wrongvm = false;
 
     while (true) {
 
-	FD_ZERO(&read_fds);
-	FD_SET(sigpipe, &read_fds);
-	if (xvp_proxy_state != XVP_STATE_IDLING &&
-	    xvp_proxy_state != XVP_STATE_CONSOLE_DELETED)
-	    FD_SET(client_sock, &read_fds);
-
-	if (xvp_proxy_writing) {
-	    FD_ZERO(&write_fds);
-	    FD_SET(client_sock, &write_fds);
-	}
+	pfds[0].events = POLLIN;
+	pfds[1].events = 0;
+	if (s->state != XVP_STATE_IDLING &&
+	    s->state != XVP_STATE_CONSOLE_DELETED)
+	    pfds[1].events |= POLLIN;
+	if (s->writing)
+	    pfds[1].events |= POLLOUT;
 
-	nready = select(nfds, &read_fds, xvp_proxy_writing ? &write_fds : NULL,
-			NULL, NULL);
+	nready = poll(pfds, 2, -1);
 
 	if (nready < 0) {
 	    if (errno == EINTR)
 		continue;
-	    xvp_log_errno(XVP_LOG_FATAL, "select");
+	    xvp_log_errno(XVP_LOG_FATAL, "poll");
 	}
 
+	sigready = (pfds[0].revents & POLLIN) != 0;
+	readable = (pfds[1].events & POLLIN) &&
+	    (pfds[1].revents & (POLLIN | POLLHUP | POLLERR));
+	writable = (pfds[1].events & POLLOUT) &&
+	    (pfds[1].revents & (POLLOUT | POLLHUP | POLLERR));
 
-	if (FD_ISSET(sigpipe, &read_fds) && !xvp_process_signal_handler()) {
+	if (sigready && !xvp_process_signal_handler()) {
 	    return 0;
-	} else if (xvp_proxy_state == XVP_STATE_CONSOLE_DELETED) {
-	    SSL_shutdown(ssl);
+	} else if (s->state == XVP_STATE_CONSOLE_DELETED) {
+	    SSL_shutdown(s->ssl);
 	    xvp_log(XVP_LOG_DEBUG, "Closed old console connection");
-	    ssl = NULL;
-	    xvp_proxy_state = XVP_STATE_IDLING;
-	    xvp_proxy_writing = false;
-	    xvp_proxy_server_init(vm, shared, true, &ssl);
+	    s->ssl = NULL;
+	    s->state = XVP_STATE_IDLING;
+	    s->writing = false;
+	    xvp_proxy_server_init(s, true);
 	    continue;
-	} else if (FD_ISSET(client_sock, &read_fds)) {
-	    if (xvp_proxy_writing)
+	} else if (readable) {
+	    if (s->writing)
 		return 1;
-	} else if (!xvp_proxy_writing) {
+	} else if (!s->writing) {
 	    continue;
-	} else if (!FD_ISSET(client_sock, &write_fds)) {
+	} else if (!writable) {
 	    continue;
 	}
 
-	switch (xvp_proxy_state) {
+	switch (s->state) {
 	case XVP_STATE_SERVER_VERSION:
 	    sprintf(buf, "RFB %03u.%03u\n",
 		    XVP_RFB_MAJOR, XVP_RFB_MINOR_CLIENT);
 	    if (!xvp_write_all(client_sock, buf, strlen(buf)))
 		return 1;
-	    xvp_proxy_state = XVP_STATE_CLIENT_VERSION;
-	    xvp_proxy_writing = false;
+	    s->state = XVP_STATE_CLIENT_VERSION;
+	    s->writing = false;
 	    continue;
 	case XVP_STATE_CLIENT_VERSION:
 	    *buf = '\0';
@@ -863,17 +1913,17 @@ static int xvp_proxy_mainloop(xvp_vm *vm, int client_sock, unsigned int client_i
 		return 1;
 	    xvp_log(XVP_LOG_DEBUG,
 		    "RFB version %03u.%03u agreed", major, minor);
-	    xvp_proxy_minor_version = minor;
-	    xvp_proxy_state = XVP_STATE_REQUIRE_AUTH;
-	    xvp_proxy_writing = true;
+	    s->minor_version = minor;
+	    s->state = XVP_STATE_REQUIRE_AUTH;
+	    s->writing = true;
 	    break;
 	case XVP_STATE_REQUIRE_AUTH:
-	    if (xvp_proxy_minor_version == XVP_RFB_MINOR_3) {
+	    if (s->minor_version == XVP_RFB_MINOR_3) {
 		type = htonl(XVP_RFB_SECURITY_VNC);
 		if (!xvp_write_all(client_sock, &type, sizeof(type)))
 		    return 1;
-		xvp_proxy_state = XVP_STATE_CHALLENGE_AUTH;
-		xvp_proxy_writing = true;
+		s->state = XVP_STATE_CHALLENGE_AUTH;
+		s->writing = true;
 	    } else {
 		char *tp = (char *)&type;
 		tp[0] = 2; /* no of sec types */
@@ -881,110 +1931,57 @@ static int xvp_proxy_mainloop(xvp_vm *vm, int client_sock, unsigned int client_i
 		tp[2] = XVP_RFB_SECURITY_XVP;
 		if (!xvp_write_all(client_sock, &type, tp[0] + 1))
 		    return 1;
-		xvp_proxy_state = XVP_STATE_SELECT_AUTH;
-		xvp_proxy_writing = false;
+		s->state = XVP_STATE_SELECT_AUTH;
+		s->writing = false;
 	    }
 	    break;
 	case XVP_STATE_SELECT_AUTH:
 	    if (!xvp_read_all(client_sock, buf, 1) ||
 		(*buf != XVP_RFB_SECURITY_VNC && *buf != XVP_RFB_SECURITY_XVP))
 		return 1;
-	    xvp_proxy_security_type = *buf;
+	    s->security_type = *buf;
 	    xvp_log(XVP_LOG_DEBUG,
-		    "RFB security type %u agreed", xvp_proxy_security_type);
-	    if (xvp_proxy_security_type == XVP_RFB_SECURITY_XVP) {
-		xvp_proxy_state = XVP_STATE_USER_TARGET;
-		xvp_proxy_writing = false;
+		    "RFB security type %u agreed", s->security_type);
+	    if (s->security_type == XVP_RFB_SECURITY_XVP) {
+		s->state = XVP_STATE_USER_TARGET;
+		s->writing = false;
 	    } else {
-		xvp_proxy_state = XVP_STATE_CHALLENGE_AUTH;
-		xvp_proxy_writing = true;
+		s->state = XVP_STATE_CHALLENGE_AUTH;
+		s->writing = true;
 	    }
 	    break;
 	case XVP_STATE_USER_TARGET:
-	    /*
-	     * XVP authentication extension to RFB, client sends:
-	     *
-	     *   U8 user-length
-	     *   U8 target-length
-	     *   U8 array user-string
-	     *   U8 array target-string  ( [pool:]vm)
-	     *
-	     * and then we proceed as in VNC authentication
-	     */
 	    user_target = (unsigned char *)buf;
 	    if (!xvp_read_all(client_sock, buf, 2))
 		return 1;
 	    len = user_target[0] + user_target[1];
 	    if (len > 0 && !xvp_read_all(client_sock, buf + 2, len))
 		return 1;
-	    len += 2;
-	    buf[len] = '\0';
-	    target = xvp_strdup(buf + 2 + user_target[0]);
-	    buf[2 + user_target[0]] = '\0';
-	    username = xvp_strdup(buf + 2);
-	    xvp_log(XVP_LOG_INFO, "XVP auth credentials %s@%s",
-		    username, target);
-
-	    if ((vmname = strchr(target, ':'))) {
-		*vmname++ = '\0';
-		if (!(pool = xvp_config_pool_by_name(target))) {
-		    wrongvm = true;
-		    xvp_proxy_state = XVP_STATE_CHALLENGE_AUTH;
-		    xvp_proxy_writing = true;
-		    break;
-		}
-	    } else {
-		vmname = target;
-		pool = NULL;
-	    }
-
-	    /*
-	     * If client connected to multiplex port, only now do we now
-	     * which VM it actually wants to connect to.  If it didn't
-	     * tell us which one, just let things drop through and fail
-	     * at challenge/response.  If not connected to multiplex
-	     * port, but target specified, it had better match.
-	     */
-
-	    if (xvp_xenapi_is_uuid(vmname))
-		real_vm = xvp_config_vm_by_uuid(pool, vmname);
-	    else
-		real_vm = xvp_config_vm_by_name(pool, vmname);
-
-	    if (vm == xvp_multiplex_vm) {
-		if (real_vm) {
-		    xvp_proxy_set_name(vm = real_vm);
-		    xvp_log(XVP_LOG_INFO,
-			    "Multiplexer selecting VM %s in pool %s",
-			    vm->vmname, vm->pool->poolname);
-		} else {
-		    wrongvm = true;
-		}
-	    } else if ((pool || *vmname) && vm != real_vm) {
+	    if (!xvp_proxy_select_vm(s, buf))
 		wrongvm = true;
-	    }
-
-	    xvp_proxy_state = XVP_STATE_CHALLENGE_AUTH;
-	    xvp_proxy_writing = true;
+	    s->state = XVP_STATE_CHALLENGE_AUTH;
+	    s->writing = true;
 	    break;
 	case XVP_STATE_CHALLENGE_AUTH:
-	    srandom((unsigned int)(time(NULL) ^ 0xdf214a30));
-	    for (i = 0; i < 4; i++) {
-		challenge[i] = (random() ^ 0x51a488ce);
+	    if (xvp_proxy_early_wanted(s, wrongvm)) {
+		s->early = true;
+		s->shared = true;
+		xvp_proxy_thread(xvp_proxy_server_early, s);
 	    }
+	    xvp_proxy_challenge(challenge);
 	    if (!xvp_write_all(client_sock, challenge, sizeof(challenge)))
 		return 1;
-	    xvp_proxy_state = XVP_STATE_RESPONSE_AUTH;
-	    xvp_proxy_writing = false;
+	    s->state = XVP_STATE_RESPONSE_AUTH;
+	    s->writing = false;
 	    break;
 	case XVP_STATE_RESPONSE_AUTH:
 	    if (!xvp_read_all(client_sock, response, 16))
 		return 1;
-	    authok = (vm == xvp_multiplex_vm || wrongvm) ? false :
-		xvp_password_vnc_ok(vm->password, client_ip,
+	    authok = (s->vm == xvp_multiplex_vm || wrongvm) ? false :
+		xvp_password_vnc_ok(s->vm->password, s->client_ip,
 				    (char *)challenge, (char *)response);
-	    xvp_proxy_state = XVP_STATE_CONFIRM_AUTH;
-	    xvp_proxy_writing = true;
+	    s->state = XVP_STATE_CONFIRM_AUTH;
+	    s->writing = true;
 	    break;
 	case XVP_STATE_CONFIRM_AUTH:
 	    res = authok ? 0 : htonl(1); /* VNC security result */
@@ -995,9 +1992,9 @@ static int xvp_proxy_mainloop(xvp_vm *vm, int client_sock, unsigned int client_i
 	    if (!xvp_write_all(client_sock, &res, sizeof(res)))
 		return 1;
 	    if (authok) {
-		xvp_proxy_state = XVP_STATE_CLIENT_INIT;
-		xvp_proxy_writing = false;
-	    } else if (xvp_proxy_minor_version <= XVP_RFB_MINOR_7) {
+		s->state = XVP_STATE_CLIENT_INIT;
+		s->writing = false;
+	    } else if (s->minor_version <= XVP_RFB_MINOR_7) {
 		return 1;
 	    } else {
 		strcpy(buf + 4, "Access denied");
@@ -1010,35 +2007,46 @@ static int xvp_proxy_mainloop(xvp_vm *vm, int client_sock, unsigned int client_i
 	case XVP_STATE_CLIENT_INIT:
 	    if (!xvp_read_all(client_sock, buf, 1))
 		return 1;
-	    shared = (*buf != 0); /* Xen ignores this, always shared */
-	    xvp_proxy_state = XVP_STATE_SERVER_CONNECT;
-	    xvp_proxy_writing = false;
-	    /* this starts background thread which signals when done */
-	    xvp_proxy_server_init(vm, shared, false, &ssl);
+	    s->shared = (*buf != 0); /* Xen ignores this, always shared */
+	    s->state = XVP_STATE_SERVER_CONNECT;
+	    s->writing = false;
+	    if (s->early_done) {
+		s->state = XVP_STATE_SERVER_INIT;
+		s->writing = true;
+	    } else if (!s->early) {
+		/* this starts background thread which signals when done */
+		xvp_proxy_server_init(s, false);
+	    }
 	    break;
 	case XVP_STATE_SERVER_CONNECT:
-	    if (FD_ISSET(client_sock, &read_fds))
+	    if (readable)
 		return 1;
 	case XVP_STATE_SERVER_INIT:
-	    if (!ssl)
+	    if (!s->ssl && s->early) {
+		/* try again, now that the client has authenticated */
+		s->early = false;
+		s->state = XVP_STATE_SERVER_CONNECT;
+		s->writing = false;
+		xvp_proxy_server_init(s, false);
+		break;
+	    }
+	    if (!s->ssl)
 		return 2;
-	    size = sizeof(xvp_proxy_server_details);
-	    sprintf(buf + size, "VM Console - %s", vm->vmname);
-	    len = strlen(buf + size);
-	    xvp_proxy_server_details.name_length = htonl(len);
-	    memcpy(buf, &xvp_proxy_server_details, size);
-	    if (!xvp_write_all(client_sock, buf, size + len))
+	    size = xvp_proxy_server_init_message(s, buf);
+	    if (!xvp_write_all(client_sock, buf, size))
 		return 1;
-	    xvp_proxy_start_proxying(client_sock, ssl);
-	    xvp_proxy_state = XVP_STATE_IDLING;
-	    xvp_proxy_writing = false;
+	    xvp_proxy_start_proxying(s);
+	    if (s->early)
+		xvp_proxy_thread(xvp_proxy_server_watcher, s);
+	    s->state = XVP_STATE_IDLING;
+	    s->writing = false;
 	    break;
 	case XVP_STATE_SERVER_REINIT:
-	    if (!ssl)
+	    if (!s->ssl)
 		return 2;
-	    xvp_proxy_start_proxying(client_sock, ssl);
-	    xvp_proxy_state = XVP_STATE_IDLING;
-	    xvp_proxy_writing = false;
+	    xvp_proxy_start_proxying(s);
+	    s->state = XVP_STATE_IDLING;
+	    s->writing = false;
 	    break;
 	default:
 	    xvp_log(XVP_LOG_FATAL, "Internal error: Broken state");
@@ -1047,54 +2055,1326 @@ static int xvp_proxy_mainloop(xvp_vm *vm, int client_sock, unsigned int client_i
     }
 }
 
+/*
+ * These are only used in a session's own process, so there's just
+ * the one session to act on
+ */
+
 void xvp_proxy_resume(void)
 {
-    switch (xvp_proxy_state) {
+    xvp_session *s = xvp_proxy_sessions;
+
+    switch (s->state) {
     case XVP_STATE_SERVER_CONNECT:
-	xvp_proxy_state = XVP_STATE_SERVER_INIT;
-	xvp_proxy_writing = true;
+	s->state = XVP_STATE_SERVER_INIT;
+	s->writing = true;
 	break;
     case XVP_STATE_IDLING:
-	xvp_proxy_state = XVP_STATE_SERVER_REINIT;
-	xvp_proxy_writing = true; /* just to force next select to return */
+	s->state = XVP_STATE_SERVER_REINIT;
+	s->writing = true; /* just to force next poll to return */
 	break;
     default:
-	xvp_proxy_state = XVP_STATE_BROKEN;
-	xvp_proxy_writing = false;
+	if (s->early && !s->early_done) { /* kept until ClientInit */
+	    s->early_done = true;
+	    break;
+	}
+	s->state = XVP_STATE_BROKEN;
+	s->writing = false;
 	break;
     }
 }
 
 void  xvp_proxy_console_deleted(void)
 {
-    xvp_proxy_state = XVP_STATE_CONSOLE_DELETED;
-    xvp_proxy_writing = false;
+    xvp_session *s = xvp_proxy_sessions;
+
+    s->state = XVP_STATE_CONSOLE_DELETED;
+    s->writing = false;
 }
 
 int xvp_proxy_main(xvp_vm *vm, int client_sock, unsigned int client_ip)
 {
-    int rc;
+    xvp_session *s = xvp_proxy_session_new(vm, client_sock, client_ip);
+    char buf[XVP_PROXY_STATS_LEN];
+    int rc, val = 1;
 
-    struct hostent *hp;
+    /* we write whole updates at a time, so Nagle would only delay them */
+    (void)setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
 
-    if (client_ip == htonl(INADDR_LOOPBACK)) {
-	strcpy(client_hostname, "localhost");
-    } else if (hp = gethostbyaddr(&client_ip, sizeof(client_ip), AF_INET)) {
-	strncpy(client_hostname, hp->h_name, XVP_MAX_HOSTNAME);
-    } else {
-	strcpy(client_hostname, inet_ntoa(*(struct in_addr *)&client_ip));
+    xvp_proxy_client_hostname(s);
+    xvp_proxy_set_name(s, vm);
+    xvp_log(XVP_LOG_INFO, "Starting %s", xvp_proxy_get_name(s));
+
+    rc = xvp_proxy_mainloop(s);
+
+    xvp_log(XVP_LOG_INFO, "Stopping: %s", xvp_proxy_get_name(s));
+    if (s->relayed || s->pointers)
+	xvp_log(XVP_LOG_DEBUG, "Relay: %s", xvp_proxy_relay_stats(s, buf));
+
+    return rc;
+}
+
+/*
+ * Sessions run by the event engine
+ * --------------------------------
+ *
+ * The engine calls back here whenever a session's client socket or
+ * console connection is ready, and we then move data as far as we can
+ * without blocking: client input is handled as in xvp_proxy_mainloop()
+ * and xvp_proxy_writer(), and console output relayed as it arrives.
+ * Anything that may block, such as talking to XenServer, is done as a
+ * job on one of the engine's threads, at most one per session at a
+ * time.  A session is freed by its final (logout) job, so jobs never
+ * see it disappear beneath them.
+ */
+
+static void xvp_proxy_pump(xvp_session *s);
+
+static void xvp_proxy_submit(xvp_session *s,
+			     void (*run)(void *), void (*done)(void *))
+{
+    s->busy = true;
+    s->job.run = run;
+    s->job.done = done;
+    s->job.arg = s;
+    xvp_engine_submit(&s->job);
+}
+
+static void xvp_proxy_logout_job(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+
+    xvp_log_id = s->id;
+    xvp_xenapi_destroy(s->xenapi);
+}
+
+static void xvp_proxy_logout_done(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+
+    xvp_proxy_buf_free(&s->in);
+    xvp_proxy_buf_free(&s->out);
+    xvp_proxy_buf_free(&s->up);
+    xvp_proxy_buf_free(&s->paste);
+    xvp_free(s);
+}
+
+static void xvp_proxy_release(xvp_session *s)
+{
+    if (s->job_ssl) {
+	xvp_xenapi_close_stream(s->job_ssl);
+	s->job_ssl = NULL;
+    }
+
+    xvp_proxy_submit(s, xvp_proxy_logout_job, xvp_proxy_logout_done);
+}
+
+static void xvp_proxy_close(xvp_session *s)
+{
+    char buf[XVP_PROXY_STATS_LEN];
+
+    if (s->closed)
+	return;
+
+    s->closed = true;
+    xvp_engine_watch(&s->client, 0);
+    close(s->client_sock);
+
+    if (s->ssl) {
+	xvp_engine_watch(&s->server, 0);
+	(void)SSL_shutdown(s->ssl);
+	xvp_xenapi_close_stream(s->ssl);
+	s->ssl = NULL;
     }
 
-    xvp_proxy_set_name(vm);
-    xvp_log(XVP_LOG_INFO, "Starting %s", xvp_proxy_get_name());
+    xvp_proxy_splice_close(s);
+    xvp_engine_cancel(&s->timer);
+    xvp_engine_cancel(&s->idle);
+    xvp_engine_cancel(&s->pace);
+    xvp_proxy_session_unlink(s);
+    xvp_log(XVP_LOG_INFO, "Stopping: %s", xvp_proxy_get_name(s));
+    if (s->relayed || s->pointers)
+	xvp_log(XVP_LOG_DEBUG, "Relay: %s", xvp_proxy_relay_stats(s, buf));
+
+    /* if a job is in progress, its completion releases the session */
+    if (!s->busy)
+	xvp_proxy_release(s);
+}
 
-    xvp_proxy_pixel_format.message_type = 0xff;
-    xvp_proxy_encodings.message_type = 0xff;
-    xvp_proxy_extensions = false;
+/*
+ * Returns true if a job has finished with a session that has since been
+ * closed, having arranged for it to be released
+ */
+static bool xvp_proxy_job_finished(xvp_session *s)
+{
+    s->busy = false;
 
-    rc = xvp_proxy_mainloop(vm, client_sock, client_ip);
+    if (s->closed) {
+	xvp_proxy_release(s);
+	return true;
+    }
 
-    xvp_log(XVP_LOG_INFO, "Stopping: %s", xvp_proxy_get_name());
+    xvp_log_id = s->id;
+    return false;
+}
 
-    return rc;
+static bool xvp_proxy_reading(xvp_session *s)
+{
+    if (s->closing)
+	return false;
+
+    switch (s->state) {
+    case XVP_STATE_CLIENT_VERSION:
+    case XVP_STATE_SELECT_AUTH:
+    case XVP_STATE_USER_TARGET:
+    case XVP_STATE_RESPONSE_AUTH:
+    case XVP_STATE_CLIENT_INIT:
+    case XVP_STATE_SERVER_CONNECT:
+	return true;
+    case XVP_STATE_IDLING:
+	return s->ssl != NULL;
+    default:
+	return false;
+    }
+}
+
+/*
+ * Output for the client, whether buffered or spliced
+ */
+static int xvp_proxy_out_used(xvp_session *s)
+{
+    return xvp_proxy_buf_used(&s->out) + s->piped;
+}
+
+static void xvp_proxy_update(xvp_session *s)
+{
+    unsigned int events = EPOLLRDHUP;
+
+    if (s->closed)
+	return;
+
+    if (xvp_proxy_reading(s) && !xvp_proxy_buf_full(&s->in))
+	events |= EPOLLIN;
+    if (xvp_proxy_out_used(s) > 0)
+	events |= EPOLLOUT;
+    xvp_engine_watch(&s->client, events);
+
+    if (s->ssl) {
+	events = 0;
+	if (!xvp_proxy_buf_full(&s->out) && s->piped == 0)
+	    events |= s->ssl_read_wants;
+	if (xvp_proxy_buf_used(&s->up) > 0)
+	    events |= s->ssl_write_wants;
+	xvp_engine_watch(&s->server, events);
+    }
+}
+
+static bool xvp_proxy_client_read(xvp_session *s)
+{
+    int room, len;
+
+    while ((room = xvp_proxy_buf_room(&s->in)) > 0) {
+	len = read(s->client_sock, s->in.data + s->in.len, room);
+	if (len > 0) {
+	    s->in.len += len;
+	    if (len < room)
+		break;
+	} else if (len == 0) {
+	    return false;
+	} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	    break;
+	} else if (errno != EINTR) {
+	    return false;
+	}
+    }
+
+    return true;
+}
+
+static bool xvp_proxy_client_write(xvp_session *s)
+{
+    int len;
+
+    while (xvp_proxy_buf_used(&s->out) > 0) {
+	len = write(s->client_sock, s->out.data + s->out.off,
+		    xvp_proxy_buf_used(&s->out));
+	s->writes++;
+	if (len > 0)
+	    xvp_proxy_buf_consume(&s->out, len);
+	else if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    break;
+	else if (len == 0 || errno != EINTR)
+	    return false;
+    }
+
+    /* spliced output follows whatever was buffered before it */
+    while (s->piped > 0 && xvp_proxy_buf_used(&s->out) == 0) {
+	len = splice(s->pipe[0], NULL, s->client_sock, NULL, s->piped,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	s->writes++;
+	if (len > 0)
+	    s->piped -= len;
+	else if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    break;
+	else if (len == 0 || errno != EINTR)
+	    return false;
+    }
+
+    return true;
+}
+
+/*
+ * Fill the pipe with console output, as far as we needn't see it to
+ * follow messages, returning 1 if all is well, 0 at end of file or on
+ * error, or -1 if a TLS control record is next, which is for SSL_read()
+ * to deal with
+ */
+static int xvp_proxy_server_splice(xvp_session *s)
+{
+    int len;
+
+    while (s->piped < XVP_PROXY_SPLICE_SIZE &&
+	   (s->frame.off || s->frame.skip > 0)) {
+	len = XVP_PROXY_SPLICE_SIZE - s->piped;
+	if (!s->frame.off)
+	    len = MIN(len, s->frame.skip);
+	len = xvp_proxy_splice_in(s, len, SPLICE_F_NONBLOCK);
+	if (len > 0) {
+	    s->piped += len;
+	    xvp_proxy_frame_feed(s, NULL, len);
+	} else if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	    return 1;
+	} else if (s->piped > 0) { /* send that first, and come back */
+	    return 1;
+	} else {
+	    return (len < 0 && (errno == EINVAL || errno == EIO)) ? -1 : 0;
+	}
+    }
+
+    return 1;
+}
+
+/*
+ * Give back what the client's buffer grew to, once the session has been
+ * quiet for a while
+ */
+static void xvp_proxy_idle(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+    int quiet = time(NULL) - s->filled;
+
+    if (quiet < XVP_PROXY_BUF_IDLE)
+	xvp_engine_schedule(&s->idle, (XVP_PROXY_BUF_IDLE - quiet) * 1000);
+    else if (!xvp_proxy_buf_shrink(&s->out))
+	xvp_engine_schedule(&s->idle, XVP_PROXY_BUF_IDLE * 1000);
+}
+
+static bool xvp_proxy_server_read(xvp_session *s)
+{
+    int room, len, res;
+    bool emptied = (xvp_proxy_buf_used(&s->out) == 0);
+
+    s->ssl_read_wants = EPOLLIN;
+
+    /* SSL_read() output mustn't overtake what's still in the pipe */
+    if (s->piped > 0)
+	return true;
+
+    if (s->ktls && xvp_proxy_buf_used(&s->out) == 0 &&
+	SSL_pending(s->ssl) == 0 && (s->frame.off || s->frame.skip > 0) &&
+	(res = xvp_proxy_server_splice(s)) >= 0)
+	return res > 0;
+
+    while ((room = xvp_proxy_buf_room(&s->out)) > 0) {
+	len = SSL_read(s->ssl, s->out.data + s->out.len, room);
+	if (len > 0) {
+	    if (xvp_verbose && xvp_tracing)
+		xvp_proxy_trace_server(s->out.data + s->out.len, len);
+	    xvp_proxy_frame_feed(s, s->out.data + s->out.len, len);
+	    s->out.len += len;
+	    s->relayed += len;
+	    s->reads++;
+	    /* with splicing, stop where it can take over */
+	    if (s->ktls && !s->frame.off && s->frame.skip > 0)
+		return true;
+	    continue;
+	}
+	switch (SSL_get_error(s->ssl, len)) {
+	case SSL_ERROR_WANT_READ:
+	    return true;
+	case SSL_ERROR_WANT_WRITE:
+	    s->ssl_read_wants = EPOLLOUT;
+	    return true;
+	default:
+	    return false;
+	}
+    }
+
+    /* the client took all we had, so could take more at a time */
+    s->filled = time(NULL);
+    if (emptied && xvp_proxy_buf_grow(&s->out))
+	xvp_engine_schedule(&s->idle, XVP_PROXY_BUF_IDLE * 1000);
+
+    return true;
+}
+
+static bool xvp_proxy_server_write(xvp_session *s)
+{
+    int len;
+
+    s->ssl_write_wants = EPOLLOUT;
+
+    while (xvp_proxy_buf_used(&s->up) > 0) {
+	len = SSL_write(s->ssl, s->up.data + s->up.off,
+			xvp_proxy_buf_used(&s->up));
+	if (len > 0) {
+	    xvp_proxy_buf_consume(&s->up, len);
+	    s->up_held = 0;
+	    continue;
+	}
+	switch (SSL_get_error(s->ssl, len)) {
+	case SSL_ERROR_WANT_WRITE:
+	    s->up_held = xvp_proxy_buf_used(&s->up);
+	    return true;
+	case SSL_ERROR_WANT_READ:
+	    s->ssl_write_wants = EPOLLIN;
+	    s->up_held = xvp_proxy_buf_used(&s->up);
+	    return true;
+	default:
+	    return false;
+	}
+    }
+
+    return true;
+}
+
+/*
+ * Put queued XVP messages in the client's buffer where the last complete
+ * console message in it ends, unless that has already been sent, or
+ * spliced output is still to go
+ */
+static void xvp_proxy_send_updates(xvp_session *s)
+{
+    char buf[XVP_PROXY_UPDATES_LEN];
+    int since, at, len;
+
+    if (!s->pending_updates || s->piped > 0 ||
+	xvp_proxy_buf_room(&s->out) < sizeof(buf) ||
+	(len = xvp_proxy_take_updates(s, buf, xvp_proxy_buf_used(&s->out),
+				      &since)) == 0)
+	return;
+
+    at = s->out.len - since;
+    memmove(s->out.data + at + len, s->out.data + at, since);
+    memcpy(s->out.data + at, buf, len);
+    s->out.len += len;
+}
+
+static void xvp_proxy_resolve_job(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+
+    xvp_log_id = s->id;
+    xvp_proxy_client_hostname(s);
+}
+
+static void xvp_proxy_resolve_done(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+
+    if (xvp_proxy_job_finished(s))
+	return;
+
+    xvp_proxy_set_name(s, s->vm);
+    xvp_log(XVP_LOG_INFO, "Starting %s", xvp_proxy_get_name(s));
+    xvp_proxy_pump(s);
+}
+
+static void xvp_proxy_connect_job(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+
+    xvp_log_id = s->id;
+    s->job_ssl = xvp_proxy_server_connect(s, s->reinit);
+}
+
+/*
+ * Start relaying over a newly made console connection, returning false
+ * if it can't be made non-blocking
+ */
+static bool xvp_proxy_server_attach(xvp_session *s)
+{
+    char buf[XVP_PROXY_BUF_SIZE];
+    int fd, flags, len;
+
+    fd = SSL_get_fd(s->ssl);
+    if ((flags = fcntl(fd, F_GETFL, 0)) == -1 ||
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+	xvp_log_errno(XVP_LOG_ERROR, "fcntl");
+	return false;
+    }
+    SSL_set_mode(s->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+		 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    s->server.fd = fd;
+    s->server.events = 0;
+    s->ssl_read_wants = EPOLLIN;
+    s->ssl_write_wants = EPOLLOUT;
+    xvp_proxy_frame_init(s);
+    xvp_proxy_splice_init(s);
+
+    if (s->state == XVP_STATE_SERVER_CONNECT) {
+	len = xvp_proxy_server_init_message(s, buf);
+	(void)xvp_proxy_buf_put(&s->out, buf, len);
+    }
+
+    xvp_log(XVP_LOG_DEBUG, "Starting relay");
+    s->state = XVP_STATE_IDLING;
+    return true;
+}
+
+static void xvp_proxy_connect_done(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+
+    if (xvp_proxy_job_finished(s))
+	return;
+
+    if (!(s->ssl = s->job_ssl)) {
+	xvp_proxy_close(s);
+	return;
+    }
+    s->job_ssl = NULL;
+
+    if (!xvp_proxy_server_attach(s)) {
+	xvp_proxy_close(s);
+	return;
+    }
+
+    xvp_proxy_pump(s);
+}
+
+static void xvp_proxy_early_job(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+
+    xvp_log_id = s->id;
+    xvp_xenapi_set_early(s->xenapi, s->client_ip);
+    s->job_ssl = xvp_proxy_server_connect(s, false);
+    xvp_xenapi_set_early(s->xenapi, 0);
+}
+
+/*
+ * At ClientInit, once the early connection is done with: use it, or if
+ * it couldn't be made, connect now
+ */
+static bool xvp_proxy_early_use(xvp_session *s)
+{
+    if (!(s->ssl = s->job_ssl)) {
+	xvp_proxy_submit(s, xvp_proxy_connect_job, xvp_proxy_connect_done);
+	return true;
+    }
+    s->job_ssl = NULL;
+
+    return xvp_proxy_server_attach(s);
+}
+
+/*
+ * Until ClientInit, the connection is kept in job_ssl, which closing
+ * the session also takes care of
+ */
+static void xvp_proxy_early_done(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+
+    if (xvp_proxy_job_finished(s))
+	return;
+
+    s->early_done = true;
+    if (s->state != XVP_STATE_SERVER_CONNECT)
+	return;
+
+    if (!xvp_proxy_early_use(s)) {
+	xvp_proxy_close(s);
+	return;
+    }
+
+    xvp_proxy_pump(s);
+}
+
+/*
+ * The client's VM operation is started by one job, then followed by a
+ * job for each change in its progress, until it has finished
+ */
+static void xvp_proxy_code_job(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+
+    xvp_log_id = s->id;
+
+    if (!s->tasking) {
+	s->job_ok = xvp_xenapi_task_start(s->xenapi, s->message_code);
+	s->job_percent = 0;
+    } else {
+	s->job_percent = xvp_xenapi_task_wait(s->xenapi);
+	s->job_ok = (s->job_percent >= 0);
+    }
+}
+
+static void xvp_proxy_code_done(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+
+    if (xvp_proxy_job_finished(s))
+	return;
+
+    if (!s->job_ok || s->job_percent == 100) {
+	s->tasking = false;
+	if (!s->job_ok)
+	    xvp_proxy_queue_update(s, XVP_MESSAGE_CODE_FAIL, 0);
+	else if (s->tasks)
+	    xvp_proxy_queue_update(s, s->message_code, 0);
+	xvp_proxy_pump(s);
+	return;
+    }
+
+    s->tasking = true;
+    if (s->tasks && s->job_percent != s->progress) {
+	xvp_proxy_queue_update(s, XVP_MESSAGE_CODE_PROGRESS, s->job_percent);
+	xvp_proxy_pump(s);
+    }
+
+    xvp_proxy_submit(s, xvp_proxy_code_job, xvp_proxy_code_done);
+}
+
+/*
+ * Timer for a session whose console connection was lost: either end
+ * it, or try connecting again, as set by xvp_reconnect_delay
+ */
+static void xvp_proxy_timeout(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+
+    xvp_log_id = s->id;
+
+    if (xvp_reconnect_delay <= 0) {
+	xvp_proxy_close(s);
+    } else if (s->busy) {
+	xvp_engine_schedule(&s->timer, 1000);
+    } else {
+	s->state = XVP_STATE_SERVER_REINIT;
+	s->reinit = true;
+	xvp_proxy_submit(s, xvp_proxy_connect_job, xvp_proxy_connect_done);
+	xvp_proxy_update(s);
+    }
+}
+
+/*
+ * Timer for a held update request, or pasted text, which parsing then
+ * sends
+ */
+static void xvp_proxy_paced(void *arg)
+{
+    xvp_session *s = (xvp_session *)arg;
+
+    xvp_log_id = s->id;
+    xvp_proxy_pump(s);
+}
+
+/*
+ * Where a session process waits for XenServer to report the console
+ * gone, here we take the end of the console connection to mean the
+ * same thing
+ */
+static void xvp_proxy_server_lost(xvp_session *s)
+{
+    xvp_log(XVP_LOG_INFO, "Lost connection to console");
+
+    xvp_engine_watch(&s->server, 0);
+    xvp_xenapi_close_stream(s->ssl);
+    s->ssl = NULL;
+    s->up.off = s->up.len = s->up_held = 0;
+    s->asking = false;
+    s->state = XVP_STATE_CONSOLE_DELETED;
+
+    if (xvp_reconnect_delay <= 0) {
+	xvp_engine_schedule(&s->timer, -xvp_reconnect_delay * 1000);
+    } else {
+	xvp_log(XVP_LOG_INFO, "Reconnect attempt in %d seconds",
+		xvp_reconnect_delay);
+	xvp_engine_schedule(&s->timer, xvp_reconnect_delay * 1000);
+    }
+}
+
+/*
+ * Hot VMs
+ * -------
+ *
+ * For each VM marked HOT, the engine keeps a console connection ready,
+ * with the RFB handshake done as far as ServerInit, so that a client
+ * sending ClientInit can be given it at once, rather than waiting for
+ * the Xen API and a new TLS connection.  XenServer ignores the shared
+ * flag, so a connection made before the client chose one will do.  It
+ * is renewed once used, every XVP_PROXY_WARM_REFRESH seconds, if the
+ * console sends anything or hangs up, and if the broker reports the
+ * console deleted or the VM moved.
+ */
+
+static void xvp_proxy_warm_done(void *arg);
+
+static void xvp_proxy_warm_job(void *arg)
+{
+    xvp_proxy_warm *w = (xvp_proxy_warm *)arg;
+    xvp_session *s = w->session;
+
+    xvp_log_id = s->id;
+
+    /* a fresh lookup each time, so as to follow the VM */
+    if (s->xenapi)
+	xvp_xenapi_destroy(s->xenapi);
+    s->xenapi = NULL;
+
+    if (w->stopped)
+	return;
+
+    s->xenapi = xvp_xenapi_create(xvp_broker_pid != 0);
+    s->job_ssl = xvp_proxy_server_connect(s, false);
+}
+
+static void xvp_proxy_warm_submit(xvp_proxy_warm *w)
+{
+    w->busy = true;
+    w->job.run = xvp_proxy_warm_job;
+    w->job.done = xvp_proxy_warm_done;
+    w->job.arg = w;
+    xvp_engine_submit(&w->job);
+}
+
+static void xvp_proxy_warm_discard(xvp_proxy_warm *w)
+{
+    xvp_engine_cancel(&w->timer);
+    xvp_engine_watch(&w->events, 0);
+
+    if (w->ssl) {
+	xvp_engine_watch(&w->stream, 0);
+	xvp_xenapi_close_stream(w->ssl);
+	w->ssl = NULL;
+    }
+}
+
+static void xvp_proxy_warm_done(void *arg)
+{
+    xvp_proxy_warm *w = (xvp_proxy_warm *)arg;
+    xvp_session *s = w->session;
+
+    w->busy = false;
+    xvp_log_id = s->id;
+
+    if (w->stopped) {
+	if (s->job_ssl) {
+	    xvp_xenapi_close_stream(s->job_ssl);
+	    s->job_ssl = NULL;
+	}
+	if (s->xenapi) {
+	    xvp_proxy_warm_submit(w); /* to log out */
+	} else {
+	    xvp_free(s);
+	    xvp_free(w);
+	}
+	return;
+    }
+
+    if (!(w->ssl = s->job_ssl)) {
+	xvp_log(XVP_LOG_DEBUG, "No console connection ready for %s, "
+		"retrying in %d seconds", s->vm->vmname, XVP_PROXY_WARM_RETRY);
+	xvp_engine_schedule(&w->timer, XVP_PROXY_WARM_RETRY * 1000);
+	return;
+    }
+    s->job_ssl = NULL;
+    w->made++;
+
+    w->stream.fd = SSL_get_fd(w->ssl);
+    xvp_engine_watch(&w->stream, EPOLLIN | EPOLLRDHUP);
+    if ((w->events.fd = xvp_xenapi_event_fd(s->xenapi)) >= 0)
+	xvp_engine_watch(&w->events, EPOLLIN);
+    xvp_engine_schedule(&w->timer, XVP_PROXY_WARM_REFRESH * 1000);
+
+    xvp_log(XVP_LOG_DEBUG, "Console connection ready for %s",
+	    s->vm->vmname);
+}
+
+static void xvp_proxy_warm_renew(void *arg)
+{
+    xvp_proxy_warm *w = (xvp_proxy_warm *)arg;
+
+    xvp_log_id = w->session->id;
+    xvp_proxy_warm_discard(w);
+    if (!w->busy)
+	xvp_proxy_warm_submit(w);
+}
+
+static void xvp_proxy_warm_ready(xvp_watch *watch, unsigned int events)
+{
+    xvp_proxy_warm *w = (xvp_proxy_warm *)watch->arg;
+
+    xvp_log_id = w->session->id;
+    xvp_log(XVP_LOG_DEBUG, "Renewing console connection for %s",
+	    w->session->vm->vmname);
+    xvp_proxy_warm_renew(w);
+}
+
+static xvp_proxy_warm *xvp_proxy_warm_find(xvp_vm *vm)
+{
+    xvp_proxy_warm *w;
+
+    for (w = xvp_proxy_warms; w; w = w->next)
+	if (w->session->vm == vm && w->ssl)
+	    return w;
+
+    return NULL;
+}
+
+/*
+ * Give a session reaching ClientInit its VM's ready console connection,
+ * if there is one, and start making the next
+ */
+static bool xvp_proxy_warm_take(xvp_session *s)
+{
+    xvp_proxy_warm *w;
+    xvp_xenapi *xa;
+
+    if (!(w = xvp_proxy_warm_find(s->vm)))
+	return false;
+
+    xvp_engine_watch(&w->stream, 0);
+    xvp_engine_watch(&w->events, 0);
+    s->ssl = w->ssl;
+    s->server_details = w->session->server_details;
+    w->ssl = NULL;
+    w->used++;
+    xvp_log(XVP_LOG_DEBUG, "Using ready console connection");
+
+    /* the session that found the console, for any XVP message codes */
+    xa = s->xenapi;
+    s->xenapi = w->session->xenapi;
+    w->session->xenapi = xa;
+
+    xvp_proxy_warm_renew(w);
+    return true;
+}
+
+void xvp_proxy_warm_start(void)
+{
+    xvp_pool *pool;
+    xvp_vm *vm;
+    xvp_proxy_warm *w;
+    xvp_session *s;
+
+    xvp_proxy_engine = true;
+
+    for (pool = xvp_pools; pool; pool = pool->next) {
+	for (vm = pool->vms; vm; vm = vm->next) {
+	    if (!vm->hot)
+		continue;
+	    w = xvp_alloc(sizeof(xvp_proxy_warm));
+	    memset(w, 0, sizeof(xvp_proxy_warm));
+	    s = xvp_alloc(sizeof(xvp_session));
+	    memset(s, 0, sizeof(xvp_session));
+	    s->id = ++xvp_proxy_next_id;
+	    s->vm = vm;
+	    s->shared = true;
+	    s->client_sock = -1;
+	    s->pipe[0] = s->pipe[1] = -1;
+	    w->session = s;
+	    w->timer.func = xvp_proxy_warm_renew;
+	    w->timer.arg = w;
+	    w->stream.func = xvp_proxy_warm_ready;
+	    w->stream.arg = w;
+	    w->events.fd = -1;
+	    w->events.func = xvp_proxy_warm_ready;
+	    w->events.arg = w;
+	    w->next = xvp_proxy_warms;
+	    xvp_proxy_warms = w;
+	    xvp_proxy_warm_submit(w);
+	}
+    }
+    xvp_log_id = 0;
+}
+
+/*
+ * When the engine is draining, its ready connections are closed, and
+ * each is freed once any job for it has finished, and it has logged out
+ */
+void xvp_proxy_warm_stop(void)
+{
+    xvp_proxy_warm *w;
+
+    while ((w = xvp_proxy_warms)) {
+	xvp_proxy_warms = w->next;
+	xvp_proxy_warm_discard(w);
+	w->stopped = true;
+	if (!w->busy)
+	    xvp_proxy_warm_submit(w);
+    }
+}
+
+/*
+ * Equivalent of xvp_proxy_mainloop() for the event engine, working
+ * through the handshake as far as the client's input allows, and
+ * queueing our replies.  Returns false if the session should end.
+ */
+static bool xvp_proxy_handshake(xvp_session *s)
+{
+    char *buf, line[17];
+    int avail, len;
+    unsigned int major, minor, type, res;
+
+    while (true) {
+
+	buf = s->in.data + s->in.off;
+	avail = xvp_proxy_buf_used(&s->in);
+
+	switch (s->state) {
+	case XVP_STATE_SERVER_VERSION:
+	    sprintf(line, "RFB %03u.%03u\n",
+		    XVP_RFB_MAJOR, XVP_RFB_MINOR_CLIENT);
+	    (void)xvp_proxy_buf_put(&s->out, line, strlen(line));
+	    s->state = XVP_STATE_CLIENT_VERSION;
+	    break;
+	case XVP_STATE_CLIENT_VERSION:
+	    for (len = 0; len < avail && len < 16; )
+		if (buf[len++] == '\n')
+		    break;
+	    if (len < 16 && (len == 0 || buf[len - 1] != '\n'))
+		return true;
+	    memcpy(line, buf, len);
+	    line[len] = '\0';
+	    xvp_proxy_buf_consume(&s->in, len);
+	    if (sscanf(line, "RFB %03u.%03u\n", &major, &minor) != 2 ||
+		!xvp_proxy_version_known(major, minor))
+		return false;
+	    xvp_log(XVP_LOG_DEBUG,
+		    "RFB version %03u.%03u agreed", major, minor);
+	    s->minor_version = minor;
+	    s->state = XVP_STATE_REQUIRE_AUTH;
+	    break;
+	case XVP_STATE_REQUIRE_AUTH:
+	    if (s->minor_version == XVP_RFB_MINOR_3) {
+		type = htonl(XVP_RFB_SECURITY_VNC);
+		(void)xvp_proxy_buf_put(&s->out, &type, sizeof(type));
+		s->state = XVP_STATE_CHALLENGE_AUTH;
+	    } else {
+		line[0] = 2; /* no of sec types */
+		line[1] = XVP_RFB_SECURITY_VNC;
+		line[2] = XVP_RFB_SECURITY_XVP;
+		(void)xvp_proxy_buf_put(&s->out, line, line[0] + 1);
+		s->state = XVP_STATE_SELECT_AUTH;
+	    }
+	    break;
+	case XVP_STATE_SELECT_AUTH:
+	    if (avail < 1)
+		return true;
+	    if (*buf != XVP_RFB_SECURITY_VNC && *buf != XVP_RFB_SECURITY_XVP)
+		return false;
+	    s->security_type = *buf;
+	    xvp_proxy_buf_consume(&s->in, 1);
+	    xvp_log(XVP_LOG_DEBUG,
+		    "RFB security type %u agreed", s->security_type);
+	    if (s->security_type == XVP_RFB_SECURITY_XVP)
+		s->state = XVP_STATE_USER_TARGET;
+	    else
+		s->state = XVP_STATE_CHALLENGE_AUTH;
+	    break;
+	case XVP_STATE_USER_TARGET:
+	    if (avail < 2 ||
+		avail < (len = 2 + (U8)buf[0] + (U8)buf[1]))
+		return true;
+	    if (!xvp_proxy_select_vm(s, buf))
+		s->wrongvm = true;
+	    xvp_proxy_buf_consume(&s->in, len);
+	    s->state = XVP_STATE_CHALLENGE_AUTH;
+	    break;
+	case XVP_STATE_CHALLENGE_AUTH:
+	    if (!s->busy && xvp_proxy_early_wanted(s, s->wrongvm)) {
+		s->early = true;
+		s->shared = true;
+		xvp_proxy_submit(s, xvp_proxy_early_job, xvp_proxy_early_done);
+	    }
+	    xvp_proxy_challenge(s->challenge);
+	    (void)xvp_proxy_buf_put(&s->out, s->challenge,
+				    sizeof(s->challenge));
+	    s->state = XVP_STATE_RESPONSE_AUTH;
+	    break;
+	case XVP_STATE_RESPONSE_AUTH:
+	    if (avail < 16)
+		return true;
+	    s->authok = (s->vm == xvp_multiplex_vm || s->wrongvm) ? false :
+		xvp_password_vnc_ok(s->vm->password, s->client_ip,
+				    (char *)s->challenge, buf);
+	    xvp_proxy_buf_consume(&s->in, 16);
+	    s->state = XVP_STATE_CONFIRM_AUTH;
+	    break;
+	case XVP_STATE_CONFIRM_AUTH:
+	    res = s->authok ? 0 : htonl(1); /* VNC security result */
+	    (void)xvp_proxy_buf_put(&s->out, &res, sizeof(res));
+	    if (s->authok) {
+		xvp_log(XVP_LOG_DEBUG, "Client authentication succeeded");
+		s->state = XVP_STATE_CLIENT_INIT;
+		break;
+	    }
+	    xvp_log(XVP_LOG_INFO, "Client authentication failed");
+	    if (s->minor_version > XVP_RFB_MINOR_7) {
+		len = strlen("Access denied");
+		res = htonl(len);
+		(void)xvp_proxy_buf_put(&s->out, &res, sizeof(res));
+		(void)xvp_proxy_buf_put(&s->out, "Access denied", len);
+	    }
+	    s->state = XVP_STATE_BROKEN;
+	    s->closing = true;
+	    return true;
+	case XVP_STATE_CLIENT_INIT:
+	    if (avail < 1)
+		return true;
+	    s->shared = (*buf != 0); /* Xen ignores this, always shared */
+	    xvp_proxy_buf_consume(&s->in, 1);
+	    s->state = XVP_STATE_SERVER_CONNECT;
+	    s->reinit = false;
+	    if (s->early_done)
+		return xvp_proxy_early_use(s);
+	    if (s->early) /* still connecting, and will carry on from there */
+		return true;
+	    if (xvp_proxy_warm_take(s))
+		return xvp_proxy_server_attach(s);
+	    xvp_proxy_submit(s, xvp_proxy_connect_job, xvp_proxy_connect_done);
+	    return true;
+	case XVP_STATE_SERVER_CONNECT:
+	    return avail == 0;
+	default:
+	    return true;
+	}
+    }
+}
+
+/*
+ * While the console is not taking input, a pointer movement replaces
+ * the PointerEvent queued before it, provided nothing else came between
+ * them, it has the same buttons down, and it isn't already being
+ * written.  So only intermediate positions are lost: button changes and
+ * key events are never dropped or reordered.
+ */
+static bool xvp_proxy_merge_pointer(xvp_session *s, char *buf)
+{
+    char *last;
+
+    if (!s->up_pointer || xvp_proxy_buf_used(&s->up) - s->up_held < 6)
+	return false;
+
+    last = s->up.data + s->up.len - 6;
+    if (last[1] != buf[1])
+	return false;
+
+    if (xvp_verbose && xvp_tracing)
+	xvp_proxy_trace_client(buf, 6, false);
+
+    memcpy(last + 2, buf + 2, 4);
+    s->pointers++;
+    s->merged++;
+    return true;
+}
+
+/*
+ * Queue complete client messages for the console, as far as there is
+ * room, for xvp_proxy_writer() or the event engine, dealing with XVP
+ * messages ourselves.  Cut text is set aside, and then converted to key
+ * events with whatever room is left, so that it doesn't hold up pointer
+ * events or update requests however long it is, though key events sent
+ * after it stay queued until it has all been typed.  Anything still
+ * queued from last time means the console is behind, so pointer
+ * movements may be merged.  Returns false if the session should end.
+ */
+static bool xvp_proxy_parse(xvp_session *s)
+{
+    char *buf;
+    int avail, expected, len;
+    bool behind = xvp_proxy_buf_used(&s->up) > 0;
+    U8 type;
+
+    while ((avail = xvp_proxy_buf_used(&s->in)) > 0) {
+
+	buf = s->in.data + s->in.off;
+
+	if (s->cut_remaining > 0) {
+	    /* set ClientCutText aside as it arrives, to be typed later */
+	    if (xvp_proxy_buf_room(&s->paste) == 0 &&
+		!xvp_proxy_buf_grow(&s->paste))
+		break;
+	    len = MIN(MIN(avail, s->cut_remaining),
+		      xvp_proxy_buf_room(&s->paste));
+	    (void)xvp_proxy_buf_put(&s->paste, buf, len);
+	    xvp_proxy_buf_consume(&s->in, len);
+	    s->cut_remaining -= len;
+	    continue;
+	}
+
+	type = buf[0];
+
+	if ((expected = xvp_proxy_client_length(type)) == 0) {
+	    xvp_log(XVP_LOG_ERROR, "Unrecognised client message type %d",
+		    buf[0]);
+	    return false;
+	}
+
+	if (avail < expected)
+	    break;
+
+	/* keys typed after a paste wait for it to be typed first */
+	if (type == XVP_RFB_MESSAGE_TYPE_KEY_EVENT &&
+	    xvp_proxy_buf_used(&s->paste) > 0) {
+	    xvp_proxy_release_paste(s);
+	    if (xvp_proxy_buf_used(&s->paste) > 0)
+		break;
+	}
+
+	if (type == XVP_RFB_MESSAGE_TYPE_POINTER_EVENT && behind &&
+	    xvp_proxy_merge_pointer(s, buf)) {
+	    xvp_proxy_buf_consume(&s->in, expected);
+	    continue;
+	}
+
+	if (type == XVP_RFB_MESSAGE_TYPE_CLIENT_CUT_TEXT) {
+
+	    xvp_rfb_client_cut_text *ct = (xvp_rfb_client_cut_text *)buf;
+	    s->cut_remaining = ntohl(ct->text_length);
+	    if (!s->paste.data)
+		xvp_proxy_buf_init(&s->paste);
+	    xvp_proxy_buf_consume(&s->in, expected);
+	    continue;
+
+	} else if (type == XVP_RFB_MESSAGE_TYPE_XVP) {
+
+	    xvp_proxy_code_message *cm = (xvp_proxy_code_message *)buf;
+	    if (!xvp_proxy_extensions_version(cm->version))
+		return false;
+	    if (!xvp_proxy_engine) {
+		(void)xvp_proxy_handle_extensions(s, cm->version, cm->code);
+	    } else if (s->tasking && cm->code == s->message_code) {
+		xvp_log(XVP_LOG_INFO, "Client %s request already in progress",
+			xvp_message_code_to_text(cm->code));
+	    } else if (s->busy) {
+		xvp_log(XVP_LOG_INFO, "Busy, refusing %s request",
+			xvp_message_code_to_text(cm->code));
+		xvp_proxy_queue_update(s, XVP_MESSAGE_CODE_FAIL, 0);
+	    } else {
+		s->message_code = cm->code;
+		s->tasks = (cm->version == XVP_RFB_MESSAGE_VERSION_TASKS);
+		s->progress = -1;
+		xvp_proxy_submit(s, xvp_proxy_code_job, xvp_proxy_code_done);
+	    }
+	    xvp_proxy_buf_consume(&s->in, expected);
+	    continue;
+
+	} else if (type == XVP_RFB_MESSAGE_TYPE_SET_ENCODINGS) {
+
+	    xvp_rfb_set_encodings *se = (xvp_rfb_set_encodings *)buf;
+	    expected += ntohs(se->number) * sizeof(S32);
+	    if (expected > XVP_PROXY_BUF_SIZE) {
+		xvp_log(XVP_LOG_ERROR, "Too many client encodings");
+		return false;
+	    }
+	    if (avail < expected)
+		break;
+	}
+
+	if (!xvp_proxy_buf_space(&s->up, expected))
+	    break;
+
+	if (type == XVP_RFB_MESSAGE_TYPE_FB_UPDATE_REQUEST &&
+	    !xvp_proxy_update_request(s, (xvp_rfb_fb_update_request *)buf)) {
+	    xvp_proxy_trace_client(buf, expected, false);
+	    xvp_proxy_buf_consume(&s->in, expected);
+	    continue;
+	}
+
+	len = expected;
+	if (type == XVP_RFB_MESSAGE_TYPE_SET_PIXEL_FORMAT) {
+	    /* save pixel format for use in re-init */
+	    memcpy(&s->pixel_format, buf, sizeof(s->pixel_format));
+	    xvp_proxy_frame_pixel_format(s);
+	} else if (type == XVP_RFB_MESSAGE_TYPE_SET_ENCODINGS) {
+	    len = xvp_proxy_frame_encodings(s, buf);
+	    if (xvp_proxy_save_encodings(s, buf)) {
+		if (xvp_proxy_extensions_init(s))
+		    xvp_proxy_queue_update(s, XVP_MESSAGE_CODE_INIT, 0);
+		else if (!s->extensions) {
+		    pthread_mutex_lock(&xvp_proxy_frame_lock);
+		    s->frame.off = true; /* no XVP messages to fit in */
+		    pthread_mutex_unlock(&xvp_proxy_frame_lock);
+		}
+	    }
+	}
+
+	if (xvp_verbose && xvp_tracing)
+	    xvp_proxy_trace_client(buf, len, false);
+
+	(void)xvp_proxy_buf_put(&s->up, buf, len);
+	xvp_proxy_buf_consume(&s->in, expected);
+	if ((s->up_pointer = (type == XVP_RFB_MESSAGE_TYPE_POINTER_EVENT)))
+	    s->pointers++;
+    }
+
+    xvp_proxy_release_update(s);
+    xvp_proxy_release_paste(s);
+    return true;
+}
+
+/*
+ * Move as much data as we can without blocking
+ */
+static void xvp_proxy_pump(xvp_session *s)
+{
+    int avail, queued, wait;
+
+    xvp_proxy_send_updates(s);
+    if (!xvp_proxy_client_write(s))
+	goto close;
+
+    /*
+     * Keep going while the client takes all we give it, as SSL may
+     * hold data already read from the console
+     */
+    while (s->state == XVP_STATE_IDLING && s->ssl) {
+	if (!xvp_proxy_server_read(s)) {
+	    xvp_proxy_server_lost(s);
+	    break;
+	}
+	xvp_proxy_send_updates(s);
+	if (!xvp_proxy_client_write(s))
+	    goto close;
+	if (xvp_proxy_out_used(s) > 0 || SSL_pending(s->ssl) == 0)
+	    break;
+    }
+
+    if (xvp_proxy_reading(s) && !xvp_proxy_client_read(s))
+	goto close;
+
+    /*
+     * As parsing stops when there's no room to queue for the console,
+     * go round again if we then manage to send it all, unless nothing
+     * was queued and nothing parsed, as then no more is complete
+     */
+    while (s->state == XVP_STATE_IDLING) {
+	avail = xvp_proxy_buf_used(&s->in);
+	queued = xvp_proxy_buf_used(&s->up);
+	if (!xvp_proxy_parse(s))
+	    goto close;
+	if (!xvp_proxy_server_write(s)) {
+	    xvp_proxy_server_lost(s);
+	    break;
+	}
+	if (xvp_proxy_buf_used(&s->up) > 0 ||
+	    xvp_proxy_buf_used(&s->in) == 0 ||
+	    (xvp_proxy_buf_used(&s->in) == avail && queued == 0))
+	    break;
+    }
+
+    if (s->state != XVP_STATE_IDLING && !xvp_proxy_handshake(s))
+	goto close;
+
+    xvp_proxy_send_updates(s);
+    if (!xvp_proxy_client_write(s))
+	goto close;
+
+    if (s->closing && xvp_proxy_out_used(s) == 0)
+	goto close;
+
+    /* come back for anything paced, or left for lack of room */
+    if (s->state == XVP_STATE_IDLING && (wait = xvp_proxy_pace_wait(s)) >= 0)
+	xvp_engine_schedule(&s->pace, wait);
+
+    xvp_proxy_update(s);
+    return;
+
+ close:
+
+    xvp_proxy_close(s);
+}
+
+static void xvp_proxy_client_ready(xvp_watch *watch, unsigned int events)
+{
+    xvp_session *s = (xvp_session *)watch->arg;
+
+    if (s->closed)
+	return;
+
+    xvp_log_id = s->id;
+
+    /* hang up when we've nothing to read or write means client gone */
+    if ((events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+	!xvp_proxy_reading(s) && xvp_proxy_out_used(s) == 0) {
+	xvp_proxy_close(s);
+	return;
+    }
+
+    xvp_proxy_pump(s);
+}
+
+static void xvp_proxy_server_ready(xvp_watch *watch, unsigned int events)
+{
+    xvp_session *s = (xvp_session *)watch->arg;
+
+    if (s->closed || !s->ssl)
+	return;
+
+    xvp_log_id = s->id;
+    xvp_proxy_pump(s);
+}
+
+/*
+ * Take on a client connection passed to the event engine by master
+ */
+void xvp_proxy_start(xvp_vm *vm, int client_sock, unsigned int client_ip)
+{
+    xvp_session *s;
+    int flags, val = 1;
+
+    xvp_proxy_engine = true;
+
+    (void)setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    if ((flags = fcntl(client_sock, F_GETFL, 0)) == -1 ||
+	fcntl(client_sock, F_SETFL, flags | O_NONBLOCK) != 0) {
+	xvp_log_errno(XVP_LOG_ERROR, "fcntl");
+	close(client_sock);
+	return;
+    }
+
+    s = xvp_proxy_session_new(vm, client_sock, client_ip);
+    s->state = XVP_STATE_SERVER_VERSION;
+    s->client.fd = client_sock;
+    s->client.func = xvp_proxy_client_ready;
+    s->client.arg = s;
+    s->server.fd = -1;
+    s->server.func = xvp_proxy_server_ready;
+    s->server.arg = s;
+    s->timer.func = xvp_proxy_timeout;
+    s->timer.arg = s;
+    s->idle.func = xvp_proxy_idle;
+    s->idle.arg = s;
+    s->pace.func = xvp_proxy_paced;
+    s->pace.arg = s;
+    xvp_proxy_buf_init(&s->in);
+    xvp_proxy_buf_init(&s->out);
+    xvp_proxy_buf_init(&s->up);
+
+    /* until the job below has looked up its name */
+    (void)inet_ntop(AF_INET, &client_ip, s->client_hostname,
+		    sizeof(s->client_hostname));
+    xvp_proxy_set_name(s, vm);
+
+    xvp_proxy_submit(s, xvp_proxy_resolve_job, xvp_proxy_resolve_done);
+    xvp_proxy_update(s);
+    xvp_log_id = 0;
+}
+
+int xvp_proxy_active(void)
+{
+    return xvp_proxy_count;
 }
@@ -0,0 +1,384 @@
+/*
+ * frame_test.c - test of console message following for Xen VNC Proxy
+ *
+ * Copyright (C) 2009-2013, Colin Dean
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Generate streams of console messages, using every encoding frame.c
+ * follows, with random contents, noting where each message ends.  Then
+ * feed each stream to xvp_frame_feed() in random pieces, at times as
+ * splicing would, passing over what may be skipped unseen, and check
+ * that since always counts from the last message end, and updates the
+ * FramebufferUpdates ended.
+ *
+ * Run by "make check", which fails if this exits non-zero.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+
+#include "../xvp.h"
+
+#define STREAM_MAX   (64 * 1024 * 1024)
+#define MESSAGES     400
+#define SEEDS        8
+
+static unsigned char *stream;
+static unsigned long stream_len;
+static unsigned long ends[MESSAGES];
+static bool updates[MESSAGES];
+static int bpp, tpixel;
+
+void xvp_log(xvp_log_type type, char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+static int pick(int n)
+{
+    return rand() % n;
+}
+
+static void put_bytes(int len)
+{
+    int i;
+
+    if (stream_len + len > STREAM_MAX) {
+	fprintf(stderr, "stream too long\n");
+	exit(1);
+    }
+    for (i = 0; i < len; i++)
+	stream[stream_len++] = pick(256);
+}
+
+static void put_u8(int value)
+{
+    stream[stream_len++] = value;
+}
+
+static void put_u16(int value)
+{
+    put_u8(value >> 8);
+    put_u8(value);
+}
+
+static void put_u32(unsigned int value)
+{
+    put_u16(value >> 16);
+    put_u16(value);
+}
+
+static void put_rect(int w, int h, int encoding)
+{
+    put_u16(pick(100));
+    put_u16(pick(100));
+    put_u16(w);
+    put_u16(h);
+    put_u32(encoding);
+}
+
+static void put_compact(int len)
+{
+    if (len <= 0x7f) {
+	put_u8(len);
+    } else if (len <= 0x3fff) {
+	put_u8(0x80 | (len & 0x7f));
+	put_u8(len >> 7);
+    } else {
+	put_u8(0x80 | (len & 0x7f));
+	put_u8(0x80 | ((len >> 7) & 0x7f));
+	put_u8(len >> 14);
+    }
+}
+
+static void put_tight(int w, int h)
+{
+    int kind = pick(6), stream_id = pick(4) << 4, colours = 0, len;
+    static int lengths[] = { 3, 100, 300, 17000 };
+    static int palettes[] = { 2, 2, 5, 256 };
+
+    switch (kind) {
+    case 0: /* fill */
+	put_u8(0x80);
+	put_bytes(tpixel);
+	return;
+    case 1: /* JPEG or PNG */
+	len = lengths[pick(4)];
+	put_u8(pick(2) ? 0x90 : 0xa0);
+	put_compact(len);
+	put_bytes(len);
+	return;
+    case 2: /* basic, no filter */
+	put_u8(stream_id);
+	break;
+    case 3: /* copy filter */
+    case 4: /* gradient filter */
+	put_u8(stream_id | 0x40);
+	put_u8(kind == 3 ? 0 : 2);
+	break;
+    default: /* palette */
+	colours = palettes[pick(4)];
+	put_u8(stream_id | 0x40);
+	put_u8(1);
+	put_u8(colours - 1);
+	put_bytes(colours * tpixel);
+	break;
+    }
+
+    if (colours == 2)
+	len = (w + 7) / 8 * h;
+    else if (colours > 0)
+	len = w * h;
+    else
+	len = w * h * tpixel;
+
+    if (len < 12) {
+	put_bytes(len);
+    } else {
+	if (pick(5) > 0)
+	    len = lengths[pick(4)];
+	put_compact(len);
+	put_bytes(len);
+    }
+}
+
+static void put_hextile(int w, int h)
+{
+    int x, y, sub, n;
+
+    for (y = 0; y < h; y += 16) {
+	for (x = 0; x < w; x += 16) {
+	    put_u8(sub = pick(32));
+	    if (sub & 1) {
+		put_bytes((w - x < 16 ? w - x : 16) *
+			  (h - y < 16 ? h - y : 16) * bpp);
+		continue;
+	    }
+	    if (sub & 2)
+		put_bytes(bpp);
+	    if (sub & 4)
+		put_bytes(bpp);
+	    if (sub & 8) {
+		put_u8(n = pick(256));
+		put_bytes(n * (2 + ((sub & 16) ? bpp : 0)));
+	    }
+	}
+    }
+}
+
+static void put_update_rect(void)
+{
+    static int widths[] = { 0, 1, 3, 15, 16, 17, 40 };
+    static int heights[] = { 0, 1, 2, 16, 33 };
+    static int lengths[] = { 0, 1, 50, 70000 };
+    static int lengthy[] = { 6, 16, 17, -307 };
+    int w = widths[pick(7)], h = heights[pick(5)], n, sub;
+
+    switch (pick(18)) {
+    case 0:
+	put_rect(w, h, 0); /* Raw */
+	put_bytes(w * h * bpp);
+	break;
+    case 1:
+	put_rect(w, h, 1); /* CopyRect */
+	put_bytes(4);
+	break;
+    case 2:
+    case 3:
+	n = pick(20);
+	sub = pick(2) ? 8 : 4;
+	put_rect(w, h, sub == 8 ? 2 : 4); /* RRE or CoRRE */
+	put_u32(n);
+	put_bytes(bpp + n * (bpp + sub));
+	break;
+    case 4:
+	put_rect(w, h, 5); /* Hextile */
+	put_hextile(w, h);
+	break;
+    case 5: /* zlib, ZRLE, ZYWRLE or DesktopName */
+	n = lengths[pick(4)];
+	put_rect(w, h, lengthy[pick(4)]);
+	put_u32(n);
+	put_bytes(n);
+	break;
+    case 6:
+    case 7:
+	put_rect(w, h, 7); /* Tight */
+	put_tight(w, h);
+	break;
+    case 8:
+	put_rect(w, h, -239); /* Cursor */
+	put_bytes(w * h * bpp + (w + 7) / 8 * h);
+	break;
+    case 9:
+	put_rect(w, h, -240); /* XCursor */
+	if (w && h)
+	    put_bytes(6 + 2 * ((w + 7) / 8) * h);
+	break;
+    case 10:
+	put_rect(w, h, -223); /* DesktopSize */
+	break;
+    case 11:
+	put_rect(w, h, -261); /* QEMU LED state */
+	put_bytes(1);
+	break;
+    case 12:
+	put_rect(w, h, -257); /* QEMU pointer motion change */
+	break;
+    case 13:
+	put_rect(w, h, -258); /* QEMU extended key events */
+	break;
+    case 14:
+	put_rect(w, h, -232); /* PointerPos */
+	break;
+    case 15:
+	put_rect(w, h, -260); /* TightPNG */
+	put_tight(w, h);
+	break;
+    default:
+	n = pick(4);
+	put_rect(w, h, -308); /* ExtendedDesktopSize */
+	put_u8(n);
+	put_bytes(3 + 16 * n);
+	break;
+    }
+}
+
+/*
+ * Returns true if the message is a FramebufferUpdate
+ */
+static bool put_message(void)
+{
+    static int cut_lengths[] = { 0, 5, 1000 };
+    int n, i, last;
+
+    switch (pick(10)) {
+    case 6: /* Bell */
+	put_u8(2);
+	break;
+    case 7: /* SetColourMapEntries */
+	n = pick(300);
+	put_u8(1);
+	put_bytes(1);
+	put_u16(0);
+	put_u16(n);
+	put_bytes(6 * n);
+	break;
+    case 8:
+    case 9: /* ServerCutText */
+	n = cut_lengths[pick(3)];
+	put_u8(3);
+	put_bytes(3);
+	put_u32(n);
+	put_bytes(n);
+	break;
+    default: /* FramebufferUpdate, perhaps ended by LastRect */
+	n = pick(6);
+	last = (n > 0 && pick(4) == 0);
+	put_u8(0);
+	put_bytes(1);
+	put_u16(last ? 0xffff : n);
+	for (i = 0; i < n; i++)
+	    put_update_rect();
+	if (last)
+	    put_rect(0, 0, -224);
+	return true;
+    }
+
+    return false;
+}
+
+/*
+ * Feed the stream in random pieces, returning the number of times since,
+ * or the count of updates ended, was wrong
+ */
+static int check(bool unseen)
+{
+    unsigned char pf[16] = { 0 };
+    unsigned long pos = 0, last = 0, len;
+    unsigned long ended = 0;
+    int e = 0, bad = 0;
+    xvp_frame f;
+
+    pf[0] = bpp * 8;
+    pf[1] = (bpp == 4) ? 24 : bpp * 8;
+    pf[3] = 1;
+    pf[5] = pf[7] = pf[9] = 255;
+    xvp_frame_init(&f, pf, false);
+
+    while (pos < stream_len) {
+	len = 1 + pick(pick(4) ? 7 : 5000);
+	if (len > stream_len - pos)
+	    len = stream_len - pos;
+	if (unseen && f.skip > 0 && len > f.skip)
+	    len = f.skip;
+	xvp_frame_feed(&f, (unseen && f.skip > 0) ? NULL :
+		       (char *)stream + pos, len);
+	pos += len;
+	while (e < MESSAGES && ends[e] <= pos) {
+	    ended += updates[e];
+	    last = ends[e++];
+	}
+	if (f.off) {
+	    fprintf(stderr, "lost track at %lu\n", pos);
+	    return 1;
+	}
+	if (f.since != pos - last && bad++ < 5)
+	    fprintf(stderr, "at %lu: since %lu, expected %lu\n",
+		    pos, f.since, pos - last);
+	if (f.updates != ended && bad++ < 5)
+	    fprintf(stderr, "at %lu: %lu updates, expected %lu\n",
+		    pos, f.updates, ended);
+    }
+
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    static int depths[] = { 1, 2, 4 };
+    int d, seed, i, failed = 0;
+
+    stream = malloc(STREAM_MAX);
+
+    for (d = 0; d < 3; d++) {
+	bpp = depths[d];
+	tpixel = (bpp == 4) ? 3 : bpp;
+	for (seed = 1; seed <= SEEDS; seed++) {
+	    srand(seed);
+	    stream_len = 0;
+	    for (i = 0; i < MESSAGES; i++) {
+		updates[i] = put_message();
+		ends[i] = stream_len;
+	    }
+	    if (check(false) || check(true)) {
+		fprintf(stderr, "FAIL: %d bits per pixel, seed %d\n",
+			bpp * 8, seed);
+		failed++;
+	    }
+	}
+    }
+
+    printf("%s: %d of %d streams followed correctly\n",
+	   failed ? "FAIL" : "PASS", 3 * SEEDS - failed, 3 * SEEDS);
+    return failed ? 1 : 0;
+}
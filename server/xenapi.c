@@ -37,7 +37,9 @@
  * the pool: if it's not the master, it will tell us which server is, and
  * we connect to that instead.  If we get no response, we try another server
  * from the pool, until we've tried all the pool servers or have found the
- * master.
+ * master.  To avoid waiting on servers that are down, we first race TCP
+ * connections to all of them, starting with the last master we found,
+ * and try whichever answers first before the rest.
  *
  * We then find the VM with the right name, and the location of its console.
  * The latter is returned by the API as something like:
@@ -59,12 +61,22 @@
  * In order to reliably discover when a console goes away (e.g. on VM
  * shutdown, reboot, or migrate), we register ourselves with the API to
  * receive console events.
+ *
+ * Where master has started a broker (see broker.c), all of the above
+ * except the RFB connection is done by the broker, with one session per
+ * pool, and we are given its session ID and the console location, and
+ * hear about console events from it, saving our own session altogether.
  */
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -76,82 +88,323 @@
 #include "xvp.h"
 
 #define XVP_XENAPI_BUFLEN 256
+#define XVP_XENAPI_EVENT_WAIT 60.0 /* seconds, for event.from */
+#define XVP_XENAPI_PROBE_STAGGER 250 /* ms between probing pool hosts */
+#define XVP_XENAPI_TASK_WAIT 5.0 /* seconds, for event.from on a task */
 
 typedef struct { /* from XenServer C SDK 5.0.0 */
     xen_result_func func;
     void *handle;
 } xen_comms;
 
-static char  xvp_xenapi_host_url[XVP_MAX_HOSTNAME + 9]; /* https://hostname */
-static char  xvp_xenapi_console_url[XVP_XENAPI_BUFLEN]; /* see above */
-static xen_vm_set      *xvp_xenapi_vmset = NULL;
-static xen_console_set *xvp_xenapi_cset = NULL;
-static xen_session     *xvp_xenapi_session = NULL;
-static xen_console     *xvp_xenapi_console = NULL;
-
-bool xvp_vm_is_host = false;
-
-/* from XenServer C SDK 5.0.0 */
-static size_t write_func(void *ptr, size_t size, size_t nmemb, xen_comms *comms)
+struct xvp_xenapi { /* Xen API state for one client session */
+    char             host_url[XVP_MAX_HOSTNAME + 9]; /* https://hostname */
+    char             console_url[XVP_XENAPI_BUFLEN]; /* see above */
+    xen_vm_set      *vmset;
+    xen_console_set *cset;
+    xen_session     *session;
+    xen_console     *console;
+    bool             vm_is_host;
+    bool             events;      /* will wait for console events */
+    bool             brokered;    /* session belongs to the broker */
+    int              broker_sock; /* to hear of events from broker */
+    xvp_vm          *vm;
+    int              logins;
+    pthread_mutex_t  curl_lock;
+    CURL            *curl;        /* kept open between calls */
+    unsigned long    calls;
+    unsigned long    connects;
+    unsigned long    usec_total;
+    unsigned long    usec_max;
+    char            *token;       /* from event.from, if used */
+    xen_task         task;        /* VM operation for the client */
+    int              task_code;   /* ... as requested */
+    bool             task_own;    /* ... started by us, not joined */
+    char            *task_token;  /* from event.from on the task */
+    unsigned int     early_ip;    /* client not yet authenticated */
+};
+
+typedef struct xvp_xenapi_tls { /* session to resume, per console host */
+    struct xvp_xenapi_tls *next;
+    char                   ip[XVP_XENAPI_BUFLEN];
+    SSL_SESSION           *session;
+} xvp_xenapi_tls;
+
+char xvp_ssl_ciphers[XVP_MAX_CIPHERS + 1] = XVP_SSL_CIPHERS;
+char xvp_ssl_ciphersuites[XVP_MAX_CIPHERS + 1] = XVP_SSL_CIPHERSUITES;
+
+static SSL_CTX *xvp_xenapi_ssl_ctx = NULL;
+static xvp_xenapi_tls *xvp_xenapi_tls_cache = NULL;
+static pthread_mutex_t xvp_xenapi_tls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* from XenServer C SDK 5.0.0, but taking the void * that curl passes */
+static size_t write_func(void *ptr, size_t size, size_t nmemb, void *arg)
 {
+    xen_comms *comms = (xen_comms *)arg;
     size_t n = size * nmemb;
 
     return comms->func(ptr, n, comms->handle) ? n : 0;
 }
 
-/* from XenServer C SDK 5.0.0 */
-static int call_func(const void *data, size_t len, void *user_handle,
-		     void *result_handle, xen_result_func result_func)
+/*
+ * Log how long a call took, naming the method from its XML-RPC request
+ * if not given
+ */
+static void xvp_xenapi_log_call(const char *method, const char *data,
+				size_t len, unsigned long usec, long connects)
 {
-    (void)user_handle;
+    char name[64], *start, *end;
+
+    if (!method) {
+	strcpy(name, "call");
+	method = name;
+	if ((start = memmem(data, len, "<methodName>", 12))) {
+	    start += 12;
+	    if ((end = memmem(start, data + len - start,
+			      "</methodName>", 13)) &&
+		end - start < sizeof(name)) {
+		memcpy(name, start, end - start);
+		name[end - start] = '\0';
+	    }
+	}
+    }
+
+    xvp_log(XVP_LOG_DEBUG, "Xen API %s took %lu us%s", method, usec,
+	    connects ? ", with new connection" : "");
+}
+
+/*
+ * Originally from XenServer C SDK 5.0.0, but reusing one curl handle,
+ * and so its connection and TLS session, for successive calls, rather
+ * than connecting afresh each time.  A call made while another thread
+ * has the handle, such as one waiting for events, gets one of its own.
+ * The response is passed to the write function as it arrives.
+ */
+static int xvp_xenapi_post(xvp_xenapi *xa, char *url, const char *method,
+			   const void *data, size_t len,
+			   struct curl_slist *headers,
+			   size_t (*write)(void *, size_t, size_t, void *),
+			   void *write_arg)
+{
+    struct timespec start, end;
+    unsigned long usec, max;
+    long connects = 0;
+    bool shared;
+    CURL *curl;
+
+    if ((shared = (pthread_mutex_trylock(&xa->curl_lock) == 0))) {
+	if (!xa->curl)
+	    xa->curl = curl_easy_init();
+	curl = xa->curl;
+    } else {
+	curl = curl_easy_init();
+    }
 
-    CURL *curl = curl_easy_init();
     if (!curl) {
+	if (shared)
+	    pthread_mutex_unlock(&xa->curl_lock);
         return -1;
     }
 
-    xen_comms comms = {
-        .func = result_func,
-        .handle = result_handle
-    };
-
-    curl_easy_setopt(curl, CURLOPT_URL, xvp_xenapi_host_url);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1);
 #ifdef CURLOPT_MUTE
     curl_easy_setopt(curl, CURLOPT_MUTE, 1);
 #endif
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &write_func);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &comms);
+#ifdef CURLOPT_TCP_KEEPALIVE
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1);
+#endif
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, write_arg);
     curl_easy_setopt(curl, CURLOPT_POST, 1);
     curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
     curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, len);
     curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
     curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     CURLcode result = curl_easy_perform(curl);
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    curl_easy_cleanup(curl);
+    (void)curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+
+    if (shared)
+	pthread_mutex_unlock(&xa->curl_lock);
+    else
+	curl_easy_cleanup(curl);
+
+    usec = (end.tv_sec - start.tv_sec) * 1000000 +
+	(end.tv_nsec - start.tv_nsec) / 1000;
+    (void)__sync_fetch_and_add(&xa->calls, 1);
+    (void)__sync_fetch_and_add(&xa->connects, connects);
+    (void)__sync_fetch_and_add(&xa->usec_total, usec);
+    while ((max = xa->usec_max) < usec &&
+	   !__sync_bool_compare_and_swap(&xa->usec_max, max, usec))
+	/* empty */;
+
+    if (xvp_verbose)
+	xvp_xenapi_log_call(method, data, len, usec, connects);
 
     return result;
 }
 
-static void xvp_xenapi_cleanup(xen_session *session)
+/*
+ * XML-RPC calls made by libxenserver
+ */
+static int call_func(const void *data, size_t len, void *user_handle,
+		     void *result_handle, xen_result_func result_func)
 {
-    if (xvp_xenapi_cset) {
-	xen_console_set_free(xvp_xenapi_cset);
-	xvp_xenapi_cset = NULL;
+    xvp_xenapi *xa = (xvp_xenapi *)user_handle;
+
+    xen_comms comms = {
+        .func = result_func,
+        .handle = result_handle
+    };
+
+    return xvp_xenapi_post(xa, xa->host_url, NULL, data, len, NULL,
+			   &write_func, &comms);
+}
+
+/*
+ * Library initialisation is done once per session process, as early
+ * as possible: pre-forked workers do it before they have a client.
+ * Cleanup is left to process exit, so that reconnects can reuse it.
+ */
+void xvp_xenapi_init(void)
+{
+    static bool initialised = false;
+
+    if (initialised)
+	return;
+
+    SSL_library_init();
+    SSL_load_error_strings();
+    curl_global_init(CURL_GLOBAL_ALL);
+    xmlInitParser();
+    xen_init();
+
+    initialised = true;
+}
+
+xvp_xenapi *xvp_xenapi_create(bool events)
+{
+    xvp_xenapi *xa = xvp_alloc(sizeof(xvp_xenapi));
+
+    memset(xa, 0, sizeof(xvp_xenapi));
+    xa->events = events;
+    xa->broker_sock = -1;
+    pthread_mutex_init(&xa->curl_lock, NULL);
+    return xa;
+}
+
+static void xvp_xenapi_free_sets(xvp_xenapi *xa)
+{
+    if (xa->cset) {
+	xen_console_set_free(xa->cset);
+	xa->cset = NULL;
+    } else if (xa->brokered && xa->console) {
+	xvp_free(xa->console);
     }
-    if (xvp_xenapi_vmset) {
-	xen_vm_set_free(xvp_xenapi_vmset);
-	xvp_xenapi_vmset = NULL;
+    xa->console = NULL;
+
+    if (xa->vmset) {
+	xen_vm_set_free(xa->vmset);
+	xa->vmset = NULL;
     }
+}
 
-    curl_global_cleanup();
-    xmlCleanupParser();
-    xen_session_logout(session);
-    xen_fini();
+/*
+ * A session from the broker is the broker's to log out, so just free
+ * our copy of it, and hang up on the broker
+ */
+static void xvp_xenapi_unbroker(xvp_xenapi *xa, xen_session *session)
+{
+    xen_session_clear_error(session);
+    xvp_free((char *)session->session_id);
+    xvp_free(session);
+
+    if (xa->broker_sock >= 0) {
+	close(xa->broker_sock);
+	xa->broker_sock = -1;
+    }
+}
+
+static void xvp_xenapi_cleanup(xvp_xenapi *xa, xen_session *session)
+{
+    xvp_xenapi_free_sets(xa);
+
+    if (xa->brokered)
+	xvp_xenapi_unbroker(xa, session);
+    else
+	xen_session_logout(session);
+
+    xa->session = NULL;
+    xa->brokered = false;
+}
+
+/*
+ * Logs out of any Xen API session, which may mean a round trip to the
+ * pool master, so the event engine does this from a job thread.
+ */
+static void xvp_xenapi_task_free(xvp_xenapi *xa, bool destroy);
+
+void xvp_xenapi_destroy(xvp_xenapi *xa)
+{
+    xvp_xenapi_task_free(xa, false);
+    if (xa->session)
+	xvp_xenapi_cleanup(xa, xa->session);
+
+    if (xa->curl)
+	curl_easy_cleanup(xa->curl);
+    if (xa->token)
+	xvp_free(xa->token);
+    pthread_mutex_destroy(&xa->curl_lock);
+    xvp_free(xa);
+}
+
+bool xvp_xenapi_vm_is_host(xvp_xenapi *xa)
+{
+    return xa->vm_is_host;
+}
+
+int xvp_xenapi_logins(xvp_xenapi *xa)
+{
+    return xa->logins;
+}
+
+/*
+ * Where the broker is watching the console for us, its socket becomes
+ * readable when the console is deleted or the VM moves, so the event
+ * engine can watch that instead of waiting in xvp_xenapi_event_wait()
+ */
+int xvp_xenapi_event_fd(xvp_xenapi *xa)
+{
+    return xa->brokered ? xa->broker_sock : -1;
+}
+
+/*
+ * Until cleared, with 0, lookups are for a client that has yet to
+ * authenticate, which the broker may refuse, and which we don't log in
+ * for ourselves, as nothing would then limit them
+ */
+void xvp_xenapi_set_early(xvp_xenapi *xa, unsigned int client_ip)
+{
+    xa->early_ip = client_ip;
+}
+
+/*
+ * Log how many calls have been made, and how many needed a new
+ * connection, which with the handle kept open should be few
+ */
+void xvp_xenapi_dump(xvp_xenapi *xa, char *label)
+{
+    if (xa->calls == 0)
+	return;
 
-    xvp_xenapi_session = NULL;
+    xvp_log(XVP_LOG_INFO, "%s: %lu Xen API calls, %lu connections, "
+	    "taking mean %lu us, max %lu us", label, xa->calls, xa->connects,
+	    xa->usec_total / xa->calls, xa->usec_max);
 }
 
 static char *xvp_xenapi_error_code(xen_session *session)
@@ -161,7 +414,7 @@ static char *xvp_xenapi_error_code(xen_session *session)
     return session->error_description[0];
 }
 
-static bool xvp_xenapi_session_failure(xen_session *session)
+static bool xvp_xenapi_log_error(xen_session *session)
 {
     int i;
     char buf[XVP_XENAPI_BUFLEN];
@@ -173,8 +426,14 @@ static bool xvp_xenapi_session_failure(xen_session *session)
 		sizeof(buf) - strlen(buf) - 1);
     }
 
-    xvp_log(XVP_LOG_ERROR, buf);
-    xvp_xenapi_cleanup(session);
+    xvp_log(XVP_LOG_ERROR, "%s", buf);
+    return false;
+}
+
+static bool xvp_xenapi_session_failure(xvp_xenapi *xa, xen_session *session)
+{
+    xvp_xenapi_log_error(session);
+    xvp_xenapi_cleanup(xa, session);
     return false;
 }
 
@@ -209,53 +468,162 @@ static char *xvp_xenapi_ip_to_hostname(xen_session *session, char *ip)
     return hostname;
 }
 
-static xen_session *xvp_xenapi_get_console(xvp_vm *vm)
+static long long xvp_xenapi_msec(void)
 {
-    xvp_pool *pool = vm->pool;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Race connections to port 443 on each candidate, starting one every
+ * XVP_XENAPI_PROBE_STAGGER ms, in order, until one connects, returning
+ * its index, or -1 if none connects within XVP_CONNECT_TIMEOUT seconds,
+ * so that a host that's down costs only the stagger, not the timeout.
+ */
+static int xvp_xenapi_probe(char (*urls)[XVP_MAX_HOSTNAME + 9], int count)
+{
+    struct addrinfo hints, *ai;
+    struct pollfd *pfds;
+    long long start = xvp_xenapi_msec(), now, due;
+    int i, started = 0, inflight = 0, winner = -1, optval, timeout;
+    socklen_t optlen;
+
+    pfds = xvp_alloc(count * sizeof(struct pollfd));
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    while (winner < 0) {
+
+	now = xvp_xenapi_msec();
+	if (now - start >= XVP_CONNECT_TIMEOUT * 1000)
+	    break;
+
+	while (started < count &&
+	       (inflight == 0 ||
+		now >= start + started * XVP_XENAPI_PROBE_STAGGER)) {
+	    i = started++;
+	    pfds[i].fd = -1;
+	    pfds[i].events = POLLOUT;
+	    if (getaddrinfo(urls[i] + 8, "443", &hints, &ai) != 0)
+		continue;
+	    if ((pfds[i].fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0 &&
+		(fcntl(pfds[i].fd, F_SETFL, O_NONBLOCK) != 0 ||
+		 (xvp_connect_start(pfds[i].fd, ai->ai_addr,
+				    (int)ai->ai_addrlen) != 0 &&
+		  errno != EINPROGRESS))) {
+		close(pfds[i].fd);
+		pfds[i].fd = -1;
+	    }
+	    freeaddrinfo(ai);
+	    if (pfds[i].fd >= 0)
+		inflight++;
+	}
+
+	if (inflight == 0) {
+	    if (started == count)
+		break;
+	    continue;
+	}
+
+	due = started < count ? start + started * XVP_XENAPI_PROBE_STAGGER :
+	    start + XVP_CONNECT_TIMEOUT * 1000;
+	timeout = due > now ? due - now : 0;
+
+	if (poll(pfds, started, timeout) < 0 && errno != EINTR)
+	    break;
+
+	for (i = 0; i < started; i++) {
+	    if (pfds[i].fd < 0 || !pfds[i].revents)
+		continue;
+	    optlen = sizeof(optval);
+	    if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR,
+			   &optval, &optlen) == 0 && optval == 0) {
+		winner = i;
+		break;
+	    }
+	    close(pfds[i].fd);
+	    pfds[i].fd = -1;
+	    inflight--;
+	}
+    }
+
+    for (i = 0; i < started; i++)
+	if (pfds[i].fd >= 0)
+	    close(pfds[i].fd);
+    xvp_free(pfds);
+
+    return winner;
+}
+
+/*
+ * Log in to the pool master, trying the one we last found first, then
+ * whichever host answered the probe first, then the rest in turn
+ */
+static xen_session *xvp_xenapi_login(xvp_xenapi *xa, xvp_pool *pool)
+{
+    static pthread_mutex_t master_lock = PTHREAD_MUTEX_INITIALIZER;
     xvp_host *host;
     char password[XVP_MAX_XEN_PW + 1], escpassword[256];
+    char (*urls)[XVP_MAX_HOSTNAME + 9], *domainname;
     xen_session *session = NULL;
-    struct xen_string_set *classes;
-    int i;
-    enum xen_console_protocol protocol;
-    char *location, *domainname;
+    int i, count = 1, first;
 
-    if (session = xvp_xenapi_session)
-	goto have_session;
-
-    curl_global_init(CURL_GLOBAL_ALL);
-    xmlInitParser();
-    xen_init();
+    xvp_xenapi_init();
     memset(password, 0, sizeof(password));
 
-    for (host = pool->hosts; host; host = host->next) {
+    for (host = pool->hosts; host; host = host->next)
+	count++;
+    urls = xvp_alloc(count * sizeof(*urls));
 
-	if (session)
-	    xen_session_logout(session);
+    pthread_mutex_lock(&master_lock);
+    if (*pool->master)
+	sprintf(urls[0], "https://%s", pool->master);
+    pthread_mutex_unlock(&master_lock);
+    count = *urls[0] ? 1 : 0;
 
+    for (host = pool->hosts; host; host = host->next) {
 	if (host->address[0]) {
-	    sprintf(xvp_xenapi_host_url, "https://%s", host->address);
+	    sprintf(urls[count], "https://%s", host->address);
 	} else {
 	    domainname = host->hostname_is_ipv4 ? "" : pool->domainname;
-	    sprintf(xvp_xenapi_host_url, "https://%s%s",
+	    sprintf(urls[count], "https://%s%s",
 		    host->hostname, domainname);
 	}
-	xvp_log(XVP_LOG_DEBUG, "Trying host %s", xvp_xenapi_host_url + 8);
+	if (count == 0 || strcmp(urls[count], urls[0]))
+	    count++;
+    }
+
+    if ((first = xvp_xenapi_probe(urls, count)) > 0) {
+	strcpy(xa->host_url, urls[first]);
+	memmove(urls + 1, urls, first * sizeof(*urls));
+	strcpy(urls[0], xa->host_url);
+    }
+
+    for (i = 0; i < count; i++) {
+
+	if (session)
+	    xen_session_logout(session);
+
+	strcpy(xa->host_url, urls[i]);
+	xvp_log(XVP_LOG_DEBUG, "Trying host %s", xa->host_url + 8);
 
 	xvp_password_decrypt(pool->password, password, XVP_PASSWORD_XEN);
 	(void)xvp_xmlescape(password, escpassword, sizeof(escpassword));
 	
-	session = xen_session_login_with_password(call_func, NULL,
+	session = xen_session_login_with_password(call_func, xa,
 		      pool->manager, escpassword, xen_api_version_1_5);
 	if (!session->ok &&
 	    session->error_description_count > 0 &&
 	    !strcmp(session->error_description[0], "HOST_IS_SLAVE")) {
 	    xvp_log(XVP_LOG_DEBUG, "Redirected to %s",
 		    session->error_description[1]); 
-	    sprintf(xvp_xenapi_host_url, "https://%s",
+	    sprintf(xa->host_url, "https://%s",
 		    session->error_description[1]);
 	    xen_session_logout(session);
-	    session = xen_session_login_with_password(call_func, NULL,
+	    session = xen_session_login_with_password(call_func, xa,
 			  pool->manager, escpassword, xen_api_version_1_5);
 	}
 
@@ -268,20 +636,45 @@ static xen_session *xvp_xenapi_get_console(xvp_vm *vm)
 	    break;
     }	
 
-    if (!session->ok) {
-	xvp_xenapi_session_failure(session);
+    xvp_free(urls);
+    xa->logins++;
+
+    if (!session || !session->ok) {
+	if (session)
+	    xvp_xenapi_session_failure(xa, session);
 	return NULL;
     }
 
     xvp_log(XVP_LOG_DEBUG, "Xen API session established to %s",
-	    xvp_xenapi_host_url);
+	    xa->host_url);
+
+    pthread_mutex_lock(&master_lock);
+    strncpy(pool->master, xa->host_url + 8, XVP_MAX_HOSTNAME);
+    pthread_mutex_unlock(&master_lock);
+
+    return session;
+}
+
+/*
+ * Find the VM and the location of its console, leaving the VM and
+ * console sets for the caller to free
+ */
+static bool xvp_xenapi_find_console(xvp_xenapi *xa, xen_session *session,
+				    xvp_vm *vm)
+{
+    xvp_pool *pool = vm->pool;
+    xvp_host *host;
+    int i;
+    enum xen_console_protocol protocol;
+    char *location;
 
- have_session:
+    xvp_xenapi_free_sets(xa);
+    xa->vm_is_host = false;
 
     for (host = pool->hosts; host; host = host->next) {
 	if (!strcmp(host->hostname, vm->vmname) ||
 	    !strcmp(host->address, vm->vmname)) {
-	    xvp_vm_is_host = true;
+	    xa->vm_is_host = true;
 	    break;
 	}
     }
@@ -290,10 +683,8 @@ static xen_session *xvp_xenapi_get_console(xvp_vm *vm)
 	char label[XVP_MAX_HOSTNAME + 32], *hostname;
 	if (host->address[0]) {
 	    hostname = xvp_xenapi_ip_to_hostname(session, host->address);
-	    if (!hostname) {
-		xvp_xenapi_session_failure(session);
-		return NULL;
-	    }
+	    if (!hostname)
+		return xvp_xenapi_log_error(session);
 	    sprintf(label, "Control domain on host: %s", hostname);
 	    xvp_free(hostname);
 	} else {
@@ -301,91 +692,472 @@ static xen_session *xvp_xenapi_get_console(xvp_vm *vm)
 		    host->hostname, pool->domainname);
 	}
 	xvp_log(XVP_LOG_DEBUG, "%s", label);
-	if (!xen_vm_get_by_name_label(session, &xvp_xenapi_vmset, label)) {
-	    xvp_xenapi_session_failure(session);
-	    return NULL;
-	}
+	if (!xen_vm_get_by_name_label(session, &xa->vmset, label))
+	    return xvp_xenapi_log_error(session);
     } else if (*vm->uuid) {
 	xen_vm xvm;
 	char *label;
 	if (!xen_vm_get_by_uuid(session, &xvm, vm->uuid) ||
-	    !xen_vm_get_name_label(session, &label, xvm)) {
-	    xvp_xenapi_session_failure(session);
-	    return NULL;
-	}
-	xvp_xenapi_vmset = xen_vm_set_alloc(1);
-	xvp_xenapi_vmset->contents[0] = xvm;
+	    !xen_vm_get_name_label(session, &label, xvm))
+	    return xvp_xenapi_log_error(session);
+	xa->vmset = xen_vm_set_alloc(1);
+	xa->vmset->contents[0] = xvm;
 	strncpy(vm->vmname, label, XVP_MAX_HOSTNAME);
 	xvp_free(label);
 	xvp_log(XVP_LOG_DEBUG, "VM name label: %s", vm->vmname);
     } else {
 	char escvmname[256];
-	if (!xen_vm_get_by_name_label(session, &xvp_xenapi_vmset,
-		xvp_xmlescape(vm->vmname, escvmname, sizeof(escvmname)))) {
-	    xvp_xenapi_session_failure(session);
-	    return NULL;
-	}
+	if (!xen_vm_get_by_name_label(session, &xa->vmset,
+		xvp_xmlescape(vm->vmname, escvmname, sizeof(escvmname))))
+	    return xvp_xenapi_log_error(session);
     }
     
-    if (xvp_xenapi_vmset->size == 0) {
+    if (xa->vmset->size == 0) {
 	xvp_log(XVP_LOG_ERROR, "%s: VM not found", vm->vmname);
-	xvp_xenapi_cleanup(session);
-	return NULL;
-    } else if (xvp_xenapi_vmset->size > 1) {
+	return false;
+    } else if (xa->vmset->size > 1) {
 	xvp_log(XVP_LOG_ERROR, "%s: Multiple VMs with same name", vm->vmname);
-	return NULL;
+	return false;
     }	
 
-    if (!xen_vm_get_consoles(session, &xvp_xenapi_cset,
-			     xvp_xenapi_vmset->contents[0])) {
-	xvp_xenapi_session_failure(session);
-	return NULL;
-    }
+    if (!xen_vm_get_consoles(session, &xa->cset,
+			     xa->vmset->contents[0]))
+	return xvp_xenapi_log_error(session);
 
-    for (i = 0, location = NULL; i < xvp_xenapi_cset->size; i++) {
+    for (i = 0, location = NULL; i < xa->cset->size; i++) {
 	if (xen_console_get_protocol(session, &protocol,
-				     xvp_xenapi_cset->contents[i]) &&
+				     xa->cset->contents[i]) &&
 	    protocol == XEN_CONSOLE_PROTOCOL_RFB) {
 	    if (!xen_console_get_location(session, &location,
-					  xvp_xenapi_cset->contents[i])) {
-		xvp_xenapi_session_failure(session);
-		return NULL;
-	    }
-	    xvp_xenapi_console = xvp_xenapi_cset->contents[i];
+					  xa->cset->contents[i]))
+		return xvp_xenapi_log_error(session);
+	    xa->console = xa->cset->contents[i];
 	    break;
 	}
     }
 
     if (!location) {
 	xvp_log(XVP_LOG_ERROR, "%s: Console not found", vm->vmname);
-	xvp_xenapi_cleanup(session);
-	return NULL;
+	return false;
     }
 
     if (strlen(location) >= XVP_XENAPI_BUFLEN) {
 	xvp_log(XVP_LOG_ERROR, "%s: Console URL too long\n", vm->vmname);
-	xvp_xenapi_cleanup(session);
+	return false;
+    }
+
+    xvp_log(XVP_LOG_DEBUG, "Xen API console location: %s", location);
+
+    strcpy(xa->console_url, location);
+    /* free(location); not sure if this is valid */
+
+    return true;
+}
+
+/*
+ * Take the console's location, and the broker's session, from the
+ * broker, returning 1 if it found the console, 0 if not, or -1 if
+ * there's no broker, for us to log in ourselves
+ */
+static int xvp_xenapi_brokered(xvp_xenapi *xa, xvp_vm *vm)
+{
+    xvp_broker_reply reply;
+    xen_session *session;
+    int res;
+
+    if ((res = xvp_broker_lookup(vm, xa->events, xa->early_ip, &reply,
+				 &xa->broker_sock)) <= 0)
+	return res;
+
+    xa->brokered = true;
+    xa->vm_is_host = reply.vm_is_host;
+    strcpy(xa->host_url, reply.host_url);
+    strcpy(xa->console_url, reply.console_url);
+    if (*vm->uuid)
+	strncpy(vm->vmname, reply.vmname, XVP_MAX_HOSTNAME);
+
+    xa->vmset = xen_vm_set_alloc(1);
+    xa->vmset->contents[0] = xvp_strdup(reply.vm_ref);
+    xa->console = (xen_console *)xvp_strdup(reply.console_ref);
+
+    /* the SDK has no call to adopt an existing session, so make one */
+    session = xvp_alloc(sizeof(xen_session));
+    session->call_func = call_func;
+    session->handle = xa;
+    session->session_id = xvp_strdup(reply.session_id);
+    session->ok = true;
+    session->api_version = xen_api_version_1_5;
+    xa->session = session;
+
+    xvp_log(XVP_LOG_DEBUG, "Xen API console location from broker: %s",
+	    xa->console_url);
+    return 1;
+}
+
+static xen_session *xvp_xenapi_get_console(xvp_xenapi *xa, xvp_vm *vm)
+{
+    xen_session *session;
+    struct xen_string_set *classes;
+
+    xa->vm = vm;
+
+    /* a broker's session may have been renewed, so always ask again */
+    if (xa->brokered)
+	xvp_xenapi_cleanup(xa, xa->session);
+
+    if (!(session = xa->session)) {
+	switch (xvp_xenapi_brokered(xa, vm)) {
+	case 1:
+	    return xa->session;
+	case 0:
+	    return NULL;
+	}
+	if (xa->early_ip) {
+	    xvp_log(XVP_LOG_DEBUG, "No broker, so not connecting early");
+	    return NULL;
+	}
+	if (!(session = xvp_xenapi_login(xa, vm->pool)))
+	    return NULL;
+    }
+
+    if (!xvp_xenapi_find_console(xa, session, vm)) {
+	xvp_xenapi_cleanup(xa, session);
 	return NULL;
     }
 
+    if (!xa->events)
+	return session;
+
     classes = xen_string_set_alloc(1);
     classes->contents[0] = xvp_strdup("console");
 
-    if (!(xen_event_register(session, classes)))
-	xvp_xenapi_session_failure(session);
+    if (!(xen_event_register(session, classes))) {
+	xen_string_set_free(classes);
+	xvp_xenapi_session_failure(xa, session);
+	return NULL;
+    }
     xen_string_set_free(classes);
 
-    xvp_log(XVP_LOG_DEBUG, "Xen API console location: %s", location);
+    return session;
+}
 
-    strcpy(xvp_xenapi_console_url, location);
-    /* free(location); not sure if this is valid */
+/*
+ * In the broker, find which host a VM is running on, so as to tell when
+ * it has moved, leaving the buffer empty if it isn't running
+ */
+bool xvp_xenapi_resident_on(xvp_xenapi *xa, char *vm_ref,
+			    char *buf, int buflen)
+{
+    xen_host host;
 
-    return session;
+    *buf = '\0';
+    if (!xa->session)
+	return false;
+
+    if (!xen_vm_get_resident_on(xa->session, &host, (xen_vm)vm_ref)) {
+	xen_session_clear_error(xa->session);
+	return false;
+    }
+
+    strncpy(buf, (char *)host, buflen - 1);
+    buf[buflen - 1] = '\0';
+    xen_host_free(host);
+    return true;
 }
 
-static char *xvp_xenapi_get_header_line(SSL *ssl)
+/*
+ * In the broker, find a console with the pool's shared session, logging
+ * in again if it has expired, and give the caller all a session process
+ * needs to connect to the console and act on the VM
+ */
+bool xvp_xenapi_lookup(xvp_xenapi *xa, xvp_vm *vm, xvp_broker_reply *reply)
+{
+    bool found;
+    int tries;
+
+    for (tries = 0; tries < 2; tries++) {
+
+	if (!xa->session && !(xa->session = xvp_xenapi_login(xa, vm->pool)))
+	    return false;
+
+	if ((found = xvp_xenapi_find_console(xa, xa->session, vm))) {
+	    reply->vm_is_host = xa->vm_is_host;
+	    strncpy(reply->vmname, vm->vmname, XVP_MAX_HOSTNAME);
+	    strncpy(reply->host_url, xa->host_url,
+		    sizeof(reply->host_url) - 1);
+	    strncpy(reply->console_url, xa->console_url,
+		    sizeof(reply->console_url) - 1);
+	    strncpy(reply->session_id, xa->session->session_id,
+		    sizeof(reply->session_id) - 1);
+	    strncpy(reply->vm_ref, (char *)xa->vmset->contents[0],
+		    sizeof(reply->vm_ref) - 1);
+	    strncpy(reply->console_ref, (char *)xa->console,
+		    sizeof(reply->console_ref) - 1);
+	    (void)xvp_xenapi_resident_on(xa, reply->vm_ref, reply->host_ref,
+					 sizeof(reply->host_ref));
+	}
+	xvp_xenapi_free_sets(xa);
+
+	if (found)
+	    return true;
+
+	if (strcmp(xvp_xenapi_error_code(xa->session), "SESSION_INVALID")) {
+	    xen_session_clear_error(xa->session);
+	    return false;
+	}
+
+	xvp_log(XVP_LOG_INFO, "Xen API session expired, logging in again");
+	xvp_xenapi_cleanup(xa, xa->session);
+    }
+
+    return false;
+}
+
+/*
+ * In the broker, give a session process the pool's current session ID
+ * and master, for a console found earlier, logging in if need be
+ */
+bool xvp_xenapi_session_reply(xvp_xenapi *xa, xvp_pool *pool,
+			      xvp_broker_reply *reply)
+{
+    if (!xa->session && !(xa->session = xvp_xenapi_login(xa, pool)))
+	return false;
+
+    strncpy(reply->host_url, xa->host_url, sizeof(reply->host_url) - 1);
+    strncpy(reply->session_id, xa->session->session_id,
+	    sizeof(reply->session_id) - 1);
+    return true;
+}
+
+#ifdef XVP_EVENT_FROM
+/*
+ * Where libxenserver has event.from (XenServer 6.0 and later), build
+ * with XVP_EVENT_FROM defined to use that, which needs no registration,
+ * and picks up from a token, so that the first call, which returns every
+ * object, can be set aside before the cache is warmed.
+ */
+static bool xvp_xenapi_next_events(xvp_xenapi *xa,
+				   struct xen_string_set *classes,
+				   struct xen_event_record_set **events)
+{
+    struct xen_event_from *from;
+
+    if (!xen_event_from(xa->session, &from, classes,
+			xa->token ? xa->token : "", XVP_XENAPI_EVENT_WAIT))
+	return false;
+
+    if (xa->token)
+	xvp_free(xa->token);
+    xa->token = from->token;
+    from->token = NULL;
+    *events = from->events;
+    from->events = NULL;
+    xen_event_from_free(from);
+    return true;
+}
+#endif
+
+/*
+ * For a pool with TRANSPORT JSONRPC, event.from is called with JSON-RPC
+ * instead, whatever libxenserver has, and its response parsed as it
+ * arrives (see json.c), rather than built into an XML document and then
+ * into records, which for the first call, returning every VM and console
+ * in the pool, takes far more time and memory than the call itself.
+ */
+typedef struct xvp_xenapi_events {
+    xvp_xenapi *xa;
+    xvp_pool   *pool;
+    void      (*changed)(xvp_pool *pool, char *ref, bool deleted);
+    bool        result;
+    char        error[XVP_XENAPI_BUFLEN];
+    char        ref[XVP_XENAPI_BUFLEN];   /* of the event being parsed */
+    bool        deleted;
+} xvp_xenapi_events;
+
+static void xvp_xenapi_events_value(xvp_json *js, xvp_json_type type,
+				    char *value)
+{
+    xvp_xenapi_events *ev = (xvp_xenapi_events *)js->arg;
+    xvp_xenapi *xa = ev->xa;
+
+    if (js->depth == 1) {
+	if (!strcmp(js->keys[1], "result") && type == XVP_JSON_OBJECT)
+	    ev->result = true;
+	return;
+    } else if (js->depth < 2) {
+	return;
+    }
+
+    if (!strcmp(js->keys[1], "error")) {
+	if (type != XVP_JSON_STRING)
+	    return;
+	if ((js->depth == 2 && !strcmp(js->keys[2], "message")) ||
+	    (js->depth == 3 && !strcmp(js->keys[2], "data"))) {
+	    if (*ev->error)
+		strncat(ev->error, " ",
+			sizeof(ev->error) - strlen(ev->error) - 1);
+	    strncat(ev->error, value,
+		    sizeof(ev->error) - strlen(ev->error) - 1);
+	}
+	return;
+    }
+
+    if (strcmp(js->keys[1], "result"))
+	return;
+
+    if (js->depth == 2) {
+	if (type == XVP_JSON_STRING && !strcmp(js->keys[2], "token")) {
+	    if (xa->token)
+		xvp_free(xa->token);
+	    xa->token = xvp_strdup(value);
+	}
+	return;
+    }
+
+    if (strcmp(js->keys[2], "events"))
+	return;
+
+    if (js->depth == 3) {
+	if (type == XVP_JSON_OBJECT) {
+	    *ev->ref = '\0';
+	    ev->deleted = false;
+	} else if (type == XVP_JSON_END && *ev->ref && ev->changed) {
+	    ev->changed(ev->pool, ev->ref, ev->deleted);
+	}
+    } else if (js->depth == 4 && type == XVP_JSON_STRING) {
+	if (!strcmp(js->keys[4], "ref")) {
+	    strncpy(ev->ref, value, sizeof(ev->ref) - 1);
+	    ev->ref[sizeof(ev->ref) - 1] = '\0';
+	} else if (!strcmp(js->keys[4], "operation")) {
+	    ev->deleted = !strcmp(value, "del");
+	}
+    }
+}
+
+static size_t xvp_xenapi_json_write(void *ptr, size_t size, size_t nmemb,
+				    void *arg)
+{
+    size_t n = size * nmemb;
+
+    return xvp_json_feed((xvp_json *)arg, ptr, n) ? n : 0;
+}
+
+/*
+ * Passes each event to the callback as soon as it has been parsed, or
+ * none if the callback is NULL
+ */
+static bool xvp_xenapi_jsonrpc_events(xvp_xenapi *xa, xvp_pool *pool,
+		  void (*changed)(xvp_pool *pool, char *ref, bool deleted))
+{
+    char url[XVP_MAX_HOSTNAME + 17], request[2 * XVP_XENAPI_BUFLEN + 128];
+    char session_id[XVP_XENAPI_BUFLEN], token[XVP_XENAPI_BUFLEN];
+    struct curl_slist *headers;
+    xvp_xenapi_events ev;
+    xvp_json js;
+    int len, result;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.xa = xa;
+    ev.pool = pool;
+    ev.changed = changed;
+
+    sprintf(url, "%s/jsonrpc", xa->host_url);
+    len = snprintf(request, sizeof(request),
+		   "{\"jsonrpc\":\"2.0\",\"method\":\"event.from\","
+		   "\"params\":[%s,[\"vm\",\"console\"],%s,%.1f],"
+		   "\"id\":%lu}",
+		   xvp_json_quote((char *)xa->session->session_id,
+				  session_id, sizeof(session_id)),
+		   xvp_json_quote(xa->token ? xa->token : "",
+				  token, sizeof(token)),
+		   XVP_XENAPI_EVENT_WAIT, xa->calls + 1);
+
+    headers = curl_slist_append(NULL, "Content-Type: application/json");
+    xvp_json_init(&js, xvp_xenapi_events_value, &ev);
+    result = xvp_xenapi_post(xa, url, "event.from", request, len, headers,
+			     xvp_xenapi_json_write, &js);
+    curl_slist_free_all(headers);
+
+    if (result != 0 || !xvp_json_done(&js)) {
+	xvp_log(XVP_LOG_ERROR, "Xen API event.from failed: %s",
+		result ? "no response" : "bad JSON-RPC response");
+	return false;
+    } else if (*ev.error || !ev.result) {
+	xvp_log(XVP_LOG_ERROR, "Xen API error: %s",
+		*ev.error ? ev.error : "no result");
+	return false;
+    }
+
+    return true;
+}
+
+/*
+ * In the broker, wait on the pool's own session for VM and console
+ * events, passing the reference of each object changed to the callback,
+ * or NULL once events are being collected, as anything may have changed
+ * before then.  Only returns, having logged out, when the session fails,
+ * such as when it expires, for the caller to log in again.
+ */
+void xvp_xenapi_watch(xvp_xenapi *xa, xvp_pool *pool,
+		      void (*changed)(xvp_pool *pool, char *ref, bool deleted))
+{
+    struct xen_string_set *classes;
+    struct xen_event_record_set *events;
+    xen_event_record *event;
+    bool ok;
+    int i;
+
+    if (!(xa->session = xvp_xenapi_login(xa, pool)))
+	return;
+
+    if (pool->jsonrpc) {
+	if (xa->token) {
+	    xvp_free(xa->token);
+	    xa->token = NULL;
+	}
+	if ((ok = xvp_xenapi_jsonrpc_events(xa, pool, NULL)))
+	    changed(pool, NULL, false);
+	while (ok)
+	    ok = xvp_xenapi_jsonrpc_events(xa, pool, changed);
+	xvp_xenapi_cleanup(xa, xa->session);
+	return;
+    }
+
+    classes = xen_string_set_alloc(2);
+    classes->contents[0] = xvp_strdup("vm");
+    classes->contents[1] = xvp_strdup("console");
+
+#ifdef XVP_EVENT_FROM
+    if (xa->token) {
+	xvp_free(xa->token);
+	xa->token = NULL;
+    }
+    if ((ok = xvp_xenapi_next_events(xa, classes, &events))) {
+	xen_event_record_set_free(events);
+	changed(pool, NULL, false);
+    }
+
+    while (ok && (ok = xvp_xenapi_next_events(xa, classes, &events))) {
+#else
+    if ((ok = xen_event_register(xa->session, classes)))
+	changed(pool, NULL, false);
+
+    while (ok && (ok = xen_event_next(xa->session, &events))) {
+#endif
+	for (i = 0; i < events->size; i++) {
+	    event = events->contents[i];
+	    changed(pool, event->ref,
+		    event->operation == XEN_EVENT_OPERATION_DEL);
+	}
+	xen_event_record_set_free(events);
+    }
+
+    xen_string_set_free(classes);
+    xvp_xenapi_session_failure(xa, xa->session);
+}
+
+static char *xvp_xenapi_get_header_line(SSL *ssl, char *buf, int buflen)
 {
-    static char buf[XVP_XENAPI_BUFLEN];
     char *bp;
     int len;
 
@@ -394,7 +1166,7 @@ static char *xvp_xenapi_get_header_line(SSL *ssl)
      * shouldn't be more than a handful of header lines, and it's
      * simpler if we can avoid overshooting into RFB handshaking.
      */
-    for (bp = buf; bp < buf + sizeof(buf) - 1; bp++) {
+    for (bp = buf; bp < buf + buflen - 1; bp++) {
 	if ((len = SSL_read(ssl, bp, 1)) != 1)
 	    return NULL;
 	if (*bp == '\r') {
@@ -408,19 +1180,134 @@ static char *xvp_xenapi_get_header_line(SSL *ssl)
     return NULL;
 }
 
-static SSL *xvp_xenapi_connect_to_rfb(xen_session *session)
+/*
+ * One SSL context serves every console connection made by this
+ * process, created on first use, so that the cipher list is parsed once,
+ * and so that sessions saved from one connection can be resumed by the
+ * next, whichever thread makes it.
+ */
+static SSL_CTX *xvp_xenapi_get_ssl_ctx(void)
+{
+    SSL_CTX *ctx;
+
+    pthread_mutex_lock(&xvp_xenapi_tls_lock);
+
+    if ((ctx = xvp_xenapi_ssl_ctx)) {
+	pthread_mutex_unlock(&xvp_xenapi_tls_lock);
+	return ctx;
+    }
+
+    if (!(ctx = SSL_CTX_new((SSL_METHOD *)SSLv23_client_method()))) {
+	pthread_mutex_unlock(&xvp_xenapi_tls_lock);
+	xvp_log(XVP_LOG_ERROR, "SSL_CTX_new: Failed");
+	return NULL;
+    }
+
+    /* we keep sessions ourselves, keyed by host rather than by context */
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+				   SSL_SESS_CACHE_NO_INTERNAL_STORE);
+
+    if (!SSL_CTX_set_cipher_list(ctx, xvp_ssl_ciphers))
+	xvp_log(XVP_LOG_ERROR, "SSL ciphers \"%s\" not usable, using default",
+		xvp_ssl_ciphers);
+#ifdef TLS1_3_VERSION
+    if (!SSL_CTX_set_ciphersuites(ctx, xvp_ssl_ciphersuites))
+	xvp_log(XVP_LOG_ERROR, "SSL ciphersuites \"%s\" not usable, "
+		"using default", xvp_ssl_ciphersuites);
+#endif
+
+#ifdef SSL_OP_ENABLE_KTLS
+    /* have the kernel take over the cipher once agreed, if it can */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    xvp_xenapi_ssl_ctx = ctx;
+    pthread_mutex_unlock(&xvp_xenapi_tls_lock);
+    return ctx;
+}
+
+static xvp_xenapi_tls *xvp_xenapi_tls_find(char *ip)
+{
+    xvp_xenapi_tls *tls;
+
+    for (tls = xvp_xenapi_tls_cache; tls; tls = tls->next)
+	if (strcmp(tls->ip, ip) == 0)
+	    return tls;
+
+    return NULL;
+}
+
+/*
+ * Offer the session last agreed with this host, if any, so that a
+ * reconnect, or a further client of a VM on the same host, skips the
+ * full handshake.
+ */
+static void xvp_xenapi_tls_resume(SSL *ssl, char *ip)
+{
+    xvp_xenapi_tls *tls;
+
+    pthread_mutex_lock(&xvp_xenapi_tls_lock);
+    if ((tls = xvp_xenapi_tls_find(ip)) && tls->session)
+	SSL_set_session(ssl, tls->session);
+    pthread_mutex_unlock(&xvp_xenapi_tls_lock);
+}
+
+/*
+ * Called once the HTTP response has been read, by which time any
+ * TLS 1.3 session ticket will have arrived along with it.
+ */
+static void xvp_xenapi_tls_save(SSL *ssl, char *ip)
+{
+    xvp_xenapi_tls *tls;
+    SSL_SESSION *session;
+
+    if (!(session = SSL_get1_session(ssl)))
+	return;
+
+    pthread_mutex_lock(&xvp_xenapi_tls_lock);
+
+    if (!(tls = xvp_xenapi_tls_find(ip))) {
+	tls = xvp_alloc(sizeof(xvp_xenapi_tls));
+	strcpy(tls->ip, ip);
+	tls->next = xvp_xenapi_tls_cache;
+	xvp_xenapi_tls_cache = tls;
+    }
+
+    if (tls->session)
+	SSL_SESSION_free(tls->session);
+    tls->session = session;
+
+    pthread_mutex_unlock(&xvp_xenapi_tls_lock);
+}
+
+/* A host that refused to resume may have restarted: forget its session */
+static void xvp_xenapi_tls_forget(char *ip)
+{
+    xvp_xenapi_tls *tls;
+
+    pthread_mutex_lock(&xvp_xenapi_tls_lock);
+    if ((tls = xvp_xenapi_tls_find(ip)) && tls->session) {
+	SSL_SESSION_free(tls->session);
+	tls->session = NULL;
+    }
+    pthread_mutex_unlock(&xvp_xenapi_tls_lock);
+}
+
+static SSL *xvp_xenapi_connect_to_rfb(xvp_xenapi *xa, xen_session *session)
 {
     char buf[XVP_XENAPI_BUFLEN], ip[XVP_XENAPI_BUFLEN], uri[XVP_XENAPI_BUFLEN];
     char *line;
     int sock, len;
     unsigned int major, minor;
     struct sockaddr_in connect_addr;
-    SSL_METHOD *method;
+    struct timespec start, end;
+    unsigned long usec;
+    bool resumed;
     SSL_CTX *ctx;
     SSL *ssl;
     BIO *bio;
 
-    if (sscanf(xvp_xenapi_console_url, "https://%[^/]/%s", ip, uri) != 2) {
+    if (sscanf(xa->console_url, "https://%[^/]/%s", ip, uri) != 2) {
 	xvp_log(XVP_LOG_ERROR, "Failed to parse console location");
 	return NULL;
     }
@@ -437,25 +1324,32 @@ static SSL *xvp_xenapi_connect_to_rfb(xen_session *session)
     if (connect(sock, (struct sockaddr *)&connect_addr,
 		sizeof(connect_addr)) != 0) {
 	xvp_log_errno(XVP_LOG_ERROR, "connect");
+	close(sock);
 	return NULL;
     }
 
-    SSL_library_init();
-    SSL_load_error_strings();
-
-    method = (SSL_METHOD *)SSLv23_client_method();
-    if (!(ctx = SSL_CTX_new(method))) {
-	xvp_log(XVP_LOG_ERROR, "SSL_ctx_new: Failed");
+    if (!(ctx = xvp_xenapi_get_ssl_ctx()) || !(ssl = SSL_new(ctx))) {
+	close(sock);
 	return NULL;
     }
-    ssl = SSL_new(ctx);
     bio = BIO_new_socket(sock, BIO_NOCLOSE);
     SSL_set_bio(ssl, bio, bio);
+    xvp_xenapi_tls_resume(ssl, ip);
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     if (SSL_connect(ssl) <= 0) {
 	xvp_log(XVP_LOG_ERROR, "SSL_connect: Failed");
-	return NULL;
+	xvp_xenapi_tls_forget(ip);
+	goto fail;
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    usec = (end.tv_sec - start.tv_sec) * 1000000 +
+	(end.tv_nsec - start.tv_nsec) / 1000;
+    resumed = SSL_session_reused(ssl);
+    xvp_log(XVP_LOG_DEBUG, "TLS handshake with %s took %lu us (%s), %s %s",
+	    ip, usec, resumed ? "resumed" : "full",
+	    SSL_get_version(ssl), SSL_get_cipher_name(ssl));
 
     sprintf(buf, "CONNECT /%s&session_id=%s HTTP/1.0\r\n\r\n",
 	    uri, session->session_id);
@@ -463,61 +1357,107 @@ static SSL *xvp_xenapi_connect_to_rfb(xen_session *session)
 
     if (SSL_write(ssl, buf, len) <= 0) {
 	xvp_log(XVP_LOG_ERROR, "SSL_write: Failed");
-	return NULL;
+	goto fail;
     }
 
-    if (!(line = xvp_xenapi_get_header_line(ssl))) {
+    if (!(line = xvp_xenapi_get_header_line(ssl, buf, sizeof(buf)))) {
 	xvp_log(XVP_LOG_ERROR, "Failed to read/parse header");
-	return NULL;
+	goto fail;
     }
 
     if (strcmp(line, "HTTP/1.1 200 OK") != 0) {
 	xvp_log(XVP_LOG_ERROR, "Failure code: %s", line);
-	return NULL;
+	goto fail;
     }
 
     do {
-	if (!(line = xvp_xenapi_get_header_line(ssl))) {
+	if (!(line = xvp_xenapi_get_header_line(ssl, buf, sizeof(buf)))) {
 	    xvp_log(XVP_LOG_ERROR, "Failed to read/parse header");
-	    return NULL;
+	    goto fail;
 	}
     } while (*line);
 
+    xvp_xenapi_tls_save(ssl, ip);
+
     xvp_log(XVP_LOG_DEBUG, "Connected to console");
     return ssl;
+
+ fail:
+
+    xvp_xenapi_close_stream(ssl);
+    return NULL;
 }
 
-void *xvp_xenapi_open_stream(xvp_vm *vm)
+void *xvp_xenapi_open_stream(xvp_xenapi *xa, xvp_vm *vm)
 {
     xen_session *session;
     SSL *ssl;
 
-    if (!(session = xvp_xenapi_get_console(vm)))
+    if (!(session = xvp_xenapi_get_console(xa, vm)))
 	return NULL;
 
-    ssl = xvp_xenapi_connect_to_rfb(session);
+    ssl = xvp_xenapi_connect_to_rfb(xa, session);
     
 #if 0
     /* keep session for event handling */
-    xvp_xenapi_cleanup(session);
+    xvp_xenapi_cleanup(xa, session);
 #endif
 
-    xvp_xenapi_session = session;
+    xa->session = session;
     return (void *)ssl;
 }
 
-bool xvp_xenapi_event_wait(xvp_vm *vm)
+/*
+ * True if the kernel is decrypting console output (kTLS), so that plain
+ * RFB data can be read straight from the socket, such as by splice(2)
+ */
+bool xvp_xenapi_stream_ktls(void *stream)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    return BIO_get_ktls_recv(SSL_get_rbio((SSL *)stream));
+#else
+    return false;
+#endif
+}
+
+/*
+ * The socket is opened with BIO_NOCLOSE, so must be closed separately
+ */
+void xvp_xenapi_close_stream(void *stream)
+{
+    SSL *ssl = (SSL *)stream;
+    int sock = SSL_get_fd(ssl);
+
+    SSL_free(ssl);
+    if (sock >= 0)
+	close(sock);
+}
+
+bool xvp_xenapi_event_wait(xvp_xenapi *xa, xvp_vm *vm)
 {
-    xen_session *session = xvp_xenapi_session;
+    xen_session *session = xa->session;
     struct xen_event_record_set *events;
     xen_event_record *event;
     char *uuid;
     int i;
 
+    if (xa->brokered) {
+	switch (xvp_broker_wait(xa->broker_sock)) {
+	case XVP_BROKER_DELETED:
+	    xvp_log(XVP_LOG_DEBUG, "Console deleted by server");
+	    return true;
+	case XVP_BROKER_MOVED:
+	    xvp_log(XVP_LOG_DEBUG, "VM moved to another host");
+	    return true;
+	}
+	xvp_log(XVP_LOG_ERROR, "Lost contact with broker");
+	return false;
+    }
+
     while (true) {
 	
         if (!xen_event_next(session, &events)) {
-	    xvp_xenapi_session_failure(session);
+	    xvp_xenapi_session_failure(xa, session);
 	    break;
 	}
 
@@ -532,7 +1472,7 @@ bool xvp_xenapi_event_wait(xvp_vm *vm)
 		 * does set event->ref to "OpaqueRef:UUID" which will be the
 		 * same as our console handle pointer coerced to a string!
 		 */
-		if (!strcmp(event->ref, (char *)xvp_xenapi_console)) {
+		if (!strcmp(event->ref, (char *)xa->console)) {
 		    xvp_log(XVP_LOG_DEBUG, "Console deleted by server");
 		    xen_event_record_set_free(events);
 		    return true;
@@ -546,19 +1486,121 @@ bool xvp_xenapi_event_wait(xvp_vm *vm)
     return false;
 }
 
-bool xvp_xenapi_handle_message_code(int code)
+/*
+ * The broker's session may have expired since we were given it, in
+ * which case it will log in again, and give us the new session ID
+ */
+static bool xvp_xenapi_rebroker(xvp_xenapi *xa, xen_session *session)
+{
+    xvp_broker_reply reply;
+
+    if (!xa->brokered ||
+	strcmp(xvp_xenapi_error_code(session), "SESSION_INVALID") ||
+	xvp_broker_lookup(xa->vm, false, 0, &reply, NULL) <= 0)
+	return false;
+
+    xen_session_clear_error(session);
+    xvp_free((char *)session->session_id);
+    session->session_id = xvp_strdup(reply.session_id);
+    return true;
+}
+
+/*
+ * Forget the client's VM operation, destroying its task if we started
+ * it and it has finished, as XenServer otherwise keeps it for a while
+ */
+static void xvp_xenapi_task_free(xvp_xenapi *xa, bool destroy)
+{
+    if (xa->task) {
+	if (destroy && xa->task_own && xa->session &&
+	    !xen_task_destroy(xa->session, xa->task))
+	    xen_session_clear_error(xa->session);
+	xen_task_free(xa->task);
+	xa->task = NULL;
+    }
+
+    if (xa->task_token) {
+	xvp_free(xa->task_token);
+	xa->task_token = NULL;
+    }
+}
+
+/*
+ * If the VM already has the operation requested in progress, whoever
+ * asked for it, follow that task rather than starting another
+ */
+static bool xvp_xenapi_task_join(xvp_xenapi *xa, xen_session *session,
+				 xen_vm xvm, int code)
+{
+    xen_string_vm_operations_map *ops;
+    enum xen_vm_operations op;
+    int i;
+
+    switch (code) {
+    case XVP_MESSAGE_CODE_SHUTDOWN:
+	op = XEN_VM_OPERATIONS_CLEAN_SHUTDOWN;
+	break;
+    case XVP_MESSAGE_CODE_REBOOT:
+	op = XEN_VM_OPERATIONS_CLEAN_REBOOT;
+	break;
+    case XVP_MESSAGE_CODE_RESET:
+	op = XEN_VM_OPERATIONS_HARD_REBOOT;
+	break;
+    default:
+	return false;
+    }
+
+    if (!xen_vm_get_current_operations(session, &ops, xvm)) {
+	xen_session_clear_error(session);
+	return false;
+    }
+
+    for (i = 0; i < ops->size; i++) {
+	if (ops->contents[i].val == op) {
+	    xa->task = (xen_task)xvp_strdup(ops->contents[i].key);
+	    xa->task_own = false;
+	    break;
+	}
+    }
+
+    xen_string_vm_operations_map_free(ops);
+    return xa->task != NULL;
+}
+
+/*
+ * Start the VM operation a client has asked for, as a task, returning
+ * as soon as XenServer has accepted it, for xvp_xenapi_task_wait() to
+ * follow.  Requests for an operation already in progress, such as from
+ * several clients of the same VM at once, all follow the one task.
+ */
+bool xvp_xenapi_task_start(xvp_xenapi *xa, int code)
 {
     char *text = xvp_message_code_to_text(code);
     xen_session *session;
     xen_vm xvm;
     bool ok = false, ha;
+    int tries;
 
     xvp_log(XVP_LOG_INFO, "Client %s request received", text); 
 
-    if ((session = xvp_xenapi_session) && xvp_xenapi_vmset &&
-	xvp_xenapi_vmset->size == 1) {
+    xvp_xenapi_task_free(xa, false);
+    xa->task_code = code;
+
+    for (tries = 0; !ok && tries < 2; tries++) {
+
+	if (!(session = xa->session) || !xa->vmset ||
+	    xa->vmset->size != 1 ||
+	    (tries > 0 && !xvp_xenapi_rebroker(xa, session)))
+	    break;
+
+	xvm = xa->vmset->contents[0];
 
-	xvm = xvp_xenapi_vmset->contents[0];
+	if (xvp_xenapi_task_join(xa, session, xvm, code)) {
+	    xvp_log(XVP_LOG_INFO, "Client %s request joins one in progress",
+		    text);
+	    ok = true;
+	    break;
+	}
 
 	switch (code) {
 	case XVP_MESSAGE_CODE_SHUTDOWN:
@@ -566,31 +1608,153 @@ bool xvp_xenapi_handle_message_code(int code)
 		xvp_log(XVP_LOG_DEBUG, "Disabling HA prior to shutdown");
 		xen_vm_set_ha_always_run(session, xvm, false);
 	    }
-	    ok = xen_vm_clean_shutdown(session, xvm);
+	    ok = xen_vm_clean_shutdown_async(session, &xa->task, xvm);
 	    break;
 	case XVP_MESSAGE_CODE_REBOOT:
-	    ok = xen_vm_clean_reboot(session, xvm);
+	    ok = xen_vm_clean_reboot_async(session, &xa->task, xvm);
 	    break;
 	case XVP_MESSAGE_CODE_RESET:
-	    ok = xen_vm_hard_reboot(session, xvm);
+	    ok = xen_vm_hard_reboot_async(session, &xa->task, xvm);
 	    break;
 	default:
 	    ok = false;
 	    break;
 	}	
+	xa->task_own = ok;
+
+	/* someone else's identical request may have just beaten us to it */
+	if (!ok && !strcmp(xvp_xenapi_error_code(session),
+			   "OTHER_OPERATION_IN_PROGRESS")) {
+	    xen_session_clear_error(session);
+	    if (!(ok = xvp_xenapi_task_join(xa, session, xvm, code))) {
+		xvp_log(XVP_LOG_ERROR, "Client %s request failed: "
+			"OTHER_OPERATION_IN_PROGRESS", text);
+		return false;
+	    }
+	}
     }
 
     if (!ok) {
 	xvp_log(XVP_LOG_ERROR, "Client %s request failed: %s",
-		text, xvp_xenapi_error_code(session));
-	xen_session_clear_error(session);
+		text, session ? xvp_xenapi_error_code(session) : "NO_SESSION");
+	if (session)
+	    xen_session_clear_error(session);
 	return false;
     }
 
-    xvp_log(XVP_LOG_INFO, "Client %s request succeeded", text);
+    xvp_log(XVP_LOG_DEBUG, "Client %s request is task %s",
+	    text, (char *)xa->task);
     return true;
 }
 
+#ifdef XVP_EVENT_FROM
+/*
+ * Wait until the task changes, or XVP_XENAPI_TASK_WAIT seconds pass,
+ * the first call returning at once.  Unlike xen_event_register(), this
+ * needs no registration, so is safe on the broker's session.
+ */
+static void xvp_xenapi_task_event(xvp_xenapi *xa, xen_session *session)
+{
+    struct xen_string_set *classes;
+    struct xen_event_from *from;
+    char class[XVP_XENAPI_BUFLEN];
+
+    snprintf(class, sizeof(class), "task/%s", (char *)xa->task);
+    classes = xen_string_set_alloc(1);
+    classes->contents[0] = xvp_strdup(class);
+
+    if (xen_event_from(session, &from, classes,
+		       xa->task_token ? xa->task_token : "",
+		       XVP_XENAPI_TASK_WAIT)) {
+	if (xa->task_token)
+	    xvp_free(xa->task_token);
+	xa->task_token = from->token;
+	from->token = NULL;
+	xen_event_from_free(from);
+    } else {
+	xen_session_clear_error(session);
+	sleep(1);
+    }
+
+    xen_string_set_free(classes);
+}
+#endif
+
+/*
+ * Wait for the task started by xvp_xenapi_task_start() to progress,
+ * returning how far it has got, as a percentage below 100 while still
+ * pending, 100 once it has succeeded, or -1 if it has failed.  Without
+ * event.from, this checks the task once a second instead.  A task we
+ * joined may be destroyed by its owner before we see how it ended, and
+ * as we can't then tell whether it succeeded, we report it as failed.
+ */
+int xvp_xenapi_task_wait(xvp_xenapi *xa)
+{
+    char *text = xvp_message_code_to_text(xa->task_code);
+    xen_session *session = xa->session;
+    struct xen_string_set *info;
+    enum xen_task_status_type status;
+    double progress;
+    bool ok = false;
+    int tries;
+
+    if (!xa->task || !session)
+	return -1;
+
+#ifdef XVP_EVENT_FROM
+    xvp_xenapi_task_event(xa, session);
+#else
+    sleep(1);
+#endif
+
+    for (tries = 0; !ok && tries < 2; tries++) {
+	if (tries > 0 && !xvp_xenapi_rebroker(xa, session))
+	    break;
+	ok = xen_task_get_status(session, &status, xa->task) &&
+	    xen_task_get_progress(session, &progress, xa->task);
+    }
+
+    if (!ok) {
+	/* a task we joined is destroyed by its owner once it finishes */
+	if (!xa->task_own && !strcmp(xvp_xenapi_error_code(session),
+				     "HANDLE_INVALID")) {
+	    xen_session_clear_error(session);
+	    xvp_log(XVP_LOG_ERROR, "Client %s request finished, "
+		    "with outcome unknown", text);
+	    xvp_xenapi_task_free(xa, false);
+	    return -1;
+	}
+	xvp_log(XVP_LOG_ERROR, "Client %s request lost: %s",
+		text, xvp_xenapi_error_code(session));
+	xen_session_clear_error(session);
+	xvp_xenapi_task_free(xa, false);
+	return -1;
+    }
+
+    switch (status) {
+    case XEN_TASK_STATUS_TYPE_PENDING:
+	return progress < 0.0 ? 0 : progress > 0.99 ? 99 : progress * 100;
+    case XEN_TASK_STATUS_TYPE_SUCCESS:
+	xvp_log(XVP_LOG_INFO, "Client %s request succeeded", text);
+	xvp_xenapi_task_free(xa, true);
+	return 100;
+    default:
+	break;
+    }
+
+    if (xen_task_get_error_info(session, &info, xa->task)) {
+	xvp_log(XVP_LOG_ERROR, "Client %s request failed: %s", text,
+		info->size > 0 ? info->contents[0] : "CANCELLED");
+	xen_string_set_free(info);
+    } else {
+	xen_session_clear_error(session);
+	xvp_log(XVP_LOG_ERROR, "Client %s request failed", text);
+    }
+
+    xvp_xenapi_task_free(xa, true);
+    return -1;
+}
+
 bool xvp_xenapi_is_uuid(char *text)
 {
     int dashes[] = XVP_UUID_DASHES;
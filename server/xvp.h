@@ -60,11 +60,45 @@ typedef enum {
     XVP_IPCHECK_HTTP
 } xvp_ipcheck;
 
+typedef enum {
+    XVP_ENGINE_FORK,
+    XVP_ENGINE_PREFORK,
+    XVP_ENGINE_EVENT
+} xvp_engine;
+
+#define XVP_ENGINE_MODE XVP_ENGINE_FORK
+#define XVP_PREFORK_MIN 4
+#define XVP_PREFORK_MAX 32
+#define XVP_PREFORK_IDLE 300
+#define XVP_PREFORK_DELAY 10 /* milliseconds */
+#define XVP_PREFORK_MAX_LIMIT 1024
+#define XVP_ENGINE_THREADS 8
+#define XVP_ENGINE_MAX_THREADS 64
+#define XVP_ENGINE_SHARDS 1
+#define XVP_ENGINE_MAX_SHARDS 64
+
 #define XVP_OTP_MODE XVP_OTP_ALLOW
 #define XVP_OTP_IPCHECK XVP_IPCHECK_OFF
 #define XVP_OTP_WINDOW 60
 #define XVP_OTP_MAX_WINDOW 3600
 
+/* favouring ciphers the kernel can take over (kTLS) */
+#define XVP_SSL_CIPHERS "ECDHE+AESGCM:ECDHE+CHACHA20:AESGCM:HIGH:!aNULL:!MD5:!RC4"
+#define XVP_SSL_CIPHERSUITES \
+    "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"
+#define XVP_MAX_CIPHERS 255
+
+#define XVP_MAX_FRAMERATE 100 /* per second, 0 for no limit */
+#define XVP_MAX_PASTERATE 1000 /* characters per second, likewise */
+
+#define XVP_BROKER_TIMEOUT 60 /* seconds to wait for a lookup */
+#define XVP_BROKER_RETRY   10 /* seconds between broker restarts */
+
+#define XVP_UPGRADE_TIMEOUT 30 /* seconds for a new master to take over */
+#define XVP_UPGRADE_MAX_ENV 65536 /* longest description of listeners */
+#define XVP_UPGRADE_FDS_ENV   "XVP_LISTEN_FDS"    /* listeners inherited */
+#define XVP_UPGRADE_READY_ENV "XVP_UPGRADE_READY" /* old master's pipe */
+
 #define XVP_MAX_POOL     80
 #define XVP_MAX_MANAGER  32
 #define XVP_MAX_HOSTNAME 80 /* should be >= MAXHOSTNAMELEN */
@@ -79,23 +113,35 @@ typedef struct xvp_pool xvp_pool;
 typedef struct xvp_host xvp_host;
 typedef struct xvp_vm   xvp_vm;
 
+/*
+ * Pools, hosts and VMs, and their strings, live in an arena for each
+ * generation of the configuration (see config.c), so the strings are
+ * only as long as they need be, and shared where they are the same.
+ * The only ones written once loaded are a pool's master, and the name
+ * of a VM configured by UUID, which has room for any name.
+ */
 struct xvp_pool {
     struct xvp_pool *next;
     xvp_host        *hosts;
+    xvp_host        *hosts_tail;
     xvp_vm          *vms;
-    char             poolname[XVP_MAX_POOL + 1];
-    char             domainname[XVP_MAX_HOSTNAME + 1];
-    char             manager[XVP_MAX_MANAGER + 1];
+    xvp_vm          *vms_tail;
+    char            *poolname;
+    char            *domainname;
+    char            *manager;
     char             password[XVP_MAX_XEN_PW + 1];
+    int              framerate;
+    int              pasterate;
+    char             master[XVP_MAX_HOSTNAME + 1]; /* last found, if any */
+    int              jsonrpc; /* for events, rather than XML-RPC */
 };
 
 struct xvp_host {
     struct xvp_pool *pool;
     struct xvp_host *next;
     int              hostname_is_ipv4; /* odd behaviour when used "bool" */
-    char             hostname[XVP_MAX_HOSTNAME + 1];
-    char             address[XVP_MAX_ADDRESS + 1];
-    char             uuid[XVP_UUID_LEN + 1];
+    char            *hostname;
+    char            *address;
 };
 
 struct xvp_vm {
@@ -103,9 +149,24 @@ struct xvp_vm {
     struct xvp_vm   *next;
     int              sock;
     unsigned short   port;
-    char             vmname[XVP_MAX_HOSTNAME + 1];
     char             password[XVP_MAX_VNC_PW + 1];
-    char             uuid[XVP_UUID_LEN + 1];
+    char            *vmname;
+    char            *uuid;
+    int              framerate;
+    int              hot; /* engine keeps a console connection ready */
+    char            *groupname; /* for xvpweb, or NULL */
+};
+
+/*
+ * Files the configuration was read from, recorded so that an image
+ * compiled from it (see image.c) can be seen to be out of date
+ */
+typedef struct xvp_config_source xvp_config_source;
+struct xvp_config_source {
+    xvp_config_source *next;
+    char              *filename;
+    unsigned int       size;
+    unsigned long long hash; /* of contents, see xvp_image_file_hash() */
 };
 
 typedef struct {
@@ -113,6 +174,138 @@ typedef struct {
     unsigned int addr;
 } xvp_client;
 
+#define XVP_BROKER_URLLEN 256
+#define XVP_BROKER_REFLEN 64
+
+/*
+ * Passed between session processes and the broker, so "int" rather
+ * than "bool", which differs between files that include the SDK
+ */
+typedef struct {
+    char poolname[XVP_MAX_POOL + 1];
+    char vmname[XVP_MAX_HOSTNAME + 1]; /* or UUID */
+    int  watch; /* keep connection open, to hear of console deletion */
+    int  early; /* before the client has authenticated, so limited */
+    unsigned int client_ip; /* if early */
+} xvp_broker_request;
+
+typedef struct {
+    int  ok;
+    int  refused; /* early, and the client's address is over its limit */
+    int  vm_is_host;
+    char vmname[XVP_MAX_HOSTNAME + 1];
+    char host_url[XVP_MAX_HOSTNAME + 9]; /* https://hostname */
+    char console_url[XVP_BROKER_URLLEN];
+    char session_id[XVP_BROKER_REFLEN];
+    char vm_ref[XVP_BROKER_REFLEN];
+    char console_ref[XVP_BROKER_REFLEN];
+    char host_ref[XVP_BROKER_REFLEN]; /* where VM is running, if it is */
+} xvp_broker_reply;
+
+#define XVP_BROKER_DELETED 'D' /* sent to a watching session */
+#define XVP_BROKER_MOVED   'M' /* likewise */
+
+struct sockaddr; /* not all files need <sys/socket.h> */
+
+typedef struct xvp_xenapi  xvp_xenapi;  /* private to xenapi.c */
+typedef struct xvp_session xvp_session; /* private to proxy.c */
+
+/*
+ * The event engine runs everything from one epoll loop, so anything
+ * that can block, such as Xen API calls, is done as a job by one of a
+ * pool of threads, and completion is then reported back to the loop.
+ */
+typedef struct xvp_job xvp_job;
+struct xvp_job {
+    xvp_job *next;
+    void   (*run)(void *arg);  /* in a job thread */
+    void   (*done)(void *arg); /* back in the event loop */
+    void    *arg;
+};
+
+typedef struct xvp_timer xvp_timer;
+struct xvp_timer {
+    xvp_timer *next;
+    long long  when; /* milliseconds, monotonic */
+    void     (*func)(void *arg);
+    void      *arg;
+};
+
+typedef struct xvp_watch xvp_watch;
+struct xvp_watch {
+    int          fd;
+    unsigned int events; /* as registered with epoll, 0 if none */
+    void       (*func)(xvp_watch *watch, unsigned int events);
+    void        *arg;
+};
+
+/*
+ * Streaming JSON parser (see json.c): keys[d] is the key of the value at
+ * depth d, or empty within an array, keys[depth] that of the value now
+ * being passed to func, and END passes the depth the container was at.
+ */
+#define XVP_JSON_MAX_DEPTH 16
+#define XVP_JSON_MAX_KEY   63
+#define XVP_JSON_MAX_TOKEN 255
+
+typedef enum {
+    XVP_JSON_STRING,
+    XVP_JSON_NUMBER,
+    XVP_JSON_LITERAL, /* true, false or null */
+    XVP_JSON_OBJECT,
+    XVP_JSON_ARRAY,
+    XVP_JSON_END      /* of object or array */
+} xvp_json_type;
+
+typedef struct xvp_json xvp_json;
+struct xvp_json {
+    void (*func)(xvp_json *js, xvp_json_type type, char *value);
+    void  *arg;
+    int    state;
+    int    depth;
+    char   stack[XVP_JSON_MAX_DEPTH];
+    char   keys[XVP_JSON_MAX_DEPTH][XVP_JSON_MAX_KEY + 1];
+    char   token[XVP_JSON_MAX_TOKEN + 1];
+    int    len;
+    int    is_key;
+    int    digits;
+    unsigned int unicode;
+};
+
+/*
+ * Following the console's messages to the client (see frame.c), to know
+ * where each ends: skip is how much of what follows can be passed over
+ * unseen, and since how much has come since a message last ended.
+ */
+#define XVP_FRAME_MAX_HEADER 12
+
+typedef struct xvp_frame xvp_frame;
+struct xvp_frame {
+    int           state;
+    int           after;    /* state once skip is done */
+    unsigned char header[XVP_FRAME_MAX_HEADER];
+    int           need;     /* bytes of header wanted */
+    int           have;
+    unsigned long skip;
+    unsigned long since;
+    unsigned long updates;  /* FramebufferUpdates ended */
+    int           update;   /* in one */
+    int           rects;    /* left in it */
+    int           width;    /* of this rectangle */
+    int           height;
+    int           tile_x;   /* Hextile tile within it */
+    int           tile_y;
+    int           subrect;  /* RRE subrectangle, less its pixel */
+    int           coloured; /* Hextile subrectangles have a pixel each */
+    int           bpp;      /* bytes per pixel */
+    int           tpixel;   /* ... as Tight sends them */
+    int           colours;  /* in Tight palette, or 0 if none */
+    unsigned long length;   /* Tight compact length so far */
+    int           shift;
+    unsigned char pixel_format[16]; /* as in SetPixelFormat */
+    int           off;      /* not wanted, or lost track */
+};
+
 typedef enum {
     XVP_PASSWORD_XEN,
     XVP_PASSWORD_VNC
@@ -130,7 +323,8 @@ typedef enum {
     XVP_MESSAGE_CODE_INIT     = 1,
     XVP_MESSAGE_CODE_SHUTDOWN = 2,
     XVP_MESSAGE_CODE_REBOOT   = 3,
-    XVP_MESSAGE_CODE_RESET    = 4
+    XVP_MESSAGE_CODE_RESET    = 4,
+    XVP_MESSAGE_CODE_PROGRESS = 5  /* of shutdown, reboot or reset */
 } xvp_message_code;
 
 extern char       *xvp_config_filename;
@@ -142,15 +336,27 @@ extern int         xvp_tracing;
 extern bool        xvp_reconnect_delay;
 extern xvp_pool   *xvp_pools;
 extern int         xvp_log_fd;
+extern __thread unsigned int xvp_log_id;
 extern pid_t       xvp_pid;
 extern pid_t       xvp_child_pid;
+extern pid_t       xvp_broker_pid;
 extern int         xvp_master_sigpipe[2];
 extern int         xvp_child_sigpipe[2];
-extern bool        xvp_vm_is_host;
 extern xvp_otp     xvp_otp_mode;
 extern xvp_ipcheck xvp_otp_ipcheck;
 extern int         xvp_otp_window;    
+extern xvp_engine  xvp_engine_mode;
+extern int         xvp_prefork_min;
+extern int         xvp_prefork_max;
+extern int         xvp_prefork_idle;
+extern int         xvp_engine_threads;
+extern int         xvp_engine_shards;
 extern xvp_vm     *xvp_multiplex_vm;
+extern char        xvp_ssl_ciphers[];
+extern char        xvp_ssl_ciphersuites[];
+extern xvp_config_source *xvp_config_sources;
+extern char       *xvp_config_database[];
+extern bool        xvp_image_compiling;
 
 extern void     *xvp_alloc(int size);
 extern char     *xvp_strdup(char *s);
@@ -158,8 +364,20 @@ extern bool      xvp_is_ipv4(char *address);
 extern void      xvp_free(void *p);
 extern char     *xvp_xmlescape(char *text, char *buf, int buflen);
 
+extern int       xvp_listen_socket(int port, bool reuseport);
 extern void      xvp_listen_init(void);
+extern void      xvp_listen_dump(void);
+extern char     *xvp_listen_fds(void);
+extern void      xvp_listen_keep_on_exec(void);
+extern void      xvp_listen_watch_upgrade(int fd, bool watch);
 extern char     *xvp_message_code_to_text(int code);
+extern int       xvp_connect_start(int sock, const struct sockaddr *addr,
+				   int addrlen);
+
+extern void      xvp_broker_main(int chan);
+extern int       xvp_broker_lookup(xvp_vm *vm, bool watch, unsigned int early_ip, xvp_broker_reply *reply, int *sockp);
+extern int       xvp_broker_wait(int sock);
+extern void      xvp_broker_dump(void);
 
 extern void      xvp_config_init(void);
 extern xvp_pool *xvp_config_last_pool(void);
@@ -171,6 +389,38 @@ extern xvp_vm   *xvp_config_vm_by_name(xvp_pool *pool, char *vmname);
 extern xvp_vm   *xvp_config_vm_by_uuid(xvp_pool *pool, char *uuid);
 extern xvp_vm   *xvp_config_vm_by_port(int port);
 extern xvp_vm   *xvp_config_vm_by_sock(int sock);
+extern void      xvp_config_set_sock(xvp_vm *vm, int sock);
+extern void      xvp_config_add_pool(xvp_pool *pool);
+extern void      xvp_config_add_host(xvp_pool *pool, xvp_host *host);
+extern void      xvp_config_add_vm(xvp_pool *pool, xvp_vm *vm);
+extern void      xvp_config_set_multiplex(int port);
+extern void      xvp_config_set_vmname(xvp_vm *vm, char *vmname);
+extern void     *xvp_config_alloc(int size);
+extern xvp_vm   *xvp_config_alloc_vm(void);
+extern char     *xvp_config_strdup(char *text);
+
+extern void      xvp_engine_main(int chan, int shard);
+extern long long xvp_engine_now(void);
+extern void      xvp_engine_watch(xvp_watch *watch, unsigned int events);
+extern void      xvp_engine_submit(xvp_job *job);
+extern void      xvp_engine_schedule(xvp_timer *timer, int msec);
+extern void      xvp_engine_cancel(xvp_timer *timer);
+extern void      xvp_engine_dump(void);
+
+extern bool      xvp_frame_encoding(int encoding);
+extern void      xvp_frame_init(xvp_frame *f, unsigned char *pixel_format, bool off);
+extern void      xvp_frame_pixel_format(xvp_frame *f, unsigned char *pixel_format);
+extern void      xvp_frame_feed(xvp_frame *f, const char *data, unsigned long len);
+
+extern char     *xvp_image_filename(void);
+extern bool      xvp_image_write(void);
+extern bool      xvp_image_load(void);
+extern bool      xvp_image_file_hash(int fd, unsigned long long *hash);
+
+extern void      xvp_json_init(xvp_json *js, void (*func)(xvp_json *js, xvp_json_type type, char *value), void *arg);
+extern bool      xvp_json_feed(xvp_json *js, const char *data, size_t len);
+extern bool      xvp_json_done(xvp_json *js);
+extern char     *xvp_json_quote(char *text, char *buf, int buflen);
 
 extern void      xvp_log_init(void);
 extern void      xvp_log(xvp_log_type type, char *format, ...);
@@ -186,15 +436,42 @@ extern bool      xvp_password_vnc_ok(char *password, unsigned int client_ip, cha
 extern void      xvp_process_init(int argc, char **argv, char **envp);
 extern void      xvp_process_set_name(char *process_name);
 extern char     *xvp_process_get_name(void);
-extern bool      xvp_process_spawn(xvp_vm *vm);
+extern bool      xvp_process_spawn(xvp_vm *vm, int client_sock, unsigned int client_ip);
+extern int       xvp_process_receive(int chan, xvp_vm **vmp, unsigned int *client_ip);
+extern void      xvp_process_prefork(void);
+extern bool      xvp_process_sharded(void);
+extern void      xvp_process_shard_load(int shard, unsigned long accepted, int active);
+extern int       xvp_process_timeout(void);
+extern void      xvp_process_dump(void);
+extern bool      xvp_process_upgrading(bool readable);
+extern void      xvp_process_upgraded(void);
 extern void      xvp_process_cleanup(void);
 extern bool      xvp_process_signal_handler(void);
 
 extern int       xvp_proxy_main(xvp_vm *vm, int client_sock, unsigned int client_ip);
+extern void      xvp_proxy_start(xvp_vm *vm, int client_sock, unsigned int client_ip);
+extern int       xvp_proxy_active(void);
 extern void      xvp_proxy_dump(void);
 extern void      xvp_proxy_resume(void);
 extern void      xvp_proxy_console_deleted(void);
-extern void     *xvp_xenapi_open_stream(xvp_vm *vm);
-extern bool      xvp_xenapi_event_wait(xvp_vm *vm);
-extern bool      xvp_xenapi_handle_message_code(int code);
+extern void      xvp_proxy_warm_start(void);
+extern void      xvp_proxy_warm_stop(void);
+extern void      xvp_xenapi_init(void);
+extern xvp_xenapi *xvp_xenapi_create(bool events);
+extern void      xvp_xenapi_destroy(xvp_xenapi *xa);
+extern bool      xvp_xenapi_vm_is_host(xvp_xenapi *xa);
+extern void     *xvp_xenapi_open_stream(xvp_xenapi *xa, xvp_vm *vm);
+extern void      xvp_xenapi_close_stream(void *stream);
+extern bool      xvp_xenapi_stream_ktls(void *stream);
+extern bool      xvp_xenapi_event_wait(xvp_xenapi *xa, xvp_vm *vm);
+extern bool      xvp_xenapi_task_start(xvp_xenapi *xa, int code);
+extern int       xvp_xenapi_task_wait(xvp_xenapi *xa);
 extern bool      xvp_xenapi_is_uuid(char *text);
+extern int       xvp_xenapi_logins(xvp_xenapi *xa);
+extern int       xvp_xenapi_event_fd(xvp_xenapi *xa);
+extern void      xvp_xenapi_set_early(xvp_xenapi *xa, unsigned int client_ip);
+extern void      xvp_xenapi_dump(xvp_xenapi *xa, char *label);
+extern bool      xvp_xenapi_lookup(xvp_xenapi *xa, xvp_vm *vm, xvp_broker_reply *reply);
+extern bool      xvp_xenapi_resident_on(xvp_xenapi *xa, char *vm_ref, char *buf, int buflen);
+extern bool      xvp_xenapi_session_reply(xvp_xenapi *xa, xvp_pool *pool, xvp_broker_reply *reply);
+extern void      xvp_xenapi_watch(xvp_xenapi *xa, xvp_pool *pool, void (*changed)(xvp_pool *pool, char *ref, bool deleted));
@@ -73,6 +73,7 @@ typedef enum {
 
 static char server_url[XVP_MAX_HOSTNAME + 9]; /* https://hostname */
 static xen_session *session;
+static CURL *curl = NULL; /* kept open between calls */
 
 static void usage(void)
 {
@@ -322,15 +323,15 @@ static size_t write_func(void *ptr, size_t size, size_t nmemb, xen_comms *comms)
 }
 
 /*
- * From XenServer C SDK 5.0.0
+ * From XenServer C SDK 5.0.0, but reusing one curl handle, and so its
+ * connection and TLS session, for all calls
  */
 static int call_func(const void *data, size_t len, void *user_handle,
 		     void *result_handle, xen_result_func result_func)
 {
     (void)user_handle;
 
-    CURL *curl = curl_easy_init();
-    if (!curl) {
+    if (!curl && !(curl = curl_easy_init())) {
         return -1;
     }
 
@@ -343,6 +344,9 @@ static int call_func(const void *data, size_t len, void *user_handle,
     curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1);
 #ifdef CURLOPT_MUTE
     curl_easy_setopt(curl, CURLOPT_MUTE, 1);
+#endif
+#ifdef CURLOPT_TCP_KEEPALIVE
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1);
 #endif
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &write_func);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &comms);
@@ -354,8 +358,6 @@ static int call_func(const void *data, size_t len, void *user_handle,
 
     CURLcode result = curl_easy_perform(curl);
 
-    curl_easy_cleanup(curl);
-
     return result;
 }
 
@@ -400,9 +402,11 @@ static void open_session(char *server, char *username, char *xenhex)
  */
 static void cleanup(void)
 {
+    xen_session_logout(session);
+    if (curl)
+	curl_easy_cleanup(curl);
     curl_global_cleanup();
     xmlCleanupParser();
-    xen_session_logout(session);
     xen_fini();
 }
 
@@ -175,11 +175,19 @@ class RfbProto {
   // Constants used by XVP extension messages
   final static int
     XVPMessageVersion = 1,
+    XVPMessageVersionTasks = 2, // server reports progress and success
     XVPCodeFail       = 0,
     XVPCodeInit       = 1,
     XVPCodeShutdown   = 2,
     XVPCodeReboot     = 3,
-    XVPCodeReset      = 4;
+    XVPCodeReset      = 4,
+    XVPCodeProgress   = 5;
+
+  // Whether the server takes XVPMessageVersionTasks requests, as it
+  // says in the padding of XVPCodeInit, and the percentage from the
+  // last XVPCodeProgress message
+  boolean xvpTasks;
+  int xvpProgress;
 
   String host;
   int port;
@@ -906,12 +914,16 @@ class RfbProto {
   //
 
   int readServerXVPCode() throws Exception {
-    skipBytes(1);
+    int accepts = readU8();
     int version = readU8();
     if (version < XVPMessageVersion)
       throw new Exception("Server doesn't support XVP version " +
 			  XVPMessageVersion);
     int code = readU8();
+    if (code == XVPCodeInit)
+      xvpTasks = (accepts >= XVPMessageVersionTasks);
+    else if (code == XVPCodeProgress)
+      xvpProgress = readU8();
     return code;
   }
 
@@ -1054,7 +1066,7 @@ class RfbProto {
 
     b[0] = (byte)ClientXVPCode;
     b[1] = 0; // padding
-    b[2] = (byte)XVPMessageVersion;
+    b[2] = (byte)(xvpTasks ? XVPMessageVersionTasks : XVPMessageVersion);
     b[3] = (byte)code;
 
     os.write(b);
@@ -1124,9 +1124,32 @@ public class VncViewer extends java.applet.Applet
       }
 
     } else if (code == rfb.XVPCodeFail) {
+      showXVPStatus(null);
       XvpConfirmDialog.confirmed(this, "fail");
+    } else if (code == rfb.XVPCodeProgress) {
+      showXVPStatus(rfb.xvpProgress + "% done");
+    } else if (code == rfb.XVPCodeShutdown) {
+      showXVPStatus("shut down");
+    } else if (code == rfb.XVPCodeReboot || code == rfb.XVPCodeReset) {
+      showXVPStatus("rebooted");
     } else {
       throw new Exception("Unknown XVP code " + code);
     }
   }
+
+  //
+  // Show how a VM operation is going, in the title if in a separate
+  // frame, else in the browser status line
+  //
+
+  void showXVPStatus(String status) {
+    String title = "XVP Viewer - " + rfb.desktopName;
+
+    if (status != null)
+      title += " [" + status + "]";
+    if (inSeparateFrame)
+      vncFrame.setTitle(title);
+    else if (status != null)
+      showStatus(title);
+  }
 }